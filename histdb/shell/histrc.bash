@@ -3,8 +3,18 @@
 
 export HISTDB_ENABLED=1
 export HISTDB_SESSION_ID=''
-export HISTDB_LAST_COMMAND=''
+# Seed a new shell's history from histdb: "directory" (the last commands run
+# in $PWD), "tree" (the last commands run in $PWD or below it), "previous"
+# (the last commands of the previous session) or "none".
+export HISTDB_SEED="${HISTDB_SEED:-none}"
+export HISTDB_SEED_SIZE="${HISTDB_SEED_SIZE:-100}"
+# Send commands to "histdb daemon" listening on this socket, commands are
+# written directly if the daemon is not running.
+# export HISTDB_SOCKET="${XDG_RUNTIME_DIR}/histdb.sock"
 # export HISTDB_COMMAND=~/bin/histdb
+# Session ids and the last command of each session are kept in a shared
+# memory registry, "off" writes sessions to the database directly.
+# export HISTDB_REGISTRY=off
 
 if ! hash histdb 2>/dev/null; then
     echo >&2 "error: histdb command not found"
@@ -36,16 +46,49 @@ __histdb_precmd() {
         local status_code=$__bp_last_ret_value
         local this_command
         this_command="$(HISTTIMEFORMAT='' builtin history 1)"
-        if [[ $this_command != "${HISTDB_LAST_COMMAND}" ]]; then
-            HISTDB_LAST_COMMAND=$this_command
-            HISTDB_PROD=1 histdb insert \
-                --session="${HISTDB_SESSION_ID}" \
-                --status-code="${status_code}" \
-                -- "${this_command}"
-        fi
+        # A prompt that did not run a new command passes the same history
+        # entry again, histdb drops it.
+        [[ -n $this_command ]] && HISTDB_PROD=1 histdb insert --dedupe \
+            --session="${HISTDB_SESSION_ID}" \
+            --status-code="${status_code}" \
+            -- "${this_command}"
     fi
 }
 
+__histdb_seed_history() {
+    local args=(--null -n "${HISTDB_SEED_SIZE}")
+    case "${HISTDB_SEED}" in
+        directory) args+=(--directory="${PWD}") ;;
+        tree)      args+=(--directory="${PWD}" --recursive) ;;
+        previous)  args+=(--previous --session="${HISTDB_SESSION_ID}") ;;
+        *)         return 0 ;;
+    esac
+    local cmd seeded=0
+    while IFS= read -r -d '' cmd; do
+        builtin history -s -- "${cmd}"
+        seeded=1
+    done < <(HISTDB_PROD=1 histdb session seed "${args[@]}")
+    # Don't record the last seeded command again on the first prompt.
+    if (( seeded )); then
+        HISTDB_PROD=1 histdb insert --mark \
+            --session="${HISTDB_SESSION_ID}" --status-code=0 \
+            -- "$(HISTTIMEFORMAT='' builtin history 1)"
+    fi
+}
+
+# Run the learned correction of the last command (if it failed), see
+# "histdb fix".
+histdb-fix() {
+    local cmd
+    cmd="$(HISTDB_PROD=1 histdb fix --session="${HISTDB_SESSION_ID}")" || {
+        echo >&2 "histdb: no correction found"
+        return 1
+    }
+    echo >&2 "${cmd}"
+    builtin history -s -- "${cmd}"
+    eval "${cmd}"
+}
+
 # WARN: using this for testing
 histdb-enable() {
     __histdb_check_session_id
@@ -66,6 +109,6 @@ else
 fi
 
 if (( HISTDB_ENABLED != 0 )); then
-    # TODO: add "last RowID so that we can replicate bash's history"
     __histdb_check_session_id
+    __histdb_seed_history
 fi
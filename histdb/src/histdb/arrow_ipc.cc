@@ -0,0 +1,380 @@
+#include "arrow_ipc.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace histdb {
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+	"arrow_ipc: buffers are written in host order");
+
+// FlatBuilder
+////////////////////////////////////////////////////////////////////////////////
+
+// FlatBuilder builds a flatbuffer back to front, like the official builder.
+// Objects are identified by their offset from the end of the buffer, which
+// does not change as more data is prepended.
+class FlatBuilder {
+public:
+	FlatBuilder() : buf_(512, '\0'), head_(buf_.size()) {}
+
+	uint32_t size() const { return static_cast<uint32_t>(buf_.size() - head_); }
+
+	uint32_t create_string(std::string_view s) {
+		align(s.size() + 1, 4);
+		push<uint8_t>(0);
+		reserve(s.size());
+		head_ -= s.size();
+		std::memcpy(&buf_[head_], s.data(), s.size());
+		push<uint32_t>(static_cast<uint32_t>(s.size()));
+		return size();
+	}
+
+	uint32_t create_offset_vector(const std::vector<uint32_t>& offsets) {
+		align(offsets.size() * 4, 4);
+		for (size_t i = offsets.size(); i-- > 0; ) {
+			push<uint32_t>(size() + 4 - offsets[i]);
+		}
+		push<uint32_t>(static_cast<uint32_t>(offsets.size()));
+		return size();
+	}
+
+	// create_struct_vector creates a vector of structs made of two longs
+	// (Buffer and FieldNode).
+	uint32_t create_struct_vector(const std::vector<std::pair<int64_t, int64_t>>& v) {
+		align(v.size() * 16, 8);
+		for (size_t i = v.size(); i-- > 0; ) {
+			push<int64_t>(v[i].second);
+			push<int64_t>(v[i].first);
+		}
+		push<uint32_t>(static_cast<uint32_t>(v.size()));
+		return size();
+	}
+
+	void start_table() {
+		fields_.clear();
+		table_start_ = size();
+	}
+
+	template <typename T>
+	void add_scalar(uint16_t id, T value) {
+		align(sizeof(T), sizeof(T));
+		push<T>(value);
+		fields_.push_back({id, size()});
+	}
+
+	void add_offset(uint16_t id, uint32_t offset) {
+		align(4, 4);
+		push<uint32_t>(size() + 4 - offset);
+		fields_.push_back({id, size()});
+	}
+
+	uint32_t end_table() {
+		align(4, 4);
+		push<int32_t>(0); // vtable offset, patched below
+		const uint32_t table = size();
+
+		uint16_t nfields = 0;
+		for (const auto& f : fields_) {
+			nfields = std::max<uint16_t>(nfields, f.id + 1);
+		}
+		std::vector<uint16_t> vtable(nfields, 0);
+		for (const auto& f : fields_) {
+			vtable[f.id] = static_cast<uint16_t>(table - f.pos);
+		}
+		for (size_t i = vtable.size(); i-- > 0; ) {
+			push<uint16_t>(vtable[i]);
+		}
+		push<uint16_t>(static_cast<uint16_t>(table - table_start_));
+		push<uint16_t>(static_cast<uint16_t>((2 + nfields) * 2));
+
+		// The vtable precedes the table: vtable = table - soffset
+		const int32_t soffset = static_cast<int32_t>(size() - table);
+		std::memcpy(&buf_[buf_.size() - table], &soffset, sizeof(soffset));
+		return table;
+	}
+
+	std::string finish(uint32_t root) {
+		align(4, max_align_);
+		push<uint32_t>(size() + 4 - root);
+		return buf_.substr(head_);
+	}
+
+private:
+	struct Field {
+		uint16_t id;
+		uint32_t pos;
+	};
+
+	// align pads the buffer so that it is aligned to alignment after len
+	// more bytes are written.
+	void align(size_t len, size_t alignment) {
+		max_align_ = std::max(max_align_, alignment);
+		size_t pad = (alignment - (size() + len) % alignment) % alignment;
+		reserve(pad);
+		for (; pad > 0; pad--) {
+			buf_[--head_] = '\0';
+		}
+	}
+
+	void reserve(size_t n) {
+		if (head_ >= n) {
+			return;
+		}
+		const size_t used = size();
+		std::string grown(std::max(buf_.size() * 2, used + n), '\0');
+		std::memcpy(&grown[grown.size() - used], &buf_[head_], used);
+		head_ = grown.size() - used;
+		buf_.swap(grown);
+	}
+
+	template <typename T>
+	void push(T value) {
+		reserve(sizeof(T));
+		head_ -= sizeof(T);
+		std::memcpy(&buf_[head_], &value, sizeof(T));
+	}
+
+	std::string buf_;
+	size_t head_;
+	size_t max_align_ = 1;
+	uint32_t table_start_ = 0;
+	std::vector<Field> fields_;
+};
+
+// Schema.fbs and Message.fbs
+////////////////////////////////////////////////////////////////////////////////
+
+constexpr int16_t metadata_version_v5 = 4;
+
+// MessageHeader union
+constexpr uint8_t header_schema = 1;
+constexpr uint8_t header_dictionary_batch = 2;
+constexpr uint8_t header_record_batch = 3;
+
+// Type union
+constexpr uint8_t type_int = 2;
+constexpr uint8_t type_utf8 = 5;
+
+enum class ColumnType { Int64, Int32, Utf8, Dictionary };
+
+struct ColumnSpec {
+	ColumnType type;
+	int64_t dictionary_id;
+};
+
+// Keep in sync with history_columns.
+static const std::vector<ColumnSpec> column_specs = {
+	{ColumnType::Int64, 0},      // id
+	{ColumnType::Int64, 0},      // session_id
+	{ColumnType::Int64, 0},      // history_id
+	{ColumnType::Int64, 0},      // ppid
+	{ColumnType::Int32, 0},      // status_code
+	{ColumnType::Utf8, 0},       // created_at
+	{ColumnType::Dictionary, 0}, // username
+	{ColumnType::Dictionary, 1}, // directory
+	{ColumnType::Utf8, 0},       // raw
+};
+
+static uint32_t create_int_type(FlatBuilder& b, int32_t bit_width) {
+	b.start_table();
+	b.add_scalar<int32_t>(0, bit_width);  // bitWidth
+	b.add_scalar<uint8_t>(1, 1);          // is_signed
+	return b.end_table();
+}
+
+static uint32_t create_field(FlatBuilder& b, const std::string& name,
+	const ColumnSpec& spec) {
+
+	const uint32_t name_off = b.create_string(name);
+	uint8_t type_type = type_utf8;
+	uint32_t type_off = 0;
+	switch (spec.type) {
+	case ColumnType::Int64:
+		type_type = type_int;
+		type_off = create_int_type(b, 64);
+		break;
+	case ColumnType::Int32:
+		type_type = type_int;
+		type_off = create_int_type(b, 32);
+		break;
+	case ColumnType::Utf8:
+	case ColumnType::Dictionary:
+		type_type = type_utf8;
+		b.start_table();
+		type_off = b.end_table();
+		break;
+	}
+	uint32_t dict_off = 0;
+	if (spec.type == ColumnType::Dictionary) {
+		const uint32_t index_type = create_int_type(b, 32);
+		b.start_table();
+		b.add_scalar<int64_t>(0, spec.dictionary_id); // id
+		b.add_offset(1, index_type);                   // indexType
+		dict_off = b.end_table();
+	}
+	const uint32_t children = b.create_offset_vector({});
+
+	b.start_table();
+	b.add_offset(0, name_off);          // name
+	b.add_scalar<uint8_t>(1, 0);        // nullable
+	b.add_scalar<uint8_t>(2, type_type);
+	b.add_offset(3, type_off);
+	if (dict_off != 0) {
+		b.add_offset(4, dict_off);      // dictionary
+	}
+	b.add_offset(5, children);
+	return b.end_table();
+}
+
+static std::string finish_message(FlatBuilder& b, uint8_t header_type,
+	uint32_t header, int64_t body_length) {
+
+	b.start_table();
+	b.add_scalar<int16_t>(0, metadata_version_v5);
+	b.add_scalar<uint8_t>(1, header_type);
+	b.add_offset(2, header);
+	b.add_scalar<int64_t>(3, body_length);
+	return b.finish(b.end_table());
+}
+
+// Messages
+////////////////////////////////////////////////////////////////////////////////
+
+static constexpr size_t pad8(size_t n) {
+	return (n + 7) & ~size_t(7);
+}
+
+template <typename T>
+static std::string_view as_bytes(const std::vector<T>& v) {
+	return std::string_view(reinterpret_cast<const char *>(v.data()), v.size() * sizeof(T));
+}
+
+// Body collects the buffers of a record batch.
+class Body {
+public:
+	void add(std::string_view data) {
+		buffers_.push_back({size_, static_cast<int64_t>(data.size())});
+		data_.push_back(data);
+		size_ += static_cast<int64_t>(pad8(data.size()));
+	}
+	void add_validity() { add(std::string_view()); } // no nulls
+	void add_node(size_t length) { nodes_.push_back({static_cast<int64_t>(length), 0}); }
+
+	int64_t size() const { return size_; }
+
+	uint32_t create_record_batch(FlatBuilder& b, size_t length) const {
+		const uint32_t nodes = b.create_struct_vector(nodes_);
+		const uint32_t buffers = b.create_struct_vector(buffers_);
+		b.start_table();
+		b.add_scalar<int64_t>(0, static_cast<int64_t>(length));
+		b.add_offset(1, nodes);
+		b.add_offset(2, buffers);
+		return b.end_table();
+	}
+
+	void write(std::string& out) const {
+		for (auto data : data_) {
+			out.append(data);
+			out.append(pad8(data.size()) - data.size(), '\0');
+		}
+	}
+
+private:
+	int64_t size_ = 0;
+	std::vector<std::pair<int64_t, int64_t>> nodes_;   // FieldNode: length, null_count
+	std::vector<std::pair<int64_t, int64_t>> buffers_; // Buffer: offset, length
+	std::vector<std::string_view> data_;
+};
+
+static void add_string_column(Body& body, const StringColumn& col) {
+	body.add_node(col.size());
+	body.add_validity();
+	body.add(as_bytes(col.offsets));
+	body.add(col.data);
+}
+
+// append_message appends an encapsulated message: continuation marker,
+// metadata size, the metadata (padded to 8 bytes) and the body.
+static void append_message(std::string& out, const std::string& metadata,
+	const Body *body) {
+
+	const uint32_t continuation = 0xFFFFFFFF;
+	const int32_t size = static_cast<int32_t>(pad8(metadata.size()));
+	out.append(reinterpret_cast<const char *>(&continuation), 4);
+	out.append(reinterpret_cast<const char *>(&size), 4);
+	out.append(metadata);
+	out.append(size - metadata.size(), '\0');
+	if (body) {
+		body->write(out);
+	}
+}
+
+std::string arrow_ipc_schema() {
+	FlatBuilder b;
+	std::vector<uint32_t> fields;
+	for (size_t i = 0; i < column_specs.size(); i++) {
+		fields.push_back(create_field(b, history_columns[i], column_specs[i]));
+	}
+	const uint32_t fields_off = b.create_offset_vector(fields);
+	b.start_table();
+	b.add_offset(1, fields_off);
+	const uint32_t schema = b.end_table();
+
+	std::string out;
+	append_message(out, finish_message(b, header_schema, schema, 0), nullptr);
+	return out;
+}
+
+static void append_dictionary_batch(std::string& out, int64_t id,
+	const DictionaryColumn& col) {
+
+	Body body;
+	add_string_column(body, col.values());
+
+	FlatBuilder b;
+	const uint32_t data = body.create_record_batch(b, col.values().size());
+	b.start_table();
+	b.add_scalar<int64_t>(0, id);
+	b.add_offset(1, data);
+	const uint32_t dict = b.end_table();
+	append_message(out, finish_message(b, header_dictionary_batch, dict, body.size()), &body);
+}
+
+std::string encode_arrow_ipc_batch(const HistoryBatch& batch) {
+	std::string out;
+	append_dictionary_batch(out, 0, batch.username);
+	append_dictionary_batch(out, 1, batch.directory);
+
+	Body body;
+	for (const auto *col : {&batch.id, &batch.session_id, &batch.history_id, &batch.ppid}) {
+		body.add_node(col->size());
+		body.add_validity();
+		body.add(as_bytes(*col));
+	}
+	body.add_node(batch.size());
+	body.add_validity();
+	body.add(as_bytes(batch.status_code));
+	add_string_column(body, batch.created_at);
+	for (const auto *col : {&batch.username, &batch.directory}) {
+		body.add_node(col->size());
+		body.add_validity();
+		body.add(as_bytes(col->indices()));
+	}
+	add_string_column(body, batch.raw);
+
+	FlatBuilder b;
+	const uint32_t record_batch = body.create_record_batch(b, batch.size());
+	append_message(out, finish_message(b, header_record_batch, record_batch, body.size()), &body);
+	return out;
+}
+
+std::string arrow_ipc_eos() {
+	const uint32_t eos[2] = {0xFFFFFFFF, 0};
+	return std::string(reinterpret_cast<const char *>(eos), sizeof(eos));
+}
+
+} // namespace histdb
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+
+#include "export.h"
+
+namespace histdb {
+
+// Minimal writer for the Arrow IPC streaming format
+// (https://arrow.apache.org/docs/format/Columnar.html#ipc-streaming-format)
+// specialized for HistoryBatch. The flatbuffer metadata is encoded by hand
+// so that we do not need to depend on Arrow.
+//
+// A stream is: arrow_ipc_schema(), any number of encoded batches, and then
+// arrow_ipc_eos(). Every batch carries its own dictionaries (replacing those
+// of the previous batch) so batches can be encoded independently.
+
+std::string arrow_ipc_schema();
+
+std::string encode_arrow_ipc_batch(const HistoryBatch& batch);
+
+std::string arrow_ipc_eos();
+
+} // namespace histdb
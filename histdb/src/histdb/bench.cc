@@ -0,0 +1,323 @@
+#include "bench.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <memory>
+#include <new>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <unistd.h> // getpid
+
+#include <SQLiteCpp/Database.h>
+#include <SQLiteCpp/Statement.h>
+
+#include "clusters.h"
+#include "durability.h"
+#include "rows.h"
+#include "sanitize.h"
+#include "timefmt.h"
+
+// Allocation counting
+////////////////////////////////////////////////////////////////////////////////
+
+// The global operator new is replaced so that benchmarks can report heap
+// allocations per operation. The default array and nothrow forms call it,
+// the aligned forms (which nothing here uses) are not counted.
+
+static std::atomic<int64_t> allocations{0};
+
+[[gnu::noinline]] void *operator new(size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void *p = std::malloc(size > 0 ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+// NB: not inlined, GCC warns about free of a pointer returned by new otherwise.
+[[gnu::noinline]] void operator delete(void *p) noexcept {
+	std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, size_t) noexcept {
+	std::free(p);
+}
+
+namespace histdb {
+
+int64_t allocation_count() {
+	return allocations.load(std::memory_order_relaxed);
+}
+
+BenchResult run_benchmark(const std::string& name, size_t bytes_per_op,
+	const std::function<void()>& fn, std::chrono::milliseconds min_time) {
+
+	using clock = std::chrono::steady_clock;
+	BenchResult res;
+	res.name = name;
+	fn(); // warm up
+
+	for (int64_t n = 1; ; n *= 2) {
+		const int64_t allocs = allocation_count();
+		auto start = clock::now();
+		for (int64_t i = 0; i < n; i++) {
+			fn();
+		}
+		auto elapsed = clock::now() - start;
+		if (elapsed >= min_time || n >= (int64_t(1) << 40)) {
+			double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+			res.iterations = n;
+			res.ns_per_op = ns / n;
+			res.allocs_per_op = double(allocation_count() - allocs) / n;
+			if (bytes_per_op > 0) {
+				res.mb_per_sec = (double(bytes_per_op) * n / (1024 * 1024)) / (ns / 1e9);
+			}
+			return res;
+		}
+	}
+}
+
+void print_benchmark_header(std::ostream& out) {
+	out << std::left << std::setw(36) << "BENCHMARK" << std::right
+		<< std::setw(12) << "ITERATIONS" << std::setw(14) << "NS/OP"
+		<< std::setw(12) << "MB/S" << std::setw(12) << "ALLOCS/OP" << "\n";
+}
+
+void print_benchmark(const BenchResult& res, std::ostream& out) {
+	out << std::left << std::setw(36) << res.name << std::right
+		<< std::setw(12) << res.iterations
+		<< std::setw(14) << std::fixed << std::setprecision(1) << res.ns_per_op;
+	if (res.mb_per_sec > 0) {
+		out << std::setw(12) << std::setprecision(1) << res.mb_per_sec;
+	} else {
+		out << std::setw(12) << "-";
+	}
+	out << std::setw(12) << std::setprecision(1) << res.allocs_per_op;
+	out << "\n" << std::defaultfloat;
+}
+
+// Benchmarks
+////////////////////////////////////////////////////////////////////////////////
+
+// heredoc returns a pasted heredoc of roughly size bytes with CRLF line
+// endings and the occasional tab and escape sequence.
+static std::string heredoc(size_t size) {
+	static constexpr std::string_view line =
+		"\tSELECT id, session_id, created_at FROM history WHERE id > 1234;\r\n"
+		"\x1b[1mecho\x1b[0m \"hello world\" | tr a-z A-Z >> /tmp/out.txt\r\n";
+	std::string s = "cat <<'EOF'\n";
+	while (s.size() < size) {
+		s.append(line);
+	}
+	s.append("EOF\n");
+	return s;
+}
+
+static std::string repeat(std::string_view s, size_t size) {
+	std::string out;
+	while (out.size() < size) {
+		out.append(s);
+	}
+	return out;
+}
+
+struct Benchmark {
+	std::string name;
+	size_t bytes;
+	std::function<void()> fn;
+};
+
+static void add_sanitize_benchmarks(std::vector<Benchmark>& benches) {
+	struct Input {
+		std::string name;
+		std::string data;
+	};
+	// NB: shared so that the captured views remain valid
+	static const std::vector<Input> inputs = {
+		{"short", "git commit -m 'fix the thing' --amend --no-edit"},
+		{"ascii-4k", repeat("ls -la /usr/local/bin && echo done; ", 4096)},
+		{"utf8-4k", repeat("echo '\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E caf\xC3\xA9' ", 4096)},
+		{"heredoc-64k", heredoc(64 * 1024)},
+	};
+	const std::string kernel = sanitize_kernel();
+	for (const auto& in : inputs) {
+		std::string_view data = in.data;
+		benches.push_back({"sanitize/scalar/" + in.name, data.size(), [data]() {
+			do_not_optimize(sanitize_command_scalar(data));
+		}});
+		benches.push_back({"sanitize/" + kernel + "/" + in.name, data.size(), [data]() {
+			do_not_optimize(sanitize_command(data));
+		}});
+	}
+}
+
+static void add_time_benchmarks(std::vector<Benchmark>& benches) {
+	// Roughly what a dump of history looks like: increasing timestamps with
+	// a fraction, spanning about a month.
+	static std::vector<TimePoint> times = []() {
+		std::vector<TimePoint> v;
+		auto t = TimePoint(std::chrono::seconds(1583020800)); // 2020-03-01
+		for (int i = 0; i < 4096; i++) {
+			t += std::chrono::seconds(10 * 60 + 17) + std::chrono::microseconds(12345);
+			v.push_back(t);
+		}
+		return v;
+	}();
+	static size_t next = 0;
+	benches.push_back({"time/libc", 0, []() {
+		do_not_optimize(format_time_libc(times[next++ % times.size()]));
+	}});
+	benches.push_back({"time/cached", 0, []() {
+		static TimeFormatter formatter;
+		char buf[TimeFormatter::max_size];
+		do_not_optimize(formatter.format_to(times[next++ % times.size()], buf));
+	}});
+}
+
+static void add_cluster_benchmarks(std::vector<Benchmark>& benches) {
+	// The work of clustering a command before the LSH lookups.
+	static const std::pair<std::string, std::string> inputs[] = {
+		{"short", "git checkout 3f2a9c1e8b7d && ssh -p 2222 host-123.example.com"},
+		{"heredoc-64k", heredoc(64 * 1024)},
+	};
+	for (const auto& [name, in] : inputs) {
+		const std::string_view data = in;
+		benches.push_back({"clusters/" + name, data.size(), [data]() {
+			do_not_optimize(command_signature(normalize_command(data.substr(0, max_shingled_bytes))));
+		}});
+	}
+}
+
+static void add_row_benchmarks(std::vector<Benchmark>& benches) {
+	// A scan of an in-memory history table, decoding every column. The
+	// statement is prepared once so that only the decoding is measured.
+	struct Table {
+		SQLite::Database db{":memory:", SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE};
+		std::unique_ptr<SQLite::Statement> query;
+		size_t bytes = 0;
+	};
+	static Table *table = []() {
+		auto t = new Table();
+		t->db.exec(R"""(
+CREATE TABLE history (
+	id         INTEGER PRIMARY KEY,
+	created_at TEXT NOT NULL,
+	directory  TEXT NOT NULL,
+	raw        TEXT NOT NULL
+);
+)""");
+		SQLite::Statement insert(t->db, "INSERT INTO history VALUES (?, ?, ?, ?);");
+		auto time = TimePoint(std::chrono::seconds(1583020800)); // 2020-03-01
+		const char *dirs[] = {
+			"/home/user",
+			"/home/user/src/github.com/charlievieth/histdb",
+			"/home/user/src/github.com/charlievieth/histdb/src/histdb",
+		};
+		const char *cmds[] = {
+			"ls -la",
+			"git commit -m 'fix the thing' --amend --no-edit",
+			"cmake --build build -j8 && ./build/stage/bin/histdb debug bench rows",
+			"rg -n 'executeStep' --type cpp src/histdb | less -R",
+		};
+		for (int i = 0; i < 4096; i++) {
+			time += std::chrono::seconds(10 * 60 + 17);
+			const std::string created_at = format_time_libc(time);
+			insert.reset();
+			insert.bind(1, i + 1);
+			insert.bind(2, created_at);
+			insert.bind(3, dirs[i % 3]);
+			insert.bind(4, cmds[i % 4]);
+			insert.exec();
+			t->bytes += created_at.size() + std::strlen(dirs[i % 3]) + std::strlen(cmds[i % 4]);
+		}
+		t->query = std::make_unique<SQLite::Statement>(t->db,
+			"SELECT id, created_at, directory, raw FROM history;");
+		return t;
+	}();
+
+	benches.push_back({"rows/getString", table->bytes, []() {
+		SQLite::Statement& query = *table->query;
+		query.reset();
+		while (query.executeStep()) {
+			do_not_optimize(query.getColumn(0).getInt64());
+			for (int col = 1; col < 4; col++) {
+				do_not_optimize(query.getColumn(col).getString());
+			}
+		}
+	}});
+	benches.push_back({"rows/cursor", table->bytes, []() {
+		static RowCursor rows(*table->query);
+		rows.reset();
+		while (rows.next_batch()) {
+			for (size_t i = 0; i < rows.size(); i++) {
+				do_not_optimize(rows.integer(i, 0));
+				for (int col = 1; col < 4; col++) {
+					do_not_optimize(rows.text(i, col));
+				}
+			}
+		}
+	}});
+}
+
+static void add_durability_benchmarks(std::vector<Benchmark>& benches) {
+	// An insert like "histdb insert" does: open a connection, write one row
+	// in a transaction of the tier and close the connection. The databases
+	// are in the temporary directory, which may be a tmpfs (where syncing
+	// is free).
+	struct Databases {
+		std::filesystem::path dir = std::filesystem::temp_directory_path() /
+			("histdb-bench-" + std::to_string(getpid()));
+
+		Databases() { std::filesystem::create_directories(dir); }
+		~Databases() {
+			std::error_code ec;
+			std::filesystem::remove_all(dir, ec);
+		}
+	};
+	static Databases databases;
+	for (const char *spec : {"strict", "grouped", "relaxed"}) {
+		const Durability d = parse_durability(spec);
+		const std::string path = (databases.dir / (std::string(spec) + ".sqlite3")).string();
+		{
+			SQLite::Database db(path, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE);
+			configure_durability(db, d);
+			db.exec("CREATE TABLE IF NOT EXISTS history (id INTEGER PRIMARY KEY, raw TEXT);");
+			db.exec(create_durability_groups_stmt);
+		}
+		benches.push_back({std::string("durability/") + spec, 0, [d, path]() {
+			SQLite::Database db(path, SQLite::OPEN_READWRITE);
+			configure_durability(db, d);
+			DurableTransaction transaction(db, d);
+			db.exec("INSERT INTO history (raw) VALUES ('git status');");
+			transaction.commit();
+		}});
+	}
+}
+
+void run_benchmarks(const std::string& filter, std::chrono::milliseconds min_time,
+	std::ostream& out) {
+
+	std::vector<Benchmark> benches;
+	add_sanitize_benchmarks(benches);
+	add_time_benchmarks(benches);
+	add_cluster_benchmarks(benches);
+	add_row_benchmarks(benches);
+	add_durability_benchmarks(benches);
+
+	print_benchmark_header(out);
+	for (const auto& b : benches) {
+		if (b.name.find(filter) == std::string::npos) {
+			continue;
+		}
+		print_benchmark(run_benchmark(b.name, b.bytes, b.fn, min_time), out);
+		out.flush();
+	}
+}
+
+} // namespace histdb
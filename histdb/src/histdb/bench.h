@@ -0,0 +1,47 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+
+namespace histdb {
+
+// Micro benchmarks run by "histdb debug bench".
+
+struct BenchResult {
+	std::string name;
+	int64_t iterations = 0;
+	double ns_per_op = 0;
+	double mb_per_sec = 0; // zero if bytes_per_op was zero
+	double allocs_per_op = 0;
+};
+
+// allocation_count returns the number of times operator new was called by
+// the process. It is counted for all threads, so benchmarks must be run
+// while no other thread is allocating.
+int64_t allocation_count();
+
+// run_benchmark calls fn repeatedly, doubling the number of iterations
+// until the run takes at least min_time.
+BenchResult run_benchmark(const std::string& name, size_t bytes_per_op,
+	const std::function<void()>& fn,
+	std::chrono::milliseconds min_time = std::chrono::milliseconds(200));
+
+void print_benchmark_header(std::ostream& out);
+void print_benchmark(const BenchResult& res, std::ostream& out);
+
+// run_benchmarks runs all benchmarks whose name contains filter and prints
+// the results to out.
+void run_benchmarks(const std::string& filter, std::chrono::milliseconds min_time,
+	std::ostream& out);
+
+// do_not_optimize prevents the compiler from eliding computations whose
+// result is otherwise unused.
+template <typename T>
+inline void do_not_optimize(const T& value) {
+	asm volatile("" : : "r,m"(value) : "memory");
+}
+
+} // namespace histdb
@@ -0,0 +1,133 @@
+#include "blobs.h"
+
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include <SQLiteCpp/Statement.h>
+
+#include "rows.h"
+
+namespace histdb {
+
+// Command blobs
+////////////////////////////////////////////////////////////////////////////////
+
+uint64_t command_hash(std::string_view raw) {
+	uint64_t h = 14695981039346656037ULL;
+	for (const char c : raw) {
+		h ^= static_cast<unsigned char>(c);
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+std::string_view command_preview(std::string_view raw) {
+	if (raw.size() <= command_preview_bytes) {
+		return raw;
+	}
+	size_t n = command_preview_bytes;
+	// Back off the continuation bytes (10xxxxxx) of a cut character.
+	while (n > 0 && (static_cast<unsigned char>(raw[n]) & 0xC0) == 0x80) {
+		n--;
+	}
+	return raw.substr(0, n);
+}
+
+// SQLite integers are signed, the hash is stored with the same bits.
+static int64_t hash_key(std::string_view raw) {
+	const uint64_t h = command_hash(raw);
+	int64_t key;
+	std::memcpy(&key, &h, sizeof(key));
+	return key;
+}
+
+// Served by the command_blobs_hash_idx index, almost always a single row.
+constexpr char select_command_blobs_stmt[] = R"""(
+SELECT id, data FROM command_blobs WHERE hash = ?;
+)""";
+
+constexpr char insert_command_blob_stmt[] = R"""(
+INSERT INTO command_blobs (hash, size, data) VALUES (?, ?, ?);
+)""";
+
+StoredCommand store_command(SQLite::Database& db, std::string_view raw) {
+	StoredCommand cmd;
+	cmd.raw = raw;
+	if (raw.size() <= command_blob_threshold) {
+		return cmd;
+	}
+	const int64_t key = hash_key(raw);
+	SQLite::Statement select(db, select_command_blobs_stmt);
+	select.bind(1, key);
+	if (select.executeStep()) {
+		const auto data = select.getColumn(1);
+		const std::string_view text(data.getText(), static_cast<size_t>(data.getBytes()));
+		if (text != raw) {
+			// Collisions are rare enough to not chain them.
+			return cmd;
+		}
+		cmd.blob_id = select.getColumn(0).getInt64();
+	} else {
+		SQLite::Statement insert(db, insert_command_blob_stmt);
+		insert.bind(1, key);
+		insert.bind(2, static_cast<int64_t>(raw.size()));
+		insert.bind(3, std::string(raw));
+		insert.exec();
+		cmd.blob_id = db.getLastInsertRowid();
+	}
+	cmd.raw = command_preview(raw);
+	return cmd;
+}
+
+// length() counts the characters of TEXT values, the threshold is in bytes.
+constexpr char select_large_commands_stmt[] = R"""(
+SELECT id, raw
+FROM history
+WHERE rowid > ? AND rowid <= ? AND raw_blob IS NULL AND length(CAST(raw AS BLOB)) > ?
+ORDER BY rowid;
+)""";
+
+constexpr char update_command_blob_stmt[] = R"""(
+UPDATE history SET raw = ?, raw_blob = ? WHERE id = ?;
+)""";
+
+void backfill_command_blobs(SQLite::Database& db, int64_t lo, int64_t hi) {
+	std::vector<std::pair<int64_t, std::string>> large;
+	{
+		SQLite::Statement select(db, select_large_commands_stmt);
+		select.bind(1, lo);
+		select.bind(2, hi);
+		select.bind(3, static_cast<int64_t>(command_blob_threshold));
+		RowCursor rows(select);
+		while (rows.next_batch()) {
+			for (size_t i = 0; i < rows.size(); i++) {
+				large.emplace_back(rows.integer(i, 0), std::string(rows.text(i, 1)));
+			}
+		}
+	}
+	SQLite::Statement update(db, update_command_blob_stmt);
+	for (const auto& [id, raw] : large) {
+		const StoredCommand cmd = store_command(db, raw);
+		if (cmd.blob_id == 0) {
+			continue;
+		}
+		update.reset();
+		update.bind(1, std::string(cmd.raw));
+		update.bind(2, cmd.blob_id);
+		update.bind(3, id);
+		update.exec();
+	}
+}
+
+// Served by the history_raw_blob_idx (partial) index.
+constexpr char delete_unused_command_blobs_stmt[] = R"""(
+DELETE FROM command_blobs
+WHERE NOT EXISTS (SELECT 1 FROM history WHERE raw_blob = command_blobs.id);
+)""";
+
+int64_t delete_unused_command_blobs(SQLite::Database& db) {
+	return db.exec(delete_unused_command_blobs_stmt);
+}
+
+} // namespace histdb
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include <SQLiteCpp/Database.h>
+
+namespace histdb {
+
+// Command blobs
+////////////////////////////////////////////////////////////////////////////////
+
+// Commands longer than command_blob_threshold bytes (pasted scripts,
+// heredocs, generated one-liners) are stored out of line, once, in the
+// command_blobs table, which is keyed by a hash of their text: running the
+// same large command again only adds a reference to its blob. The history
+// row keeps the first command_preview_bytes of the command in raw, so that
+// rows stay small and everything that only needs the start of the command
+// (the program of the stats rollups) still reads raw, and references the
+// blob with raw_blob.
+constexpr size_t command_blob_threshold = 2048;
+constexpr size_t command_preview_bytes = 256;
+
+// HISTDB_COMMAND_SQL is the full command of a history row as a SQL
+// expression: raw, or the text of its blob. It is a macro so that it can be
+// pasted into statements that are string literals.
+#define HISTDB_COMMAND_SQL \
+	"(CASE WHEN raw_blob IS NULL THEN raw " \
+	"ELSE (SELECT data FROM command_blobs WHERE id = raw_blob) END)"
+
+// command_hash returns the 64-bit FNV-1a hash of raw.
+uint64_t command_hash(std::string_view raw);
+
+// command_preview returns the prefix of raw that is stored in history.raw
+// when raw is stored out of line, cut on a UTF-8 character boundary.
+std::string_view command_preview(std::string_view raw);
+
+// StoredCommand is what a history row holds for a command.
+struct StoredCommand {
+	std::string_view raw; // history.raw (a view of the command)
+	int64_t blob_id = 0;  // history.raw_blob, 0 if the command is inline
+};
+
+// store_command returns how raw is stored in a new history row, adding its
+// blob (unless it already exists) if it is stored out of line. It must be
+// called in the transaction that inserts the row.
+//
+// Blobs are found by hash and their text is compared, a command whose hash
+// collides with the blob of another one is stored inline.
+StoredCommand store_command(SQLite::Database& db, std::string_view raw);
+
+// backfill_command_blobs moves the large commands of the history rows in
+// the rowid range (lo, hi] out of line (see migrate.h).
+void backfill_command_blobs(SQLite::Database& db, int64_t lo, int64_t hi);
+
+// delete_unused_command_blobs deletes the blobs that no history row
+// references anymore and returns their number.
+int64_t delete_unused_command_blobs(SQLite::Database& db);
+
+} // namespace histdb
@@ -0,0 +1,266 @@
+#include "clusters.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "absl/strings/ascii.h"
+
+#include "blobs.h"
+#include "rows.h"
+
+namespace histdb {
+
+// Normalization
+////////////////////////////////////////////////////////////////////////////////
+
+std::string normalize_command(std::string_view raw) {
+	std::string s;
+	s.reserve(raw.size());
+	size_t i = 0;
+	while (i < raw.size()) {
+		const char c = raw[i];
+		if (absl::ascii_isspace(static_cast<unsigned char>(c))) {
+			while (i < raw.size() && absl::ascii_isspace(static_cast<unsigned char>(raw[i]))) {
+				i++;
+			}
+			if (!s.empty() && i < raw.size()) {
+				s.push_back(' ');
+			}
+			continue;
+		}
+		if (!absl::ascii_isalnum(static_cast<unsigned char>(c))) {
+			s.push_back(c);
+			i++;
+			continue;
+		}
+		size_t end = i;
+		bool digit = false;
+		bool hex = true;
+		while (end < raw.size() && absl::ascii_isalnum(static_cast<unsigned char>(raw[end]))) {
+			digit |= absl::ascii_isdigit(static_cast<unsigned char>(raw[end]));
+			hex &= absl::ascii_isxdigit(static_cast<unsigned char>(raw[end]));
+			end++;
+		}
+		const std::string_view word = raw.substr(i, end - i);
+		i = end;
+		if (!digit) {
+			s.append(word);
+		} else if (hex) {
+			s.push_back('#');
+		} else {
+			for (size_t j = 0; j < word.size(); j++) {
+				if (!absl::ascii_isdigit(static_cast<unsigned char>(word[j]))) {
+					s.push_back(word[j]);
+				} else if (j == 0 || !absl::ascii_isdigit(static_cast<unsigned char>(word[j - 1]))) {
+					s.push_back('#');
+				}
+			}
+		}
+	}
+	return s;
+}
+
+// MinHash signatures
+////////////////////////////////////////////////////////////////////////////////
+
+// splitmix64 derives the hash functions of the signature from one hash of
+// each shingle.
+static uint64_t splitmix64(uint64_t x) {
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+constexpr size_t shingle_bytes = 3;
+
+CommandSignature command_signature(std::string_view normalized) {
+	CommandSignature sig;
+	sig.fill(UINT32_MAX);
+	const std::string_view text = normalized.substr(0, max_shingled_bytes);
+	const size_t n = text.size() < shingle_bytes ? 1 : text.size() - shingle_bytes + 1;
+	for (size_t i = 0; i < n; i++) {
+		const uint64_t h = command_hash(text.substr(i, shingle_bytes));
+		for (size_t k = 0; k < minhash_size; k++) {
+			const auto v = static_cast<uint32_t>(splitmix64(h + k));
+			sig[k] = std::min(sig[k], v);
+		}
+	}
+	return sig;
+}
+
+double signature_similarity(const CommandSignature& a, const CommandSignature& b) {
+	size_t equal = 0;
+	for (size_t k = 0; k < minhash_size; k++) {
+		equal += a[k] == b[k];
+	}
+	return static_cast<double>(equal) / minhash_size;
+}
+
+int64_t band_key(const CommandSignature& sig, size_t band) {
+	const std::string_view bytes(reinterpret_cast<const char *>(&sig[band * lsh_rows]),
+		lsh_rows * sizeof(uint32_t));
+	const uint64_t h = command_hash(bytes);
+	int64_t key;
+	std::memcpy(&key, &h, sizeof(key));
+	return key;
+}
+
+// Clusters
+////////////////////////////////////////////////////////////////////////////////
+
+// Served by the (band, key, cluster_id) primary key. A bucket that many
+// clusters share is not worth comparing to all of them.
+constexpr char select_cluster_candidates_stmt[] = R"""(
+SELECT cluster_id FROM command_cluster_bands WHERE band = ? AND key = ? LIMIT 16;
+)""";
+
+constexpr char select_cluster_stmt[] = R"""(
+SELECT signature, command FROM command_clusters WHERE id = ?;
+)""";
+
+constexpr char insert_cluster_stmt[] = R"""(
+INSERT INTO command_clusters (signature, command) VALUES (?, ?);
+)""";
+
+constexpr char insert_cluster_band_stmt[] = R"""(
+INSERT OR IGNORE INTO command_cluster_bands (band, key, cluster_id) VALUES (?, ?, ?);
+)""";
+
+constexpr char update_cluster_stmt[] = R"""(
+UPDATE command_clusters SET
+	runs = runs + 1,
+	failures = failures + ?,
+	last_day = max(last_day, ?)
+WHERE id = ?;
+)""";
+
+constexpr char update_history_cluster_stmt[] = R"""(
+UPDATE history SET cluster_id = ? WHERE id = ?;
+)""";
+
+ClusterIndexer::ClusterIndexer(SQLite::Database& db)
+	: db_(db), select_candidates_(db, select_cluster_candidates_stmt),
+	  select_cluster_(db, select_cluster_stmt), insert_cluster_(db, insert_cluster_stmt),
+	  insert_band_(db, insert_cluster_band_stmt), update_cluster_(db, update_cluster_stmt),
+	  update_history_(db, update_history_cluster_stmt) {}
+
+int64_t ClusterIndexer::cluster_id(const std::string& normalized) {
+	if (auto it = ids_.find(normalized); it != ids_.end()) {
+		return it->second;
+	}
+	const CommandSignature sig = command_signature(normalized);
+	const std::string_view command = command_preview(normalized);
+
+	std::vector<int64_t> candidates;
+	for (size_t band = 0; band < lsh_bands; band++) {
+		select_candidates_.reset();
+		select_candidates_.bind(1, static_cast<int64_t>(band));
+		select_candidates_.bind(2, band_key(sig, band));
+		while (select_candidates_.executeStep()) {
+			const int64_t id = select_candidates_.getColumn(0).getInt64();
+			if (std::find(candidates.begin(), candidates.end(), id) == candidates.end()) {
+				candidates.push_back(id);
+			}
+		}
+	}
+	select_candidates_.reset();
+
+	int64_t id = 0;
+	double best = cluster_similarity;
+	for (const int64_t candidate : candidates) {
+		select_cluster_.reset();
+		select_cluster_.bind(1, candidate);
+		if (!select_cluster_.executeStep()) {
+			continue;
+		}
+		const auto blob = select_cluster_.getColumn(0);
+		const auto text = select_cluster_.getColumn(1);
+		if (command.size() == normalized.size() &&
+			std::string_view(text.getText(), static_cast<size_t>(text.getBytes())) == command) {
+			id = candidate;
+			break;
+		}
+		CommandSignature other;
+		if (static_cast<size_t>(blob.getBytes()) != sizeof(other)) {
+			continue;
+		}
+		std::memcpy(other.data(), blob.getBlob(), sizeof(other));
+		const double similarity = signature_similarity(sig, other);
+		if (id == 0 ? similarity >= best : similarity > best) {
+			id = candidate;
+			best = similarity;
+		}
+	}
+	select_cluster_.reset();
+
+	if (id == 0) {
+		insert_cluster_.reset();
+		insert_cluster_.bind(1, sig.data(), static_cast<int>(sizeof(sig)));
+		insert_cluster_.bind(2, std::string(command));
+		insert_cluster_.exec();
+		id = db_.getLastInsertRowid();
+		for (size_t band = 0; band < lsh_bands; band++) {
+			insert_band_.reset();
+			insert_band_.bind(1, static_cast<int64_t>(band));
+			insert_band_.bind(2, band_key(sig, band));
+			insert_band_.bind(3, id);
+			insert_band_.exec();
+		}
+	}
+	ids_.emplace(normalized, id);
+	return id;
+}
+
+int64_t ClusterIndexer::add(int64_t id, std::string_view raw, int32_t status_code,
+	std::string_view created_at) {
+
+	const int64_t cluster = cluster_id(normalize_command(raw.substr(0, max_shingled_bytes)));
+	update_cluster_.reset();
+	update_cluster_.bind(1, status_code != 0 ? 1 : 0);
+	update_cluster_.bind(2, std::string(created_at.substr(0, 10)));
+	update_cluster_.bind(3, cluster);
+	update_cluster_.exec();
+	update_history_.reset();
+	update_history_.bind(1, cluster);
+	update_history_.bind(2, id);
+	update_history_.exec();
+	return cluster;
+}
+
+constexpr char select_backfill_clusters_stmt[] = R"""(
+SELECT id, status_code, created_at, )""" HISTDB_COMMAND_SQL R"""(
+FROM history
+WHERE rowid > ? AND rowid <= ? AND cluster_id IS NULL
+ORDER BY rowid;
+)""";
+
+void backfill_command_clusters(SQLite::Database& db, int64_t lo, int64_t hi) {
+	// Read the range before updating its rows.
+	struct Row {
+		int64_t id;
+		int32_t status_code;
+		std::string created_at;
+		std::string raw;
+	};
+	std::vector<Row> pending;
+	{
+		SQLite::Statement select(db, select_backfill_clusters_stmt);
+		select.bind(1, lo);
+		select.bind(2, hi);
+		RowCursor rows(select);
+		while (rows.next_batch()) {
+			for (size_t i = 0; i < rows.size(); i++) {
+				pending.push_back({rows.integer(i, 0), static_cast<int32_t>(rows.integer(i, 1)),
+					std::string(rows.text(i, 2)), std::string(rows.text(i, 3))});
+			}
+		}
+	}
+	ClusterIndexer indexer(db);
+	for (const auto& row : pending) {
+		indexer.add(row.id, row.raw, row.status_code, row.created_at);
+	}
+}
+
+} // namespace histdb
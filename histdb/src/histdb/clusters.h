@@ -0,0 +1,113 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <SQLiteCpp/Database.h>
+#include <SQLiteCpp/Statement.h>
+
+namespace histdb {
+
+// Normalization
+////////////////////////////////////////////////////////////////////////////////
+
+// normalize_command replaces the volatile parts of raw with "#" so that
+// commands that only differ in them are equal: every run of letters and
+// digits that has a digit is replaced if it is all hex ("3f2a9c1",
+// "8080"), otherwise only its digits are ("host-123" is "host-#", "v1.2" is
+// "v#.#"). Runs of whitespace are collapsed to a space.
+//
+//   git checkout 3f2a9c1e     -> git checkout #
+//   ssh -p 2222 10.0.0.12     -> ssh -p # #.#.#.#
+std::string normalize_command(std::string_view raw);
+
+// MinHash signatures
+////////////////////////////////////////////////////////////////////////////////
+
+// The signature of a command is its MinHash: the minimum of each of
+// minhash_size hash functions over the 3-byte shingles of its normalized
+// text. The fraction of equal values of two signatures estimates the
+// Jaccard similarity of the shingle sets, the commands are near duplicates
+// if it is at least cluster_similarity.
+//
+// The threshold is high because short commands are few shingles: "git
+// push" and "git pull" have a similarity of 0.5.
+//
+// Locality sensitive hashing finds the candidates without comparing every
+// pair: the signature is cut in lsh_bands bands of lsh_rows values and
+// commands that share the hash of a band are candidates. With 8 bands of 4
+// a pair with a similarity of 0.7 is a candidate with a probability of 0.89,
+// one of 0.3 with 0.06.
+constexpr size_t minhash_size = 32;
+constexpr size_t lsh_bands = 8;
+constexpr size_t lsh_rows = minhash_size / lsh_bands;
+constexpr double cluster_similarity = 0.7;
+
+// Only the start of long commands (heredocs, pasted scripts) is normalized
+// and shingled.
+constexpr size_t max_shingled_bytes = 2048;
+
+using CommandSignature = std::array<uint32_t, minhash_size>;
+
+// command_signature returns the signature of normalized, a normalized
+// command.
+CommandSignature command_signature(std::string_view normalized);
+
+// signature_similarity returns the fraction of equal values of a and b.
+double signature_similarity(const CommandSignature& a, const CommandSignature& b);
+
+// band_key returns the hash of band of sig, which is stored as a signed
+// SQLite integer.
+int64_t band_key(const CommandSignature& sig, size_t band);
+
+// Clusters
+////////////////////////////////////////////////////////////////////////////////
+
+// Every history row belongs to a cluster of near-duplicate commands
+// (history.cluster_id). The command_clusters table holds the signature and
+// the normalized text of the first command of each cluster, and like the
+// stats rollups (see stats.h) the number of runs of the cluster and the day
+// it was last used, which are not decremented when rows are deleted. The
+// command_cluster_bands (band, key) primary key is the LSH index.
+//
+// A command joins the cluster whose signature is the most similar among the
+// candidates of its bands, or starts a new one: clusters are assigned
+// incrementally, as the commands are inserted, and never merged. The first
+// command of a cluster is its center, so that a cluster can't drift one
+// near duplicate at a time.
+
+// ClusterIndexer assigns history rows to clusters. It keeps its statements
+// and the clusters of the normalized commands that it has seen, so one
+// indexer should be used for many rows.
+class ClusterIndexer {
+public:
+	explicit ClusterIndexer(SQLite::Database& db);
+
+	// add assigns history row id, whose command is raw, to its cluster and
+	// counts the run. It must be called in the transaction that inserts the
+	// row. Returns the id of the cluster.
+	int64_t add(int64_t id, std::string_view raw, int32_t status_code,
+		std::string_view created_at);
+
+private:
+	int64_t cluster_id(const std::string& normalized);
+
+	SQLite::Database& db_;
+	SQLite::Statement select_candidates_;
+	SQLite::Statement select_cluster_;
+	SQLite::Statement insert_cluster_;
+	SQLite::Statement insert_band_;
+	SQLite::Statement update_cluster_;
+	SQLite::Statement update_history_;
+	std::unordered_map<std::string, int64_t> ids_; // by normalized command
+};
+
+// backfill_command_clusters assigns the history rows in the rowid range
+// (lo, hi] to clusters (see migrate.h).
+void backfill_command_clusters(SQLite::Database& db, int64_t lo, int64_t hi);
+
+} // namespace histdb
@@ -0,0 +1,342 @@
+#include "compact.h"
+
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include <SQLiteCpp/Database.h>
+#include <SQLiteCpp/Statement.h>
+
+#include "blobs.h"
+#include "rows.h"
+#include "trace.h"
+#include "transaction.h"
+
+namespace histdb {
+
+// Chunked transactions
+////////////////////////////////////////////////////////////////////////////////
+
+// Every policy that only depends on a row and its predecessor in the session
+// is a predicate that is applied to the history in id ranges.
+
+// ?3 is the cutoff as a Julian day number (created_at includes its UTC offset).
+constexpr char expired_pred[] = "julianday(created_at) < ?3";
+
+// bash exits with 127 when a command is not found.
+constexpr char typo_pred[] = "status_code = 127";
+
+// Served by the history_session_id_idx (session_id, id) index. Blobs are
+// content addressed, so two rows run the same command if they have the same
+// raw (preview) and blob.
+constexpr char duplicate_pred[] = R"""((raw, COALESCE(raw_blob, 0), directory) = (
+	SELECT p.raw, COALESCE(p.raw_blob, 0), p.directory FROM history AS p
+	WHERE p.session_id = history.session_id AND p.id < history.id
+	ORDER BY p.id DESC
+	LIMIT 1
+))""";
+
+// ?3 is the id of the newest row to delete.
+constexpr char truncated_pred[] = "id <= ?3";
+
+// RangePolicy deletes the rows matching a predicate in id ranges.
+class RangePolicy {
+public:
+	RangePolicy(SQLite::Database& db, const char *pred)
+		: query_(db, absl::StrCat(
+			"DELETE FROM history WHERE id >= ?1 AND id < ?2 AND ", pred, ";")) {}
+
+	// bind binds the policy's argument (?3), if any.
+	template <typename T>
+	void bind(T arg) { query_.bind(3, arg); }
+
+	// run returns the number of rows deleted with ids in [lo, hi).
+	int64_t run(int64_t lo, int64_t hi) {
+		query_.reset();
+		query_.bind(1, lo);
+		query_.bind(2, hi);
+		return query_.exec();
+	}
+
+private:
+	SQLite::Statement query_;
+};
+
+// ChunkTransaction is a WriteTransaction that is only started (and followed
+// by a pause) when each chunk is committed on its own, which is not the case
+// for a dry run (which is one transaction that is rolled back).
+class ChunkTransaction {
+public:
+	ChunkTransaction(SQLite::Database& db, const CompactOptions& opts,
+		CompactStats& stats) : opts_(opts), stats_(stats) {
+		if (!opts_.dry_run) {
+			transaction_.emplace(db);
+		}
+	}
+
+	void commit() {
+		if (transaction_) {
+			transaction_->commit();
+			stats_.transactions++;
+			std::this_thread::sleep_for(opts_.pause);
+		}
+	}
+
+private:
+	const CompactOptions& opts_;
+	CompactStats& stats_;
+	std::optional<WriteTransaction> transaction_;
+};
+
+// Policies
+////////////////////////////////////////////////////////////////////////////////
+
+struct IdRange {
+	int64_t min = 0;
+	int64_t max = -1;
+};
+
+static IdRange history_id_range(SQLite::Database& db) {
+	IdRange r;
+	SQLite::Statement query(db, "SELECT MIN(id), MAX(id) FROM history;");
+	if (query.executeStep() && !query.getColumn(0).isNull()) {
+		r.min = query.getColumn(0).getInt64();
+		r.max = query.getColumn(1).getInt64();
+	}
+	return r;
+}
+
+// julianday_now returns the current time as a Julian day number.
+static double julianday_now() {
+	using namespace std::chrono;
+	auto us = duration_cast<microseconds>(system_clock::now().time_since_epoch());
+	return static_cast<double>(us.count()) / (86400.0 * 1e6) + 2440587.5;
+}
+
+// run_range_policies applies policies to the rows with ids in range, one
+// transaction per chunk of ids.
+static void run_range_policies(SQLite::Database& db, const CompactOptions& opts,
+	IdRange range, const std::vector<std::pair<RangePolicy *, int64_t *>>& policies,
+	CompactStats& stats) {
+
+	if (policies.empty()) {
+		return;
+	}
+	for (int64_t lo = range.min; lo <= range.max; lo += opts.chunk_rows) {
+		const int64_t hi = std::min(range.max, lo + opts.chunk_rows - 1) + 1;
+		ChunkTransaction transaction(db, opts, stats);
+		for (auto& [policy, count] : policies) {
+			*count += policy->run(lo, hi);
+		}
+		transaction.commit();
+	}
+}
+
+// superseded_ids returns the ids of the rows that are older than the last
+// keep runs of the same command, or with opts.by_cluster of the same cluster
+// of near duplicates (see clusters.h; rows that the backfill has not
+// assigned yet count as their command). The history is read newest first
+// in chunks (each a short read transaction).
+static std::vector<int64_t> superseded_ids(SQLite::Database& db,
+	const CompactOptions& opts, IdRange range) {
+
+	std::vector<int64_t> ids;
+	std::unordered_map<std::string, int64_t> runs;
+	std::string key;
+	SQLite::Statement query(db, R"""(
+SELECT id, raw, COALESCE(raw_blob, 0), COALESCE(cluster_id, 0)
+FROM history WHERE id <= ? ORDER BY id DESC LIMIT ?;
+)""");
+	query.bind(2, opts.chunk_rows);
+	RowCursor rows(query, static_cast<size_t>(opts.chunk_rows));
+	for (int64_t next = range.max; next >= range.min; ) {
+		rows.reset();
+		query.bind(1, next);
+		int64_t n = 0;
+		while (rows.next_batch()) {
+			for (size_t i = 0; i < rows.size(); i++) {
+				const int64_t id = rows.integer(i, 0);
+				if (const int64_t cluster = rows.integer(i, 3); opts.by_cluster && cluster != 0) {
+					// Commands don't start with a NUL.
+					key.assign(1, '\0');
+					key.append(std::to_string(cluster));
+				} else {
+					key.assign(rows.text(i, 1));
+					if (const int64_t blob = rows.integer(i, 2); blob != 0) {
+						// The preview of a large command and its blob.
+						key.push_back('\0');
+						key.append(std::to_string(blob));
+					}
+				}
+				if (++runs[key] > opts.keep_last) {
+					ids.push_back(id);
+				}
+				next = id - 1;
+				n++;
+			}
+		}
+		if (n < opts.chunk_rows) {
+			break;
+		}
+	}
+	std::sort(ids.begin(), ids.end());
+	return ids;
+}
+
+static void delete_ids(SQLite::Database& db, const CompactOptions& opts,
+	const std::vector<int64_t>& ids, CompactStats& stats) {
+
+	SQLite::Statement query(db, "DELETE FROM history WHERE id = ?;");
+	for (size_t i = 0; i < ids.size(); ) {
+		ChunkTransaction transaction(db, opts, stats);
+		const size_t end = std::min(ids.size(), i + static_cast<size_t>(opts.chunk_rows));
+		for (; i < end; i++) {
+			query.reset();
+			query.bind(1, ids[i]);
+			query.exec();
+		}
+		transaction.commit();
+	}
+}
+
+// Vacuum
+////////////////////////////////////////////////////////////////////////////////
+
+// Number of pages released by each "PRAGMA incremental_vacuum".
+constexpr int64_t vacuum_step_pages = 256;
+
+constexpr int auto_vacuum_incremental = 2;
+
+static int64_t freelist_count(SQLite::Database& db) {
+	return db.execAndGet("PRAGMA freelist_count;").getInt64();
+}
+
+static void vacuum(SQLite::Database& db, const CompactOptions& opts,
+	CompactStats& stats) {
+
+	if (db.execAndGet("PRAGMA auto_vacuum;").getInt() != auto_vacuum_incremental) {
+		// auto_vacuum can only be changed by rebuilding the database.
+		stats.freed_pages = freelist_count(db);
+		db.exec("PRAGMA auto_vacuum = INCREMENTAL;");
+		db.exec("VACUUM;");
+		stats.converted = true;
+		stats.transactions++;
+		return;
+	}
+	for (int64_t free = freelist_count(db); free > 0; ) {
+		db.exec(absl::StrCat("PRAGMA incremental_vacuum(", vacuum_step_pages, ");"));
+		stats.transactions++;
+		const int64_t left = freelist_count(db);
+		if (left >= free) {
+			break; // nothing was released
+		}
+		stats.freed_pages += free - left;
+		free = left;
+		std::this_thread::sleep_for(opts.pause);
+	}
+}
+
+// Compaction
+////////////////////////////////////////////////////////////////////////////////
+
+CompactStats compact_history(const std::string& path, const CompactOptions& opts) {
+	if (opts.chunk_rows <= 0) {
+		throw std::invalid_argument("compact: chunk rows must be positive");
+	}
+
+	// NB: the default (normal) locking mode releases the lock after every
+	// transaction, unlike the connections used by the other commands.
+	SQLite::Database db(path, SQLite::OPEN_READWRITE);
+	trace_connection(db, opts.busy_timeout_ms);
+	db.exec(absl::StrCat("PRAGMA journal_mode = '", opts.journal_mode, "';"));
+
+	// A dry run deletes the rows in a single transaction that is rolled back
+	// so that the counts are exact (policies overlap).
+	std::optional<WriteTransaction> dry_run;
+	if (opts.dry_run) {
+		dry_run.emplace(db);
+	}
+
+	CompactStats stats;
+	const IdRange range = history_id_range(db);
+
+	RangePolicy expired(db, expired_pred);
+	RangePolicy typos(db, typo_pred);
+	RangePolicy duplicates(db, duplicate_pred);
+	std::vector<std::pair<RangePolicy *, int64_t *>> policies;
+	if (opts.max_age_days > 0) {
+		expired.bind(julianday_now() - static_cast<double>(opts.max_age_days));
+		policies.emplace_back(&expired, &stats.expired);
+	}
+	if (opts.drop_typos) {
+		policies.emplace_back(&typos, &stats.typos);
+	}
+	if (opts.dedupe) {
+		policies.emplace_back(&duplicates, &stats.duplicates);
+	}
+	run_range_policies(db, opts, range, policies, stats);
+
+	if (opts.keep_last > 0) {
+		auto ids = superseded_ids(db, opts, range);
+		stats.superseded = static_cast<int64_t>(ids.size());
+		delete_ids(db, opts, ids, stats);
+	}
+
+	if (opts.max_rows > 0) {
+		// Rows inserted while compacting are not counted.
+		SQLite::Statement query(db, R"""(
+SELECT id FROM history WHERE id <= ? ORDER BY id DESC LIMIT 1 OFFSET ?;
+)""");
+		query.bind(1, range.max);
+		query.bind(2, opts.max_rows);
+		if (query.executeStep()) {
+			RangePolicy truncated(db, truncated_pred);
+			truncated.bind(query.getColumn(0).getInt64());
+			query.reset();
+			run_range_policies(db, opts, range, {{&truncated, &stats.truncated}}, stats);
+		}
+	}
+
+	if (stats.deleted() > 0) {
+		std::optional<WriteTransaction> tx;
+		if (!opts.dry_run) {
+			tx.emplace(db);
+		}
+		stats.blobs = delete_unused_command_blobs(db);
+		if (tx) {
+			tx->commit();
+			stats.transactions++;
+		}
+	}
+
+	if (!opts.dry_run) {
+		vacuum(db, opts, stats);
+	}
+	return stats;
+}
+
+void print_compact_stats(const CompactStats& stats, bool dry_run, std::ostream& out) {
+	out << (dry_run ? "would delete:" : "deleted:") << "\n"
+		<< "  expired:      " << stats.expired << "\n"
+		<< "  not found:    " << stats.typos << "\n"
+		<< "  duplicates:   " << stats.duplicates << "\n"
+		<< "  superseded:   " << stats.superseded << "\n"
+		<< "  over limit:   " << stats.truncated << "\n"
+		<< "  total:        " << stats.deleted() << "\n"
+		<< "  unused blobs: " << stats.blobs << "\n";
+	if (dry_run) {
+		return;
+	}
+	out << "transactions:   " << stats.transactions << "\n"
+		<< "freed pages:    " << stats.freed_pages << "\n";
+	if (stats.converted) {
+		out << "note: enabled incremental auto_vacuum (the database was rebuilt)\n";
+	}
+}
+
+} // namespace histdb
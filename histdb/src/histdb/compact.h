@@ -0,0 +1,72 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace histdb {
+
+// Compaction
+////////////////////////////////////////////////////////////////////////////////
+
+struct CompactOptions {
+	int64_t max_age_days = 0; // delete commands older than this (0 means keep all)
+	int64_t max_rows = 0;     // keep only the newest N commands (0 means keep all)
+	int64_t keep_last = 0;    // keep only the last K runs of each command (0 means keep all)
+	bool by_cluster = false;  // count the runs of keep_last per cluster of near duplicates
+	bool drop_typos = false;  // delete commands that were not found (exit status 127)
+	bool dedupe = false;      // delete consecutive repeats of a command in a session
+
+	// Every transaction deletes at most chunk_rows rows and is followed by
+	// a pause so that shells inserting commands are not starved.
+	int64_t chunk_rows = 1000;
+	std::chrono::milliseconds pause{5};
+	int busy_timeout_ms = 0;
+	// Journal mode of the database's durability tier (see durability.h).
+	std::string journal_mode = "persist";
+
+	// Only count the rows that would be deleted. The rows are deleted in a
+	// single transaction that is rolled back, which holds the write lock for
+	// the whole run.
+	bool dry_run = false;
+};
+
+struct CompactStats {
+	int64_t expired = 0;
+	int64_t typos = 0;
+	int64_t duplicates = 0;
+	int64_t superseded = 0; // older runs dropped by keep_last
+	int64_t truncated = 0;  // oldest rows dropped by max_rows
+	int64_t blobs = 0;      // command blobs no longer referenced (see blobs.h)
+	int64_t transactions = 0;
+	int64_t freed_pages = 0;
+	bool converted = false; // database was converted to incremental vacuum
+
+	int64_t deleted() const {
+		return expired + typos + duplicates + superseded + truncated;
+	}
+};
+
+// compact_history deletes the history rows selected by opts from the
+// database at path and then returns the freed pages to the file system.
+//
+// Rows are deleted in id ranges of opts.chunk_rows, one transaction each,
+// and the free pages are released with "PRAGMA incremental_vacuum" in equally
+// small steps, so the write lock is only ever held for a short time and
+// compaction can run (from cron) while shells are recording commands. The
+// database is opened with its own connection in the normal locking mode.
+//
+// Databases created before auto_vacuum was enabled are converted with a
+// single VACUUM the first time they are compacted.
+//
+// The blobs of large commands (see blobs.h) that no remaining row references
+// are deleted in one more transaction.
+//
+// The stats rollups are not changed: they count every command that was ever
+// recorded.
+CompactStats compact_history(const std::string& path, const CompactOptions& opts);
+
+void print_compact_stats(const CompactStats& stats, bool dry_run, std::ostream& out);
+
+} // namespace histdb
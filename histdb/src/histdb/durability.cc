@@ -0,0 +1,168 @@
+#include "durability.h"
+
+#include <fstream>
+#include <stdexcept>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include <SQLiteCpp/Statement.h>
+
+#include "timefmt.h"
+
+namespace histdb {
+
+// Durability tiers
+////////////////////////////////////////////////////////////////////////////////
+
+std::string Durability::name() const {
+	switch (tier) {
+	case DurabilityTier::Strict:
+		return "strict";
+	case DurabilityTier::Grouped:
+		return absl::StrCat("grouped:", group_interval.count(), ":", group_records);
+	case DurabilityTier::Relaxed:
+		return "relaxed";
+	}
+	return "unknown";
+}
+
+const char *Durability::journal_mode() const {
+	return tier == DurabilityTier::Strict ? "persist" : "wal";
+}
+
+Durability parse_durability(std::string_view spec) {
+	const std::string s = absl::AsciiStrToLower(absl::StripAsciiWhitespace(spec));
+	const std::string_view name = std::string_view(s).substr(0, s.find(':'));
+	Durability d;
+	if (name == "strict" && name.size() == s.size()) {
+		d.tier = DurabilityTier::Strict;
+	} else if (name == "relaxed" && name.size() == s.size()) {
+		d.tier = DurabilityTier::Relaxed;
+	} else if (name == "grouped") {
+		d.tier = DurabilityTier::Grouped;
+		std::string_view rest = std::string_view(s).substr(name.size());
+		int64_t values[2] = {d.group_interval.count(), d.group_records};
+		for (int64_t& v : values) {
+			if (rest.empty()) {
+				break;
+			}
+			rest.remove_prefix(1); // ':'
+			const std::string_view field = rest.substr(0, rest.find(':'));
+			rest.remove_prefix(field.size());
+			if (!absl::SimpleAtoi(field, &v) || v <= 0) {
+				throw std::invalid_argument(absl::StrCat(
+					"invalid durability: '", spec, "': '", field, "' is not a positive number"));
+			}
+		}
+		if (!rest.empty()) {
+			throw std::invalid_argument(absl::StrCat("invalid durability: '", spec,
+				"' (expected grouped[:INTERVAL_MS[:RECORDS]])"));
+		}
+		d.group_interval = std::chrono::milliseconds(values[0]);
+		d.group_records = values[1];
+	} else {
+		throw std::invalid_argument(absl::StrCat("invalid durability: '", spec,
+			"' (expected strict, grouped or relaxed)"));
+	}
+	return d;
+}
+
+Durability load_durability(std::string_view env, const std::filesystem::path& config) {
+	if (!env.empty()) {
+		return parse_durability(env);
+	}
+	std::ifstream in(config);
+	std::string line;
+	while (std::getline(in, line)) {
+		const std::string_view spec = absl::StripAsciiWhitespace(line);
+		if (!spec.empty() && spec[0] != '#') {
+			return parse_durability(spec);
+		}
+	}
+	return Durability{};
+}
+
+void configure_durability(SQLite::Database& db, const Durability& d) {
+	if (d.tier == DurabilityTier::Strict) {
+		db.exec(
+			"PRAGMA journal_mode = 'PERSIST';\n"
+			"PRAGMA locking_mode = 'EXCLUSIVE';\n"
+			"PRAGMA synchronous = FULL;"
+		);
+		return;
+	}
+	db.exec(
+		"PRAGMA journal_mode = 'WAL';\n"
+		"PRAGMA locking_mode = 'NORMAL';\n"
+		"PRAGMA synchronous = NORMAL;"
+	);
+}
+
+// Grouped commits
+////////////////////////////////////////////////////////////////////////////////
+
+const char create_durability_groups_stmt[] = R"""(
+CREATE TABLE IF NOT EXISTS durability_groups (
+    `id`        INTEGER PRIMARY KEY CHECK (id = 1),
+    `synced_us` INTEGER NOT NULL,
+    `pending`   INTEGER NOT NULL
+);
+
+INSERT OR IGNORE INTO durability_groups (id, synced_us, pending) VALUES (1, 0, 0);
+)""";
+
+constexpr char select_durability_group_stmt[] = R"""(
+SELECT synced_us, pending FROM durability_groups WHERE id = 1;
+)""";
+
+constexpr char update_durability_group_stmt[] = R"""(
+UPDATE durability_groups SET
+	synced_us = CASE WHEN ?1 THEN ?2 ELSE synced_us END,
+	pending = CASE WHEN ?1 THEN 0 ELSE pending + ?3 END
+WHERE id = 1;
+)""";
+
+DurableTransaction::DurableTransaction(SQLite::Database& db, const Durability& d,
+	int64_t records)
+	: db_(db), tier_(d.tier), records_(records), synced_(d.tier == DurabilityTier::Strict) {
+
+	if (tier_ != DurabilityTier::Grouped) {
+		transaction_.emplace(db_);
+		return;
+	}
+	// Most commits of a group are not synced. If the group turns out to be
+	// due once the lock is held, start over with a synced commit.
+	bool full = false;
+	for (;;) {
+		db_.exec(full ? "PRAGMA synchronous = FULL;" : "PRAGMA synchronous = NORMAL;");
+		transaction_.emplace(db_);
+		now_us_ = unix_micros(std::chrono::system_clock::now());
+		SQLite::Statement query(db_, select_durability_group_stmt);
+		const bool due = !query.executeStep() ||
+			now_us_ - query.getColumn(0).getInt64() >=
+				std::chrono::microseconds(d.group_interval).count() ||
+			query.getColumn(1).getInt64() + records_ >= d.group_records;
+		query.reset();
+		if (full || !due) {
+			// A synced commit starts a new group even if it was not due.
+			synced_ = full;
+			return;
+		}
+		transaction_.reset(); // roll back
+		full = true;
+	}
+}
+
+void DurableTransaction::commit() {
+	if (tier_ == DurabilityTier::Grouped) {
+		SQLite::Statement update(db_, update_durability_group_stmt);
+		update.bind(1, synced_ ? 1 : 0);
+		update.bind(2, now_us_);
+		update.bind(3, records_);
+		update.exec();
+	}
+	transaction_->commit();
+}
+
+} // namespace histdb
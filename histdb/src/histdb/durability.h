@@ -0,0 +1,116 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include <SQLiteCpp/Database.h>
+
+#include "transaction.h"
+
+namespace histdb {
+
+// Durability tiers
+////////////////////////////////////////////////////////////////////////////////
+
+// A durability tier trades the commands that a crash may lose for the cost
+// of writing them. None of the tiers lose a command whose write returned
+// when only the histdb process crashes (or is killed): the tiers differ in
+// what an OS crash or a power loss loses.
+//
+//   strict   The rollback journal (PERSIST) with synchronous=FULL: every
+//            commit is synced to disk before the write returns. Nothing is
+//            lost. This is the default.
+//
+//   grouped  WAL with synchronous=NORMAL, except that a commit is synced
+//            (synchronous=FULL, which syncs the WAL and so every commit
+//            before it) once group_records records are unsynced or
+//            group_interval passed since the last synced commit. A crash
+//            loses fewer than group_records commands, written since the
+//            last sync; commands older than group_interval are only lost
+//            if no command was written after them (the interval is checked
+//            by the writes, there is no timer).
+//
+//   relaxed  WAL with synchronous=NORMAL: commits are left in the OS page
+//            cache and synced by the WAL checkpoints (every 1000 pages of
+//            WAL, or when the last connection closes). A crash loses the
+//            commands since the last checkpoint.
+//
+// The WAL tiers use the normal locking mode, so that concurrent shells
+// don't wait for each other's exclusive lock. The last connection to close
+// still checkpoints the WAL (and syncs it): skipping that checkpoint makes
+// the next connection rebuild the WAL index from the whole WAL, which costs
+// more than the sync.
+enum class DurabilityTier {
+	Strict,
+	Grouped,
+	Relaxed,
+};
+
+struct Durability {
+	DurabilityTier tier = DurabilityTier::Strict;
+	std::chrono::milliseconds group_interval{1000}; // grouped
+	int64_t group_records = 64;                     // grouped
+
+	// name returns the specification of d (see parse_durability).
+	std::string name() const;
+
+	// journal_mode returns the journal mode of the tier ("persist" or
+	// "wal").
+	const char *journal_mode() const;
+};
+
+// parse_durability parses "strict", "relaxed" or
+// "grouped[:INTERVAL_MS[:RECORDS]]" and throws std::invalid_argument if spec
+// is invalid.
+Durability parse_durability(std::string_view spec);
+
+// load_durability returns the tier specified by env (the value of
+// $HISTDB_DURABILITY) if it is not empty, or else by the first line of
+// config that is neither empty nor a comment ("#"), or else strict.
+Durability load_durability(std::string_view env, const std::filesystem::path& config);
+
+// configure_durability sets the journal mode, locking mode and synchronous
+// setting of d on a new connection.
+void configure_durability(SQLite::Database& db, const Durability& d);
+
+// Grouped commits
+////////////////////////////////////////////////////////////////////////////////
+
+// The durability_groups table holds the time of the last synced commit and
+// the number of records written since, which every writer of a grouped
+// database shares. It is created by a migration.
+extern const char create_durability_groups_stmt[];
+
+// DurableTransaction is a WriteTransaction that writes records history
+// records and whose commit is synced as the tier of d requires. For the
+// grouped tier whether to sync is decided from the durability_groups table
+// once the write lock is held, so that concurrent writers see each other's
+// commits. The synchronous setting can't change within a transaction: it is
+// set to NORMAL before the transaction starts, which is restarted with FULL
+// if the group is due.
+class DurableTransaction {
+public:
+	DurableTransaction(SQLite::Database& db, const Durability& d, int64_t records = 1);
+
+	void commit();
+
+	// synced returns if the commit is synced to disk.
+	bool synced() const { return synced_; }
+
+	DurableTransaction(const DurableTransaction&) = delete;
+	DurableTransaction& operator=(const DurableTransaction&) = delete;
+
+private:
+	SQLite::Database& db_;
+	const DurabilityTier tier_;
+	const int64_t records_;
+	bool synced_;
+	int64_t now_us_ = 0;
+	std::optional<WriteTransaction> transaction_;
+};
+
+} // namespace histdb
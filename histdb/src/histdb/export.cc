@@ -0,0 +1,382 @@
+#include "export.h"
+
+#include <algorithm>
+#include <charconv>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "absl/strings/str_cat.h"
+#include <SQLiteCpp/Database.h>
+#include <SQLiteCpp/Statement.h>
+
+#include "arrow_ipc.h"
+#include "blobs.h"
+#include "parquet.h"
+#include "rows.h"
+#include "timefmt.h"
+#include "trace.h"
+
+namespace histdb {
+
+// Columnar batches
+////////////////////////////////////////////////////////////////////////////////
+
+const std::vector<std::string> history_columns = {
+	"id",
+	"session_id",
+	"history_id",
+	"ppid",
+	"status_code",
+	"created_at",
+	"username",
+	"directory",
+	"raw",
+};
+
+void DictionaryColumn::push_back(std::string_view s) {
+	auto [it, inserted] = lookup_.try_emplace(std::string(s),
+		static_cast<int32_t>(values_.size()));
+	if (inserted) {
+		values_.push_back(s);
+	}
+	indices_.push_back(it->second);
+}
+
+void append_history_row(const RowCursor& rows, size_t i, HistoryBatch& batch) {
+	batch.id.push_back(rows.integer(i, 0));
+	batch.session_id.push_back(rows.integer(i, 1));
+	batch.history_id.push_back(rows.integer(i, 2));
+	batch.ppid.push_back(rows.integer(i, 3));
+	batch.status_code.push_back(static_cast<int32_t>(rows.integer(i, 4)));
+	batch.created_at.push_back(rows.text(i, 5));
+	batch.username.push_back(rows.text(i, 6));
+	batch.directory.push_back(rows.text(i, 7));
+	batch.raw.push_back(rows.text(i, 8));
+}
+
+size_t HistoryBatch::byte_size() const {
+	return size() * (4 * sizeof(int64_t) + 3 * sizeof(int32_t) + 2 * sizeof(int32_t)) +
+		created_at.data.size() + username.values().data.size() +
+		directory.values().data.size() + raw.data.size();
+}
+
+// CSV
+////////////////////////////////////////////////////////////////////////////////
+
+static void append_csv_field(std::string& out, std::string_view s) {
+	if (s.find_first_of(",\"\r\n") == std::string_view::npos) {
+		out.append(s);
+		return;
+	}
+	out.push_back('"');
+	for (char c : s) {
+		if (c == '"') {
+			out.push_back('"');
+		}
+		out.push_back(c);
+	}
+	out.push_back('"');
+}
+
+template <typename T>
+static void append_csv_int(std::string& out, T v) {
+	char buf[24];
+	auto res = std::to_chars(buf, buf + sizeof(buf), v);
+	out.append(buf, res.ptr);
+	out.push_back(',');
+}
+
+std::string csv_header() {
+	std::string out;
+	for (const auto& name : history_columns) {
+		if (!out.empty()) {
+			out.push_back(',');
+		}
+		out.append(name);
+	}
+	out.push_back('\n');
+	return out;
+}
+
+std::string encode_csv(const HistoryBatch& batch) {
+	std::string out;
+	out.reserve(batch.byte_size() + batch.size() * 16);
+	for (size_t i = 0; i < batch.size(); i++) {
+		append_csv_int(out, batch.id[i]);
+		append_csv_int(out, batch.session_id[i]);
+		append_csv_int(out, batch.history_id[i]);
+		append_csv_int(out, batch.ppid[i]);
+		append_csv_int(out, batch.status_code[i]);
+		append_csv_field(out, batch.created_at.at(i));
+		out.push_back(',');
+		append_csv_field(out, batch.username.at(i));
+		out.push_back(',');
+		append_csv_field(out, batch.directory.at(i));
+		out.push_back(',');
+		append_csv_field(out, batch.raw.at(i));
+		out.push_back('\n');
+	}
+	return out;
+}
+
+// Export
+////////////////////////////////////////////////////////////////////////////////
+
+ExportFormat parse_export_format(std::string_view name) {
+	if (name == "csv") {
+		return ExportFormat::Csv;
+	}
+	if (name == "arrow-ipc") {
+		return ExportFormat::ArrowIpc;
+	}
+	if (name == "parquet") {
+		return ExportFormat::Parquet;
+	}
+	throw std::invalid_argument(absl::StrCat("invalid export format: '", name, "'"));
+}
+
+// Batches are flushed once they reach this size so that string offsets fit
+// in 32 bits and a shard full of large commands does not use unbounded memory.
+constexpr size_t max_batch_bytes = 64 * 1024 * 1024;
+
+constexpr char select_history_columns[] =
+	"id, session_id, history_id, ppid, status_code, created_at, username, directory, "
+	HISTDB_COMMAND_SQL;
+
+std::string export_select(const CompiledFilter& filter) {
+	return filtered_select(filter, select_history_columns, "id >= ?1 AND id <= ?2",
+		"ORDER BY id");
+}
+
+struct EncodedBatch {
+	std::string data;
+	ParquetRowGroup row_group; // Parquet only (data is stored here)
+};
+
+static EncodedBatch encode_batch(ExportFormat format, const HistoryBatch& batch) {
+	EncodedBatch enc;
+	switch (format) {
+	case ExportFormat::Csv:
+		enc.data = encode_csv(batch);
+		break;
+	case ExportFormat::ArrowIpc:
+		enc.data = encode_arrow_ipc_batch(batch);
+		break;
+	case ExportFormat::Parquet:
+		enc.row_group = encode_parquet_row_group(batch);
+		break;
+	}
+	return enc;
+}
+
+// read_shard reads and encodes the history rows with ids in [lo, hi] that
+// match filter. The statement is prepared once per connection.
+static std::vector<EncodedBatch> read_shard(StatementCache& cache,
+	ExportFormat format, const CompiledFilter& filter, int64_t lo, int64_t hi) {
+
+	std::vector<EncodedBatch> batches;
+	SQLite::Statement& query = cache.get(export_select(filter));
+	query.bind(1, lo);
+	query.bind(2, hi);
+	bind_filter(query, filter);
+	RowCursor rows(query);
+	HistoryBatch batch;
+	while (rows.next_batch()) {
+		for (size_t i = 0; i < rows.size(); i++) {
+			append_history_row(rows, i, batch);
+			if (batch.byte_size() >= max_batch_bytes) {
+				batches.push_back(encode_batch(format, batch));
+				batch = HistoryBatch();
+			}
+		}
+	}
+	if (batch.size() > 0) {
+		batches.push_back(encode_batch(format, batch));
+	}
+	return batches;
+}
+
+// ShardQueue hands out shards to the workers and their results to the writer
+// in order. Workers do not start a shard more than window shards ahead of the
+// writer, which bounds memory use.
+class ShardQueue {
+public:
+	ShardQueue(size_t nshards, size_t window) : nshards_(nshards), window_(window) {}
+
+	// next returns the index of the next shard to read or nshards if there
+	// are none left (or the export failed).
+	size_t next() {
+		std::unique_lock<std::mutex> lock(mu_);
+		cond_.wait(lock, [this]() {
+			return failed_ || next_ >= nshards_ || next_ < written_ + window_;
+		});
+		if (failed_ || next_ >= nshards_) {
+			return nshards_;
+		}
+		return next_++;
+	}
+
+	void put(size_t shard, std::vector<EncodedBatch> batches) {
+		std::lock_guard<std::mutex> lock(mu_);
+		done_.emplace(shard, std::move(batches));
+		cond_.notify_all();
+	}
+
+	void fail(std::exception_ptr err) {
+		std::lock_guard<std::mutex> lock(mu_);
+		if (!failed_) {
+			failed_ = true;
+			err_ = err;
+		}
+		cond_.notify_all();
+	}
+
+	// take waits for the next shard in order and returns false if the
+	// export failed.
+	bool take(std::vector<EncodedBatch>& batches) {
+		std::unique_lock<std::mutex> lock(mu_);
+		cond_.wait(lock, [this]() {
+			return failed_ || done_.count(written_) != 0;
+		});
+		if (failed_) {
+			return false;
+		}
+		auto it = done_.find(written_);
+		batches = std::move(it->second);
+		done_.erase(it);
+		written_++;
+		cond_.notify_all();
+		return true;
+	}
+
+	std::exception_ptr error() {
+		std::lock_guard<std::mutex> lock(mu_);
+		return err_;
+	}
+
+private:
+	std::mutex mu_;
+	std::condition_variable cond_;
+	const size_t nshards_;
+	const size_t window_;
+	size_t next_ = 0;
+	size_t written_ = 0;
+	bool failed_ = false;
+	std::exception_ptr err_;
+	std::map<size_t, std::vector<EncodedBatch>> done_;
+};
+
+void export_history(const std::string& path, const ExportOptions& opts,
+	std::ostream& out) {
+
+	if (opts.shard_rows <= 0) {
+		throw std::invalid_argument("export: shard rows must be positive");
+	}
+
+	int64_t min_id = 0;
+	int64_t max_id = -1;
+	CompiledFilter filter;
+	{
+		SQLite::Database db(path, SQLite::OPEN_READONLY);
+		trace_connection(db, opts.busy_timeout_ms);
+		filter = compile_filter(opts.filter, read_filter_schema(db));
+		SQLite::Statement query(db, "SELECT MIN(id), MAX(id) FROM history;");
+		if (query.executeStep() && !query.getColumn(0).isNull()) {
+			min_id = query.getColumn(0).getInt64();
+			max_id = query.getColumn(1).getInt64();
+		}
+	}
+	const size_t nshards = max_id < min_id ? 0 :
+		static_cast<size_t>((max_id - min_id) / opts.shard_rows + 1);
+
+	size_t nthreads = opts.threads > 0 ? static_cast<size_t>(opts.threads) :
+		std::max(1u, std::thread::hardware_concurrency());
+	nthreads = std::max<size_t>(1, std::min(nthreads, nshards));
+
+	ShardQueue queue(nshards, nthreads * 2);
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < nthreads && nshards > 0; i++) {
+		workers.emplace_back([&]() {
+			try {
+				SQLite::Database db(path, SQLite::OPEN_READONLY);
+				trace_connection(db, opts.busy_timeout_ms);
+				register_time_functions(db);
+				StatementCache cache(db);
+				for (size_t shard; (shard = queue.next()) < nshards; ) {
+					const int64_t lo = min_id + static_cast<int64_t>(shard) * opts.shard_rows;
+					const int64_t hi = std::min(max_id, lo + opts.shard_rows - 1);
+					queue.put(shard, read_shard(cache, opts.format, filter, lo, hi));
+				}
+			} catch (...) {
+				queue.fail(std::current_exception());
+			}
+		});
+	}
+
+	// Write the shards in order while the workers are busy.
+	try {
+		switch (opts.format) {
+		case ExportFormat::Csv:
+			out << csv_header();
+			break;
+		case ExportFormat::ArrowIpc:
+			out << arrow_ipc_schema();
+			break;
+		case ExportFormat::Parquet:
+			out << parquet_magic;
+			break;
+		}
+		int64_t offset = static_cast<int64_t>(parquet_magic.size());
+		std::vector<ParquetRowGroup> row_groups;
+		std::vector<EncodedBatch> batches;
+		for (size_t i = 0; i < nshards && queue.take(batches); i++) {
+			for (auto& batch : batches) {
+				if (opts.format == ExportFormat::Parquet) {
+					auto& rg = batch.row_group;
+					rg.file_offset = offset;
+					out.write(rg.data.data(), static_cast<std::streamsize>(rg.data.size()));
+					offset += static_cast<int64_t>(rg.data.size());
+					rg.data = std::string();
+					row_groups.push_back(std::move(rg));
+				} else {
+					out.write(batch.data.data(), static_cast<std::streamsize>(batch.data.size()));
+				}
+			}
+			if (!out) {
+				throw std::runtime_error("export: error writing output");
+			}
+		}
+		if (auto err = queue.error()) {
+			std::rethrow_exception(err);
+		}
+		switch (opts.format) {
+		case ExportFormat::Csv:
+			break;
+		case ExportFormat::ArrowIpc:
+			out << arrow_ipc_eos();
+			break;
+		case ExportFormat::Parquet:
+			out << parquet_footer(row_groups);
+			break;
+		}
+		out.flush();
+		if (!out) {
+			throw std::runtime_error("export: error writing output");
+		}
+	} catch (...) {
+		queue.fail(std::current_exception());
+		for (auto& t : workers) {
+			t.join();
+		}
+		throw;
+	}
+	for (auto& t : workers) {
+		t.join();
+	}
+}
+
+} // namespace histdb
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "filter.h"
+#include "rows.h"
+
+namespace histdb {
+
+// Columnar batches
+////////////////////////////////////////////////////////////////////////////////
+
+// StringColumn stores strings using the Arrow layout: string i is
+// data[offsets[i]:offsets[i+1]].
+struct StringColumn {
+	std::vector<int32_t> offsets = {0};
+	std::string data;
+
+	size_t size() const { return offsets.size() - 1; }
+	std::string_view at(size_t i) const {
+		return std::string_view(data).substr(offsets[i], offsets[i + 1] - offsets[i]);
+	}
+	void push_back(std::string_view s) {
+		data.append(s);
+		offsets.push_back(static_cast<int32_t>(data.size()));
+	}
+};
+
+// DictionaryColumn is a dictionary encoded string column. Values are
+// numbered in order of first appearance.
+class DictionaryColumn {
+public:
+	const StringColumn& values() const { return values_; }
+	const std::vector<int32_t>& indices() const { return indices_; }
+	size_t size() const { return indices_.size(); }
+	std::string_view at(size_t i) const { return values_.at(indices_[i]); }
+
+	void push_back(std::string_view s);
+
+private:
+	StringColumn values_;
+	std::vector<int32_t> indices_;
+	std::unordered_map<std::string, int32_t> lookup_;
+};
+
+// HistoryBatch is a batch of rows from the history table. The directory and
+// username columns are dictionary encoded since they are highly repetitive.
+struct HistoryBatch {
+	std::vector<int64_t> id;
+	std::vector<int64_t> session_id;
+	std::vector<int64_t> history_id;
+	std::vector<int64_t> ppid;
+	std::vector<int32_t> status_code;
+	StringColumn created_at;
+	DictionaryColumn username;
+	DictionaryColumn directory;
+	StringColumn raw;
+
+	size_t size() const { return id.size(); }
+
+	// byte_size returns the approximate memory used by the batch.
+	size_t byte_size() const;
+};
+
+// Names of the exported columns, in order.
+extern const std::vector<std::string> history_columns;
+
+// append_history_row appends row i of rows, whose columns are
+// history_columns, to batch.
+void append_history_row(const RowCursor& rows, size_t i, HistoryBatch& batch);
+
+// CSV
+////////////////////////////////////////////////////////////////////////////////
+
+// csv_header returns the header row of history_columns.
+std::string csv_header();
+
+// encode_csv returns the rows of batch as CSV (without a header row).
+std::string encode_csv(const HistoryBatch& batch);
+
+// Export
+////////////////////////////////////////////////////////////////////////////////
+
+enum class ExportFormat {
+	Csv,      // RFC 4180 with a header row
+	ArrowIpc, // Arrow IPC streaming format
+	Parquet,
+};
+
+// parse_export_format parses the name of a format ("csv", "arrow-ipc" or
+// "parquet") and throws std::invalid_argument if it is invalid.
+ExportFormat parse_export_format(std::string_view name);
+
+struct ExportOptions {
+	ExportFormat format = ExportFormat::Csv;
+	int threads = 0;                // 0 means one per core
+	int64_t shard_rows = 64 * 1024; // number of history ids per shard
+	int busy_timeout_ms = 0;
+	Filter filter;                  // only export the rows that match it
+};
+
+// export_select returns the statement that reads the rows of a shard
+// (positional parameters 1 and 2 are its first and last ids) that match
+// filter.
+std::string export_select(const CompiledFilter& filter);
+
+// export_history exports the history table of the database at path to out.
+//
+// The table is split into shards by rowid range which are read and encoded
+// in parallel, each thread with its own read-only connection, and written to
+// out in order (each shard is an Arrow record batch or Parquet row group).
+// Only a bounded number of shards are buffered at a time.
+//
+// The caller must not hold a lock on the database.
+void export_history(const std::string& path, const ExportOptions& opts,
+	std::ostream& out);
+
+} // namespace histdb
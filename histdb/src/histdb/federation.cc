@@ -0,0 +1,336 @@
+#include "federation.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+
+#include "absl/strings/str_cat.h"
+#include <SQLiteCpp/Statement.h>
+
+#include "rows.h"
+#include "timefmt.h"
+
+namespace histdb {
+
+// Source streams
+////////////////////////////////////////////////////////////////////////////////
+
+// SourceBatch is a batch of rows read by a source. The commands are stored
+// back to back in text.
+struct SourceBatch {
+	std::vector<int64_t> id;
+	std::vector<int64_t> created_us;
+	std::vector<size_t> end; // end offset of each command in text
+	std::string text;
+
+	size_t size() const { return id.size(); }
+
+	std::string_view raw(size_t i) const {
+		const size_t start = i == 0 ? 0 : end[i - 1];
+		return std::string_view(text).substr(start, end[i] - start);
+	}
+
+	void clear() {
+		id.clear();
+		created_us.clear();
+		end.clear();
+		text.clear();
+	}
+};
+
+// SourceStream reads a source on its own thread into a bounded queue of
+// batches. Consumed batches are handed back so that their memory is reused.
+class SourceStream {
+public:
+	SourceStream(const FederatedSource& source, const FederatedQuery& query,
+		std::atomic<bool>& cancel)
+		: source_(source), query_(query), cancel_(cancel) {}
+
+	~SourceStream() { join(); }
+
+	void start() { thread_ = std::thread([this]() { run(); }); }
+
+	void join() {
+		if (thread_.joinable()) {
+			cond_.notify_all();
+			thread_.join();
+		}
+	}
+
+	// next waits for the next batch and returns false once the source is
+	// exhausted. Throws the error of the source if it failed.
+	bool next(SourceBatch& batch) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_.wait(lock, [this]() { return !ready_.empty() || done_; });
+		if (ready_.empty()) {
+			if (error_) {
+				std::rethrow_exception(error_);
+			}
+			return false;
+		}
+		free_.push_back(std::move(batch));
+		batch = std::move(ready_.front());
+		ready_.pop_front();
+		cond_.notify_all();
+		return true;
+	}
+
+	void wake() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		cond_.notify_all();
+	}
+
+private:
+	void run();
+	void read();
+
+	const FederatedSource source_;
+	const FederatedQuery query_;
+	std::atomic<bool>& cancel_;
+	std::thread thread_;
+
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::deque<SourceBatch> ready_;
+	std::vector<SourceBatch> free_;
+	bool done_ = false;
+	std::exception_ptr error_;
+};
+
+std::string federated_select(SQLite::Database& db, const FederatedQuery& query,
+	CompiledFilter& filter) {
+
+	const FilterSchema schema = read_filter_schema(db);
+	Filter f = query.filter;
+	if (!query.contains.empty()) {
+		FilterTerm term;
+		term.text = query.contains;
+		f.terms.push_back(std::move(term));
+	}
+	filter = compile_filter(f, schema);
+	// Databases that predate created_at_us (or were not backfilled) parse
+	// created_at instead.
+	const char *created_us = schema.created_at_us ?
+		"COALESCE(created_at_us, histdb_unix_us(created_at), 0)" :
+		"COALESCE(histdb_unix_us(created_at), 0)";
+	return filtered_select(filter,
+		absl::StrCat("id, ", created_us, ", ", command_sql(schema)), "",
+		query.order == ScanOrder::Newest ? "ORDER BY id DESC" : "ORDER BY id");
+}
+
+void SourceStream::read() {
+	SQLite::Database db(source_.path, SQLite::OPEN_READONLY);
+	register_time_functions(db);
+	CompiledFilter filter;
+	SQLite::Statement select(db, federated_select(db, query_, filter));
+	bind_filter(select, filter);
+	RowCursor rows(select, query_.batch_rows);
+	while (rows.next_batch()) {
+		SourceBatch batch;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_.wait(lock, [this]() {
+				return ready_.size() < query_.queue_batches || cancel_.load();
+			});
+			if (cancel_.load()) {
+				return;
+			}
+			if (!free_.empty()) {
+				batch = std::move(free_.back());
+				free_.pop_back();
+			}
+		}
+		batch.clear();
+		for (size_t i = 0; i < rows.size(); i++) {
+			batch.id.push_back(rows.integer(i, 0));
+			batch.created_us.push_back(rows.integer(i, 1));
+			batch.text.append(rows.text(i, 2));
+			batch.end.push_back(batch.text.size());
+		}
+		std::lock_guard<std::mutex> lock(mutex_);
+		ready_.push_back(std::move(batch));
+		cond_.notify_all();
+	}
+}
+
+void SourceStream::run() {
+	std::exception_ptr error;
+	try {
+		read();
+	} catch (const std::exception& e) {
+		error = std::make_exception_ptr(std::runtime_error(
+			absl::StrCat(source_.name, ": ", source_.path, ": ", e.what())));
+	}
+	std::lock_guard<std::mutex> lock(mutex_);
+	error_ = error;
+	done_ = true;
+	cond_.notify_all();
+}
+
+// Scans
+////////////////////////////////////////////////////////////////////////////////
+
+void federated_scan(const std::vector<FederatedSource>& sources,
+	const FederatedQuery& query, const FederatedFunc& fn) {
+
+	std::atomic<bool> cancel{false};
+	std::vector<std::unique_ptr<SourceStream>> streams;
+	for (const auto& source : sources) {
+		streams.push_back(std::make_unique<SourceStream>(source, query, cancel));
+	}
+	// Stop (and join) the readers however the merge ends.
+	struct Stopper {
+		std::atomic<bool>& cancel;
+		std::vector<std::unique_ptr<SourceStream>>& streams;
+		~Stopper() {
+			cancel.store(true);
+			for (auto& s : streams) {
+				s->wake();
+				s->join();
+			}
+		}
+	} stopper{cancel, streams};
+	for (auto& s : streams) {
+		s->start();
+	}
+
+	// The heap holds the position of the next row of every stream that has
+	// one, ordered by its creation time (then by source so that the merge is
+	// deterministic).
+	struct Cursor {
+		SourceBatch batch;
+		size_t pos = 0;
+	};
+	std::vector<Cursor> cursors(streams.size());
+	const bool newest = query.order == ScanOrder::Newest;
+	auto after = [&](size_t a, size_t b) {
+		const int64_t ta = cursors[a].batch.created_us[cursors[a].pos];
+		const int64_t tb = cursors[b].batch.created_us[cursors[b].pos];
+		if (ta != tb) {
+			return newest ? ta < tb : ta > tb;
+		}
+		return a > b;
+	};
+	std::priority_queue<size_t, std::vector<size_t>, decltype(after)> heap(after);
+	auto advance = [&](size_t i) {
+		Cursor& c = cursors[i];
+		if (++c.pos < c.batch.size()) {
+			heap.push(i);
+			return;
+		}
+		while (streams[i]->next(c.batch)) {
+			if (c.batch.size() > 0) {
+				c.pos = 0;
+				heap.push(i);
+				return;
+			}
+		}
+	};
+	for (size_t i = 0; i < streams.size(); i++) {
+		cursors[i].pos = 0;
+		if (streams[i]->next(cursors[i].batch) && cursors[i].batch.size() > 0) {
+			heap.push(i);
+		}
+	}
+
+	FederatedRow row;
+	while (!heap.empty()) {
+		const size_t i = heap.top();
+		heap.pop();
+		const Cursor& c = cursors[i];
+		row.source = i;
+		row.id = c.batch.id[c.pos];
+		row.created_us = c.batch.created_us[c.pos];
+		row.raw = c.batch.raw(c.pos);
+		if (!fn(row)) {
+			return;
+		}
+		advance(i);
+	}
+}
+
+// Stats
+////////////////////////////////////////////////////////////////////////////////
+
+struct StatsTable {
+	const char *name;
+	const char *columns;
+};
+
+static constexpr StatsTable stats_tables[] = {
+	{"stats_daily", "day, directory, program, count, failures"},
+	{"stats_hourly", "day, hour, count, failures"},
+	{"stats_session", "session_id, program, last_day, count, failures"},
+	{"stats_redactions", "day, redacted, ignored"},
+	{"command_clusters", "command, runs, failures, last_day"},
+};
+
+// uri_path escapes the characters of path that have a meaning in a URI.
+static std::string uri_path(const std::string& path) {
+	std::string s;
+	for (char c : path) {
+		switch (c) {
+		case '?':
+			s.append("%3f");
+			break;
+		case '#':
+			s.append("%23");
+			break;
+		case '%':
+			s.append("%25");
+			break;
+		default:
+			s.push_back(c);
+		}
+	}
+	return s;
+}
+
+void attach_stats_sources(SQLite::Database& db,
+	const std::vector<FederatedSource>& sources) {
+
+	std::vector<std::string> selects[std::size(stats_tables)];
+	for (size_t i = 0; i < sources.size(); i++) {
+		const std::string schema = absl::StrCat("source", i);
+		SQLite::Statement attach(db, "ATTACH DATABASE ? AS ?;");
+		attach.bind(1, absl::StrCat("file:", uri_path(sources[i].path), "?mode=ro"));
+		attach.bind(2, schema);
+		try {
+			attach.exec();
+		} catch (const std::exception& e) {
+			throw std::runtime_error(absl::StrCat(sources[i].name, ": ",
+				sources[i].path, ": ", e.what()));
+		}
+		for (size_t t = 0; t < std::size(stats_tables); t++) {
+			SQLite::Statement exists(db, absl::StrCat(
+				"SELECT 1 FROM ", schema, ".sqlite_master WHERE type = 'table' AND name = ?;"));
+			exists.bind(1, stats_tables[t].name);
+			if (exists.executeStep()) {
+				selects[t].push_back(absl::StrCat("SELECT ", stats_tables[t].columns,
+					" FROM ", schema, ".", stats_tables[t].name));
+			}
+		}
+	}
+	for (size_t t = 0; t < std::size(stats_tables); t++) {
+		if (selects[t].empty()) {
+			// None of the sources has the table.
+			db.exec(absl::StrCat("CREATE TEMP TABLE ", stats_tables[t].name,
+				" (", stats_tables[t].columns, ");"));
+			continue;
+		}
+		std::string view = absl::StrCat("CREATE TEMP VIEW ", stats_tables[t].name, " AS ");
+		for (size_t i = 0; i < selects[t].size(); i++) {
+			absl::StrAppend(&view, i == 0 ? "" : " UNION ALL ", selects[t][i]);
+		}
+		db.exec(view + ";");
+	}
+}
+
+} // namespace histdb
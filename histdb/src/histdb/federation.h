@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <SQLiteCpp/Database.h>
+
+#include "filter.h"
+
+namespace histdb {
+
+// Sources
+////////////////////////////////////////////////////////////////////////////////
+
+// A federated query reads the history of several databases as if it was
+// one: typically the prod and test databases and restored archives of old
+// ones. Sources are always opened read-only and are not migrated, so
+// archives written by older versions of histdb are read as they are.
+struct FederatedSource {
+	std::string name; // shown in the output ("prod", "test", an archive name...)
+	std::string path;
+};
+
+// Scans
+////////////////////////////////////////////////////////////////////////////////
+
+enum class ScanOrder {
+	Newest, // newest first
+	Oldest, // oldest first
+};
+
+struct FederatedQuery {
+	ScanOrder order = ScanOrder::Newest;
+	std::string contains;     // only commands that contain this (if not empty)
+	Filter filter;            // only the rows that match it (see filter.h)
+	size_t batch_rows = 1024; // rows read by a source at a time
+	size_t queue_batches = 4; // batches each source may read ahead
+};
+
+// FederatedRow is a history row of one of the sources. raw is only valid
+// during the callback it is passed to.
+struct FederatedRow {
+	size_t source = 0;       // index of the source
+	int64_t id = 0;          // history row id in the source
+	int64_t created_us = 0;  // microseconds since the Unix epoch (0 if unknown)
+	std::string_view raw;
+};
+
+// FederatedFunc is called with each row, the scan stops if it returns false.
+using FederatedFunc = std::function<bool(const FederatedRow& row)>;
+
+// federated_scan reads the history of every source on its own thread and
+// calls fn with the rows of all of them merged by creation time (a k-way
+// merge of the sources' streams), so memory use is bounded by the batches
+// that each source reads ahead regardless of the size of the databases.
+//
+// Each source is read in id order, which is its insertion order: rows whose
+// clock went backwards are merged where their neighbours are.
+//
+// Errors of a source (for example a missing file) are rethrown with the
+// name of the source once the other threads stopped.
+void federated_scan(const std::vector<FederatedSource>& sources,
+	const FederatedQuery& query, const FederatedFunc& fn);
+
+// federated_select returns the statement that scans the history of the
+// source db for query and stores the filter it uses, compiled for the
+// schema of db, in filter.
+std::string federated_select(SQLite::Database& db, const FederatedQuery& query,
+	CompiledFilter& filter);
+
+// Stats
+////////////////////////////////////////////////////////////////////////////////
+
+// attach_stats_sources attaches the sources (read-only) to db, which should
+// be an in-memory database opened with SQLite::OPEN_URI, and creates
+// temporary views named after the stats rollup tables (see stats.h) that
+// union the rollups of every source that has them, so that
+// print_stats_report reports on all of them. The rollups are tiny, so unlike
+// history they are not scanned in parallel.
+void attach_stats_sources(SQLite::Database& db,
+	const std::vector<FederatedSource>& sources);
+
+} // namespace histdb
@@ -0,0 +1,396 @@
+#include "filter.h"
+
+#include <cctype>
+#include <cstdio>
+#include <ctime>
+#include <map>
+#include <stdexcept>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+
+#include "blobs.h"
+#include "paths.h"
+#include "timefmt.h"
+#include "tokens.h"
+
+namespace histdb {
+
+// Filters
+////////////////////////////////////////////////////////////////////////////////
+
+// split_filter splits text into whitespace separated words, double quotes
+// (which are removed) protect whitespace and \" is a literal quote.
+static std::vector<std::string> split_filter(std::string_view text) {
+	std::vector<std::string> words;
+	std::string word;
+	bool in_word = false;
+	bool quoted = false;
+	for (size_t i = 0; i < text.size(); i++) {
+		const char c = text[i];
+		if (c == '"') {
+			quoted = !quoted;
+			in_word = true;
+		} else if (c == '\\' && quoted && i + 1 < text.size() && text[i + 1] == '"') {
+			word.push_back('"');
+			i++;
+		} else if (!quoted && std::isspace(static_cast<unsigned char>(c))) {
+			if (in_word) {
+				words.push_back(std::move(word));
+				word.clear();
+				in_word = false;
+			}
+		} else {
+			word.push_back(c);
+			in_word = true;
+		}
+	}
+	if (quoted) {
+		throw std::invalid_argument("filter: unterminated quote");
+	}
+	if (in_word) {
+		words.push_back(std::move(word));
+	}
+	return words;
+}
+
+static int64_t parse_filter_int(std::string_view key, std::string_view value) {
+	int64_t n;
+	if (!absl::SimpleAtoi(value, &n)) {
+		throw std::invalid_argument(absl::StrCat("filter: ", key, ": invalid number: '", value, "'"));
+	}
+	return n;
+}
+
+// parse_filter_time parses an RFC 3339 timestamp or a date, which is the
+// local midnight that starts it.
+static int64_t parse_filter_time(std::string_view key, std::string_view value) {
+	int64_t us;
+	if (parse_time(value, us)) {
+		return us;
+	}
+	int year, month, day;
+	char end;
+	const std::string s(value);
+	if (value.size() == 10 &&
+		std::sscanf(s.c_str(), "%4d-%2d-%2d%c", &year, &month, &day, &end) == 3 &&
+		month >= 1 && month <= 12 && day >= 1 && day <= 31) {
+
+		std::tm tm{};
+		tm.tm_year = year - 1900;
+		tm.tm_mon = month - 1;
+		tm.tm_mday = day;
+		tm.tm_isdst = -1;
+		const std::time_t t = std::mktime(&tm);
+		if (t != -1) {
+			return static_cast<int64_t>(t) * 1000000;
+		}
+	}
+	throw std::invalid_argument(absl::StrCat(
+		"filter: ", key, ": invalid time: '", value, "' (expected YYYY-MM-DD or RFC 3339)"));
+}
+
+static FilterTerm parse_directory_term(std::string_view value, const FilterContext& ctx) {
+	FilterTerm term;
+	term.key = FilterKey::Directory;
+	std::string path(value);
+	for (std::string_view suffix : {"/**", "/*"}) {
+		if (path.size() > suffix.size() &&
+			std::string_view(path).substr(path.size() - suffix.size()) == suffix) {
+			path.resize(path.size() - suffix.size());
+			term.subtree = true;
+			break;
+		}
+	}
+	if (path.empty()) {
+		throw std::invalid_argument("filter: dir: empty path");
+	}
+	if (path[0] == '~' && (path.size() == 1 || path[1] == '/')) {
+		if (ctx.home.empty()) {
+			throw std::invalid_argument("filter: dir: can't expand ~ ($HOME is not set)");
+		}
+		path = ctx.home + path.substr(1);
+	}
+	term.text = canonical_directory(path);
+	return term;
+}
+
+Filter parse_filter(std::string_view text, const FilterContext& ctx) {
+	Filter filter;
+	for (std::string& word : split_filter(text)) {
+		const size_t colon = word.find(':');
+		const std::string_view key = colon == std::string::npos ?
+			std::string_view() : std::string_view(word).substr(0, colon);
+		const std::string_view value = colon == std::string::npos ?
+			std::string_view() : std::string_view(word).substr(colon + 1);
+
+		FilterTerm term;
+		if (key == "cmd") {
+			term.text = std::string(value);
+		} else if (key == "dir") {
+			term = parse_directory_term(value, ctx);
+		} else if (key == "session") {
+			term.key = FilterKey::Session;
+			if (value == "current") {
+				if (ctx.session_id <= 0) {
+					throw std::invalid_argument(
+						"filter: session:current: $HISTDB_SESSION_ID is not set");
+				}
+				term.value = ctx.session_id;
+			} else {
+				term.value = parse_filter_int(key, value);
+			}
+		} else if (key == "status") {
+			term.key = FilterKey::Status;
+			std::string_view n = value;
+			if (n.substr(0, 2) == "!=") {
+				term.negated = true;
+				n.remove_prefix(2);
+			} else if (n.substr(0, 1) == "=") {
+				n.remove_prefix(1);
+			}
+			term.value = parse_filter_int(key, n);
+		} else if (key == "prog" || key == "flag" || key == "pipe" || key == "env") {
+			term.key = FilterKey::Token;
+			for (TokenKind kind : {TokenKind::Program, TokenKind::Flag, TokenKind::Pipe,
+				TokenKind::Env}) {
+				if (key == token_kind_name(kind)) {
+					term.value = static_cast<int64_t>(kind);
+				}
+			}
+			if (value.empty()) {
+				throw std::invalid_argument(absl::StrCat("filter: ", key, ": empty text"));
+			}
+			term.text = std::string(value);
+		} else if (key == "after" || key == "before") {
+			term.key = key == "after" ? FilterKey::After : FilterKey::Before;
+			term.value = parse_filter_time(key, value);
+		} else {
+			// A bare word (or one with a colon like a URL).
+			term.text = std::move(word);
+		}
+		if (term.key == FilterKey::Command && term.text.empty()) {
+			throw std::invalid_argument("filter: cmd: empty text");
+		}
+		filter.terms.push_back(std::move(term));
+	}
+	return filter;
+}
+
+// Compilation
+////////////////////////////////////////////////////////////////////////////////
+
+constexpr char session_index[] = "history_session_id_idx";
+constexpr char directory_index[] = "history_directory_ref_idx";
+constexpr char created_index[] = "history_created_at_us_idx";
+
+FilterSchema read_filter_schema(SQLite::Database& db) {
+	FilterSchema schema;
+	SQLite::Statement columns(db, "SELECT name FROM pragma_table_info('history');");
+	while (columns.executeStep()) {
+		const std::string name = columns.getColumn(0).getString();
+		schema.created_at_us |= name == "created_at_us";
+		schema.directory_id |= name == "directory_id";
+		schema.raw_blob |= name == "raw_blob";
+	}
+	SQLite::Statement indexes(db, "SELECT name FROM pragma_index_list('history');");
+	while (indexes.executeStep()) {
+		const std::string name = indexes.getColumn(0).getString();
+		schema.session_index |= name == session_index;
+		schema.directory_index |= name == directory_index;
+		schema.created_index |= name == created_index;
+	}
+	schema.tokens = db.tableExists("command_postings");
+	return schema;
+}
+
+const char *command_sql(const FilterSchema& schema) {
+	return schema.raw_blob ? HISTDB_COMMAND_SQL : "raw";
+}
+
+// driving_index returns the index that the scan of filter should use.
+static const char *driving_index(const Filter& filter, const FilterSchema& schema) {
+	auto has = [&filter](FilterKey key, bool subtree) {
+		for (const auto& term : filter.terms) {
+			if (term.key == key && term.subtree == subtree) {
+				return true;
+			}
+		}
+		return false;
+	};
+	if (has(FilterKey::Token, false)) {
+		return ""; // the posting lists
+	}
+	if (schema.session_index && has(FilterKey::Session, false)) {
+		return session_index;
+	}
+	if (schema.directory_index &&
+		(has(FilterKey::Directory, false) || has(FilterKey::Directory, true))) {
+		return directory_index;
+	}
+	if (schema.created_at_us && schema.created_index &&
+		(has(FilterKey::After, false) || has(FilterKey::Before, false))) {
+		return created_index;
+	}
+	return "";
+}
+
+CompiledFilter compile_filter(const Filter& filter, const FilterSchema& schema) {
+	CompiledFilter f;
+	f.index = driving_index(filter, schema);
+	std::vector<std::string> postings;
+	std::vector<std::string> shape;
+	std::vector<std::string> conditions;
+	auto param = [&f](std::variant<int64_t, std::string> value) {
+		f.params.push_back({absl::StrCat(":f", f.params.size() + 1), std::move(value)});
+		return f.params.back().name;
+	};
+	const char *created_us = schema.created_at_us ? "created_at_us" : "histdb_unix_us(created_at)";
+	for (const auto& term : filter.terms) {
+		switch (term.key) {
+		case FilterKey::Command:
+			shape.push_back("cmd");
+			conditions.push_back(absl::StrCat("instr(", command_sql(schema), ", ",
+				param(term.text), ") > 0"));
+			break;
+		case FilterKey::Directory: {
+			if (!schema.directory_id) {
+				throw std::invalid_argument(
+					"filter: dir: the database predates directory ids (run histdb migrate)");
+			}
+			if (!term.subtree) {
+				shape.push_back("dir");
+				conditions.push_back(absl::StrCat(
+					"directory_id = (SELECT id FROM directories WHERE path = ",
+					param(term.text), ")"));
+				break;
+			}
+			shape.push_back("dir/*");
+			const PathRange range = subtree_range(term.text);
+			const std::string path = param(term.text);
+			const std::string lo = param(range.lo);
+			const std::string hi = param(range.hi);
+			conditions.push_back(absl::StrCat(
+				"directory_id IN (SELECT id FROM directories WHERE path = ", path,
+				" OR (path >= ", lo, " AND path < ", hi, "))"));
+			break;
+		}
+		case FilterKey::Session:
+			shape.push_back("session");
+			conditions.push_back(absl::StrCat("session_id = ", param(term.value)));
+			break;
+		case FilterKey::Status:
+			shape.push_back(term.negated ? "status!=" : "status=");
+			conditions.push_back(absl::StrCat("status_code ", term.negated ? "!=" : "=",
+				" ", param(term.value)));
+			break;
+		case FilterKey::After:
+			shape.push_back("after");
+			conditions.push_back(absl::StrCat(created_us, " >= ", param(term.value)));
+			break;
+		case FilterKey::Before:
+			shape.push_back("before");
+			conditions.push_back(absl::StrCat(created_us, " < ", param(term.value)));
+			break;
+		case FilterKey::Token:
+			if (!schema.tokens) {
+				throw std::invalid_argument(absl::StrCat("filter: ",
+					token_kind_name(static_cast<TokenKind>(term.value)),
+					": the database has no token index (run histdb migrate)"));
+			}
+			// The kind is part of the shape, only the text is a parameter.
+			shape.push_back(token_kind_name(static_cast<TokenKind>(term.value)));
+			postings.push_back(absl::StrCat(
+				"SELECT row_id FROM command_postings WHERE token_id = "
+				"(SELECT id FROM command_tokens WHERE kind = ", term.value,
+				" AND text = ", param(term.text), ")"));
+			break;
+		}
+	}
+	if (!postings.empty()) {
+		f.postings = true;
+		conditions.insert(conditions.begin(),
+			absl::StrCat("id IN (", absl::StrJoin(postings, " INTERSECT "), ")"));
+	}
+	f.shape = absl::StrJoin(shape, " ");
+	f.condition = absl::StrJoin(conditions, " AND ");
+	return f;
+}
+
+std::string filtered_select(const CompiledFilter& filter, std::string_view columns,
+	std::string_view condition, std::string_view tail) {
+
+	std::string sql = absl::StrCat("SELECT ", columns, " FROM history");
+	if (filter.postings) {
+		absl::StrAppend(&sql, " NOT INDEXED");
+	} else if (!filter.index.empty()) {
+		absl::StrAppend(&sql, " INDEXED BY ", filter.index);
+	}
+	if (!condition.empty() && !filter.condition.empty()) {
+		absl::StrAppend(&sql, " WHERE (", condition, ") AND ", filter.condition);
+	} else if (!condition.empty() || !filter.condition.empty()) {
+		absl::StrAppend(&sql, " WHERE ", condition.empty() ? filter.condition : condition);
+	}
+	if (!tail.empty()) {
+		absl::StrAppend(&sql, " ", tail);
+	}
+	sql.push_back(';');
+	return sql;
+}
+
+void bind_filter(SQLite::Statement& stmt, const CompiledFilter& filter) {
+	for (const auto& p : filter.params) {
+		if (const auto *n = std::get_if<int64_t>(&p.value)) {
+			stmt.bind(p.name.c_str(), *n);
+		} else {
+			stmt.bind(p.name.c_str(), std::get<std::string>(p.value));
+		}
+	}
+}
+
+void print_filter_plan(SQLite::Database& db, const CompiledFilter& filter,
+	const std::string& sql, std::ostream& out) {
+
+	out << "shape:  " << (filter.shape.empty() ? "(empty)" : filter.shape) << "\n"
+		<< "index:  " << (filter.postings ? "command_postings" :
+			filter.index.empty() ? "primary key" : filter.index) << "\n"
+		<< "sql:    " << sql << "\n";
+	for (const auto& p : filter.params) {
+		out << "param:  " << p.name << " = ";
+		if (const auto *n = std::get_if<int64_t>(&p.value)) {
+			out << *n << "\n";
+		} else {
+			out << "'" << std::get<std::string>(p.value) << "'\n";
+		}
+	}
+	out << "plan:\n";
+	SQLite::Statement plan(db, absl::StrCat("EXPLAIN QUERY PLAN ", sql));
+	bind_filter(plan, filter);
+	std::map<int64_t, int> depth; // of the plan rows by id
+	while (plan.executeStep()) {
+		const auto it = depth.find(plan.getColumn(1).getInt64());
+		const int d = it == depth.end() ? 1 : it->second + 1;
+		depth[plan.getColumn(0).getInt64()] = d;
+		out << std::string(static_cast<size_t>(d) * 2, ' ')
+			<< plan.getColumn(3).getString() << "\n";
+	}
+}
+
+// Statement cache
+////////////////////////////////////////////////////////////////////////////////
+
+SQLite::Statement& StatementCache::get(const std::string& sql) {
+	auto it = stmts_.find(sql);
+	if (it != stmts_.end()) {
+		hits_++;
+		it->second->reset();
+		it->second->clearBindings();
+		return *it->second;
+	}
+	misses_++;
+	auto stmt = std::make_unique<SQLite::Statement>(db_, sql);
+	return *stmts_.emplace(sql, std::move(stmt)).first->second;
+}
+
+} // namespace histdb
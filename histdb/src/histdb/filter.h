@@ -0,0 +1,180 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include <SQLiteCpp/Database.h>
+#include <SQLiteCpp/Statement.h>
+
+namespace histdb {
+
+// Filters
+////////////////////////////////////////////////////////////////////////////////
+
+// A filter selects history rows with whitespace separated terms that must
+// all match, for example:
+//
+//   dir:~/src/* status:!=0 after:2026-01-01 session:current cmd:git
+//
+//   cmd:TEXT      the command contains TEXT (a bare word is the same)
+//   dir:PATH      the command ran in PATH, or below it with "PATH/*"
+//   session:ID    the command ran in session ID ("current" is
+//                 $HISTDB_SESSION_ID)
+//   status:N      the exit status is N ("!=N" for any other)
+//   after:TIME    the command ran at or after TIME
+//   before:TIME   the command ran before TIME
+//   prog:NAME     the command runs the program NAME
+//   flag:FLAG     a program of the command has the flag FLAG ("--context"
+//                 also matches "--context=prod")
+//   pipe:NAME     the command pipes into the program NAME
+//   env:NAME      the command assigns the variable NAME for a program
+//
+// Values may be double quoted to include spaces (cmd:"git push"). Times are
+// dates (YYYY-MM-DD, midnight in the local time zone) or RFC 3339
+// timestamps. Paths start with "~" for the home directory and are relative
+// to the working directory otherwise. The prog, flag, pipe and env terms
+// are looked up in the token index of the commands (see tokens.h).
+
+enum class FilterKey {
+	Command,
+	Directory,
+	Session,
+	Status,
+	After,
+	Before,
+	Token, // prog, flag, pipe and env
+};
+
+struct FilterTerm {
+	FilterKey key = FilterKey::Command;
+	bool negated = false; // status:!=N
+	bool subtree = false; // dir:PATH/*
+	std::string text;     // Command, Directory (canonical) and Token
+	int64_t value = 0;    // Session, Status, the times (Unix microseconds) and
+	                      // the TokenKind of Token
+};
+
+struct Filter {
+	std::vector<FilterTerm> terms;
+
+	bool empty() const { return terms.empty(); }
+};
+
+// FilterContext holds what the terms that are relative to the caller are
+// resolved with.
+struct FilterContext {
+	int64_t session_id = 0; // session:current (0 if there is none)
+	std::string home;       // "~"
+};
+
+// parse_filter parses text and throws std::invalid_argument if it is not a
+// valid filter.
+Filter parse_filter(std::string_view text, const FilterContext& ctx);
+
+// Compilation
+////////////////////////////////////////////////////////////////////////////////
+
+// FilterSchema is what a filter is compiled against: the history of
+// databases (archives) written by older versions of histdb may lack some of
+// the columns and indexes.
+struct FilterSchema {
+	bool created_at_us = false; // history.created_at_us exists
+	bool directory_id = false;  // history.directory_id exists
+	bool session_index = false; // history_session_id_idx
+	bool directory_index = false; // history_directory_ref_idx
+	bool created_index = false; // history_created_at_us_idx
+	bool raw_blob = false;      // history.raw_blob exists (see blobs.h)
+	bool tokens = false;        // the command_postings table exists (see tokens.h)
+};
+
+FilterSchema read_filter_schema(SQLite::Database& db);
+
+// command_sql returns the SQL expression of the full command of a history
+// row of a database with the given schema.
+const char *command_sql(const FilterSchema& schema);
+
+// FilterParam is a value bound to the named parameter name.
+struct FilterParam {
+	std::string name; // ":f1", ":f2"...
+	std::variant<int64_t, std::string> value;
+};
+
+// CompiledFilter is a filter compiled to a SQL condition on the history
+// table. The values of the terms are always bound as parameters, so the SQL
+// only depends on the shape of the filter (its keys and operators) and
+// statements prepared for one filter are reused for every filter of the same
+// shape (see StatementCache).
+//
+// The scan is driven by the index of the most selective term that has one,
+// in order: tokens (the intersection of their posting lists), session
+// (history_session_id_idx), directory (history_directory_ref_idx), and time
+// (history_created_at_us_idx). The index is forced with INDEXED BY (and the
+// rows of the posting lists are looked up by primary key with NOT INDEXED),
+// so that preparing the statement fails rather than silently scanning the
+// table if SQLite can't use it. Filters without any of these terms scan the
+// table in primary key order; command and status terms are only ever
+// checked on the rows that the scan reads.
+struct CompiledFilter {
+	std::string shape;     // e.g. "dir/* status!= cmd"
+	std::string index;     // forced index, empty for a primary key scan
+	bool postings = false; // driven by the posting lists of the token terms
+	std::string condition; // SQL condition, empty if the filter is empty
+	std::vector<FilterParam> params;
+};
+
+// compile_filter compiles filter for a database with the given schema and
+// throws std::invalid_argument if schema lacks a column that a term needs.
+CompiledFilter compile_filter(const Filter& filter, const FilterSchema& schema);
+
+// filtered_select returns
+//
+//   SELECT columns FROM history [INDEXED BY index | NOT INDEXED]
+//   [WHERE condition AND ...] tail
+//
+// where condition is ANDed with the filter's (it may use positional
+// parameters, which do not clash with the filter's named ones) and tail is
+// the rest of the statement ("ORDER BY id", "GROUP BY 1"...).
+std::string filtered_select(const CompiledFilter& filter, std::string_view columns,
+	std::string_view condition, std::string_view tail);
+
+// bind_filter binds the parameters of filter to stmt.
+void bind_filter(SQLite::Statement& stmt, const CompiledFilter& filter);
+
+// print_filter_plan prints the shape of filter, the statement sql that uses
+// it, its parameters and the query plan that SQLite chose for it on db.
+void print_filter_plan(SQLite::Database& db, const CompiledFilter& filter,
+	const std::string& sql, std::ostream& out);
+
+// Statement cache
+////////////////////////////////////////////////////////////////////////////////
+
+// StatementCache keeps the statements prepared on a connection by their
+// SQL, which for filtered statements is determined by the filter's shape:
+// running the same kind of query again (the next shard of an export, the
+// next filter of the same shape) only resets and rebinds the statement
+// instead of compiling it again.
+class StatementCache {
+public:
+	explicit StatementCache(SQLite::Database& db) : db_(db) {}
+
+	// get returns the statement of sql, reset and with its bindings
+	// cleared. It remains valid as long as the cache.
+	SQLite::Statement& get(const std::string& sql);
+
+	int64_t hits() const { return hits_; }
+	int64_t misses() const { return misses_; }
+
+private:
+	SQLite::Database& db_;
+	std::unordered_map<std::string, std::unique_ptr<SQLite::Statement>> stmts_;
+	int64_t hits_ = 0;
+	int64_t misses_ = 0;
+};
+
+} // namespace histdb
@@ -0,0 +1,259 @@
+#include "fix.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <limits>
+
+#include <SQLiteCpp/Statement.h>
+
+#include "blobs.h"
+#include "rows.h"
+
+namespace histdb {
+
+// Correction pairs
+////////////////////////////////////////////////////////////////////////////////
+
+// edit_distance returns the optimal string alignment distance between a and
+// b (Levenshtein plus adjacent transpositions) or max + 1 if it exceeds max.
+static size_t edit_distance(std::string_view a, std::string_view b, size_t max) {
+	if (a.size() > b.size()) {
+		std::swap(a, b);
+	}
+	if (b.size() - a.size() > max) {
+		return max + 1;
+	}
+	// Three rows of the (a.size() + 1) x (b.size() + 1) matrix.
+	std::vector<size_t> prev2(a.size() + 1), prev(a.size() + 1), cur(a.size() + 1);
+	for (size_t i = 0; i <= a.size(); i++) {
+		prev[i] = i;
+	}
+	for (size_t j = 1; j <= b.size(); j++) {
+		cur[0] = j;
+		size_t row_min = cur[0];
+		for (size_t i = 1; i <= a.size(); i++) {
+			const size_t cost = a[i - 1] == b[j - 1] ? 0 : 1;
+			size_t d = std::min({prev[i] + 1, cur[i - 1] + 1, prev[i - 1] + cost});
+			if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1]) {
+				d = std::min(d, prev2[i - 2] + 1);
+			}
+			cur[i] = d;
+			row_min = std::min(row_min, d);
+		}
+		if (row_min > max) {
+			return max + 1;
+		}
+		std::swap(prev2, prev);
+		std::swap(prev, cur);
+	}
+	return std::min(prev[a.size()], max + 1);
+}
+
+bool is_correction(std::string_view failed, std::string_view fixed) {
+	if (failed.empty() || fixed.empty() || failed == fixed ||
+		failed.size() > max_correction_size || fixed.size() > max_correction_size) {
+		return false;
+	}
+	// More arguments: "git push" then "git push -u origin main".
+	if (fixed.size() > failed.size() && fixed.compare(0, failed.size(), failed) == 0 &&
+		fixed[failed.size()] == ' ') {
+		return true;
+	}
+	// A typo: about one edit per 8 bytes.
+	const size_t max = 1 + std::min(failed.size(), fixed.size()) / 8;
+	return edit_distance(failed, fixed, max) <= max;
+}
+
+// Learning
+////////////////////////////////////////////////////////////////////////////////
+
+// Served by the history_session_id_idx (session_id, id) index.
+constexpr char select_previous_command_stmt[] = R"""(
+SELECT status_code, directory_id, )""" HISTDB_COMMAND_SQL R"""(
+FROM history
+WHERE session_id = ? AND id < ?
+ORDER BY id DESC
+LIMIT 1;
+)""";
+
+constexpr char update_correction_stmt[] = R"""(
+UPDATE corrections SET count = count + 1, last_used_us = max(last_used_us, ?3)
+WHERE failed = ?1 AND fixed = ?2;
+)""";
+
+constexpr char insert_correction_stmt[] = R"""(
+INSERT INTO corrections (failed, fixed, count, last_used_us) VALUES (?, ?, 1, ?);
+)""";
+
+// Evicts the least used fix of a failed command.
+constexpr char evict_fix_stmt[] = R"""(
+DELETE FROM corrections WHERE failed = ?1 AND fixed = (
+	SELECT fixed FROM corrections WHERE failed = ?1
+	ORDER BY count, last_used_us
+	LIMIT 1
+);
+)""";
+
+// Evicts the least recently used pairs, served by corrections_last_used_idx.
+constexpr char evict_corrections_stmt[] = R"""(
+DELETE FROM corrections WHERE (failed, fixed) IN (
+	SELECT failed, fixed FROM corrections
+	ORDER BY last_used_us
+	LIMIT ?
+);
+)""";
+
+// A command that was interrupted (or killed) by a signal did not fail
+// because it was wrong.
+static bool failed_status(int64_t status_code) {
+	return status_code != 0 && status_code <= 128;
+}
+
+// add_correction records one more occurrence of the pair, evicting pairs if
+// it is new and the bounds are exceeded.
+static void add_correction(SQLite::Database& db, const std::string& failed,
+	const std::string& fixed, int64_t used_us) {
+
+	SQLite::Statement update(db, update_correction_stmt);
+	update.bind(1, failed);
+	update.bind(2, fixed);
+	update.bind(3, used_us);
+	if (update.exec() > 0) {
+		return;
+	}
+	SQLite::Statement insert(db, insert_correction_stmt);
+	insert.bind(1, failed);
+	insert.bind(2, fixed);
+	insert.bind(3, used_us);
+	insert.exec();
+
+	SQLite::Statement fixes(db, "SELECT COUNT(*) FROM corrections WHERE failed = ?;");
+	fixes.bind(1, failed);
+	fixes.executeStep();
+	if (fixes.getColumn(0).getInt64() > max_fixes_per_command) {
+		SQLite::Statement evict(db, evict_fix_stmt);
+		evict.bind(1, failed);
+		evict.exec();
+	}
+
+	// New pairs are rare (most corrections repeat), and the count is
+	// bounded by max_corrections.
+	const int64_t total = db.execAndGet("SELECT COUNT(*) FROM corrections;").getInt64();
+	if (total > max_corrections) {
+		SQLite::Statement evict(db, evict_corrections_stmt);
+		evict.bind(1, total - max_corrections);
+		evict.exec();
+	}
+}
+
+void learn_correction(SQLite::Database& db, const CommandRun& run) {
+	if (run.status_code != 0 || run.raw.empty() || run.raw.size() > max_correction_size) {
+		return;
+	}
+	SQLite::Statement query(db, select_previous_command_stmt);
+	query.bind(1, run.session_id);
+	query.bind(2, run.id);
+	if (!query.executeStep()) {
+		return;
+	}
+	const auto status = query.getColumn(0);
+	const auto directory_id = query.getColumn(1);
+	if (!failed_status(status.getInt64())) {
+		return;
+	}
+	if (run.directory_id != 0 && !directory_id.isNull() &&
+		directory_id.getInt64() != run.directory_id) {
+		return;
+	}
+	const auto failed = query.getColumn(2);
+	const std::string_view failed_raw(failed.getText(), static_cast<size_t>(failed.getBytes()));
+	if (!is_correction(failed_raw, run.raw)) {
+		return;
+	}
+	add_correction(db, std::string(failed_raw), std::string(run.raw), run.created_us);
+}
+
+void backfill_corrections(SQLite::Database& db, int64_t lo, int64_t hi) {
+	SQLite::Statement select(db, R"""(
+SELECT id, session_id, status_code, COALESCE(directory_id, 0),
+	COALESCE(created_at_us, 0), )""" HISTDB_COMMAND_SQL R"""(
+FROM history
+WHERE rowid > ? AND rowid <= ? AND status_code = 0
+ORDER BY rowid;
+)""");
+	select.bind(1, lo);
+	select.bind(2, hi);
+	RowCursor rows(select);
+	while (rows.next_batch()) {
+		for (size_t i = 0; i < rows.size(); i++) {
+			CommandRun run;
+			run.id = rows.integer(i, 0);
+			run.session_id = rows.integer(i, 1);
+			run.status_code = static_cast<int32_t>(rows.integer(i, 2));
+			run.directory_id = rows.integer(i, 3);
+			run.created_us = rows.integer(i, 4);
+			run.raw = rows.text(i, 5);
+			learn_correction(db, run);
+		}
+	}
+}
+
+// Suggestions
+////////////////////////////////////////////////////////////////////////////////
+
+// Served by the (failed, fixed) primary key, each failed command has at most
+// max_fixes_per_command rows to sort.
+constexpr char select_corrections_stmt[] = R"""(
+SELECT fixed, count, last_used_us
+FROM corrections
+WHERE failed = ?
+ORDER BY count DESC, last_used_us DESC
+LIMIT ?;
+)""";
+
+std::vector<Correction> suggest_corrections(SQLite::Database& db,
+	std::string_view failed, int64_t limit) {
+
+	std::vector<Correction> res;
+	SQLite::Statement query(db, select_corrections_stmt);
+	query.bind(1, std::string(failed));
+	query.bind(2, limit);
+	while (query.executeStep()) {
+		Correction c;
+		c.failed = std::string(failed);
+		c.fixed = query.getColumn(0).getString();
+		c.count = query.getColumn(1).getInt64();
+		c.last_used_us = query.getColumn(2).getInt64();
+		res.push_back(std::move(c));
+	}
+	return res;
+}
+
+bool last_failed_command(SQLite::Database& db, int64_t session_id, std::string& raw) {
+	SQLite::Statement query(db, select_previous_command_stmt);
+	query.bind(1, session_id);
+	query.bind(2, std::numeric_limits<int64_t>::max());
+	if (!query.executeStep() || !failed_status(query.getColumn(0).getInt64())) {
+		return false;
+	}
+	raw = query.getColumn(2).getString();
+	return true;
+}
+
+void print_corrections(SQLite::Database& db, int64_t limit, std::ostream& out) {
+	SQLite::Statement query(db, R"""(
+SELECT count, failed, fixed
+FROM corrections
+ORDER BY count DESC, last_used_us DESC
+LIMIT ?;
+)""");
+	query.bind(1, limit > 0 ? limit : -1);
+	out << std::setw(8) << "COUNT" << "  FAILED -> FIXED\n";
+	while (query.executeStep()) {
+		out << std::setw(8) << query.getColumn(0).getInt64() << "  "
+			<< query.getColumn(1).getString() << " -> "
+			<< query.getColumn(2).getString() << "\n";
+	}
+}
+
+} // namespace histdb
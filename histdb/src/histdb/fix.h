@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <SQLiteCpp/Database.h>
+
+namespace histdb {
+
+// Correction pairs
+////////////////////////////////////////////////////////////////////////////////
+
+// A correction is a failed command followed, in the same session and
+// directory, by a successful command that looks like a fix of it: a typo
+// ("gti status" then "git status") or missing arguments ("git push" then
+// "git push -u origin main"). Corrections are learned as commands are
+// inserted and stored in the corrections table keyed by (failed, fixed) with
+// the number of times the pair was seen.
+//
+// The table is bounded: each failed command keeps at most
+// max_fixes_per_command fixes (the least used is evicted) and the table at
+// most max_corrections pairs (the least recently used are evicted), so that
+// learning and looking up a correction are a few indexed statements
+// regardless of the size of the history.
+
+constexpr int64_t max_corrections = 4096;
+constexpr int64_t max_fixes_per_command = 8;
+
+// Commands longer than this are never considered corrections.
+constexpr size_t max_correction_size = 1024;
+
+// is_correction returns if fixed looks like a correction of failed: it is
+// failed with more arguments or within a small edit distance of it
+// (adjacent transpositions count as one edit).
+bool is_correction(std::string_view failed, std::string_view fixed);
+
+// CommandRun is a history row as seen by the correction learner.
+struct CommandRun {
+	int64_t id = 0;           // history row id, the previous command has a smaller id
+	int64_t session_id = 0;
+	int32_t status_code = 0;
+	int64_t directory_id = 0; // zero if unknown
+	int64_t created_us = 0;
+	std::string_view raw;
+};
+
+// learn_correction records a correction if run succeeded and the previous
+// command of its session failed in the same directory and is_correction. It
+// must be called in the write transaction that inserted run.
+void learn_correction(SQLite::Database& db, const CommandRun& run);
+
+// backfill_corrections learns the corrections of the history rows with
+// rowids in (lo, hi], see migrate.h.
+void backfill_corrections(SQLite::Database& db, int64_t lo, int64_t hi);
+
+// Suggestions
+////////////////////////////////////////////////////////////////////////////////
+
+struct Correction {
+	std::string failed;
+	std::string fixed;
+	int64_t count = 0;
+	int64_t last_used_us = 0;
+};
+
+// suggest_corrections returns the (at most limit) learned fixes of failed,
+// the most frequent first.
+std::vector<Correction> suggest_corrections(SQLite::Database& db,
+	std::string_view failed, int64_t limit = 1);
+
+// last_failed_command returns the last command of the session if it failed
+// (and false otherwise).
+bool last_failed_command(SQLite::Database& db, int64_t session_id, std::string& raw);
+
+// print_corrections prints the (at most limit, 0 for all) most frequent
+// corrections.
+void print_corrections(SQLite::Database& db, int64_t limit, std::ostream& out);
+
+} // namespace histdb
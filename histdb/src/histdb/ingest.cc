@@ -0,0 +1,615 @@
+#include "ingest.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+
+#include "timefmt.h"
+
+namespace histdb {
+
+// Records
+////////////////////////////////////////////////////////////////////////////////
+
+// The fields are separated by NUL bytes with raw last, sanitize_command
+// removes NUL bytes from commands but raw may contain them regardless.
+std::string encode_record(const IngestRecord& rec) {
+	constexpr char sep = '\0';
+	std::string s = absl::StrCat(
+		rec.session_id, std::string_view(&sep, 1),
+		rec.history_id, std::string_view(&sep, 1),
+		rec.ppid, std::string_view(&sep, 1),
+		rec.status_code, std::string_view(&sep, 1),
+		rec.created_us, std::string_view(&sep, 1),
+		rec.redacted, std::string_view(&sep, 1),
+		rec.ignored ? 1 : 0, std::string_view(&sep, 1));
+	absl::StrAppend(&s, rec.user, std::string_view(&sep, 1),
+		rec.directory, std::string_view(&sep, 1), rec.raw);
+	return s;
+}
+
+bool decode_record(std::string_view payload, IngestRecord& rec) {
+	constexpr size_t nfields = 10;
+	std::string_view fields[nfields];
+	for (size_t i = 0; i < nfields - 1; i++) {
+		const size_t n = payload.find('\0');
+		if (n == std::string_view::npos) {
+			return false;
+		}
+		fields[i] = payload.substr(0, n);
+		payload.remove_prefix(n + 1);
+	}
+	fields[nfields - 1] = payload;
+
+	int ignored = 0;
+	if (!absl::SimpleAtoi(fields[0], &rec.session_id) ||
+		!absl::SimpleAtoi(fields[1], &rec.history_id) ||
+		!absl::SimpleAtoi(fields[2], &rec.ppid) ||
+		!absl::SimpleAtoi(fields[3], &rec.status_code) ||
+		!absl::SimpleAtoi(fields[4], &rec.created_us) ||
+		!absl::SimpleAtoi(fields[5], &rec.redacted) ||
+		!absl::SimpleAtoi(fields[6], &ignored)) {
+		return false;
+	}
+	if (rec.session_id <= 0 || fields[8].empty() || (fields[9].empty() && ignored == 0)) {
+		return false;
+	}
+	rec.ignored = ignored != 0;
+	rec.user = std::string(fields[7]);
+	rec.directory = std::string(fields[8]);
+	rec.raw = std::string(fields[9]);
+	return true;
+}
+
+// Latency
+////////////////////////////////////////////////////////////////////////////////
+
+static size_t bucket_index(uint64_t v) {
+	if (v < 8) {
+		return static_cast<size_t>(v);
+	}
+	const int e = 63 - __builtin_clzll(v); // e >= 3
+	const uint64_t sub = (v >> (e - 3)) & 7;
+	return static_cast<size_t>(e - 2) * 8 + static_cast<size_t>(sub);
+}
+
+static uint64_t bucket_upper_bound(size_t index) {
+	if (index < 8) {
+		return index;
+	}
+	const size_t e = index / 8 + 2;
+	const uint64_t sub = index % 8;
+	return ((8 + sub + 1) << (e - 3)) - 1;
+}
+
+void LatencyHistogram::record(int64_t us) {
+	const uint64_t v = us > 0 ? static_cast<uint64_t>(us) : 0;
+	buckets_[bucket_index(v)]++;
+	count_++;
+	max_ = std::max(max_, static_cast<int64_t>(v));
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+	for (size_t i = 0; i < buckets_.size(); i++) {
+		buckets_[i] += other.buckets_[i];
+	}
+	count_ += other.count_;
+	max_ = std::max(max_, other.max_);
+}
+
+int64_t LatencyHistogram::percentile(double p) const {
+	if (count_ == 0) {
+		return 0;
+	}
+	const auto rank = std::max(int64_t(1),
+		static_cast<int64_t>(std::ceil(p / 100 * static_cast<double>(count_))));
+	int64_t seen = 0;
+	for (size_t i = 0; i < buckets_.size(); i++) {
+		seen += buckets_[i];
+		if (seen >= rank) {
+			return std::min(static_cast<int64_t>(bucket_upper_bound(i)), max_);
+		}
+	}
+	return max_;
+}
+
+// Pipeline
+////////////////////////////////////////////////////////////////////////////////
+
+OverflowPolicy parse_overflow_policy(const std::string& name) {
+	if (name == "block") {
+		return OverflowPolicy::Block;
+	}
+	if (name == "drop-oldest") {
+		return OverflowPolicy::DropOldest;
+	}
+	throw std::invalid_argument(absl::StrCat("invalid overflow policy: ", name));
+}
+
+IngestPipeline::IngestPipeline(size_t capacity, OverflowPolicy policy,
+	size_t batch_rows, std::chrono::milliseconds retry_timeout, IngestSink sink)
+	: ring_(capacity), policy_(policy), batch_rows_(std::max(batch_rows, size_t(1))),
+	  retry_timeout_(retry_timeout), sink_(std::move(sink)) {
+
+	writer_metrics_.capacity = static_cast<int64_t>(capacity);
+	writer_ = std::thread([this]() { run_writer(); });
+}
+
+IngestPipeline::~IngestPipeline() {
+	stop();
+}
+
+void IngestPipeline::wake_writer() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+	}
+	cond_.notify_one();
+}
+
+std::future<bool> IngestPipeline::push(IngestRecord rec) {
+	Entry e{std::move(rec), TraceClock::now(), std::promise<bool>()};
+	std::future<bool> written = e.written.get_future();
+	if (!ring_.try_push(e)) {
+		if (policy_ == OverflowPolicy::DropOldest) {
+			Entry oldest;
+			do {
+				if (ring_.try_pop(oldest)) {
+					dropped_.fetch_add(1, std::memory_order_relaxed);
+					oldest.written.set_value(false);
+				}
+			} while (!ring_.try_push(e));
+		} else {
+			blocked_.fetch_add(1, std::memory_order_relaxed);
+			wake_writer();
+			for (int spins = 0; !ring_.try_push(e); spins++) {
+				if (spins < 64) {
+					std::this_thread::yield();
+				} else {
+					std::this_thread::sleep_for(std::chrono::microseconds(50));
+				}
+			}
+		}
+	}
+	// Pairs with the fence of run_writer: either it sees the record, or we
+	// see that it sleeps.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleeping_.load(std::memory_order_relaxed)) {
+		wake_writer();
+	}
+	return written;
+}
+
+void IngestPipeline::stop() {
+	if (!writer_.joinable()) {
+		return;
+	}
+	stopping_.store(true, std::memory_order_release);
+	wake_writer();
+	writer_.join();
+}
+
+void IngestPipeline::run_writer() {
+	std::vector<Entry> batch;
+	batch.reserve(batch_rows_);
+	for (;;) {
+		const size_t depth = ring_.size();
+		Entry e;
+		while (batch.size() < batch_rows_ && ring_.try_pop(e)) {
+			batch.push_back(std::move(e));
+		}
+		if (!batch.empty()) {
+			depth_sum_ += static_cast<int64_t>(depth);
+			writer_metrics_.depth_max = std::max(writer_metrics_.depth_max,
+				static_cast<int64_t>(depth));
+			write_batch(batch);
+			batch.clear();
+			continue;
+		}
+		// Producers are done once stop was called and the queue is empty.
+		if (stopping_.load(std::memory_order_acquire)) {
+			return;
+		}
+		std::unique_lock<std::mutex> lock(mutex_);
+		sleeping_.store(true, std::memory_order_relaxed);
+		// Pairs with the fence of push: a producer that pushed before seeing
+		// sleeping_ did not wake us, but its record is seen here.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		cond_.wait(lock, [this]() {
+			return ring_.size() != 0 || stopping_.load(std::memory_order_acquire);
+		});
+		sleeping_.store(false, std::memory_order_relaxed);
+	}
+}
+
+void IngestPipeline::write_batch(std::vector<Entry>& batch) {
+	std::vector<IngestRecord> records;
+	records.reserve(batch.size());
+	for (auto& e : batch) {
+		records.push_back(std::move(e.rec));
+	}
+	const auto n = static_cast<int64_t>(records.size());
+	const auto start = TraceClock::now();
+	// The batch is in the queue order, its first record waited the longest.
+	const auto deadline = batch.front().enqueued + retry_timeout_;
+	std::chrono::milliseconds backoff(10);
+	bool ok = false;
+	for (;;) {
+		try {
+			sink_(records);
+			ok = true;
+			break;
+		} catch (const std::exception& ex) {
+			if (TraceClock::now() + backoff >= deadline) {
+				std::cerr << "histdb: ingest: returned batch of " << n
+					<< " records to the shells: " << ex.what() << std::endl;
+				break;
+			}
+		}
+		writer_metrics_.retries++;
+		std::this_thread::sleep_for(backoff);
+		backoff = std::min(backoff * 2, std::chrono::milliseconds(200));
+	}
+	if (ok) {
+		writer_metrics_.written += n;
+	} else {
+		writer_metrics_.failed += n;
+	}
+	const auto end = TraceClock::now();
+	writer_metrics_.batches++;
+	writer_metrics_.commit_us.record(
+		std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+	for (auto& e : batch) {
+		writer_metrics_.latency_us.record(
+			std::chrono::duration_cast<std::chrono::microseconds>(end - e.enqueued).count());
+		e.written.set_value(ok);
+	}
+}
+
+IngestMetrics IngestPipeline::metrics() const {
+	IngestMetrics m = writer_metrics_;
+	if (m.batches > 0) {
+		m.depth_mean = static_cast<double>(depth_sum_) / static_cast<double>(m.batches);
+	}
+	m.blocked = blocked_.load();
+	m.dropped = dropped_.load();
+	return m;
+}
+
+void print_ingest_metrics(const IngestMetrics& m, std::ostream& out) {
+	std::ostringstream os;
+	os << std::fixed << std::setprecision(1);
+	os << "  accept:  " << m.connections << " connections, " << m.refused << " refused, "
+		<< m.frames << " frames, " << m.invalid << " invalid\n";
+	os << "  queue:   " << m.capacity << " capacity, " << m.depth_max << " max depth, "
+		<< m.depth_mean << " mean depth, " << m.blocked << " blocked, "
+		<< m.dropped << " dropped\n";
+	os << "  write:   " << m.batches << " batches, " << m.written << " written, "
+		<< m.retries << " retries, " << m.failed << " failed, "
+		<< (m.batches > 0 ? static_cast<double>(m.written) / static_cast<double>(m.batches) : 0.0)
+		<< " rows/batch\n";
+	os << "  commit:  p50 " << m.commit_us.percentile(50) << " us, p99 "
+		<< m.commit_us.percentile(99) << " us, max " << m.commit_us.max() << " us\n";
+	os << "  latency: p50 " << m.latency_us.percentile(50) << " us, p99 "
+		<< m.latency_us.percentile(99) << " us, max " << m.latency_us.max() << " us\n";
+	out << os.str();
+}
+
+// Sockets
+////////////////////////////////////////////////////////////////////////////////
+
+// Commands larger than this are not sent to the daemon.
+constexpr uint32_t max_frame_size = 16 * 1024 * 1024;
+
+static volatile std::sig_atomic_t ingest_signaled = 0;
+
+static void on_ingest_signal(int) {
+	ingest_signaled = 1;
+}
+
+void install_ingest_signal_handlers() {
+	struct sigaction sa;
+	std::memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_ingest_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+	std::signal(SIGPIPE, SIG_IGN);
+}
+
+static sockaddr_un socket_address(const std::string& path) {
+	sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+		throw std::invalid_argument(absl::StrCat("invalid socket path: ", path));
+	}
+	addr.sun_family = AF_UNIX;
+	std::memcpy(addr.sun_path, path.data(), path.size());
+	return addr;
+}
+
+static void set_timeouts(int fd, std::chrono::milliseconds timeout) {
+	timeval tv;
+	tv.tv_sec = static_cast<time_t>(timeout.count() / 1000);
+	tv.tv_usec = static_cast<suseconds_t>(timeout.count() % 1000 * 1000);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#ifdef SO_NOSIGPIPE
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+static bool read_full(int fd, void *buf, size_t size) {
+	auto *p = static_cast<char *>(buf);
+	while (size > 0) {
+		const ssize_t n = ::read(fd, p, size);
+		if (n > 0) {
+			p += n;
+			size -= static_cast<size_t>(n);
+		} else if (n == 0 || errno != EINTR) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t size) {
+#ifdef MSG_NOSIGNAL
+	constexpr int flags = MSG_NOSIGNAL;
+#else
+	constexpr int flags = 0;
+#endif
+	const auto *p = static_cast<const char *>(buf);
+	while (size > 0) {
+		const ssize_t n = ::send(fd, p, size, flags);
+		if (n > 0) {
+			p += n;
+			size -= static_cast<size_t>(n);
+		} else if (n == 0 || errno != EINTR) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool send_record(const std::string& socket_path, const IngestRecord& rec) {
+	const std::string payload = encode_record(rec);
+	if (payload.size() > max_frame_size) {
+		return false;
+	}
+	const sockaddr_un addr = socket_address(socket_path);
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		return false;
+	}
+	set_timeouts(fd, std::chrono::seconds(2));
+	bool ok = false;
+	if (connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == 0) {
+		const auto len = static_cast<uint32_t>(payload.size());
+		std::string frame(reinterpret_cast<const char *>(&len), sizeof(len));
+		frame.append(payload);
+		char ack = 0;
+		ok = write_full(fd, frame.data(), frame.size()) &&
+			read_full(fd, &ack, 1) && ack == 'k';
+	}
+	close(fd);
+	return ok;
+}
+
+// Server
+////////////////////////////////////////////////////////////////////////////////
+
+IngestServer::IngestServer(const IngestOptions& opts, IngestSink sink)
+	: opts_(opts),
+	  pipeline_(opts.queue_size, opts.policy, opts.batch_rows, opts.retry_timeout,
+		std::move(sink)) {}
+
+IngestServer::~IngestServer() {
+	if (listen_fd_ != -1) {
+		close(listen_fd_);
+		unlink(opts_.socket_path.c_str());
+	}
+}
+
+void IngestServer::listen() {
+	const sockaddr_un addr = socket_address(opts_.socket_path);
+	const auto *sa = reinterpret_cast<const sockaddr *>(&addr);
+
+	// Replace the socket of a daemon that exited without removing it, but
+	// not the socket of one that is still running.
+	const int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (probe != -1) {
+		const bool running = connect(probe, sa, sizeof(addr)) == 0;
+		close(probe);
+		if (running) {
+			throw std::runtime_error(absl::StrCat(
+				"daemon already listening on: ", opts_.socket_path));
+		}
+	}
+	unlink(opts_.socket_path.c_str());
+
+	listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd_ == -1 || bind(listen_fd_, sa, sizeof(addr)) != 0 ||
+		chmod(opts_.socket_path.c_str(), 0600) != 0 ||
+		::listen(listen_fd_, SOMAXCONN) != 0) {
+
+		const int err = errno;
+		throw std::system_error(err, std::generic_category(),
+			absl::StrCat("listen: ", opts_.socket_path));
+	}
+}
+
+void IngestServer::serve() {
+	while (!stopping_.load(std::memory_order_acquire) && !ingest_signaled) {
+		pollfd pfd{listen_fd_, POLLIN, 0};
+		if (poll(&pfd, 1, 100) <= 0) {
+			continue;
+		}
+		const int fd = accept(listen_fd_, nullptr, nullptr);
+		if (fd == -1) {
+			continue;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (conns_.size() >= opts_.max_connections) {
+				refused_.fetch_add(1, std::memory_order_relaxed);
+				close(fd);
+				continue;
+			}
+			conns_.push_back(fd);
+		}
+		connections_.fetch_add(1, std::memory_order_relaxed);
+		std::thread([this, fd]() { handle(fd); }).detach();
+	}
+
+	close(listen_fd_);
+	unlink(opts_.socket_path.c_str());
+	listen_fd_ = -1;
+	{
+		// Wake the handlers that wait for their next frame.
+		std::unique_lock<std::mutex> lock(mutex_);
+		for (int fd : conns_) {
+			::shutdown(fd, SHUT_RD);
+		}
+		idle_.wait(lock, [this]() { return conns_.empty(); });
+	}
+	pipeline_.stop();
+}
+
+void IngestServer::shutdown() {
+	stopping_.store(true, std::memory_order_release);
+}
+
+void IngestServer::handle(int fd) {
+	set_timeouts(fd, std::chrono::seconds(5));
+	std::string payload;
+	for (;;) {
+		uint32_t len = 0;
+		if (!read_full(fd, &len, sizeof(len))) {
+			break;
+		}
+		if (len > max_frame_size) {
+			invalid_.fetch_add(1, std::memory_order_relaxed);
+			break;
+		}
+		payload.resize(len);
+		if (!read_full(fd, payload.data(), len)) {
+			break;
+		}
+		frames_.fetch_add(1, std::memory_order_relaxed);
+		IngestRecord rec;
+		char ack = 'k';
+		if (decode_record(payload, rec)) {
+			// Only acknowledge records that are stored, the shell writes the
+			// others itself.
+			ack = pipeline_.push(std::move(rec)).get() ? 'k' : 'e';
+		} else {
+			invalid_.fetch_add(1, std::memory_order_relaxed);
+			ack = 'e';
+		}
+		if (!write_full(fd, &ack, 1)) {
+			break;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	conns_.erase(std::find(conns_.begin(), conns_.end(), fd));
+	close(fd);
+	idle_.notify_all();
+}
+
+IngestMetrics IngestServer::metrics() const {
+	IngestMetrics m = pipeline_.metrics();
+	m.connections = connections_.load();
+	m.refused = refused_.load();
+	m.frames = frames_.load();
+	m.invalid = invalid_.load();
+	return m;
+}
+
+// Stress test
+////////////////////////////////////////////////////////////////////////////////
+
+int64_t run_ingest_stress(const IngestStressOptions& opts, IngestSink sink,
+	std::ostream& out) {
+
+	IngestServer server(opts.ingest, std::move(sink));
+	server.listen();
+	std::thread serve_thread([&server]() { server.serve(); });
+
+	std::vector<LatencyHistogram> latencies(static_cast<size_t>(opts.shells));
+	std::atomic<int64_t> acked{0};
+	std::atomic<int64_t> refused{0};
+	const auto start = TraceClock::now();
+	std::vector<std::thread> shells;
+	for (int i = 0; i < opts.shells; i++) {
+		shells.emplace_back([&, i]() {
+			IngestRecord rec;
+			rec.session_id = i + 1;
+			rec.ppid = 1000 + i;
+			rec.user = "stress";
+			rec.directory = absl::StrCat("/stress/", i);
+			auto& hist = latencies[static_cast<size_t>(i)];
+			for (int j = 0; j < opts.records; j++) {
+				rec.history_id = j + 1;
+				rec.created_us = unix_micros(std::chrono::system_clock::now());
+				rec.raw = absl::StrCat("echo ", i, " ", j);
+				const auto t0 = TraceClock::now();
+				if (send_record(opts.ingest.socket_path, rec)) {
+					acked.fetch_add(1, std::memory_order_relaxed);
+				} else {
+					refused.fetch_add(1, std::memory_order_relaxed);
+				}
+				hist.record(std::chrono::duration_cast<std::chrono::microseconds>(
+					TraceClock::now() - t0).count());
+			}
+		});
+	}
+	for (auto& t : shells) {
+		t.join();
+	}
+	const auto elapsed = std::chrono::duration<double>(TraceClock::now() - start).count();
+	server.shutdown();
+	serve_thread.join();
+
+	LatencyHistogram client;
+	for (const auto& h : latencies) {
+		client.merge(h);
+	}
+	const IngestMetrics m = server.metrics();
+	const int64_t sent = int64_t(opts.shells) * opts.records;
+	const int64_t lost = acked.load() - m.written;
+
+	std::ostringstream os;
+	os << std::fixed << std::setprecision(3);
+	os << "histdb: ingest stress: " << opts.shells << " shells x " << opts.records
+		<< " records in " << elapsed << " s ("
+		<< std::setprecision(0) << static_cast<double>(sent) / elapsed << " records/s)\n";
+	os << "  client:  " << sent << " sent, " << acked.load() << " acked, "
+		<< refused.load() << " refused, p50 " << client.percentile(50) << " us, p99 "
+		<< client.percentile(99) << " us, max " << client.max() << " us\n";
+	out << os.str();
+	print_ingest_metrics(m, out);
+	out << "  lost:    " << lost << std::endl;
+	return lost;
+}
+
+} // namespace histdb
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "ring.h"
+#include "trace.h"
+
+namespace histdb {
+
+// Records
+////////////////////////////////////////////////////////////////////////////////
+
+// IngestRecord is a command recorded by a shell, after redaction.
+struct IngestRecord {
+	int64_t session_id = 0;
+	int64_t history_id = 0;
+	int32_t ppid = 0;
+	int32_t status_code = 0;
+	int64_t created_us = 0; // microseconds since the Unix epoch
+	int32_t redacted = 0;   // number of redacted values
+	bool ignored = false;   // only count the command as ignored
+	std::string user;
+	std::string directory;  // raw $PWD
+	std::string raw;
+};
+
+// encode_record and decode_record convert a record to and from the payload
+// of a frame sent to the daemon. decode_record returns false if payload is
+// malformed.
+std::string encode_record(const IngestRecord& rec);
+bool decode_record(std::string_view payload, IngestRecord& rec);
+
+// Latency
+////////////////////////////////////////////////////////////////////////////////
+
+// LatencyHistogram counts latencies (in microseconds) in log-linear buckets:
+// 8 buckets per power of two, so percentiles are accurate to within 12.5%.
+class LatencyHistogram {
+public:
+	void record(int64_t us);
+	void merge(const LatencyHistogram& other);
+	int64_t count() const { return count_; }
+	int64_t max() const { return max_; }
+
+	// percentile returns the upper bound of the bucket holding the p-th
+	// (0-100) percentile.
+	int64_t percentile(double p) const;
+
+private:
+	static constexpr int sub_buckets = 8;
+	std::array<int64_t, 64 * sub_buckets> buckets_{};
+	int64_t count_ = 0;
+	int64_t max_ = 0;
+};
+
+// Pipeline
+////////////////////////////////////////////////////////////////////////////////
+
+// OverflowPolicy decides what a producer does when the queue is full.
+enum class OverflowPolicy {
+	Block,      // wait for the writer to make room (backpressure to the shell)
+	DropOldest, // evict the oldest queued record, whose shell writes it itself
+};
+
+OverflowPolicy parse_overflow_policy(const std::string& name);
+
+// IngestSink writes a batch of records, it is expected to do so in a single
+// transaction. It is only ever called from the writer thread.
+using IngestSink = std::function<void(const std::vector<IngestRecord>& batch)>;
+
+// IngestMetrics are the counters of each stage of the pipeline.
+struct IngestMetrics {
+	// accept
+	int64_t connections = 0;
+	int64_t refused = 0;   // over the connection limit
+	int64_t frames = 0;
+	int64_t invalid = 0;   // malformed frames
+
+	// queue
+	int64_t capacity = 0;
+	int64_t depth_max = 0;
+	double depth_mean = 0; // sampled by the writer before every batch
+	int64_t blocked = 0;   // pushes that had to wait for room
+	int64_t dropped = 0;   // records evicted by DropOldest (returned to the shells)
+
+	// write
+	int64_t batches = 0;
+	int64_t written = 0;
+	int64_t retries = 0;   // sink calls that threw and were retried
+	int64_t failed = 0;    // records of batches that failed until the retry timeout
+	                       // (returned to the shells)
+	LatencyHistogram commit_us;  // time spent in the sink per batch
+	LatencyHistogram latency_us; // enqueue to commit per record
+};
+
+void print_ingest_metrics(const IngestMetrics& m, std::ostream& out);
+
+// IngestPipeline queues records pushed by any number of threads in a
+// RingBuffer and writes them from a single writer thread in batches of up
+// to batch_rows, so the SQLite write lock is taken once per batch instead of
+// once per command.
+//
+// A batch whose sink throws (SQLITE_BUSY while another process holds the
+// write lock...) is retried with a backoff until its oldest record has
+// waited retry_timeout. Its records are then returned to their shells,
+// which write them themselves, as are the records evicted by DropOldest: a
+// record is only ever acknowledged once it is committed.
+class IngestPipeline {
+public:
+	IngestPipeline(size_t capacity, OverflowPolicy policy, size_t batch_rows,
+		std::chrono::milliseconds retry_timeout, IngestSink sink);
+	~IngestPipeline();
+
+	IngestPipeline(const IngestPipeline&) = delete;
+	IngestPipeline& operator=(const IngestPipeline&) = delete;
+
+	// push queues rec, applying the overflow policy if the queue is full.
+	// The future is true once rec is committed and false if it was evicted
+	// or its batch failed, the shell must then write it itself.
+	std::future<bool> push(IngestRecord rec);
+
+	// stop writes the queued records and stops the writer. No records may be
+	// pushed once it was called.
+	void stop();
+
+	// metrics returns the metrics of the pipeline, it must be called after
+	// stop.
+	IngestMetrics metrics() const;
+
+private:
+	struct Entry {
+		IngestRecord rec;
+		TraceClock::time_point enqueued;
+		std::promise<bool> written;
+	};
+
+	void run_writer();
+	void write_batch(std::vector<Entry>& batch);
+	void wake_writer();
+
+	RingBuffer<Entry> ring_;
+	const OverflowPolicy policy_;
+	const size_t batch_rows_;
+	const std::chrono::milliseconds retry_timeout_;
+	IngestSink sink_;
+
+	// The writer sleeps on cond_ while the queue is empty, producers only
+	// take mutex_ to wake it if sleeping_ is set.
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::atomic<bool> sleeping_{false};
+	std::atomic<bool> stopping_{false};
+	std::thread writer_;
+
+	std::atomic<int64_t> blocked_{0};
+	std::atomic<int64_t> dropped_{0};
+
+	// Only accessed by the writer thread (until it is joined).
+	IngestMetrics writer_metrics_;
+	int64_t depth_sum_ = 0;
+};
+
+// Daemon
+////////////////////////////////////////////////////////////////////////////////
+
+struct IngestOptions {
+	std::string socket_path;
+	size_t queue_size = 4096;
+	OverflowPolicy policy = OverflowPolicy::Block;
+	size_t batch_rows = 256;
+	size_t max_connections = 1024;
+	// Less than the time send_record waits for the acknowledgment, minus the
+	// busy timeout of a sink call.
+	std::chrono::milliseconds retry_timeout{1000};
+};
+
+// IngestServer accepts shells on a unix socket and feeds the records they
+// send into an IngestPipeline. Each connection gets a handler thread that
+// reads length prefixed frames (a native uint32 length followed by an
+// encoded record) and answers every record with a single byte: 'k' once it
+// is committed, or 'e' if it is invalid or was not written (see
+// IngestPipeline) so that the shell writes it itself. Connections over
+// max_connections are closed right away so the shell falls back to writing
+// the database itself.
+class IngestServer {
+public:
+	IngestServer(const IngestOptions& opts, IngestSink sink);
+	~IngestServer();
+
+	IngestServer(const IngestServer&) = delete;
+	IngestServer& operator=(const IngestServer&) = delete;
+
+	// listen binds the socket, replacing a stale socket file.
+	void listen();
+
+	// serve accepts connections until shutdown is called or the process
+	// receives SIGINT or SIGTERM (see install_ingest_signal_handlers), then
+	// waits for the connections to finish and drains the queue.
+	void serve();
+
+	// shutdown makes serve return, it may be called from any thread.
+	void shutdown();
+
+	// metrics must only be called after serve returned.
+	IngestMetrics metrics() const;
+
+private:
+	void handle(int fd);
+
+	IngestOptions opts_;
+	IngestPipeline pipeline_;
+	int listen_fd_ = -1;
+	std::atomic<bool> stopping_{false};
+
+	std::mutex mutex_;
+	std::condition_variable idle_;
+	std::vector<int> conns_; // open connections (guarded by mutex_)
+
+	std::atomic<int64_t> connections_{0};
+	std::atomic<int64_t> refused_{0};
+	std::atomic<int64_t> frames_{0};
+	std::atomic<int64_t> invalid_{0};
+};
+
+// install_ingest_signal_handlers makes SIGINT and SIGTERM stop
+// IngestServer::serve and ignores SIGPIPE.
+void install_ingest_signal_handlers();
+
+// send_record sends rec to the daemon listening on socket_path and waits for
+// it to be committed. Returns false if the daemon is not running or did not
+// write the record (the caller should then write it itself).
+bool send_record(const std::string& socket_path, const IngestRecord& rec);
+
+// Stress test
+////////////////////////////////////////////////////////////////////////////////
+
+struct IngestStressOptions {
+	IngestOptions ingest;
+	int shells = 200;
+	int records = 50; // per shell
+};
+
+// run_ingest_stress starts an IngestServer writing to sink and simulates
+// opts.shells shells that concurrently send opts.records records each (one
+// connection per record, like "histdb insert"). It prints the client round
+// trip latencies, the pipeline metrics and the number of lost records
+// (acknowledged but not written) and returns the latter.
+int64_t run_ingest_stress(const IngestStressOptions& opts, IngestSink sink,
+	std::ostream& out);
+
+} // namespace histdb
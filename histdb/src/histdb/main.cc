@@ -7,8 +7,20 @@
 #include <cerrno>
 #include <stdexcept>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 namespace fs = std::filesystem;
 
 #include <sys/sysctl.h> // sysctl (for boot time)
@@ -18,12 +30,39 @@ namespace fs = std::filesystem;
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_join.h"
 #include <SQLiteCpp/Database.h>
+#include <SQLiteCpp/Transaction.h>
 
 // WARN
 #include <CLI/CLI.hpp>
 
 #include <sqlite3.h>
 
+#include "bench.h"
+#include "blobs.h"
+#include "clusters.h"
+#include "compact.h"
+#include "durability.h"
+#include "export.h"
+#include "federation.h"
+#include "filter.h"
+#include "fix.h"
+#include "ingest.h"
+#include "migrate.h"
+#include "paths.h"
+#include "redact.h"
+#include "registry.h"
+#include "rows.h"
+#include "sanitize.h"
+#include "session.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "tail.h"
+#include "timefmt.h"
+#include "tokens.h"
+#include "torture.h"
+#include "trace.h"
+#include "transaction.h"
+
 // TODO: use or remove
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
@@ -36,11 +75,10 @@ constexpr int32_t BUSY_TIMEOUT_MS = 300;
 // Options
 ////////////////////////////////////////////////////////////////////////////////
 
-static const int current_schema_migration = 2;
+// Migrations are applied by run_migrations (see migrate.h) which runs each
+// one in a transaction and records it in the schema_migrations table.
 
 constexpr char m001_create_tables_stmt[] = R"""(
-BEGIN;
-
 CREATE TABLE IF NOT EXISTS session_ids (
     id        INTEGER PRIMARY KEY,
     ppid      INTEGER NOT NULL,
@@ -59,27 +97,228 @@ CREATE TABLE IF NOT EXISTS history (
     `raw`         TEXT NOT NULL,
     FOREIGN KEY(session_id) REFERENCES session_ids(id)
 );
-
-CREATE TABLE IF NOT EXISTS schema_migrations (
-	`version` INTEGER PRIMARY KEY
-);
-
-INSERT OR IGNORE INTO schema_migrations (version) VALUES (1);
-
-COMMIT;
 )""";
 
 // TODO: use boot_ids table !!!
 constexpr char m002_create_boot_id_table[] = R"""(
-BEGIN;
 CREATE TABLE IF NOT EXISTS boot_ids (
     id         INTEGER PRIMARY KEY,
     created_at TIMESTAMP NOT NULL
 );
-COMMIT;
-INSERT OR IGNORE INTO schema_migrations (version) VALUES (2);
 )""";
 
+// Per-day, per-hour and per-session rollups used by the "stats" command. The
+// rows that existed when this migration was applied are added to the rollups
+// by its backfill, the newer ones are counted on insert.
+constexpr char m003_create_stats_tables[] = R"""(
+CREATE TABLE IF NOT EXISTS stats_daily (
+    `day`       TEXT NOT NULL,
+    `directory` TEXT NOT NULL,
+    `program`   TEXT NOT NULL,
+    `count`     INTEGER NOT NULL DEFAULT 0,
+    `failures`  INTEGER NOT NULL DEFAULT 0,
+    PRIMARY KEY (day, directory, program)
+) WITHOUT ROWID;
+
+CREATE TABLE IF NOT EXISTS stats_hourly (
+    `day`      TEXT NOT NULL,
+    `hour`     INTEGER NOT NULL,
+    `count`    INTEGER NOT NULL DEFAULT 0,
+    `failures` INTEGER NOT NULL DEFAULT 0,
+    PRIMARY KEY (day, hour)
+) WITHOUT ROWID;
+
+CREATE TABLE IF NOT EXISTS stats_session (
+    `session_id` INTEGER NOT NULL,
+    `program`    TEXT NOT NULL,
+    `last_day`   TEXT NOT NULL,
+    `count`      INTEGER NOT NULL DEFAULT 0,
+    `failures`   INTEGER NOT NULL DEFAULT 0,
+    PRIMARY KEY (session_id, program)
+) WITHOUT ROWID;
+)""";
+
+// Counts of redacted and ignored (dropped) commands, see redact.h.
+constexpr char m004_create_redaction_stats_table[] = R"""(
+CREATE TABLE IF NOT EXISTS stats_redactions (
+    `day`      TEXT PRIMARY KEY,
+    `redacted` INTEGER NOT NULL DEFAULT 0,
+    `ignored`  INTEGER NOT NULL DEFAULT 0
+) WITHOUT ROWID;
+)""";
+
+// Indexes used to read a session in order (session show/replay) and to seed
+// a new shell's history from its directory or previous session.
+constexpr char m005_create_session_indexes[] = R"""(
+CREATE INDEX IF NOT EXISTS history_session_id_idx ON history (session_id, id);
+CREATE INDEX IF NOT EXISTS history_directory_id_idx ON history (directory, id);
+)""";
+
+// The creation time in microseconds since the Unix epoch, which (unlike the
+// created_at string) can be compared and range scanned without parsing. The
+// existing rows are backfilled in batches.
+constexpr char m006_add_history_created_at_us[] = R"""(
+ALTER TABLE history ADD COLUMN `created_at_us` INTEGER;
+)""";
+
+constexpr char m006_backfill_history_created_at_us[] = R"""(
+UPDATE history SET created_at_us = histdb_unix_us(created_at)
+WHERE rowid > ?1 AND rowid <= ?2 AND created_at_us IS NULL;
+)""";
+
+// Directories are interned in a tree (see paths.h) and history rows reference
+// them by id. The backfill also rewrites the directory of existing rows in
+// its canonical form (the stats rollups keep the old spelling until they are
+// rebuilt with "histdb stats --rebuild").
+constexpr char m007_create_directories_table[] = R"""(
+CREATE TABLE IF NOT EXISTS directories (
+    `id`        INTEGER PRIMARY KEY,
+    `parent_id` INTEGER REFERENCES directories(id),
+    `name`      TEXT NOT NULL,
+    `path`      TEXT NOT NULL UNIQUE
+);
+
+CREATE TABLE IF NOT EXISTS directory_aliases (
+    `raw`          TEXT PRIMARY KEY,
+    `directory_id` INTEGER NOT NULL REFERENCES directories(id),
+    `dev`          INTEGER NOT NULL,
+    `ino`          INTEGER NOT NULL
+) WITHOUT ROWID;
+
+ALTER TABLE history ADD COLUMN `directory_id` INTEGER REFERENCES directories(id);
+
+CREATE INDEX IF NOT EXISTS history_directory_ref_idx ON history (directory_id, id);
+DROP INDEX IF EXISTS history_directory_id_idx;
+)""";
+
+// Learned corrections of failed commands (see fix.h). The backfill learns the
+// corrections of the existing history.
+constexpr char m008_create_corrections_table[] = R"""(
+CREATE TABLE IF NOT EXISTS corrections (
+    `failed`       TEXT NOT NULL,
+    `fixed`        TEXT NOT NULL,
+    `count`        INTEGER NOT NULL,
+    `last_used_us` INTEGER NOT NULL,
+    PRIMARY KEY (failed, fixed)
+) WITHOUT ROWID;
+
+CREATE INDEX IF NOT EXISTS corrections_last_used_idx ON corrections (last_used_us);
+)""";
+
+// Session ids are reserved in blocks by the session registry (see
+// registry.h) before their rows are written.
+constexpr char m009_create_session_id_reservations_table[] = R"""(
+CREATE TABLE IF NOT EXISTS session_id_reservations (
+    `id`      INTEGER PRIMARY KEY CHECK (id = 1),
+    `next_id` INTEGER NOT NULL
+);
+
+INSERT OR IGNORE INTO session_id_reservations (id, next_id)
+SELECT 1, COALESCE(MAX(id), 0) + 1 FROM session_ids;
+)""";
+
+// Index of the time range of the "after:" and "before:" filters (see
+// filter.h).
+constexpr char m010_create_history_created_at_us_index[] = R"""(
+CREATE INDEX IF NOT EXISTS history_created_at_us_idx ON history (created_at_us);
+)""";
+
+// Large commands are stored once, out of line (see blobs.h). The backfill
+// moves the large commands of the existing history.
+constexpr char m011_create_command_blobs_table[] = R"""(
+CREATE TABLE IF NOT EXISTS command_blobs (
+    `id`   INTEGER PRIMARY KEY,
+    `hash` INTEGER NOT NULL,
+    `size` INTEGER NOT NULL,
+    `data` TEXT NOT NULL
+);
+
+CREATE INDEX IF NOT EXISTS command_blobs_hash_idx ON command_blobs (hash);
+
+ALTER TABLE history ADD COLUMN `raw_blob` INTEGER REFERENCES command_blobs(id);
+
+CREATE INDEX IF NOT EXISTS history_raw_blob_idx ON history (raw_blob)
+WHERE raw_blob IS NOT NULL;
+)""";
+
+// Posting lists of the programs, flags, pipes and variables of the commands
+// (see tokens.h). The trigger deletes the postings of deleted rows, whichever
+// connection (and foreign_keys setting) deletes them. The backfill indexes
+// the existing history.
+constexpr char m012_create_command_tokens_tables[] = R"""(
+CREATE TABLE IF NOT EXISTS command_tokens (
+    `id`   INTEGER PRIMARY KEY,
+    `kind` INTEGER NOT NULL,
+    `text` TEXT NOT NULL,
+    UNIQUE (kind, text)
+);
+
+CREATE TABLE IF NOT EXISTS command_postings (
+    `token_id` INTEGER NOT NULL REFERENCES command_tokens(id),
+    `row_id`   INTEGER NOT NULL,
+    PRIMARY KEY (token_id, row_id)
+) WITHOUT ROWID;
+
+CREATE INDEX IF NOT EXISTS command_postings_row_idx ON command_postings (row_id);
+
+CREATE TRIGGER IF NOT EXISTS history_delete_postings AFTER DELETE ON history
+BEGIN
+    DELETE FROM command_postings WHERE row_id = old.id;
+END;
+)""";
+
+// Clusters of near-duplicate commands (see clusters.h): the clusters, their
+// LSH bands and the cluster of every history row, which the backfill
+// assigns.
+constexpr char m014_create_command_clusters_tables[] = R"""(
+CREATE TABLE IF NOT EXISTS command_clusters (
+    `id`        INTEGER PRIMARY KEY,
+    `signature` BLOB NOT NULL,
+    `command`   TEXT NOT NULL,
+    `runs`      INTEGER NOT NULL DEFAULT 0,
+    `failures`  INTEGER NOT NULL DEFAULT 0,
+    `last_day`  TEXT NOT NULL DEFAULT ''
+);
+
+CREATE TABLE IF NOT EXISTS command_cluster_bands (
+    `band`       INTEGER NOT NULL,
+    `key`        INTEGER NOT NULL,
+    `cluster_id` INTEGER NOT NULL REFERENCES command_clusters(id),
+    PRIMARY KEY (band, key, cluster_id)
+) WITHOUT ROWID;
+
+ALTER TABLE history ADD COLUMN `cluster_id` INTEGER REFERENCES command_clusters(id);
+)""";
+
+static const std::vector<histdb::Migration> migrations = {
+	{1, "create_tables", m001_create_tables_stmt},
+	{2, "create_boot_id_table", m002_create_boot_id_table},
+	{3, "create_stats_tables", m003_create_stats_tables,
+		nullptr, "history", histdb::backfill_stats_rollups},
+	{4, "create_redaction_stats_table", m004_create_redaction_stats_table},
+	{5, "create_session_indexes", m005_create_session_indexes},
+	{6, "add_history_created_at_us", m006_add_history_created_at_us,
+		m006_backfill_history_created_at_us},
+	{7, "create_directories_table", m007_create_directories_table,
+		nullptr, "history", histdb::backfill_history_directories},
+	{8, "create_corrections_table", m008_create_corrections_table,
+		nullptr, "history", histdb::backfill_corrections},
+	{9, "create_session_id_reservations_table", m009_create_session_id_reservations_table},
+	{10, "create_history_created_at_us_index", m010_create_history_created_at_us_index},
+	{11, "create_command_blobs_table", m011_create_command_blobs_table,
+		nullptr, "history", histdb::backfill_command_blobs},
+	{12, "create_command_tokens_tables", m012_create_command_tokens_tables,
+		nullptr, "history", histdb::backfill_command_tokens},
+	{13, "create_durability_groups_table", histdb::create_durability_groups_stmt},
+	{14, "create_command_clusters_tables", m014_create_command_clusters_tables,
+		nullptr, "history", histdb::backfill_command_clusters},
+	{15, "create_history_deletions_table", histdb::create_history_deletions_stmt},
+};
+
+// Time that opening the database may spend backfilling migrations, the rest
+// is left for the next command (or "histdb migrate").
+constexpr std::chrono::milliseconds MIGRATION_BUDGET{20};
+
 constexpr char insert_history_stmt[] = R"""(
 INSERT INTO history (
 	session_id,
@@ -89,8 +328,11 @@ INSERT INTO history (
 	created_at,
 	username,
 	directory,
-	raw
-) VALUES (?, ?, ?, ?, ?, ?, ?, ?);
+	raw,
+	created_at_us,
+	directory_id,
+	raw_blob
+) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);
 )""";
 
 constexpr std::string_view root_usage_msg = R"""(histdb: shell history tool
@@ -158,6 +400,7 @@ void assertion_failed(const char* apFile, const long apLine, const char* apFunc,
 // insert command options
 
 static bool verbose = false;
+static std::string metrics_file;
 // TODO: use this
 static bool FORCE_USE_PROD_DATABASE = false;
 static bool use_prod_database = false;
@@ -254,44 +497,6 @@ static bool use_test_database() {
 	return get_env_bool(HISTDB_PROD) == false;
 }
 
-static constexpr bool is_ascii_space(unsigned char c) {
-	return c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r' || c == ' ';
-}
-
-static constexpr bool is_ascii_cntrl(unsigned char c) {
-	return c <= '\x1f' || c == '\x7F';
-}
-
-static constexpr std::string_view ascii_space_and_cntrl() {
-	return "\x00\x01\x02\x03\x04\x05\x06\a\b\t\n\v\f\r"
-		"\x0e\x0f\x10\x11\x12\x13\x14\x15\x16\x17\x18"
-		"\x19\x1a\x1b\x1c\x1d\x1e\x1f \x7f";
-}
-
-static std::string trim_ascii_space_x(const std::string& s)  {
-	auto start = s.find_first_not_of("\t\n\v\f\r ");
-	auto end = s.find_last_not_of(ascii_space_and_cntrl());
-	if (start == std::string_view::npos || end == std::string_view::npos) {
-		return std::string();
-	}
-	return s.substr(start, end);
-}
-
-static std::string trim_ascii_space(const char *s) {
-	while (is_ascii_space(*s)) {
-		s++;
-	};
-	if (*s) {
-		ssize_t n = std::strlen(s) - 1;
-		const unsigned char c = s[n];
-		while (n >= 0 && (is_ascii_space(c) || is_ascii_cntrl(c))) {
-			n--;
-		}
-		return std::string(s, n + 1);
-	}
-	return std::string();
-}
-
 // command line parsers
 
 static bool chars_are_numeric(const char *s) {
@@ -394,12 +599,9 @@ static void parse_insert_cmd_argments(int argc, char * const argv[]) {
 	if (!raw || !*raw) {
 		throw ArgumentException("empty argument: RAW_HISTORY");
 	}
-	raw_history = trim_ascii_space(raw);
+	raw_history = histdb::sanitize_command(raw);
 
-	// TODO: clean PWD via .lexically_normal()
-	//
-	// TODO: use getwd() to get the absolute WD since PWD can be wrong
-	// or on macOS the casing can differ from the actual WD.
+	// NB: canonicalized by intern_directory (see paths.h)
 	current_wd = must_getenv("PWD");
 	current_user = must_getenv("USER");;
 }
@@ -462,44 +664,77 @@ static fs::path user_data_dir() {
 	throw ArgumentException("neither $XDG_DATA_HOME nor $HOME are defined");
 }
 
-static fs::path histdb_database_path() {
-	// Pedantically guard against writing to the real database.
-	// TODO: Remove this once testing is done.
-	if (use_test_database()) {
-		return "test.sqlite3";
+static fs::path user_config_dir() {
+	auto s = safe_getenv("XDG_CONFIG_HOME");
+	if (!s.empty()) {
+		return s;
 	}
-	return user_data_dir() / "histdb" / "data" / HISTDB_NAME;
+	s = safe_getenv("HOME");
+	if (!s.empty()) {
+		return fs::path(s) / ".config";
+	}
+	throw ArgumentException("neither $XDG_CONFIG_HOME nor $HOME are defined");
 }
 
-static bool should_migrate_database(SQLite::Database& db) {
-	if (!db.tableExists("schema_migrations")) {
-		return true;
+static fs::path user_cache_dir() {
+	auto s = safe_getenv("XDG_CACHE_HOME");
+	if (!s.empty()) {
+		return s;
 	}
-	SQLite::Statement query(
-		db, "SELECT version FROM schema_migrations ORDER BY version DESC LIMIT 1;"
-	);
-	if (!query.executeStep()) {
-		return true;
+	s = safe_getenv("HOME");
+	if (!s.empty()) {
+		return fs::path(s) / ".cache";
 	}
-	int version = query.getColumn(0).getInt();
+	throw ArgumentException("neither $XDG_CACHE_HOME nor $HOME are defined");
+}
 
-	// The database is running a schema version that we don't know about.
-	if (unlikely(version > current_schema_migration)) {
-		throw std::runtime_error(absl::StrCat(
-			"database schema (", version, ") exceeds program ",
-			"version (", current_schema_migration, ")"
-		));
+// load_redact_matcher loads the redaction rules from $HISTDB_REDACT_CONFIG
+// or "$XDG_CONFIG_HOME/histdb/redact.conf" (the default rules are used if
+// neither exist). The compiled rules are cached in "$XDG_CACHE_HOME/histdb".
+static histdb::RedactMatcher load_redact_matcher() {
+	fs::path config = safe_getenv("HISTDB_REDACT_CONFIG");
+	if (config.empty()) {
+		config = user_config_dir() / "histdb" / "redact.conf";
 	}
+	return histdb::RedactMatcher::load(config, user_cache_dir() / "histdb" / "redact.cache");
+}
 
-	return version < current_schema_migration;
+// durability returns the durability tier of the database (see durability.h):
+// $HISTDB_DURABILITY, or the first line of $HISTDB_DURABILITY_CONFIG or
+// "$XDG_CONFIG_HOME/histdb/durability.conf", or strict if neither is set.
+static const histdb::Durability& durability() {
+	static const histdb::Durability d = []() {
+		const auto env = safe_getenv("HISTDB_DURABILITY");
+		fs::path config = safe_getenv("HISTDB_DURABILITY_CONFIG");
+		if (env.empty() && config.empty()) {
+			config = user_config_dir() / "histdb" / "durability.conf";
+		}
+		return histdb::load_durability(env, config);
+	}();
+	return d;
 }
 
-static SQLite::Database open_database(std::string& filename, bool readonly = false) {
+static fs::path histdb_database_path() {
+	// Pedantically guard against writing to the real database.
+	// TODO: Remove this once testing is done.
+	if (use_test_database()) {
+		return "test.sqlite3";
+	}
+	return user_data_dir() / "histdb" / "data" / HISTDB_NAME;
+}
+
+// open_database opens (and creates) the database at filename. Unless it is
+// opened readonly or auto_migrate is false, pending migrations are applied and
+// backfilled for at most MIGRATION_BUDGET.
+static SQLite::Database open_database(std::string& filename, bool readonly = false,
+	bool auto_migrate = true) {
+
 	// TODO: set SQLITE_OPEN_EXRESCODE (if defined)
 	const int flags = readonly ?
 		SQLite::OPEN_READONLY :
 		SQLite::OPEN_READWRITE|SQLite::OPEN_CREATE;
 
+	histdb::TraceSpan span("open_database");
 	SQLite::Database db = SQLite::Database(filename, flags);
 
 	// Enable extended error codes
@@ -511,91 +746,140 @@ static SQLite::Database open_database(std::string& filename, bool readonly = fal
 	// TODO: look into using journal_mode = 'WAL' (https://sqlite.org/wal.html)
 	// since it is more performant and is supported by Unix and Windows systems.
 	// CEV: This only helps a little and does create 2 new files
-	db.setBusyTimeout(BUSY_TIMEOUT_MS);
-	db.exec(
-		"PRAGMA foreign_keys = 1;\n"
-		"PRAGMA journal_mode = 'PERSIST';\n"
-		"PRAGMA locking_mode = 'EXCLUSIVE';"
-	);
-	if (should_migrate_database(db)) {
-		db.exec(m001_create_tables_stmt);
-		db.exec(m002_create_boot_id_table);
+	histdb::trace_connection(db, BUSY_TIMEOUT_MS);
+	{
+		histdb::TraceSpan pragma_span("pragmas");
+		db.exec("PRAGMA foreign_keys = 1;");
+		// Neither can be set on a read-only connection, which uses the
+		// journal mode that the database was written with.
+		if (!readonly) {
+			// Only takes effect when the database is created (see compact.h).
+			db.exec("PRAGMA auto_vacuum = INCREMENTAL;");
+			histdb::configure_durability(db, durability());
+		}
+		histdb::register_stats_functions(db);
+		histdb::register_time_functions(db);
+	}
+	if (readonly) {
+		histdb::migrations_pending(db, migrations);
+	} else if (auto_migrate) {
+		histdb::MigrationOptions opts;
+		opts.budget = MIGRATION_BUDGET;
+		histdb::run_migrations(db, migrations, opts);
 	}
 	return db;
 }
 
-static SQLite::Database open_default_database(bool readonly = false) {
-	auto name = fs::path(histdb_database_path());
-	if (!fs::exists(name)) {
-		if (name.has_parent_path()) {
-			fs::create_directories(name.remove_filename());
-		}
-	}
-	auto sname = name.string();
-	return open_database(sname, readonly);
-}
-
-// code_us_fraction encodes microsecond fraction us into char p. The behavior
-// is undefined if us is greater than one second or if p is not large enough
-// to store the fraction and leading '.'.
-static char *code_us_fraction(int64_t us, char *p) {
-	if (us == 0) {
-		*p = '\0';
-		return p;
-	}
-	int32_t i = 6;
-	*p++ = '.';
-	while (us % 10 == 0) {
-		us /= 10;
-		i--;
-	}
-	p[i] = '\0';
-	char *end = &p[i];
-	for (;;) {
-		p[--i] = '0' + us % 10;
-		if (i == 0) {
-			break;
-		}
-		us /= 10;
-	}
-	return end;
+// histdb_snapshot_path returns the path of the snapshot of the database (see
+// snapshot.h), which is kept next to it.
+static fs::path histdb_snapshot_path() {
+	return fs::path(histdb_database_path()).replace_extension(".snapshot");
 }
 
-static std::string format_time(const std::chrono::time_point<std::chrono::system_clock> now) {
-	const auto us = std::chrono::duration_cast<std::chrono::microseconds>(
-		now - std::chrono::floor<std::chrono::seconds>(now)
-	);
+// Federation
+////////////////////////////////////////////////////////////////////////////////
 
-	const std::time_t tt = std::chrono::system_clock::to_time_t(now);
-	const std::tm tm = *std::localtime(&tt);
+// histdb_archive_dir holds restored archives of old databases ("*.sqlite3"),
+// which are read by the --all option of federated commands.
+static fs::path histdb_archive_dir() {
+	return user_data_dir() / "histdb" / "archive";
+}
 
-	char format[32] = "%Y-%m-%dT%H:%M:%S";
-	char *frac = &format[std::strlen("%Y-%m-%dT%H:%M:%S")];
+static void add_federation_options(CLI::App *app) {
+	app->add_option("--db", "also read this database (may be repeated)")
+		->multi_option_policy(CLI::MultiOptionPolicy::TakeAll);
+	app->add_flag("--all", "read the prod and test databases and all archives");
+}
 
-	// append microseconds to the format string => "%Y-%m-%dT%H:%M:%S.01234"
-	// zone is the new end of the format string
-	char *zone = code_us_fraction(us.count(), frac);
+// Filters
+////////////////////////////////////////////////////////////////////////////////
 
-	// bytes remaining in the format string after appending microseconds
-	auto bufsz = sizeof(format) - ptrdiff_t(zone - format);
+static void add_filter_options(CLI::App *app) {
+	app->add_option("--filter",
+		"only include the commands that match a filter, e.g. 'dir:~/src/* status:!=0 "
+		"after:2026-01-01 session:current cmd:git'")
+		->default_val("");
+	app->add_flag("--explain", "print the SQL and query plan of the filter and exit");
+}
 
-	// convert zone (-0400 => -04:00) and append it to the format string
-	if (std::strftime(zone, bufsz, "%z", &tm) == 5) {
-		std::memmove(&zone[4], &zone[3], 3);
-		zone[3] = ':';
+// parse_filter_option parses the --filter option of app, session:current is
+// the session of the shell.
+static histdb::Filter parse_filter_option(CLI::App *app) {
+	histdb::FilterContext ctx;
+	const auto session = safe_getenv("HISTDB_SESSION_ID");
+	if (!session.empty()) {
+		ctx.session_id = std::strtoll(std::string(session).c_str(), nullptr, 10);
 	}
+	ctx.home = std::string(safe_getenv("HOME"));
+	return histdb::parse_filter(app->get_option("--filter")->as<std::string>(), ctx);
+}
 
-	auto dest = std::string(34, '\0');
-	std::size_t n = std::strftime(&dest.at(0), dest.capacity(), format, &tm);
-	if (unlikely(n == 0)) {
-		throw std::runtime_error("error: failed to format time");
+// federated_sources returns the databases read by a command with the --db
+// and --all options: the default database followed by the other databases
+// that exist with --all and the --db databases. An empty vector is returned
+// if neither option was given.
+static std::vector<histdb::FederatedSource> federated_sources(CLI::App *app) {
+	std::vector<histdb::FederatedSource> sources;
+	const auto dbs = app->get_option("--db")->as<std::vector<std::string>>();
+	const bool all = app->get_option("--all")->as<bool>();
+	if (dbs.empty() && !all) {
+		return sources;
 	}
-	dest.resize(n);
+	std::vector<fs::path> seen;
+	auto add = [&](const std::string& name, const fs::path& path) {
+		const fs::path canonical = fs::weakly_canonical(path);
+		if (std::find(seen.begin(), seen.end(), canonical) == seen.end()) {
+			seen.push_back(canonical);
+			sources.push_back({name, path.string()});
+		}
+	};
 
-	return dest;
+	const fs::path prod = user_data_dir() / "histdb" / "data" / HISTDB_NAME;
+	const fs::path test = "test.sqlite3";
+	add(use_test_database() ? "test" : "prod", histdb_database_path());
+	if (all) {
+		for (const auto& [name, path] : {std::pair{"prod", prod}, std::pair{"test", test}}) {
+			if (fs::exists(path)) {
+				add(name, path);
+			}
+		}
+		std::vector<fs::path> archives;
+		if (fs::is_directory(histdb_archive_dir())) {
+			for (const auto& entry : fs::directory_iterator(histdb_archive_dir())) {
+				if (entry.path().extension() == ".sqlite3") {
+					archives.push_back(entry.path());
+				}
+			}
+		}
+		std::sort(archives.begin(), archives.end());
+		for (const auto& path : archives) {
+			add(path.stem().string(), path);
+		}
+	}
+	for (const auto& db : dbs) {
+		if (!fs::exists(db)) {
+			throw ArgumentException(absl::StrCat("database does not exist: ", db));
+		}
+		add(db, db);
+	}
+	return sources;
 }
 
-static std::string get_boot_time() {
+static SQLite::Database open_default_database(bool readonly = false,
+	bool auto_migrate = true) {
+
+	auto name = fs::path(histdb_database_path());
+	if (!fs::exists(name)) {
+		if (name.has_parent_path()) {
+			fs::create_directories(name.remove_filename());
+		}
+	}
+	auto sname = name.string();
+	return open_database(sname, readonly, auto_migrate);
+}
+
+// get_boot_time_us returns the boot time in microseconds since the Unix epoch.
+static int64_t get_boot_time_us() {
 	int mib[2] = { CTL_KERN, KERN_BOOTTIME };
 	struct timeval boot;
 	size_t size = sizeof(boot);
@@ -606,21 +890,34 @@ static std::string get_boot_time() {
 		));
 	}
 
-	// NB: We rely on the epoch of the system_clock being the Unix epoch,
-	// which is unspecified until C++20.
-	auto unix = std::chrono::seconds(boot.tv_sec) +
-		std::chrono::microseconds(boot.tv_usec);
-	return format_time(
-		std::chrono::time_point<std::chrono::system_clock>(unix)
-	);
+	return int64_t(boot.tv_sec) * 1000000 + boot.tv_usec;
+}
+
+static std::string get_boot_time() {
+	const histdb::TimePoint boot{std::chrono::microseconds(get_boot_time_us())};
+	return histdb::format_time(boot);
+}
+
+// bind_command_blob binds the raw_blob of cmd, NULL if it is inline.
+static void bind_command_blob(SQLite::Statement& query, int index,
+	const histdb::StoredCommand& cmd) {
+
+	if (cmd.blob_id != 0) {
+		query.bind(index, cmd.blob_id);
+	} else {
+		query.bind(index);
+	}
 }
 
-// TODO:
-//	* don't allow control chars
-//	* pass in the raw history and trim whitespace
-static void insert_history_record(SQLite::Database& db) {
-	auto ts = format_time(std::chrono::system_clock::now());
+// insert_history_record inserts the command being recorded, the indexers
+// must be those of the transaction.
+static void insert_history_record(SQLite::Database& db, histdb::TokenIndexer& tokens,
+	histdb::ClusterIndexer& clusters) {
+
+	auto now = std::chrono::system_clock::now();
+	auto ts = histdb::format_time(now);
 	auto ppid = getppid();
+	auto dir = histdb::intern_directory(db, current_wd);
 	SQLite::Statement query(db, insert_history_stmt);
 	query.bind(1, session_id);
 	query.bind(2, history_id);
@@ -629,19 +926,92 @@ static void insert_history_record(SQLite::Database& db) {
 	query.bind(4, status_code);
 	query.bind(5, ts);
 	query.bind(6, current_user);
-	query.bind(7, current_wd);
-	query.bind(8, raw_history);
+	query.bind(7, dir.path);
+	const histdb::StoredCommand cmd = histdb::store_command(db, raw_history);
+	query.bind(8, std::string(cmd.raw));
+	query.bind(9, histdb::unix_micros(now));
+	query.bind(10, dir.id);
+	bind_command_blob(query, 11, cmd);
 	query.exec();
+	const int64_t id = db.getLastInsertRowid();
+	tokens.add(id, raw_history);
+	clusters.add(id, raw_history, status_code, ts);
 }
 
+// new_session_id writes the row of a new session, its id is reserved so
+// that it does not collide with the ids handed out by the session registry.
 static int64_t new_session_id(SQLite::Database& db) {
+	const int64_t id = histdb::reserve_session_ids(db, 1);
 	SQLite::Statement query(
-		db, "INSERT INTO session_ids (ppid, boot_time) VALUES (?, ?);"
+		db, "INSERT INTO session_ids (id, ppid, boot_time) VALUES (?, ?, ?);"
 	);
-	query.bind(1, static_cast<int32_t>(getppid()));
-	query.bind(2, get_boot_time());
+	query.bind(1, id);
+	query.bind(2, static_cast<int32_t>(getppid()));
+	query.bind(3, get_boot_time());
 	query.exec();
-	return db.getLastInsertRowid();
+	return id;
+}
+
+// Session registry
+////////////////////////////////////////////////////////////////////////////////
+
+// session_registry_name returns the name of the session registry (see
+// registry.h): $HISTDB_REGISTRY or the registry of the database, or an empty
+// string if HISTDB_REGISTRY is "off".
+static std::string session_registry_name() {
+	const auto name = safe_getenv("HISTDB_REGISTRY");
+	if (name == "off") {
+		return "";
+	}
+	if (!name.empty()) {
+		return absl::StrCat(name[0] == '/' ? "" : "/", name);
+	}
+	const fs::path db = histdb_database_path();
+	return histdb::SessionRegistry::default_name(fs::weakly_canonical(db).string());
+}
+
+// open_session_registry returns nullptr if the registry is disabled or
+// cannot be opened, in which case sessions are written to the database
+// directly.
+static std::unique_ptr<histdb::SessionRegistry> open_session_registry() {
+	const auto name = session_registry_name();
+	if (name.empty()) {
+		return nullptr;
+	}
+	try {
+		return std::make_unique<histdb::SessionRegistry>(name, get_boot_time_us);
+	} catch (const std::exception& e) {
+		std::cerr << "histdb: session registry: " << e.what() << std::endl;
+		return nullptr;
+	}
+}
+
+// flush_session_registry writes the pending sessions of registry (if any)
+// in a transaction of its own.
+static void flush_session_registry(SQLite::Database& db, histdb::SessionRegistry& registry) {
+	histdb::WriteTransaction transaction(db);
+	const auto flushed = registry.write_pending(db);
+	transaction.commit();
+	registry.mark_flushed(flushed);
+}
+
+// registry_new_session hands out a session id from the registry, opening
+// the database only when a new block of ids has to be reserved (which also
+// flushes the pending sessions).
+static int64_t registry_new_session(histdb::SessionRegistry& registry) {
+	const auto ppid = static_cast<int32_t>(getppid());
+	int64_t id = registry.claim_session(ppid);
+	if (id != 0) {
+		return id;
+	}
+	SQLite::Database db = open_default_database();
+	histdb::WriteTransaction transaction(db);
+	const auto flushed = registry.write_pending(db);
+	id = histdb::reserve_session_ids(db, histdb::registry_block_size);
+	transaction.commit();
+	registry.mark_flushed(flushed);
+	registry.add_block(id, histdb::registry_block_size, ppid);
+	return id;
 }
 
 static int session_id_command(int argc, char * const argv[]) {
@@ -677,7 +1047,7 @@ static int session_id_command(int argc, char * const argv[]) {
 }
 
 static int64_t new_boot_id(SQLite::Database& db) {
-	auto ts = format_time(std::chrono::system_clock::now());
+	auto ts = histdb::format_time(std::chrono::system_clock::now());
 	SQLite::Statement query(
 		db, "INSERT INTO boot_ids (created_at) VALUES (?);"
 	);
@@ -757,32 +1127,35 @@ static int dump_history_command(int argc, char * const argv[]) {
 		SQLite::Database db = open_default_database(true);
 
 		SQLite::Statement query(
-			db, "SELECT raw FROM history;"
+			db, "SELECT " HISTDB_COMMAND_SQL " FROM history;"
 		);
 
 		// TODO: support line buffering.
 		// Using a buffer here is ~3x faster.
+		constexpr size_t buffer_size = 96 * 1024;
 		auto buf = std::string();
-		buf.reserve(96 * 1024);
-		while (query.executeStep()) {
-			auto raw = absl::NullSafeStringView(query.getColumn(0).getText());
-			if (raw.length() >= buf.capacity()) {
-				if (buf.length() > 0) {
+		buf.reserve(buffer_size);
+		histdb::RowCursor rows(query);
+		while (rows.next_batch()) {
+			for (size_t i = 0; i < rows.size(); i++) {
+				const std::string_view raw = rows.text(i, 0);
+				if (buf.size() + raw.size() + 1 > buffer_size) {
 					std::cout << buf;
 					buf.clear();
 				}
-				if (raw.length() >= 96 * 1024) {
+				if (raw.size() >= buffer_size) {
 					// Large string - write directly
-					std::cout << raw << std::endl;
+					std::cout << raw << '\n';
+				} else {
+					buf.append(raw);
+					buf.push_back('\n');
 				}
-			} else {
-				buf.append(raw);
-				buf.push_back('\n');
 			}
 		}
 		if (buf.length() > 0) {
 			std::cout << buf;
 		}
+		std::cout.flush();
 		return EXIT_SUCCESS;
 
 	} catch (const SQLite::Exception& e) {
@@ -808,7 +1181,12 @@ static int insert_command(int argc, char * const argv[]) {
 			return EXIT_SUCCESS;
 		}
 		SQLite::Database db = open_default_database();
-		insert_history_record(db);
+		// The row and the blob of a large command are written together.
+		histdb::DurableTransaction tx(db, durability());
+		histdb::TokenIndexer tokens(db);
+		histdb::ClusterIndexer clusters(db);
+		insert_history_record(db, tokens, clusters);
+		tx.commit();
 		return EXIT_SUCCESS;
 
 	} catch (const SQLite::Exception& e) {
@@ -838,18 +1216,21 @@ static int db_dump_info() {
 		auto is_prod = FORCE_USE_PROD_DATABASE || get_env_bool(HISTDB_PROD);
 		std::cout << "  prod:        " << (is_prod ? "true" : "false") << std::endl;
 		std::cout << "  database:    " << histdb_database_path() << std::endl;
+		std::cout << "  durability:  " << durability().name() << std::endl;
 		std::string last_ts;
 		std::string last_cmd;
 		int64_t rows = 0;
 		try {
 			SQLite::Statement query(
-				db, "SELECT created_at, raw FROM history order BY id DESC LIMIT 1;"
+				db, "SELECT created_at, " HISTDB_COMMAND_SQL
+					" FROM history order BY id DESC LIMIT 1;"
 			);
-			if (!query.executeStep()) {
+			histdb::RowCursor row(query, 1);
+			if (!row.next_batch()) {
 				return;
 			}
-			last_ts = query.getColumn(0).getString();
-			last_cmd = query.getColumn(1).getString();
+			last_ts = row.text(0, 0);
+			last_cmd = row.text(0, 1);
 			rows = db.execAndGet("SELECT COUNT(*) FROM history;").getInt64();
 		} catch (const std::exception& e) {
 			last_ts = "NONE";
@@ -886,9 +1267,14 @@ class RawHistoryValidator : public CLI::Validator {
     }
 };
 
-using RawHistoryTuple = std::tuple<int64_t, std::string>;
+// RawHistory is a parsed "HISTORY_ID COMMAND" argument, command points into
+// the argument and is not sanitized.
+struct RawHistory {
+	int64_t history_id;
+	std::string_view command;
+};
 
-RawHistoryTuple parse_raw_history(const std::string& raw) {
+static RawHistory parse_raw_history(const std::string& raw) {
 	char *end;
 	int64_t hist_id = std::strtoll(raw.data(), &end, 10);
 	// TODO: use [[annotations]]
@@ -901,7 +1287,7 @@ RawHistoryTuple parse_raw_history(const std::string& raw) {
 	if (!std::isspace(end[0])) {
 		throw ArgumentException(absl::StrCat("non-numeric: HISTORY_ID: ", raw));
 	}
-	return RawHistoryTuple(hist_id, trim_ascii_space(end));
+	return RawHistory{hist_id, std::string_view(end, raw.size() - (end - raw.data()))};
 }
 
 // static void insert_history_record(SQLite::Database& db) {
@@ -923,26 +1309,15 @@ RawHistoryTuple parse_raw_history(const std::string& raw) {
 static int64_t new_session_id_command(CLI::App *app) {
 	(void)app; // WARN: use app
 
-	// WARN: see if the App requests prod
-	//
-	// Pedantically guard against writing to the real database.
-	// TODO: Remove this once testing is done.
-	std::string dbname;
-	if (use_test_database()) {
-		dbname = "test.sqlite3";
+	// New shells get their id from the registry, which only touches the
+	// database once per block of ids.
+	int64_t id;
+	if (auto registry = open_session_registry()) {
+		id = registry_new_session(*registry);
 	} else {
-		dbname = user_data_dir() / "histdb" / "data" / HISTDB_NAME;
+		SQLite::Database db = open_default_database();
+		id = new_session_id(db);
 	}
-	SQLite::Database db = open_database(dbname);
-
-	SQLite::Statement query(
-		db, "INSERT INTO session_ids (ppid, boot_time) VALUES (?, ?);"
-	);
-	query.bind(1, static_cast<int32_t>(getppid()));
-	query.bind(2, get_boot_time());
-	query.exec();
-
-	int64_t id = db.getLastInsertRowid();
 	if (print_eval) {
 		std::cout << "export HISTDB_SESSION_ID=" << id << ";" << std::endl;
 	} else {
@@ -953,12 +1328,89 @@ static int64_t new_session_id_command(CLI::App *app) {
 	return EXIT_SUCCESS;
 }
 
+// is_written_record returns if rec was already written. A shell that timed
+// out waiting for the daemon writes its command itself, while the daemon may
+// still write it as well: both use the creation time set by the shell.
+static bool is_written_record(SQLite::Database& db, const histdb::IngestRecord& rec) {
+	SQLite::Statement query(db, R"""(
+SELECT 1 FROM history
+WHERE created_at_us = ? AND session_id = ? AND history_id = ?
+LIMIT 1;
+)""");
+	query.bind(1, rec.created_us);
+	query.bind(2, rec.session_id);
+	query.bind(3, rec.history_id);
+	return query.executeStep();
+}
+
+// write_history_record writes rec (and updates the rollups) unless it was
+// already written, it should be called in a transaction. The indexers and
+// rollups are those of the transaction, which its records share so that
+// their statements are prepared once.
+static void write_history_record(SQLite::Database& db, const histdb::IngestRecord& rec,
+	histdb::TokenIndexer& tokens, histdb::ClusterIndexer& clusters,
+	histdb::StatsRollups& rollups) {
+
+	const histdb::TimePoint created{std::chrono::microseconds(rec.created_us)};
+	const auto ts = histdb::format_time(created);
+	if (rec.ignored) {
+		// Only record that the command was dropped.
+		histdb::update_redaction_stats(db, ts, 0, true);
+		return;
+	}
+	if (is_written_record(db, rec)) {
+		return;
+	}
+	const histdb::Directory dir = histdb::intern_directory(db, rec.directory);
+	SQLite::Statement query(db, insert_history_stmt);
+	query.bind(1, rec.session_id);
+	query.bind(2, rec.history_id);
+	// TODO: don't need this if it's part of the session_ids table
+	query.bind(3, rec.ppid);
+	query.bind(4, rec.status_code);
+	query.bind(5, ts);
+	query.bind(6, rec.user);
+	query.bind(7, dir.path);
+	const histdb::StoredCommand cmd = histdb::store_command(db, rec.raw);
+	query.bind(8, std::string(cmd.raw));
+	query.bind(9, rec.created_us);
+	query.bind(10, dir.id);
+	bind_command_blob(query, 11, cmd);
+	query.exec();
+
+	histdb::CommandRun run;
+	run.id = db.getLastInsertRowid();
+	run.session_id = rec.session_id;
+	run.status_code = rec.status_code;
+	run.directory_id = dir.id;
+	run.created_us = rec.created_us;
+	run.raw = rec.raw;
+	histdb::learn_correction(db, run);
+	tokens.add(run.id, rec.raw);
+	clusters.add(run.id, rec.raw, rec.status_code, ts);
+
+	rollups.add(rec.session_id, rec.status_code, ts, dir.path, rec.raw);
+	histdb::update_redaction_stats(db, ts, rec.redacted, false);
+}
+
+// is_last_command returns if rec is the last command of its session, which
+// detects repeated prompts when there is no session registry.
+static bool is_last_command(SQLite::Database& db, const histdb::IngestRecord& rec) {
+	SQLite::Statement query(db, R"""(
+SELECT history_id, )""" HISTDB_COMMAND_SQL R"""(
+FROM history WHERE session_id = ? ORDER BY id DESC LIMIT 1;
+)""");
+	query.bind(1, rec.session_id);
+	return query.executeStep() && query.getColumn(0).getInt64() == rec.history_id &&
+		query.getColumn(1).getString() == rec.raw;
+}
+
 static int new_insert_command(CLI::App *app) {
 	try {
 		// Parse first to detect errors
-		auto [hist_id, raw_cmd] = parse_raw_history(
-			app->get_option("history")->as<std::string>()
-		);
+		const auto history = app->get_option("history")->as<std::string>();
+		const RawHistory parsed = parse_raw_history(history);
+		std::string raw_cmd = histdb::sanitize_command(parsed.command);
 		if (raw_cmd.length() == 0) {
 			throw ArgumentException("empty raw history command");
 		}
@@ -969,13 +1421,50 @@ static int new_insert_command(CLI::App *app) {
 		}
 		auto status_code = app->get_option("--status-code")->as<int32_t>();
 
+		// The shell runs insert at every prompt: a prompt that did not run a
+		// new command passes the same history entry again.
+		const bool dedupe = app->get_option("--dedupe")->as<bool>();
+		auto registry = open_session_registry();
+		if (registry && !registry->record_command(session_id, history) && dedupe) {
+			return EXIT_SUCCESS;
+		}
+		if (app->get_option("--mark")->as<bool>()) {
+			return EXIT_SUCCESS;
+		}
+
+		histdb::RedactResult redaction;
+		{
+			histdb::TraceSpan span("redact");
+			redaction = load_redact_matcher().apply(raw_cmd);
+		}
+
 		// WARN: remove
 		// std::cout << "session_id: " << session_id << std::endl;
 		// std::cout << "status_code: " << status_code << std::endl;
 
-		auto pwd = must_getenv("PWD");
-		auto user = must_getenv("USER");;
-		auto ppid = getppid();
+		histdb::IngestRecord rec;
+		rec.session_id = session_id;
+		rec.history_id = parsed.history_id;
+		rec.ppid = static_cast<int32_t>(getppid());
+		rec.status_code = status_code;
+		rec.created_us = histdb::unix_micros(std::chrono::system_clock::now());
+		rec.redacted = redaction.redacted;
+		rec.ignored = redaction.ignore;
+		rec.user = must_getenv("USER");
+		rec.directory = must_getenv("PWD");
+		if (!rec.ignored) {
+			rec.raw = std::move(raw_cmd);
+		}
+
+		// Hand the command to the daemon (if one is running), otherwise
+		// write it ourselves.
+		const auto socket = app->get_option("--socket")->as<std::string>();
+		if (!socket.empty()) {
+			histdb::TraceSpan span("send");
+			if (histdb::send_record(socket, rec)) {
+				return EXIT_SUCCESS;
+			}
+		}
 
 		// WARN: see if the App requests prod
 		//
@@ -988,19 +1477,29 @@ static int new_insert_command(CLI::App *app) {
 			dbname = user_data_dir() / "histdb" / "data" / HISTDB_NAME;
 		}
 		SQLite::Database db = open_database(dbname);
+		if (dedupe && !registry && !rec.ignored && is_last_command(db, rec)) {
+			return EXIT_SUCCESS;
+		}
 
-		auto ts = format_time(std::chrono::system_clock::now());
-		SQLite::Statement query(db, insert_history_stmt);
-		query.bind(1, session_id);
-		query.bind(2, hist_id);
-		// TODO: don't need this if it's part of the session_ids table
-		query.bind(3, ppid);
-		query.bind(4, status_code);
-		query.bind(5, ts);
-		query.bind(6, user);
-		query.bind(7, pwd);
-		query.bind(8, raw_cmd);
-		query.exec();
+		std::vector<int64_t> flushed;
+		histdb::DurableTransaction transaction(db, durability());
+		{
+			histdb::TraceSpan span("write");
+			// Sessions handed out by the registry are written with the next
+			// command (which may be their first).
+			if (registry) {
+				flushed = registry->write_pending(db);
+			}
+			histdb::TokenIndexer tokens(db);
+			histdb::ClusterIndexer clusters(db);
+			histdb::StatsRollups rollups(db);
+			write_history_record(db, rec, tokens, clusters, rollups);
+		}
+		histdb::TraceSpan commit_span("commit");
+		transaction.commit();
+		if (registry) {
+			registry->mark_flushed(flushed);
+		}
 
 		return EXIT_SUCCESS;
 
@@ -1019,11 +1518,787 @@ static int new_insert_command(CLI::App *app) {
 	return EXIT_FAILURE;
 }
 
+// run_command runs command and reports any exceptions it throws.
+static int run_command(const std::function<int()>& command) {
+	try {
+		return command();
+
+	} catch (const SQLite::Exception& e) {
+		int ext = e.getExtendedErrorCode();
+		if (ext >= 0) {
+			std::cerr << "sqlite: " << e.getErrorCode() << "." << ext << ": "
+				<< e.getErrorStr() << std::endl;
+		} else {
+			std::cerr << "sqlite: " << e.getErrorCode() << ": "
+				<< e.getErrorStr() << std::endl;
+		}
+	} catch (const std::exception& e) {
+		std::cerr << "error: " << e.what() << std::endl;
+	}
+	return EXIT_FAILURE;
+}
+
+// print_next_cursor tells the user how to get the next page of a session.
+static void print_next_cursor(CLI::App *app, int64_t next) {
+	if (next != 0) {
+		std::cerr << "histdb: more commands available, continue with: histdb session "
+			<< app->get_name() << " " << app->get_option("session")->as<int64_t>()
+			<< " --after=" << next << std::endl;
+	}
+}
+
+static int new_session_show_command(CLI::App *app, bool replay) {
+	return run_command([app, replay]() {
+		histdb::SessionOptions opts;
+		opts.session_id = app->get_option("session")->as<int64_t>();
+		opts.after_id = app->get_option("--after")->as<int64_t>();
+		opts.limit = app->get_option("--limit")->as<int64_t>();
+
+		SQLite::Database db = open_default_database();
+		int64_t next = replay ?
+			histdb::print_session_replay(db, opts, std::cout) :
+			histdb::print_session(db, opts, std::cout);
+		std::cout.flush();
+		print_next_cursor(app, next);
+		return EXIT_SUCCESS;
+	});
+}
+
+static int new_session_seed_command(CLI::App *app) {
+	return run_command([app]() {
+		histdb::SeedOptions opts;
+		opts.limit = app->get_option("--limit")->as<int64_t>();
+		opts.previous_session = app->get_option("--previous")->as<bool>();
+		opts.session_id = app->get_option("--session")->as<int64_t>();
+		opts.directory = app->get_option("--directory")->as<std::string>();
+		if (opts.directory.empty()) {
+			opts.directory = must_getenv("PWD");
+		}
+		opts.directory = histdb::canonical_directory(opts.directory);
+		opts.subdirectories = app->get_option("--recursive")->as<bool>();
+		const char sep = app->get_option("--null")->as<bool>() ? '\0' : '\n';
+
+		SQLite::Database db = open_default_database();
+		std::string buf;
+		for (const auto& cmd : histdb::seed_history(db, opts)) {
+			buf.append(cmd);
+			buf.push_back(sep);
+		}
+		std::cout << buf;
+		return EXIT_SUCCESS;
+	});
+}
+
+static int new_session_registry_command(CLI::App *app) {
+	return run_command([app]() {
+		const auto name = session_registry_name();
+		if (name.empty()) {
+			throw ArgumentException("the session registry is disabled (HISTDB_REGISTRY=off)");
+		}
+		const bool remove = app->get_option("--remove")->as<bool>();
+		{
+			histdb::SessionRegistry registry(name, get_boot_time_us);
+			if (remove || app->get_option("--flush")->as<bool>()) {
+				SQLite::Database db = open_default_database();
+				flush_session_registry(db, registry);
+			}
+			if (!remove) {
+				histdb::print_registry_stats(registry.stats(), std::cout);
+			}
+		}
+		if (remove) {
+			histdb::SessionRegistry::remove(name);
+		}
+		return EXIT_SUCCESS;
+	});
+}
+
+static int new_stats_command(CLI::App *app) {
+	return run_command([app]() {
+		histdb::StatsOptions opts;
+		opts.report = histdb::parse_stats_report(
+			app->get_option("--report")->as<std::string>()
+		);
+		opts.days = app->get_option("--days")->as<int>();
+		opts.limit = app->get_option("--limit")->as<int>();
+		opts.directory = app->get_option("--directory")->as<std::string>();
+		if (!opts.directory.empty()) {
+			if (!histdb::stats_report_by_directory(opts.report)) {
+				throw ArgumentException(
+					"--directory only applies to the programs and failing reports");
+			}
+			opts.directory = histdb::canonical_directory(opts.directory);
+		}
+
+		const auto filter = parse_filter_option(app);
+		const bool explain = app->get_option("--explain")->as<bool>();
+		if ((!filter.empty() || explain) && opts.report == histdb::StatsReport::Redactions) {
+			throw ArgumentException("the redactions report can't be filtered");
+		}
+
+		const auto sources = federated_sources(app);
+		if (!sources.empty()) {
+			if (app->get_option("--rebuild")->as<bool>()) {
+				throw ArgumentException("--rebuild can't be used with --db or --all");
+			}
+			if (!filter.empty() || explain) {
+				throw ArgumentException("--filter and --explain can't be used with --db or --all");
+			}
+			SQLite::Database db(":memory:",
+				SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE | SQLite::OPEN_URI);
+			histdb::attach_stats_sources(db, sources);
+			histdb::print_stats_report(db, opts, std::cout);
+			return EXIT_SUCCESS;
+		}
+
+		// NB: opened read-write since the rollup tables may need to be migrated
+		SQLite::Database db = open_default_database();
+		if (app->get_option("--rebuild")->as<bool>()) {
+			SQLite::Transaction transaction(db);
+			histdb::rebuild_stats_rollups(db);
+			transaction.commit();
+		}
+		if (explain) {
+			if (filter.empty()) {
+				std::cout << "stats reads the rollup tables without a filter\n";
+				return EXIT_SUCCESS;
+			}
+			const auto compiled = histdb::compile_filter(filter, histdb::read_filter_schema(db));
+			for (const auto& sql : histdb::filtered_stats_selects(compiled)) {
+				histdb::print_filter_plan(db, compiled, sql, std::cout);
+			}
+			return EXIT_SUCCESS;
+		}
+		if (!filter.empty()) {
+			// The rollups of the matching rows shadow the full ones.
+			histdb::filter_stats_rollups(db,
+				histdb::compile_filter(filter, histdb::read_filter_schema(db)));
+		}
+		histdb::print_stats_report(db, opts, std::cout);
+		return EXIT_SUCCESS;
+	});
+}
+
+static int new_debug_bench_command(CLI::App *app) {
+	return run_command([app]() {
+		auto filter = app->get_option("filter")->as<std::string>();
+		auto min_time = app->get_option("--min-time")->as<int>();
+		histdb::run_benchmarks(filter, std::chrono::milliseconds(min_time), std::cout);
+		return EXIT_SUCCESS;
+	});
+}
+
+static int new_export_command(CLI::App *app) {
+	return run_command([app]() {
+		histdb::ExportOptions opts;
+		opts.format = histdb::parse_export_format(
+			app->get_option("--format")->as<std::string>()
+		);
+		opts.threads = app->get_option("--threads")->as<int>();
+		opts.shard_rows = app->get_option("--shard-rows")->as<int64_t>();
+		opts.busy_timeout_ms = BUSY_TIMEOUT_MS;
+		opts.filter = parse_filter_option(app);
+
+		// Migrate the database (if necessary) and release our lock on it
+		// before the export opens its own read-only connections.
+		open_default_database();
+		auto path = histdb_database_path().string();
+		if (app->get_option("--explain")->as<bool>()) {
+			SQLite::Database db(path, SQLite::OPEN_READONLY);
+			histdb::register_time_functions(db);
+			const auto filter = histdb::compile_filter(opts.filter, histdb::read_filter_schema(db));
+			histdb::print_filter_plan(db, filter, histdb::export_select(filter), std::cout);
+			return EXIT_SUCCESS;
+		}
+
+		auto output = app->get_option("--output")->as<std::string>();
+		if (output == "-") {
+			histdb::export_history(path, opts, std::cout);
+			return EXIT_SUCCESS;
+		}
+		std::ofstream out(output, std::ios::binary | std::ios::trunc);
+		if (!out) {
+			throw ErrnoException(absl::StrCat(
+				"opening output file: ", output, ": ",
+				absl::NullSafeStringView(std::strerror(errno))
+			));
+		}
+		histdb::export_history(path, opts, out);
+		return EXIT_SUCCESS;
+	});
+}
+
+static int new_compact_command(CLI::App *app) {
+	return run_command([app]() {
+		histdb::CompactOptions opts;
+		opts.max_age_days = app->get_option("--max-age")->as<int64_t>();
+		opts.max_rows = app->get_option("--max-rows")->as<int64_t>();
+		opts.keep_last = app->get_option("--keep-last")->as<int64_t>();
+		opts.by_cluster = app->get_option("--by-cluster")->as<bool>();
+		opts.drop_typos = app->get_option("--drop-not-found")->as<bool>();
+		opts.dedupe = app->get_option("--dedupe")->as<bool>();
+		opts.chunk_rows = app->get_option("--chunk-rows")->as<int64_t>();
+		opts.pause = std::chrono::milliseconds(app->get_option("--pause")->as<int>());
+		opts.dry_run = app->get_option("--dry-run")->as<bool>();
+		opts.busy_timeout_ms = BUSY_TIMEOUT_MS;
+		opts.journal_mode = durability().journal_mode();
+
+		// Migrate the database (if necessary) and release our exclusive lock
+		// on it before compacting with a connection that does not hold one.
+		open_default_database();
+		auto stats = histdb::compact_history(histdb_database_path().string(), opts);
+		// Don't let search find the deleted commands until the snapshot is
+		// rebuilt (the next search does it).
+		if (!opts.dry_run && stats.deleted() > 0) {
+			fs::remove(histdb_snapshot_path());
+		}
+		histdb::print_compact_stats(stats, opts.dry_run, std::cout);
+		return EXIT_SUCCESS;
+	});
+}
+
+static int new_migrate_command(CLI::App *app) {
+	return run_command([app]() {
+		SQLite::Database db = open_default_database(false, false);
+		if (app->get_option("--status")->as<bool>()) {
+			histdb::print_migration_status(db, migrations, std::cout);
+			return EXIT_SUCCESS;
+		}
+		histdb::MigrationOptions opts;
+		opts.batch_rows = app->get_option("--batch-rows")->as<int64_t>();
+		opts.max_batches = app->get_option("--max-batches")->as<int64_t>();
+		opts.progress = &std::cerr;
+		if (histdb::run_migrations(db, migrations, opts)) {
+			std::cout << "database is up to date (version "
+				<< migrations.back().version << ")" << std::endl;
+		} else {
+			std::cout << "migration incomplete: run \"histdb migrate\" to resume" << std::endl;
+		}
+		return EXIT_SUCCESS;
+	});
+}
+
+// default_socket_path returns the socket of the daemon: $HISTDB_SOCKET or
+// "histdb.sock" in $XDG_RUNTIME_DIR (or the cache directory).
+static std::string default_socket_path() {
+	auto s = safe_getenv("HISTDB_SOCKET");
+	if (!s.empty()) {
+		return std::string(s);
+	}
+	s = safe_getenv("XDG_RUNTIME_DIR");
+	if (!s.empty()) {
+		return (fs::path(s) / "histdb.sock").string();
+	}
+	auto dir = user_cache_dir() / "histdb";
+	fs::create_directories(dir);
+	return (dir / "histdb.sock").string();
+}
+
+static histdb::IngestOptions parse_ingest_options(CLI::App *app) {
+	histdb::IngestOptions opts;
+	opts.queue_size = app->get_option("--queue-size")->as<size_t>();
+	opts.policy = histdb::parse_overflow_policy(app->get_option("--policy")->as<std::string>());
+	opts.batch_rows = app->get_option("--batch-rows")->as<size_t>();
+	opts.max_connections = app->get_option("--max-connections")->as<size_t>();
+	return opts;
+}
+
+// write_history_batch writes the records received by the daemon in a single
+// transaction, along with the pending sessions of the registry.
+static void write_history_batch(SQLite::Database& db,
+	const std::vector<histdb::IngestRecord>& batch, histdb::SessionRegistry *registry) {
+
+	histdb::DurableTransaction transaction(db, durability(),
+		static_cast<int64_t>(batch.size()));
+	std::vector<int64_t> flushed;
+	if (registry) {
+		flushed = registry->write_pending(db);
+	}
+	// The indexers cache the ids written by the transaction, so they don't
+	// outlive it (a failed batch is rolled back and retried).
+	histdb::TokenIndexer tokens(db);
+	histdb::ClusterIndexer clusters(db);
+	histdb::StatsRollups rollups(db);
+	for (const auto& rec : batch) {
+		write_history_record(db, rec, tokens, clusters, rollups);
+	}
+	transaction.commit();
+	if (registry) {
+		registry->mark_flushed(flushed);
+	}
+}
+
+// open_daemon_database opens a connection of the ingest daemon.
+static SQLite::Database open_daemon_database() {
+	SQLite::Database db = open_default_database();
+	// Only hold the write lock while writing a batch so that other
+	// commands can use the database. The locks taken in the exclusive
+	// mode of the strict tier are only released by the next access.
+	db.exec("PRAGMA locking_mode = 'NORMAL';");
+	db.exec("SELECT count(*) FROM sqlite_master;");
+	return db;
+}
+
+static int new_daemon_command(CLI::App *app) {
+	return run_command([app]() {
+		histdb::IngestOptions opts = parse_ingest_options(app);
+		opts.socket_path = app->get_option("--socket")->as<std::string>();
+		if (opts.socket_path.empty()) {
+			opts.socket_path = default_socket_path();
+		}
+
+		SQLite::Database db = open_daemon_database();
+		// Keep the snapshot fresh while commands are coming in. It is
+		// refreshed on its own thread and connection so that the clients
+		// waiting for their acknowledgment don't wait for the rewrite.
+		const std::chrono::seconds snapshot_interval(
+			app->get_option("--snapshot-interval")->as<int64_t>());
+		const auto snapshot_path = histdb_snapshot_path().string();
+		std::atomic<bool> written{false};
+		std::mutex snapshot_mutex;
+		std::condition_variable snapshot_cond;
+		bool stopping = false;
+		std::thread snapshotter;
+		if (snapshot_interval.count() > 0) {
+			snapshotter = std::thread([&, snapshot_db = open_daemon_database()]() mutable {
+				const auto refresh = [&]() {
+					if (!written.exchange(false)) {
+						return;
+					}
+					try {
+						histdb::refresh_snapshot(snapshot_db, snapshot_path);
+					} catch (const std::exception& e) {
+						std::cerr << "histdb: daemon: snapshot: " << e.what() << std::endl;
+					}
+				};
+				std::unique_lock<std::mutex> lock(snapshot_mutex);
+				while (!snapshot_cond.wait_for(lock, snapshot_interval, [&]() { return stopping; })) {
+					lock.unlock();
+					refresh();
+					lock.lock();
+				}
+				lock.unlock();
+				// Include the last batches before the daemon exits.
+				refresh();
+			});
+		}
+		const auto registry = open_session_registry();
+		histdb::IngestServer server(opts, [&](const auto& batch) {
+			write_history_batch(db, batch, registry.get());
+			written.store(true);
+		});
+		server.listen();
+		histdb::install_ingest_signal_handlers();
+		std::cerr << "histdb: daemon: listening on " << opts.socket_path << std::endl;
+		server.serve();
+		if (snapshotter.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock(snapshot_mutex);
+				stopping = true;
+			}
+			snapshot_cond.notify_one();
+			snapshotter.join();
+		}
+		std::cerr << "histdb: daemon: stopped" << std::endl;
+		histdb::print_ingest_metrics(server.metrics(), std::cerr);
+		return EXIT_SUCCESS;
+	});
+}
+
+static int new_debug_stress_ingest_command(CLI::App *app) {
+	return run_command([app]() {
+		histdb::IngestStressOptions opts;
+		opts.ingest = parse_ingest_options(app);
+		opts.shells = app->get_option("--shells")->as<int>();
+		opts.records = app->get_option("--records")->as<int>();
+
+		// Write to a scratch database (with the schema of the real one).
+		const fs::path dir = fs::temp_directory_path() /
+			absl::StrCat("histdb-stress-", getpid());
+		fs::create_directories(dir);
+		opts.ingest.socket_path = (dir / "histdb.sock").string();
+		int64_t lost = 0;
+		{
+			std::string dbname = (dir / "stress.sqlite3").string();
+			SQLite::Database db = open_database(dbname);
+			// The simulated shells use sessions 1 to opts.shells.
+			for (int i = 0; i < opts.shells; i++) {
+				new_session_id(db);
+			}
+			lost = histdb::run_ingest_stress(opts, [&db](const auto& batch) {
+				write_history_batch(db, batch, nullptr);
+			}, std::cout);
+		}
+		fs::remove_all(dir);
+		return lost == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	});
+}
+
+// write_torture_record writes a command of a torture writer along with its
+// session (the first commands of a writer may have failed).
+static void write_torture_record(SQLite::Database& db, const histdb::IngestRecord& rec) {
+	SQLite::Statement session(db,
+		"INSERT OR IGNORE INTO session_ids (id, ppid, boot_time) VALUES (?, ?, '');");
+	session.bind(1, rec.session_id);
+	session.bind(2, rec.ppid);
+	session.exec();
+	histdb::TokenIndexer tokens(db);
+	histdb::ClusterIndexer clusters(db);
+	histdb::StatsRollups rollups(db);
+	write_history_record(db, rec, tokens, clusters, rollups);
+}
+
+static int new_debug_torture_command(CLI::App *app) {
+	return run_command([app]() {
+		histdb::TortureOptions opts;
+		opts.writers = app->get_option("--writers")->as<int>();
+		opts.readers = app->get_option("--readers")->as<int>();
+		opts.duration = std::chrono::milliseconds(app->get_option("--duration")->as<int64_t>());
+		opts.kill_interval = std::chrono::milliseconds(
+			app->get_option("--kill-interval")->as<int64_t>());
+		opts.hold = std::chrono::microseconds(app->get_option("--hold")->as<int64_t>());
+		opts.seed = app->get_option("--seed")->as<uint64_t>();
+		opts.busy_timeout_ms = BUSY_TIMEOUT_MS;
+		auto specs = app->get_option("--config")->as<std::vector<std::string>>();
+		if (specs.empty()) {
+			specs = {"strict", "grouped", "relaxed"};
+		}
+		std::vector<histdb::TortureConfig> configs;
+		for (const auto& spec : specs) {
+			configs.push_back(histdb::parse_torture_config(spec));
+		}
+
+		histdb::TortureHooks hooks;
+		hooks.setup = [](const std::string& path) {
+			std::string name = path;
+			open_database(name);
+		};
+		hooks.prepare = [](SQLite::Database& db) {
+			db.exec("PRAGMA foreign_keys = 1;");
+			histdb::register_stats_functions(db);
+			histdb::register_time_functions(db);
+		};
+		hooks.write = write_torture_record;
+
+		// Each configuration gets a scratch database (with the schema of the
+		// real one).
+		const fs::path dir = fs::temp_directory_path() /
+			absl::StrCat("histdb-torture-", getpid());
+		fs::create_directories(dir);
+		bool ok = true;
+		try {
+			for (const auto& config : configs) {
+				std::string name = config.name();
+				std::replace(name.begin(), name.end(), ':', '-');
+				const std::string path = (dir / absl::StrCat("torture-", name, ".sqlite3")).string();
+				const auto r = histdb::run_torture(opts, config, path, hooks);
+				histdb::print_torture_result(opts, r, std::cout);
+				ok = ok && r.ok();
+			}
+		} catch (...) {
+			fs::remove_all(dir);
+			throw;
+		}
+		fs::remove_all(dir);
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	});
+}
+
+static int new_snapshot_command(CLI::App *app) {
+	return run_command([app]() {
+		SQLite::Database db = open_default_database();
+		auto stats = histdb::refresh_snapshot(db, histdb_snapshot_path().string(),
+			app->get_option("--full")->as<bool>());
+		histdb::print_snapshot_stats(stats, std::cout);
+		return EXIT_SUCCESS;
+	});
+}
+
+// federated_search prints the (at most limit) distinct commands of sources
+// that match q, the most recently used first.
+static int federated_search(const std::vector<histdb::FederatedSource>& sources,
+	const histdb::FederatedQuery& q, size_t limit, bool long_format, char sep) {
+
+	std::unordered_set<std::string> seen;
+	std::ostringstream out;
+	histdb::federated_scan(sources, q, [&](const histdb::FederatedRow& row) {
+		if (!seen.emplace(row.raw).second) {
+			return true;
+		}
+		if (long_format) {
+			const histdb::TimePoint created{std::chrono::microseconds(row.created_us)};
+			out << sources[row.source].name << "  " << histdb::format_time(created) << "  ";
+		}
+		out << row.raw << sep;
+		return seen.size() < limit;
+	});
+	std::cout << out.str();
+	return EXIT_SUCCESS;
+}
+
+// explain_federated prints the plan of the scan of each source by q.
+static int explain_federated(const std::vector<histdb::FederatedSource>& sources,
+	const histdb::FederatedQuery& q) {
+
+	for (const auto& source : sources) {
+		SQLite::Database db(source.path, SQLite::OPEN_READONLY);
+		histdb::register_time_functions(db);
+		histdb::CompiledFilter filter;
+		const auto sql = histdb::federated_select(db, q, filter);
+		if (sources.size() > 1) {
+			std::cout << "source: " << source.name << "\n";
+		}
+		histdb::print_filter_plan(db, filter, sql, std::cout);
+	}
+	return EXIT_SUCCESS;
+}
+
+static int new_search_command(CLI::App *app) {
+	return run_command([app]() {
+		const auto query = app->get_option("query")->as<std::string>();
+		const auto limit = app->get_option("--limit")->as<size_t>();
+		const char sep = app->get_option("--null")->as<bool>() ? '\0' : '\n';
+		const bool long_format = app->get_option("--long")->as<bool>();
+		const bool explain = app->get_option("--explain")->as<bool>();
+		const auto filter = parse_filter_option(app);
+
+		auto sources = federated_sources(app);
+		if (sources.empty() && !filter.empty()) {
+			// The snapshot only has the commands, read the database instead.
+			open_default_database();
+			sources.push_back({"default", histdb_database_path().string()});
+		}
+		if (!sources.empty()) {
+			histdb::FederatedQuery q;
+			q.contains = query;
+			q.filter = filter;
+			if (explain) {
+				return explain_federated(sources, q);
+			}
+			return federated_search(sources, q, limit, long_format, sep);
+		}
+		if (explain) {
+			std::cout << "search reads the snapshot without a filter\n";
+			return EXIT_SUCCESS;
+		}
+
+		// Build the snapshot the first time, after that it is only read.
+		const auto path = histdb_snapshot_path().string();
+		if (!fs::exists(path)) {
+			SQLite::Database db = open_default_database();
+			histdb::refresh_snapshot(db, path);
+		}
+		histdb::Snapshot snapshot(path);
+		std::ostringstream out;
+		for (size_t i : snapshot.search(query, limit)) {
+			if (long_format) {
+				const auto& e = snapshot.entry(i);
+				const histdb::TimePoint last_used{std::chrono::microseconds(e.last_used_us)};
+				out << std::setw(6) << e.count << "  " << histdb::format_time(last_used) << "  ";
+			}
+			out << snapshot.text(i) << sep;
+		}
+		std::cout << out.str();
+		return EXIT_SUCCESS;
+	});
+}
+
+static int new_tail_command(CLI::App *app) {
+	return run_command([app]() {
+		histdb::TailOptions opts;
+		opts.format = histdb::parse_tail_format(app->get_option("--format")->as<std::string>());
+		opts.separator = app->get_option("--null")->as<bool>() ? '\0' : '\n';
+		opts.lines = app->get_option("--lines")->as<int64_t>();
+		opts.follow = app->get_option("--follow")->as<bool>();
+		opts.poll_interval = std::chrono::seconds(app->get_option("--interval")->as<int64_t>());
+		opts.busy_timeout_ms = BUSY_TIMEOUT_MS;
+
+		// Migrate the database (if necessary) and release our exclusive lock
+		// on it, the tail only reads and must not block the shells.
+		open_default_database();
+		histdb::tail_history(histdb_database_path().string(), opts, std::cout);
+		return EXIT_SUCCESS;
+	});
+}
+
+static int new_dump_command(CLI::App *app) {
+	return run_command([app]() {
+		const char sep = app->get_option("--null")->as<bool>() ? '\0' : '\n';
+		auto sources = federated_sources(app);
+		histdb::FederatedQuery q;
+		q.order = histdb::ScanOrder::Oldest;
+		q.filter = parse_filter_option(app);
+		if (sources.empty()) {
+			if (!q.filter.empty()) {
+				// Filters may need indexes added by the migrations.
+				open_default_database();
+			}
+			sources.push_back({"default", histdb_database_path().string()});
+		}
+		if (app->get_option("--explain")->as<bool>()) {
+			return explain_federated(sources, q);
+		}
+
+		// Buffer the output, see dump_history_command.
+		constexpr size_t buffer_size = 96 * 1024;
+		std::string buf;
+		buf.reserve(buffer_size);
+		histdb::federated_scan(sources, q, [&](const histdb::FederatedRow& row) {
+			if (buf.size() + row.raw.size() + 1 > buffer_size) {
+				std::cout << buf;
+				buf.clear();
+			}
+			buf.append(row.raw);
+			buf.push_back(sep);
+			return true;
+		});
+		std::cout << buf;
+		std::cout.flush();
+		return EXIT_SUCCESS;
+	});
+}
+
+static int new_fix_command(CLI::App *app) {
+	return run_command([app]() {
+		const auto limit = app->get_option("--limit")->as<int64_t>();
+		SQLite::Database db = open_default_database();
+		if (app->get_option("--list")->as<bool>()) {
+			// All of them unless a limit was given.
+			const bool limited = app->get_option("--limit")->count() > 0;
+			histdb::print_corrections(db, limited ? limit : 0, std::cout);
+			return EXIT_SUCCESS;
+		}
+
+		auto failed = app->get_option("command")->as<std::string>();
+		if (failed.empty()) {
+			const auto fix_session = app->get_option("--session")->as<int64_t>();
+			if (fix_session <= 0) {
+				throw ArgumentException("a command or --session is required");
+			}
+			if (!histdb::last_failed_command(db, fix_session, failed)) {
+				return EXIT_FAILURE; // nothing to fix
+			}
+		}
+		const auto fixes = histdb::suggest_corrections(db, failed, limit);
+		for (const auto& c : fixes) {
+			std::cout << c.fixed << "\n";
+		}
+		return fixes.empty() ? EXIT_FAILURE : EXIT_SUCCESS;
+	});
+}
+
+static int new_debug_profile_command(CLI::App *app) {
+	return run_command([app]() {
+		auto file = app->get_option("file")->as<std::string>();
+		if (file.empty()) {
+			file = metrics_file;
+		}
+		if (file.empty()) {
+			throw ArgumentException("no metrics file: pass FILE or set HISTDB_METRICS_FILE");
+		}
+		histdb::print_profile(file, std::cout);
+		return EXIT_SUCCESS;
+	});
+}
+
+// command_name returns the names of the subcommands that were run
+// ("session show").
+static std::string command_name(const CLI::App& app) {
+	std::string name;
+	for (const CLI::App *parent = &app; parent; ) {
+		const CLI::App *next = nullptr;
+		for (const auto *sub : parent->get_subcommands(nullptr)) {
+			if (parent->got_subcommand(sub)) {
+				absl::StrAppend(&name, name.empty() ? "" : " ", sub->get_name());
+				next = sub;
+				break;
+			}
+		}
+		parent = next;
+	}
+	return name;
+}
+
+// parse_unix_time parses a Unix timestamp with an optional fraction of up
+// to 6 digits ("1646388367.25").
+static histdb::TimePoint parse_unix_time(const std::string& s) {
+	char *end;
+	auto sec = std::strtoll(s.c_str(), &end, 10);
+	int64_t us = 0;
+	if (*end == '.') {
+		int ndigits = 0;
+		for (end++; std::isdigit(static_cast<unsigned char>(*end)) && ndigits < 6; end++, ndigits++) {
+			us = us * 10 + (*end - '0');
+		}
+		for (; ndigits < 6; ndigits++) {
+			us *= 10;
+		}
+	}
+	if (end == s.c_str() || *end != '\0' || sec < 0) {
+		throw ArgumentException(absl::StrCat("invalid timestamp: ", s));
+	}
+	return histdb::TimePoint(std::chrono::seconds(sec) + std::chrono::microseconds(us));
+}
+
+static int new_debug_format_time_command(CLI::App *app) {
+	return run_command([app]() {
+		auto timestamps = app->get_option("timestamps")->as<std::vector<std::string>>();
+		bool use_libc = app->get_option("--libc")->as<bool>();
+		histdb::TimeFormatter formatter;
+		for (const auto& ts : timestamps) {
+			auto t = parse_unix_time(ts);
+			std::cout << (use_libc ? histdb::format_time_libc(t) : formatter.format(t)) << "\n";
+		}
+		return EXIT_SUCCESS;
+	});
+}
+
+static int new_debug_tokens_command(CLI::App *app) {
+	return run_command([app]() {
+		const auto command = app->get_option("command")->as<std::string>();
+		for (const auto& token : histdb::command_tokens(command)) {
+			std::cout << histdb::token_kind_name(token.kind) << ":" << token.text << "\n";
+		}
+		return EXIT_SUCCESS;
+	});
+}
+
+static int new_debug_clusters_command(CLI::App *app) {
+	return run_command([app]() {
+		const auto commands = app->get_option("command")->as<std::vector<std::string>>();
+		const auto first = histdb::command_signature(histdb::normalize_command(commands.at(0)));
+		for (const auto& command : commands) {
+			const auto normalized = histdb::normalize_command(command);
+			const double similarity = histdb::signature_similarity(first,
+				histdb::command_signature(normalized));
+			std::cout << std::fixed << std::setprecision(2) << similarity << "  "
+				<< normalized << "\n";
+		}
+		return EXIT_SUCCESS;
+	});
+}
+
+static int new_debug_sanitize_check_command(CLI::App *app) {
+	return run_command([app]() {
+		histdb::SanitizeCheckOptions opts;
+		opts.max_length = app->get_option("--max-length")->as<size_t>();
+		opts.random = app->get_option("--random")->as<int64_t>();
+		opts.seed = app->get_option("--seed")->as<uint64_t>();
+		const int64_t mismatches = histdb::run_sanitize_check(opts, std::cout);
+		return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	});
+}
+
 int root_command(int argc, char * const argv[]) {
+	// Parsing the command line is timed before tracing can be enabled.
+	const auto cli_start = histdb::TraceClock::now();
+
 	// App
 
 	CLI::App app("histdb");
-	app.add_option("-d,--debug", verbose, "print debug output (not supported)");
+	app.add_flag("-d,--debug", verbose, "print timing spans and SQLite statistics to stderr");
+	app.add_option("--metrics-file", metrics_file, "append timing metrics to this file")
+		->envname("HISTDB_METRICS_FILE");
 
 	// TODO: do we need this if we have the envname() option?
 	use_prod_database = get_env_bool(HISTDB_PROD);
@@ -1041,6 +2316,38 @@ int root_command(int argc, char * const argv[]) {
 	CLI::App *session = app.add_subcommand("session", "return a new session id");
 	session->add_flag("-e,--eval", print_eval,
 		"print the session id as a statment that can be evaluated by bash");
+	CLI::App *session_show = session->add_subcommand("show",
+		"print the commands of a session in order");
+	CLI::App *session_replay = session->add_subcommand("replay",
+		"print a session as a bash script");
+	for (auto *subc : {session_show, session_replay}) {
+		subc->add_option("session", "session id")
+			->required()
+			->check(CLI::PositiveNumber);
+		subc->add_option("--after", "start after the history row with this id (cursor)")
+			->default_val(0)
+			->check(CLI::NonNegativeNumber);
+		subc->add_option("-n,--limit", "maximum number of commands to print (0 for all)")
+			->default_val(0)
+			->check(CLI::NonNegativeNumber);
+	}
+	CLI::App *session_seed = session->add_subcommand("seed",
+		"print recent commands to seed the history of a new shell");
+	session_seed->add_option("-n,--limit", "number of commands")
+		->default_val(100)
+		->check(CLI::NonNegativeNumber);
+	session_seed->add_option("--directory", "seed from commands run in this directory (default: $PWD)")
+		->default_val("");
+	session_seed->add_flag("-r,--recursive", "also seed from commands run in subdirectories");
+	session_seed->add_flag("--previous", "seed from the previous session instead of the directory");
+	session_seed->add_option("--session", "current session id (excluded by --previous)")
+		->default_val(0)
+		->envname("HISTDB_SESSION_ID");
+	session_seed->add_flag("-0,--null", "terminate commands with NUL instead of newline");
+	CLI::App *session_registry = session->add_subcommand("registry",
+		"print the state of the session registry");
+	session_registry->add_flag("--flush", "write the pending sessions to the database");
+	session_registry->add_flag("--remove", "write the pending sessions and remove the registry");
 
 	// Info
 	app.add_subcommand("info", "print information about the histdb database");
@@ -1056,12 +2363,232 @@ int root_command(int argc, char * const argv[]) {
 	// Positional "history" argument
 	// TODO: validate that it matches `^\d+\s+\w+`
 	insert->add_option("history", "raw history")->required();
+	insert->add_option("--socket", "send the command to the daemon listening on this socket")
+		->default_val("")
+		->envname("HISTDB_SOCKET");
+	insert->add_flag("--dedupe", "skip the command if it is the last one of the session");
+	insert->add_flag("--mark", "only record the command as the last one of the session (it is not inserted)");
 
 	// Boot-id
 	CLI::App *boot_id = app.add_subcommand("boot-id", "generate a new boot-id");
 	boot_id->add_flag("-e,--eval", print_eval,
 		"print the boot id as a statment that can be evaluated by bash");
 
+	// Stats
+	CLI::App *stats = app.add_subcommand("stats", "print command statistics");
+	stats->add_option("-r,--report",
+		"report to print: programs, failing, hourly, sessions, redactions or clusters")
+		->default_val("programs")
+		->check(CLI::IsMember({"programs", "failing", "hourly", "sessions", "redactions",
+			"clusters"}));
+	stats->add_option("--days", "only include the last N days (0 for all)")
+		->default_val(7)
+		->check(CLI::NonNegativeNumber);
+	stats->add_option("-n,--limit", "maximum number of rows to print")
+		->default_val(20)
+		->check(CLI::PositiveNumber);
+	stats->add_option("--directory", "only include commands run in this directory")
+		->default_val("");
+	stats->add_flag("--rebuild", "rebuild the rollup tables from the history table");
+	add_federation_options(stats);
+	add_filter_options(stats);
+
+	// Export
+	CLI::App *export_cmd = app.add_subcommand("export", "export the history table");
+	export_cmd->add_option("-f,--format", "output format: csv, arrow-ipc or parquet")
+		->default_val("csv")
+		->check(CLI::IsMember({"csv", "arrow-ipc", "parquet"}));
+	export_cmd->add_option("-o,--output", "output file (default: stdout)")
+		->default_val("-");
+	export_cmd->add_option("-j,--threads", "number of threads (0 for one per core)")
+		->default_val(0)
+		->check(CLI::NonNegativeNumber);
+	export_cmd->add_option("--shard-rows", "number of history ids read per shard")
+		->default_val(64 * 1024)
+		->check(CLI::PositiveNumber);
+	add_filter_options(export_cmd);
+
+	// Compact
+	CLI::App *compact = app.add_subcommand("compact",
+		"delete old, failed and duplicate commands and shrink the database");
+	compact->add_option("--max-age", "delete commands older than N days (0 for no limit)")
+		->default_val(0)
+		->check(CLI::NonNegativeNumber);
+	compact->add_option("--max-rows", "keep only the newest N commands (0 for no limit)")
+		->default_val(0)
+		->check(CLI::NonNegativeNumber);
+	compact->add_option("--keep-last", "keep only the last K runs of each command (0 for all)")
+		->default_val(0)
+		->check(CLI::NonNegativeNumber);
+	compact->add_flag("--by-cluster",
+		"with --keep-last, keep the last K runs of each cluster of near-duplicate commands");
+	compact->add_flag("--drop-not-found", "delete commands that were not found (exit status 127)");
+	compact->add_flag("--dedupe", "delete consecutive repeats of a command in a session");
+	compact->add_option("--chunk-rows", "maximum number of rows deleted per transaction")
+		->default_val(1000)
+		->check(CLI::PositiveNumber);
+	compact->add_option("--pause", "pause between transactions (ms)")
+		->default_val(5)
+		->check(CLI::NonNegativeNumber);
+	compact->add_flag("-n,--dry-run", "only print the number of commands that would be deleted");
+
+	// Migrate
+	CLI::App *migrate = app.add_subcommand("migrate",
+		"apply pending schema migrations and backfills");
+	migrate->add_option("--batch-rows", "number of rows backfilled per transaction")
+		->default_val(20000)
+		->check(CLI::PositiveNumber);
+	migrate->add_option("--max-batches", "stop after N batches (0 for no limit)")
+		->default_val(0)
+		->check(CLI::NonNegativeNumber);
+	migrate->add_flag("--status", "print the state of every migration");
+
+	// Snapshot
+	CLI::App *snapshot = app.add_subcommand("snapshot",
+		"update the read-only snapshot used by search");
+	snapshot->add_flag("--full", "rebuild the snapshot from all history rows");
+
+	// Search
+	CLI::App *search = app.add_subcommand("search",
+		"print the most frecent commands that contain a string");
+	search->add_option("query", "string to search for")->required();
+	search->add_option("-n,--limit", "maximum number of commands")
+		->default_val(20)
+		->check(CLI::PositiveNumber);
+	search->add_flag("-l,--long", "also print the number of runs and the last run");
+	search->add_flag("-0,--null", "terminate commands with NUL instead of newline");
+	add_federation_options(search);
+	add_filter_options(search);
+
+	// Dump
+	CLI::App *dump = app.add_subcommand("dump",
+		"print every command, oldest first");
+	dump->add_flag("-0,--null", "terminate commands with NUL instead of newline");
+	add_federation_options(dump);
+	add_filter_options(dump);
+
+	// Tail
+	CLI::App *tail = app.add_subcommand("tail",
+		"print the last commands and, with --follow, new commands as they are recorded");
+	tail->add_option("-n,--lines", "number of commands to print before following")
+		->default_val(10)
+		->check(CLI::NonNegativeNumber);
+	tail->add_flag("-f,--follow", "print new commands as they are recorded by any shell");
+	tail->add_option("--format", "output format: text, csv or arrow-ipc")
+		->default_val("text")
+		->check(CLI::IsMember({"text", "csv", "arrow-ipc"}));
+	tail->add_flag("-0,--null", "terminate commands with NUL instead of newline (text)");
+	tail->add_option("--interval", "seconds after which to look for new commands even if the database was not written to")
+		->default_val(30)
+		->check(CLI::PositiveNumber);
+
+	// Fix
+	CLI::App *fix = app.add_subcommand("fix",
+		"print the learned correction of the last failed command");
+	fix->add_option("command", "failed command to correct (default: the last command of the session)")
+		->default_val("");
+	fix->add_option("--session", "session id")
+		->default_val(0)
+		->envname("HISTDB_SESSION_ID");
+	fix->add_option("-n,--limit", "maximum number of corrections")
+		->default_val(1)
+		->check(CLI::PositiveNumber);
+	fix->add_flag("-l,--list", "list the most frequent corrections");
+
+	// Daemon
+	CLI::App *daemon = app.add_subcommand("daemon",
+		"receive commands from shells on a unix socket and write them in batches");
+	daemon->add_option("--socket", "socket path (default: $XDG_RUNTIME_DIR/histdb.sock)")
+		->default_val("")
+		->envname("HISTDB_SOCKET");
+	daemon->add_option("--snapshot-interval", "update the snapshot at most every N seconds (0 to disable)")
+		->default_val(60)
+		->check(CLI::NonNegativeNumber);
+
+	// Debug
+	CLI::App *debug = app.add_subcommand("debug", "debugging and benchmarking tools");
+	debug->require_subcommand();
+	CLI::App *debug_bench = debug->add_subcommand("bench", "run micro benchmarks");
+	debug_bench->add_option("filter", "only run benchmarks whose name contains filter")
+		->default_val("");
+	debug_bench->add_option("--min-time", "minimum run time of each benchmark (ms)")
+		->default_val(200)
+		->check(CLI::PositiveNumber);
+	CLI::App *debug_format_time = debug->add_subcommand("format-time",
+		"format Unix timestamps as RFC 3339 in the local time zone");
+	debug_format_time->add_option("timestamps", "Unix timestamps (SECONDS[.FRACTION])")
+		->required()
+		->expected(-1);
+	debug_format_time->add_flag("--libc", "format using localtime/strftime");
+	CLI::App *debug_tokens = debug->add_subcommand("tokens",
+		"print the tokens of a command that the token index records");
+	debug_tokens->add_option("command", "shell command")->required();
+	CLI::App *debug_clusters = debug->add_subcommand("clusters",
+		"print the normalized commands and their similarity to the first one");
+	debug_clusters->add_option("command", "shell commands")
+		->required()
+		->expected(-1);
+	CLI::App *debug_sanitize_check = debug->add_subcommand("sanitize-check",
+		"compare the vector kernels of command sanitizing to the scalar path");
+	debug_sanitize_check->add_option("--max-length",
+		"longest command with a special byte at every position")
+		->default_val(100)
+		->check(CLI::NonNegativeNumber);
+	debug_sanitize_check->add_option("--random", "number of random commands")
+		->default_val(100000)
+		->check(CLI::NonNegativeNumber);
+	debug_sanitize_check->add_option("--seed", "seed of the random commands")
+		->default_val(1);
+	CLI::App *debug_stress_ingest = debug->add_subcommand("stress-ingest",
+		"simulate many shells sending commands to a daemon");
+	debug_stress_ingest->add_option("--shells", "number of simulated shells")
+		->default_val(200)
+		->check(CLI::PositiveNumber);
+	debug_stress_ingest->add_option("--records", "commands sent by each shell")
+		->default_val(50)
+		->check(CLI::PositiveNumber);
+	for (auto *subc : {daemon, debug_stress_ingest}) {
+		subc->add_option("--queue-size", "capacity of the queue (a power of two)")
+			->default_val(4096)
+			->check(CLI::PositiveNumber);
+		subc->add_option("--policy", "what to do when the queue is full: block or drop-oldest")
+			->default_val("block")
+			->check(CLI::IsMember({"block", "drop-oldest"}));
+		subc->add_option("--batch-rows", "maximum number of commands written per transaction")
+			->default_val(256)
+			->check(CLI::PositiveNumber);
+		subc->add_option("--max-connections", "maximum number of concurrent connections")
+			->default_val(1024)
+			->check(CLI::PositiveNumber);
+	}
+	CLI::App *debug_torture = debug->add_subcommand("torture",
+		"kill concurrent inserters and readers at random and check the database");
+	debug_torture->add_option("--config",
+		"durability tier (strict, grouped[:MS[:RECORDS]] or relaxed) or journal and "
+		"locking mode (JOURNAL:LOCKING) to test (may be repeated, default: every tier)")
+		->multi_option_policy(CLI::MultiOptionPolicy::TakeAll);
+	debug_torture->add_option("--writers", "number of inserting processes")
+		->default_val(200)
+		->check(CLI::PositiveNumber);
+	debug_torture->add_option("--readers", "number of reading processes")
+		->default_val(50)
+		->check(CLI::NonNegativeNumber);
+	debug_torture->add_option("--duration", "run time of each configuration (ms)")
+		->default_val(5000)
+		->check(CLI::PositiveNumber);
+	debug_torture->add_option("--kill-interval", "time between two kills (ms, 0 disables them)")
+		->default_val(10)
+		->check(CLI::NonNegativeNumber);
+	debug_torture->add_option("--hold", "time writers hold their transaction open (us)")
+		->default_val(200)
+		->check(CLI::NonNegativeNumber);
+	debug_torture->add_option("--seed", "seed of the choice of processes to kill")
+		->default_val(1);
+	CLI::App *debug_profile = debug->add_subcommand("profile",
+		"print percentiles of the metrics appended to the metrics file");
+	debug_profile->add_option("file", "metrics file (default: $HISTDB_METRICS_FILE)")
+		->default_val("");
+
 	// TODO: add "boot-id"
 
 	// Propagate common root flags to child commands
@@ -1070,6 +2597,8 @@ int root_command(int argc, char * const argv[]) {
 			->envname(std::string(HISTDB_PROD));
 		subc->add_flag_function("--development", force_dev_callback,
 			"force use of development/test database");
+		subc->add_flag("-d,--debug", verbose,
+			"print timing spans and SQLite statistics to stderr");
 	}
 
 	// TODO: use a callback to run subcommands
@@ -1081,22 +2610,102 @@ int root_command(int argc, char * const argv[]) {
 
 	// std::cout << "num subcommands: " << std::to_string(app.get_subcommands(nullptr).size()) << std::endl;
 	CLI11_PARSE(app, argc, argv);
+	const auto cli_end = histdb::TraceClock::now();
+
+	auto run_subcommand = [&]() -> int {
+		if (app.got_subcommand("insert")) {
+			// TODO: run insert logic
+			// std::cout << "subcommand: insert" << std::endl;
+			return new_insert_command(insert);
+		} else if (app.got_subcommand("session")) {
+			if (session->got_subcommand("show")) {
+				return new_session_show_command(session_show, false);
+			}
+			if (session->got_subcommand("replay")) {
+				return new_session_show_command(session_replay, true);
+			}
+			if (session->got_subcommand("seed")) {
+				return new_session_seed_command(session_seed);
+			}
+			if (session->got_subcommand("registry")) {
+				return new_session_registry_command(session_registry);
+			}
+			return new_session_id_command(session);
+		} else if (app.got_subcommand("boot-id")) {
+			return new_boot_id_command(boot_id);
+		} else if (app.got_subcommand("info")) {
+			return run_command(db_dump_info);
+		} else if (app.got_subcommand("stats")) {
+			return new_stats_command(stats);
+		} else if (app.got_subcommand("export")) {
+			return new_export_command(export_cmd);
+		} else if (app.got_subcommand("compact")) {
+			return new_compact_command(compact);
+		} else if (app.got_subcommand("migrate")) {
+			return new_migrate_command(migrate);
+		} else if (app.got_subcommand("snapshot")) {
+			return new_snapshot_command(snapshot);
+		} else if (app.got_subcommand("search")) {
+			return new_search_command(search);
+		} else if (app.got_subcommand("dump")) {
+			return new_dump_command(dump);
+		} else if (app.got_subcommand("tail")) {
+			return new_tail_command(tail);
+		} else if (app.got_subcommand("fix")) {
+			return new_fix_command(fix);
+		} else if (app.got_subcommand("daemon")) {
+			return new_daemon_command(daemon);
+		} else if (app.got_subcommand("debug")) {
+			if (debug->got_subcommand("bench")) {
+				return new_debug_bench_command(debug_bench);
+			}
+			if (debug->got_subcommand("format-time")) {
+				return new_debug_format_time_command(debug_format_time);
+			}
+			if (debug->got_subcommand("tokens")) {
+				return new_debug_tokens_command(debug_tokens);
+			}
+			if (debug->got_subcommand("clusters")) {
+				return new_debug_clusters_command(debug_clusters);
+			}
+			if (debug->got_subcommand("sanitize-check")) {
+				return new_debug_sanitize_check_command(debug_sanitize_check);
+			}
+			if (debug->got_subcommand("stress-ingest")) {
+				return new_debug_stress_ingest_command(debug_stress_ingest);
+			}
+			if (debug->got_subcommand("torture")) {
+				return new_debug_torture_command(debug_torture);
+			}
+			if (debug->got_subcommand("profile")) {
+				return new_debug_profile_command(debug_profile);
+			}
+		} else {
+			// WARN: is this reachable?
+		}
 
-	if (app.got_subcommand("insert")) {
-		// TODO: run insert logic
-		// std::cout << "subcommand: insert" << std::endl;
-		return new_insert_command(insert);
-	} else if (app.got_subcommand("session")) {
-		return new_session_id_command(session);
-	} else if (app.got_subcommand("boot-id")) {
-		return new_boot_id_command(boot_id);
-	} else if (app.got_subcommand("info")) {
-		return db_dump_info();
-	} else {
-		// WARN: is this reachable?
-	}
+		return 0;
+	};
 
-	return 0;
+	const bool tracing = verbose || !metrics_file.empty();
+	if (tracing) {
+		histdb::trace_enable();
+		histdb::trace_span("cli", cli_start, cli_end);
+	}
+	int rc;
+	{
+		histdb::TraceSpan span("command");
+		rc = run_subcommand();
+	}
+	if (tracing) {
+		try {
+			histdb::trace_finish(command_name(app), verbose ? &std::cerr : nullptr,
+				metrics_file);
+		} catch (const std::exception& e) {
+			std::cerr << "error: " << e.what() << std::endl;
+		}
+	}
+	return rc;
 }
 
 int main(int argc, char * const argv[]) {
@@ -1128,7 +2737,7 @@ int main(int argc, char * const argv[]) {
 	}
 	// TODO: document this
 	if (cmd == "info") {
-		return db_dump_info();
+		return run_command(db_dump_info);
 	}
 	if (cmd == "-h" || cmd == "--help") {
 		root_usage();
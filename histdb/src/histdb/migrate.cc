@@ -0,0 +1,279 @@
+#include "migrate.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <optional>
+#include <set>
+#include <stdexcept>
+
+#include "absl/strings/str_cat.h"
+#include <SQLiteCpp/Statement.h>
+
+#include "trace.h"
+#include "transaction.h"
+
+namespace histdb {
+
+// Bookkeeping
+////////////////////////////////////////////////////////////////////////////////
+
+// schema_migrations lists the applied migrations and schema_backfills the
+// backfills that are still running: rows with rowids in (cursor, end_id]
+// remain to be backfilled.
+constexpr char create_migration_tables_stmt[] = R"""(
+CREATE TABLE IF NOT EXISTS schema_migrations (
+	`version` INTEGER PRIMARY KEY
+);
+CREATE TABLE IF NOT EXISTS schema_backfills (
+	`version` INTEGER PRIMARY KEY,
+	`cursor`  INTEGER NOT NULL,
+	`end_id`  INTEGER NOT NULL
+);
+)""";
+
+static int latest_version(const std::vector<Migration>& migrations) {
+	return migrations.empty() ? 0 : migrations.back().version;
+}
+
+static int user_version(SQLite::Database& db) {
+	return db.execAndGet("PRAGMA user_version;").getInt();
+}
+
+static void check_version(int version, const std::vector<Migration>& migrations) {
+	// The database is running a schema version that we don't know about.
+	if (version > latest_version(migrations)) {
+		throw std::runtime_error(absl::StrCat(
+			"database schema (", version, ") exceeds program ",
+			"version (", latest_version(migrations), ")"
+		));
+	}
+}
+
+bool migrations_pending(SQLite::Database& db, const std::vector<Migration>& migrations) {
+	TraceSpan span("migration_check");
+	const int version = user_version(db);
+	check_version(version, migrations);
+	return version < latest_version(migrations);
+}
+
+static std::set<int> applied_versions(SQLite::Database& db) {
+	std::set<int> versions;
+	if (!db.tableExists("schema_migrations")) {
+		return versions;
+	}
+	SQLite::Statement query(db, "SELECT version FROM schema_migrations;");
+	while (query.executeStep()) {
+		versions.insert(query.getColumn(0).getInt());
+	}
+	return versions;
+}
+
+static const Migration *find_migration(const std::vector<Migration>& migrations,
+	int version) {
+
+	for (const auto& m : migrations) {
+		if (m.version == version) {
+			return &m;
+		}
+	}
+	return nullptr;
+}
+
+// Schema
+////////////////////////////////////////////////////////////////////////////////
+
+// apply_migration applies m in a single transaction unless another process
+// beat us to it.
+static void apply_migration(SQLite::Database& db, const Migration& m) {
+	WriteTransaction transaction(db);
+	if (applied_versions(db).count(m.version) != 0) {
+		return;
+	}
+	db.exec(m.schema);
+	if (m.has_backfill()) {
+		SQLite::Statement query(db, absl::StrCat(
+			"INSERT INTO schema_backfills (version, cursor, end_id) ",
+			"SELECT ?, COALESCE(MIN(rowid), 1) - 1, COALESCE(MAX(rowid), 0) FROM ",
+			m.backfill_table, ";"));
+		query.bind(1, m.version);
+		query.exec();
+	}
+	SQLite::Statement query(db, "INSERT INTO schema_migrations (version) VALUES (?);");
+	query.bind(1, m.version);
+	query.exec();
+	transaction.commit();
+}
+
+// Backfills
+////////////////////////////////////////////////////////////////////////////////
+
+struct Backfill {
+	int version = 0;
+	int64_t cursor = 0;
+	int64_t end_id = 0;
+};
+
+static std::vector<Backfill> pending_backfills(SQLite::Database& db) {
+	std::vector<Backfill> backfills;
+	SQLite::Statement query(db, R"""(
+SELECT version, cursor, end_id FROM schema_backfills ORDER BY version;
+)""");
+	while (query.executeStep()) {
+		backfills.push_back({
+			query.getColumn(0).getInt(),
+			query.getColumn(1).getInt64(),
+			query.getColumn(2).getInt64(),
+		});
+	}
+	return backfills;
+}
+
+static void print_progress(std::ostream& out, const Migration& m, const Backfill& b,
+	int64_t start) {
+
+	const int64_t total = b.end_id - start;
+	const int64_t done = b.cursor - start;
+	out << "histdb: migration " << m.version << " (" << m.name << "): backfilled "
+		<< done << "/" << total << " rows";
+	if (total > 0) {
+		out << " (" << done * 100 / total << "%)";
+	}
+	out << std::endl;
+}
+
+// run_backfill runs the batches of backfill b until it is done (returns true)
+// or the limits of opts are reached (returns false).
+static bool run_backfill(SQLite::Database& db, const Migration& m, Backfill b,
+	const MigrationOptions& opts, int64_t& batches, TraceClock::time_point start) {
+
+	using namespace std::chrono;
+	const int64_t first = b.cursor;
+	auto last_progress = TraceClock::now();
+	std::optional<SQLite::Statement> query;
+	if (m.backfill) {
+		query.emplace(db, m.backfill);
+	}
+	SQLite::Statement cursor(db, "SELECT cursor FROM schema_backfills WHERE version = ?;");
+	cursor.bind(1, m.version);
+	SQLite::Statement update(db, "UPDATE schema_backfills SET cursor = ? WHERE version = ?;");
+	SQLite::Statement remove(db, "DELETE FROM schema_backfills WHERE version = ?;");
+	for (;;) {
+		if (opts.max_batches > 0 && batches >= opts.max_batches) {
+			return false;
+		}
+		if (opts.budget.count() > 0 && batches > 0 && TraceClock::now() - start >= opts.budget) {
+			return false;
+		}
+
+		WriteTransaction transaction(db);
+		// Re-read the cursor since another process may be backfilling too.
+		cursor.reset();
+		if (!cursor.executeStep()) {
+			return true;
+		}
+		b.cursor = cursor.getColumn(0).getInt64();
+		cursor.reset();
+
+		const int64_t hi = std::min(b.end_id, b.cursor + opts.batch_rows);
+		if (query) {
+			query->reset();
+			query->bind(1, b.cursor);
+			query->bind(2, hi);
+			query->exec();
+		} else {
+			m.backfill_fn(db, b.cursor, hi);
+		}
+		if (hi >= b.end_id) {
+			remove.reset();
+			remove.bind(1, m.version);
+			remove.exec();
+		} else {
+			update.reset();
+			update.bind(1, hi);
+			update.bind(2, m.version);
+			update.exec();
+		}
+		transaction.commit();
+		b.cursor = hi;
+		batches++;
+
+		if (opts.progress && (hi >= b.end_id ||
+			TraceClock::now() - last_progress >= seconds(1))) {
+			print_progress(*opts.progress, m, b, first);
+			last_progress = TraceClock::now();
+		}
+		if (hi >= b.end_id) {
+			return true;
+		}
+	}
+}
+
+// Migrate
+////////////////////////////////////////////////////////////////////////////////
+
+bool run_migrations(SQLite::Database& db, const std::vector<Migration>& migrations,
+	const MigrationOptions& opts) {
+
+	if (opts.batch_rows <= 0) {
+		throw std::invalid_argument("migrate: batch rows must be positive");
+	}
+	if (!migrations_pending(db, migrations)) {
+		return true;
+	}
+	TraceSpan span("migrate");
+	const auto start = TraceClock::now();
+
+	db.exec(create_migration_tables_stmt);
+	const auto applied = applied_versions(db);
+	if (!applied.empty()) {
+		check_version(*applied.rbegin(), migrations);
+	}
+	for (const auto& m : migrations) {
+		if (applied.count(m.version) == 0) {
+			apply_migration(db, m);
+		}
+	}
+
+	int64_t batches = 0;
+	for (const auto& b : pending_backfills(db)) {
+		const Migration *m = find_migration(migrations, b.version);
+		if (m == nullptr || !m->has_backfill()) {
+			throw std::runtime_error(absl::StrCat(
+				"unknown backfill for migration ", b.version));
+		}
+		TraceSpan backfill_span("backfill");
+		if (!run_backfill(db, *m, b, opts, batches, start)) {
+			return false;
+		}
+	}
+
+	db.exec(absl::StrCat("PRAGMA user_version = ", latest_version(migrations), ";"));
+	return true;
+}
+
+void print_migration_status(SQLite::Database& db, const std::vector<Migration>& migrations,
+	std::ostream& out) {
+
+	const auto applied = applied_versions(db);
+	std::vector<Backfill> backfills;
+	if (db.tableExists("schema_backfills")) {
+		backfills = pending_backfills(db);
+	}
+	out << "user_version: " << user_version(db) << "\n";
+	out << std::setw(7) << "version" << "  " << std::left << std::setw(10) << "state"
+		<< std::right << "name\n";
+	for (const auto& m : migrations) {
+		std::string state = applied.count(m.version) ? "applied" : "pending";
+		std::string note;
+		for (const auto& b : backfills) {
+			if (b.version == m.version) {
+				state = "backfill";
+				note = absl::StrCat(" (", b.end_id - b.cursor, " rows left)");
+			}
+		}
+		out << std::setw(7) << m.version << "  " << std::left << std::setw(10) << state
+			<< std::right << m.name << note << "\n";
+	}
+}
+
+} // namespace histdb
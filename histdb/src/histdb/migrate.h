@@ -0,0 +1,74 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include <SQLiteCpp/Database.h>
+
+namespace histdb {
+
+// Migrations
+////////////////////////////////////////////////////////////////////////////////
+
+// Migration is a versioned schema change. The schema statements are applied
+// in a single transaction (together with recording the version in the
+// schema_migrations table) and must be fast.
+//
+// Migrations that need to rewrite existing rows do so with a backfill: an
+// UPDATE (or similar) statement of the rows of backfill_table with rowids in
+// (?1, ?2] which is run in batches, each in its own transaction, after the
+// schema was applied. The progress is stored in the schema_backfills table so
+// an interrupted backfill resumes where it stopped. Rows inserted after the
+// schema was applied are not backfilled, the code that inserts them must
+// write the new columns.
+//
+// Backfills that can't be written in SQL use backfill_fn instead, which is
+// called with the same rowid range.
+using BackfillFunc = void (*)(SQLite::Database& db, int64_t lo, int64_t hi);
+
+struct Migration {
+	int version;
+	const char *name;
+	const char *schema;
+	const char *backfill = nullptr;
+	const char *backfill_table = "history";
+	BackfillFunc backfill_fn = nullptr;
+
+	bool has_backfill() const { return backfill != nullptr || backfill_fn != nullptr; }
+};
+
+struct MigrationOptions {
+	int64_t batch_rows = 5000;
+
+	// Stop backfilling once this much time was spent (after at least one
+	// batch) and leave the rest for the next call. Zero means no limit.
+	std::chrono::milliseconds budget{0};
+
+	// Stop backfilling after this many batches (zero means no limit).
+	int64_t max_batches = 0;
+
+	// Backfill progress is printed here (if not null).
+	std::ostream *progress = nullptr;
+};
+
+// migrations_pending returns if db is not fully migrated. The check only
+// reads "PRAGMA user_version", which is set to the latest version once all
+// migrations are applied and backfilled. Throws std::runtime_error if the
+// database was migrated by a newer version of histdb.
+bool migrations_pending(SQLite::Database& db, const std::vector<Migration>& migrations);
+
+// run_migrations applies the migrations that were not yet applied, in order,
+// and then runs the pending backfills within the limits of opts. Returns true
+// if the database is fully migrated.
+//
+// Migrations must be sorted by version.
+bool run_migrations(SQLite::Database& db, const std::vector<Migration>& migrations,
+	const MigrationOptions& opts = MigrationOptions());
+
+// print_migration_status prints the state of every migration.
+void print_migration_status(SQLite::Database& db, const std::vector<Migration>& migrations,
+	std::ostream& out);
+
+} // namespace histdb
@@ -0,0 +1,389 @@
+#include "parquet.h"
+
+#include <cstring>
+#include <string_view>
+
+namespace histdb {
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+	"parquet: values are written in host order");
+
+const std::string parquet_magic = "PAR1";
+
+// ThriftWriter
+////////////////////////////////////////////////////////////////////////////////
+
+// Thrift compact protocol types
+enum ThriftType : uint8_t {
+	thrift_true = 1,
+	thrift_false = 2,
+	thrift_i32 = 5,
+	thrift_i64 = 6,
+	thrift_binary = 8,
+	thrift_list = 9,
+	thrift_struct = 12,
+};
+
+static void append_varint(std::string& out, uint64_t v) {
+	while (v >= 0x80) {
+		out.push_back(static_cast<char>((v & 0x7F) | 0x80));
+		v >>= 7;
+	}
+	out.push_back(static_cast<char>(v));
+}
+
+// ThriftWriter writes structs using the Thrift compact protocol. Fields must
+// be written in increasing order of their ids.
+class ThriftWriter {
+public:
+	explicit ThriftWriter(std::string& out) : out_(out) {}
+
+	void field_i32(int16_t id, int32_t v) {
+		field_header(id, thrift_i32);
+		append_varint(out_, zigzag(v));
+	}
+	void field_i64(int16_t id, int64_t v) {
+		field_header(id, thrift_i64);
+		append_varint(out_, zigzag(v));
+	}
+	void field_binary(int16_t id, std::string_view s) {
+		field_header(id, thrift_binary);
+		binary(s);
+	}
+	void field_list(int16_t id, ThriftType elem, size_t size) {
+		field_header(id, thrift_list);
+		if (size < 15) {
+			out_.push_back(static_cast<char>((size << 4) | elem));
+		} else {
+			out_.push_back(static_cast<char>(0xF0 | elem));
+			append_varint(out_, size);
+		}
+	}
+	void field_struct(int16_t id) {
+		field_header(id, thrift_struct);
+		begin_struct();
+	}
+
+	// List elements
+	void i32(int32_t v) { append_varint(out_, zigzag(v)); }
+	void binary(std::string_view s) {
+		append_varint(out_, s.size());
+		out_.append(s);
+	}
+	void begin_struct() {
+		last_ids_.push_back(last_id_);
+		last_id_ = 0;
+	}
+
+	void end_struct() {
+		out_.push_back(0); // STOP
+		if (!last_ids_.empty()) {
+			last_id_ = last_ids_.back();
+			last_ids_.pop_back();
+		}
+	}
+
+private:
+	static uint64_t zigzag(int64_t v) {
+		return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+	}
+
+	void field_header(int16_t id, ThriftType type) {
+		const int delta = id - last_id_;
+		if (0 < delta && delta <= 15) {
+			out_.push_back(static_cast<char>((delta << 4) | type));
+		} else {
+			out_.push_back(static_cast<char>(type));
+			append_varint(out_, zigzag(id));
+		}
+		last_id_ = id;
+	}
+
+	std::string& out_;
+	int16_t last_id_ = 0;
+	std::vector<int16_t> last_ids_;
+};
+
+// parquet.thrift
+////////////////////////////////////////////////////////////////////////////////
+
+enum ParquetType : int32_t {
+	type_int32 = 1,
+	type_int64 = 2,
+	type_byte_array = 6,
+};
+
+constexpr int32_t repetition_required = 0;
+constexpr int32_t converted_type_utf8 = 0;
+constexpr int32_t codec_uncompressed = 0;
+
+constexpr int32_t encoding_plain = 0;
+constexpr int32_t encoding_rle = 3;
+constexpr int32_t encoding_rle_dictionary = 8;
+
+constexpr int32_t page_data = 0;
+constexpr int32_t page_dictionary = 2;
+
+// Keep in sync with history_columns.
+static const std::vector<ParquetType> column_types = {
+	type_int64,      // id
+	type_int64,      // session_id
+	type_int64,      // history_id
+	type_int64,      // ppid
+	type_int32,      // status_code
+	type_byte_array, // created_at
+	type_byte_array, // username (dictionary)
+	type_byte_array, // directory (dictionary)
+	type_byte_array, // raw
+};
+
+static void append_page_header(std::string& out, int32_t type, size_t size,
+	size_t num_values, int32_t encoding) {
+
+	ThriftWriter w(out);
+	w.field_i32(1, type);
+	w.field_i32(2, static_cast<int32_t>(size)); // uncompressed_page_size
+	w.field_i32(3, static_cast<int32_t>(size)); // compressed_page_size
+	if (type == page_dictionary) {
+		w.field_struct(7);
+		w.field_i32(1, static_cast<int32_t>(num_values));
+		w.field_i32(2, encoding);
+		w.end_struct();
+	} else {
+		w.field_struct(5);
+		w.field_i32(1, static_cast<int32_t>(num_values));
+		w.field_i32(2, encoding);
+		w.field_i32(3, encoding_rle); // definition_level_encoding
+		w.field_i32(4, encoding_rle); // repetition_level_encoding
+		w.end_struct();
+	}
+	w.end_struct();
+}
+
+// Encoding
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+static std::string plain_values(const std::vector<T>& v) {
+	return std::string(reinterpret_cast<const char *>(v.data()), v.size() * sizeof(T));
+}
+
+static std::string plain_strings(const StringColumn& col) {
+	std::string out;
+	out.reserve(col.data.size() + col.size() * 4);
+	for (size_t i = 0; i < col.size(); i++) {
+		auto s = col.at(i);
+		const uint32_t n = static_cast<uint32_t>(s.size());
+		out.append(reinterpret_cast<const char *>(&n), 4);
+		out.append(s);
+	}
+	return out;
+}
+
+// append_bit_packed appends a bit-packed run of values (padded with zeros to
+// a multiple of 8 values).
+static void append_bit_packed(std::string& out, const int32_t *values,
+	size_t n, int width) {
+
+	const size_t groups = (n + 7) / 8;
+	append_varint(out, (groups << 1) | 1);
+	uint64_t acc = 0;
+	int nbits = 0;
+	for (size_t i = 0; i < groups * 8; i++) {
+		const uint64_t v = i < n ? static_cast<uint32_t>(values[i]) : 0;
+		acc |= v << nbits;
+		nbits += width;
+		while (nbits >= 8) {
+			out.push_back(static_cast<char>(acc & 0xFF));
+			acc >>= 8;
+			nbits -= 8;
+		}
+	}
+}
+
+static void append_rle_run(std::string& out, int32_t value, size_t count, int width) {
+	append_varint(out, count << 1);
+	for (int i = 0; i < (width + 7) / 8; i++) {
+		out.push_back(static_cast<char>((value >> (i * 8)) & 0xFF));
+	}
+}
+
+// rle_dictionary_indices encodes dictionary indices with the RLE/bit-packing
+// hybrid encoding: runs of 8 or more repeated values (the common case for
+// username and directory) are run length encoded and everything else is
+// bit-packed.
+static std::string rle_dictionary_indices(const std::vector<int32_t>& indices,
+	size_t dictionary_size) {
+
+	int width = 1;
+	while ((size_t(1) << width) < dictionary_size) {
+		width++;
+	}
+	std::string out;
+	out.push_back(static_cast<char>(width));
+
+	const size_t n = indices.size();
+	size_t literal_start = 0; // start of the pending bit-packed values
+	size_t i = 0;
+	while (i < n) {
+		size_t run = 1;
+		while (i + run < n && indices[i + run] == indices[i]) {
+			run++;
+		}
+		const size_t literals = i - literal_start;
+		// Bit-packed runs must be a multiple of 8 values, so the first
+		// (8 - literals % 8) values of the run go to the pending literals.
+		const size_t fill = (8 - literals % 8) % 8;
+		if (run >= fill + 8) {
+			if (literals + fill > 0) {
+				append_bit_packed(out, &indices[literal_start], literals + fill, width);
+			}
+			append_rle_run(out, indices[i], run - fill, width);
+			literal_start = i + run;
+		}
+		i += run;
+	}
+	if (literal_start < n) {
+		append_bit_packed(out, &indices[literal_start], n - literal_start, width);
+	}
+	return out;
+}
+
+static ParquetColumnChunk append_column(std::string& out, const std::string& values,
+	size_t num_values) {
+
+	ParquetColumnChunk col;
+	col.data_page_offset = static_cast<int64_t>(out.size());
+	append_page_header(out, page_data, values.size(), num_values, encoding_plain);
+	out.append(values);
+	col.size = static_cast<int64_t>(out.size()) - col.data_page_offset;
+	return col;
+}
+
+static ParquetColumnChunk append_dictionary_column(std::string& out,
+	const DictionaryColumn& dict) {
+
+	ParquetColumnChunk col;
+	col.dictionary_page_offset = static_cast<int64_t>(out.size());
+	const std::string values = plain_strings(dict.values());
+	append_page_header(out, page_dictionary, values.size(), dict.values().size(),
+		encoding_plain);
+	out.append(values);
+
+	col.data_page_offset = static_cast<int64_t>(out.size());
+	const std::string indices = rle_dictionary_indices(dict.indices(), dict.values().size());
+	append_page_header(out, page_data, indices.size(), dict.size(), encoding_rle_dictionary);
+	out.append(indices);
+	col.size = static_cast<int64_t>(out.size()) - col.dictionary_page_offset;
+	return col;
+}
+
+ParquetRowGroup encode_parquet_row_group(const HistoryBatch& batch) {
+	ParquetRowGroup rg;
+	rg.num_rows = static_cast<int64_t>(batch.size());
+	std::string& out = rg.data;
+	const size_t n = batch.size();
+	for (const auto *col : {&batch.id, &batch.session_id, &batch.history_id, &batch.ppid}) {
+		rg.columns.push_back(append_column(out, plain_values(*col), n));
+	}
+	rg.columns.push_back(append_column(out, plain_values(batch.status_code), n));
+	rg.columns.push_back(append_column(out, plain_strings(batch.created_at), n));
+	rg.columns.push_back(append_dictionary_column(out, batch.username));
+	rg.columns.push_back(append_dictionary_column(out, batch.directory));
+	rg.columns.push_back(append_column(out, plain_strings(batch.raw), n));
+	return rg;
+}
+
+// Footer
+////////////////////////////////////////////////////////////////////////////////
+
+static void write_schema(ThriftWriter& w) {
+	w.field_list(2, thrift_struct, history_columns.size() + 1);
+	w.begin_struct();
+	w.field_binary(4, "schema");
+	w.field_i32(5, static_cast<int32_t>(history_columns.size())); // num_children
+	w.end_struct();
+	for (size_t i = 0; i < history_columns.size(); i++) {
+		w.begin_struct();
+		w.field_i32(1, column_types[i]);
+		w.field_i32(3, repetition_required);
+		w.field_binary(4, history_columns[i]);
+		if (column_types[i] == type_byte_array) {
+			w.field_i32(6, converted_type_utf8);
+			w.field_struct(10); // logicalType
+			w.field_struct(1);  // STRING
+			w.end_struct();
+			w.end_struct();
+		}
+		w.end_struct();
+	}
+}
+
+static void write_column_chunk(ThriftWriter& w, const ParquetRowGroup& rg, size_t i) {
+	const auto& col = rg.columns[i];
+	const bool dictionary = col.dictionary_page_offset >= 0;
+	const int64_t start = rg.file_offset +
+		(dictionary ? col.dictionary_page_offset : col.data_page_offset);
+
+	w.begin_struct();
+	w.field_i64(2, start); // file_offset
+	w.field_struct(3);     // meta_data
+	w.field_i32(1, column_types[i]);
+	if (dictionary) {
+		w.field_list(2, thrift_i32, 2);
+		w.i32(encoding_plain);
+		w.i32(encoding_rle_dictionary);
+	} else {
+		w.field_list(2, thrift_i32, 1);
+		w.i32(encoding_plain);
+	}
+	w.field_list(3, thrift_binary, 1); // path_in_schema
+	w.binary(history_columns[i]);
+	w.field_i32(4, codec_uncompressed);
+	w.field_i64(5, rg.num_rows);       // num_values
+	w.field_i64(6, col.size);          // total_uncompressed_size
+	w.field_i64(7, col.size);          // total_compressed_size
+	w.field_i64(9, rg.file_offset + col.data_page_offset);
+	if (dictionary) {
+		w.field_i64(11, start);
+	}
+	w.end_struct();
+	w.end_struct();
+}
+
+std::string parquet_footer(const std::vector<ParquetRowGroup>& row_groups) {
+	int64_t num_rows = 0;
+	for (const auto& rg : row_groups) {
+		num_rows += rg.num_rows;
+	}
+
+	std::string out;
+	ThriftWriter w(out);
+	w.field_i32(1, 1); // version
+	write_schema(w);
+	w.field_i64(3, num_rows);
+	w.field_list(4, thrift_struct, row_groups.size());
+	for (const auto& rg : row_groups) {
+		int64_t size = 0;
+		for (const auto& col : rg.columns) {
+			size += col.size;
+		}
+		w.begin_struct();
+		w.field_list(1, thrift_struct, rg.columns.size());
+		for (size_t i = 0; i < rg.columns.size(); i++) {
+			write_column_chunk(w, rg, i);
+		}
+		w.field_i64(2, size); // total_byte_size
+		w.field_i64(3, rg.num_rows);
+		w.end_struct();
+	}
+	w.field_binary(6, "histdb"); // created_by
+	w.end_struct();
+
+	const uint32_t len = static_cast<uint32_t>(out.size());
+	out.append(reinterpret_cast<const char *>(&len), 4);
+	out.append(parquet_magic);
+	return out;
+}
+
+} // namespace histdb
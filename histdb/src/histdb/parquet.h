@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "export.h"
+
+namespace histdb {
+
+// Minimal Parquet writer (https://parquet.apache.org/docs/file-format/)
+// specialized for HistoryBatch: every batch is written as a row group of
+// uncompressed, PLAIN encoded columns except for the dictionary encoded
+// columns which use a dictionary page and RLE_DICTIONARY indices. The Thrift
+// metadata is encoded by hand.
+//
+// A file is: parquet_magic, any number of row groups, and then
+// parquet_footer() of the row groups (with their file offsets set).
+
+extern const std::string parquet_magic;
+
+struct ParquetColumnChunk {
+	int64_t dictionary_page_offset = -1; // -1 if not dictionary encoded
+	int64_t data_page_offset = 0;
+	int64_t size = 0;
+};
+
+struct ParquetRowGroup {
+	std::string data;
+	int64_t num_rows = 0;
+	int64_t file_offset = 0; // offset of data in the file
+	std::vector<ParquetColumnChunk> columns; // offsets are relative to data
+};
+
+// encode_parquet_row_group encodes batch as a row group. The returned row
+// group's file_offset must be set before passing it to parquet_footer.
+ParquetRowGroup encode_parquet_row_group(const HistoryBatch& batch);
+
+// parquet_footer returns the file metadata followed by its length and the
+// trailing magic. The data of the row groups is not used and may be cleared.
+std::string parquet_footer(const std::vector<ParquetRowGroup>& row_groups);
+
+} // namespace histdb
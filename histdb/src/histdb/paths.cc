@@ -0,0 +1,177 @@
+#include "paths.h"
+
+#include <filesystem>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+
+#ifdef __APPLE__
+#include <fcntl.h>      // fcntl, F_GETPATH
+#include <sys/param.h>  // MAXPATHLEN
+#include <unistd.h>     // close
+#endif
+
+#include <SQLiteCpp/Statement.h>
+
+namespace fs = std::filesystem;
+
+namespace histdb {
+
+// Canonical paths
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef __APPLE__
+// realpath keeps the case it was given on case-insensitive file systems, so
+// ask the file system for the path of the directory.
+static void fix_path_case(fs::path& p) {
+	int fd = open(p.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		return;
+	}
+	char buf[MAXPATHLEN];
+	if (fcntl(fd, F_GETPATH, buf) != -1) {
+		p = buf;
+	}
+	close(fd);
+}
+#endif
+
+std::string canonical_directory(const std::string& dir) {
+	if (dir.empty()) {
+		throw std::invalid_argument("canonical_directory: empty path");
+	}
+	std::error_code ec;
+	fs::path p = fs::absolute(dir, ec);
+	if (ec) {
+		p = dir;
+	}
+	fs::path resolved = fs::weakly_canonical(p, ec);
+	p = ec ? p.lexically_normal() : resolved;
+#ifdef __APPLE__
+	fix_path_case(p);
+#endif
+	std::string s = p.string();
+	while (s.size() > 1 && s.back() == '/') {
+		s.pop_back();
+	}
+	return s;
+}
+
+std::string_view parent_directory(std::string_view path) {
+	if (path.size() <= 1) {
+		return std::string_view();
+	}
+	const size_t n = path.rfind('/');
+	if (n == std::string_view::npos) {
+		return std::string_view();
+	}
+	return n == 0 ? path.substr(0, 1) : path.substr(0, n);
+}
+
+PathRange subtree_range(std::string_view path) {
+	// The root is the only canonical path that ends with a slash.
+	std::string prefix(path == "/" ? std::string_view() : path);
+	return {prefix + "/", prefix + "0"};
+}
+
+// Interning
+////////////////////////////////////////////////////////////////////////////////
+
+constexpr char select_alias_stmt[] = R"""(
+SELECT a.directory_id, d.path, a.dev, a.ino
+FROM directory_aliases AS a
+JOIN directories AS d ON d.id = a.directory_id
+WHERE a.raw = ?;
+)""";
+
+constexpr char upsert_alias_stmt[] = R"""(
+INSERT INTO directory_aliases (raw, directory_id, dev, ino) VALUES (?, ?, ?, ?)
+ON CONFLICT (raw) DO UPDATE SET
+	directory_id = excluded.directory_id,
+	dev = excluded.dev,
+	ino = excluded.ino;
+)""";
+
+// intern_path returns the id of the canonical path, inserting it and any
+// missing parents.
+static int64_t intern_path(SQLite::Database& db, std::string_view path) {
+	SQLite::Statement select(db, "SELECT id FROM directories WHERE path = ?;");
+	select.bind(1, std::string(path));
+	if (select.executeStep()) {
+		return select.getColumn(0).getInt64();
+	}
+	const std::string_view parent = parent_directory(path);
+	SQLite::Statement insert(db,
+		"INSERT INTO directories (parent_id, name, path) VALUES (?, ?, ?);");
+	if (parent.empty()) {
+		insert.bind(1);
+		insert.bind(2, std::string(path));
+	} else {
+		insert.bind(1, intern_path(db, parent));
+		const size_t n = parent.size() == 1 ? 1 : parent.size() + 1;
+		insert.bind(2, std::string(path.substr(n)));
+	}
+	insert.bind(3, std::string(path));
+	insert.exec();
+	return db.getLastInsertRowid();
+}
+
+Directory intern_directory(SQLite::Database& db, const std::string& raw) {
+	struct stat st;
+	const bool exists = stat(raw.c_str(), &st) == 0;
+	const int64_t dev = exists ? static_cast<int64_t>(st.st_dev) : 0;
+	const int64_t ino = exists ? static_cast<int64_t>(st.st_ino) : 0;
+
+	SQLite::Statement alias(db, select_alias_stmt);
+	alias.bind(1, raw);
+	if (alias.executeStep()) {
+		if (!exists || (alias.getColumn(2).getInt64() == dev &&
+			alias.getColumn(3).getInt64() == ino)) {
+			return {alias.getColumn(0).getInt64(), alias.getColumn(1).getString()};
+		}
+	}
+
+	Directory dir;
+	dir.path = canonical_directory(raw);
+	dir.id = intern_path(db, dir.path);
+	SQLite::Statement upsert(db, upsert_alias_stmt);
+	upsert.bind(1, raw);
+	upsert.bind(2, dir.id);
+	upsert.bind(3, dev);
+	upsert.bind(4, ino);
+	upsert.exec();
+	return dir;
+}
+
+void backfill_history_directories(SQLite::Database& db, int64_t lo, int64_t hi) {
+	std::vector<std::pair<int64_t, std::string>> rows;
+	{
+		SQLite::Statement select(db,
+			"SELECT rowid, directory FROM history WHERE rowid > ? AND rowid <= ?;");
+		select.bind(1, lo);
+		select.bind(2, hi);
+		while (select.executeStep()) {
+			rows.emplace_back(select.getColumn(0).getInt64(), select.getColumn(1).getString());
+		}
+	}
+	std::unordered_map<std::string, Directory> dirs;
+	SQLite::Statement update(db,
+		"UPDATE history SET directory_id = ?, directory = ? WHERE rowid = ?;");
+	for (const auto& [rowid, raw] : rows) {
+		auto it = dirs.find(raw);
+		if (it == dirs.end()) {
+			it = dirs.emplace(raw, intern_directory(db, raw)).first;
+		}
+		update.reset();
+		update.bind(1, it->second.id);
+		update.bind(2, it->second.path);
+		update.bind(3, rowid);
+		update.exec();
+	}
+}
+
+} // namespace histdb
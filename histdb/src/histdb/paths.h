@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include <SQLiteCpp/Database.h>
+
+namespace histdb {
+
+// Canonical paths
+////////////////////////////////////////////////////////////////////////////////
+
+// canonical_directory returns the canonical spelling of the directory dir:
+// an absolute path with symlinks, "." and ".." components and trailing
+// slashes removed and (on macOS) the case used by the file system. Paths
+// that no longer exist are resolved as far as possible and normalized
+// lexically.
+std::string canonical_directory(const std::string& dir);
+
+// parent_directory returns the parent of the canonical path or an empty
+// string for the root directory.
+std::string_view parent_directory(std::string_view path);
+
+// PathRange is the range of paths [lo, hi) that are below a directory: with
+// the BINARY collation every path that starts with "dir/" sorts between
+// "dir/" and "dir0" ('0' follows '/' in ASCII). The directory itself is not
+// included.
+struct PathRange {
+	std::string lo;
+	std::string hi;
+};
+
+PathRange subtree_range(std::string_view path);
+
+// Interning
+////////////////////////////////////////////////////////////////////////////////
+
+// Directories are stored once in the directories table, a tree linked by
+// parent_id whose path column holds the canonical path, and history rows
+// reference them by id. directory_aliases maps the raw $PWD strings that
+// shells report to their directory so that each spelling is only
+// canonicalized once: the alias is used as long as $PWD still refers to the
+// same inode (or no longer exists).
+
+struct Directory {
+	int64_t id = 0;
+	std::string path;
+};
+
+// intern_directory returns the directory of the raw working directory raw,
+// adding it (and its parents) to the directories table if needed. It should
+// be called in the write transaction that uses the directory.
+Directory intern_directory(SQLite::Database& db, const std::string& raw);
+
+// backfill_history_directories sets history.directory_id (and canonicalizes
+// history.directory) of the rows with rowids in (lo, hi], see migrate.h.
+void backfill_history_directories(SQLite::Database& db, int64_t lo, int64_t hi);
+
+} // namespace histdb
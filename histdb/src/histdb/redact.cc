@@ -0,0 +1,364 @@
+#include "redact.h"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <system_error>
+
+#include <unistd.h> // getpid
+
+#include "absl/strings/str_cat.h"
+
+namespace fs = std::filesystem;
+
+namespace histdb {
+
+constexpr std::string_view redacted_value = "[REDACTED]";
+
+// Bump this whenever the default rules or the serialized format change.
+constexpr uint32_t redact_cache_version = 1;
+constexpr char redact_cache_magic[8] = {'H', 'D', 'B', 'R', 'E', 'D', 'A', 'C'};
+
+std::vector<RedactRule> default_redact_rules() {
+	return {
+		{RedactAction::Redact, "_SECRET="},
+		{RedactAction::Redact, "SECRET_ACCESS_KEY="},
+		{RedactAction::Redact, "_TOKEN="},
+		{RedactAction::Redact, "PASSWORD="},
+		{RedactAction::Redact, "PASSWD="},
+		{RedactAction::Redact, "API_KEY="},
+		{RedactAction::Redact, "--password="},
+		{RedactAction::Redact, "--token="},
+		{RedactAction::Redact, "Authorization: Bearer "},
+		{RedactAction::Redact, "ghp_"},
+		{RedactAction::Redact, "github_pat_"},
+		{RedactAction::Redact, "xoxb-"},
+		{RedactAction::Redact, "xoxp-"},
+		{RedactAction::Ignore, "PRIVATE KEY-----"},
+	};
+}
+
+std::vector<RedactRule> parse_redact_rules(std::string_view config) {
+	std::vector<RedactRule> rules;
+	int lineno = 0;
+	while (!config.empty()) {
+		lineno++;
+		auto n = config.find('\n');
+		auto line = config.substr(0, n);
+		config = n == std::string_view::npos ? std::string_view() : config.substr(n + 1);
+		if (!line.empty() && line.back() == '\r') {
+			line.remove_suffix(1);
+		}
+		auto start = line.find_first_not_of(" \t");
+		if (start == std::string_view::npos || line[start] == '#') {
+			continue;
+		}
+		line = line.substr(start);
+
+		auto sp = line.find(' ');
+		auto action = line.substr(0, sp);
+		auto pattern = sp == std::string_view::npos ? std::string_view() : line.substr(sp + 1);
+		if (pattern.empty()) {
+			throw std::invalid_argument(absl::StrCat(
+				"redact config: line ", lineno, ": missing pattern"
+			));
+		}
+		if (action == "redact") {
+			rules.push_back({RedactAction::Redact, std::string(pattern)});
+		} else if (action == "ignore") {
+			rules.push_back({RedactAction::Ignore, std::string(pattern)});
+		} else {
+			throw std::invalid_argument(absl::StrCat(
+				"redact config: line ", lineno, ": invalid action: '", action, "'"
+			));
+		}
+	}
+	return rules;
+}
+
+static constexpr unsigned char ascii_lower(unsigned char c) {
+	return ('A' <= c && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+RedactMatcher::RedactMatcher(const std::vector<RedactRule>& rules) {
+	// Assign an equivalence class to every byte used by a pattern, all
+	// other bytes share class 0. This keeps the DFA small enough that the
+	// whole thing stays in L1/L2.
+	for (const auto& rule : rules) {
+		for (unsigned char c : rule.pattern) {
+			c = ascii_lower(c);
+			if (classes_[c] == 0) {
+				if (nclasses_ == 256) {
+					throw std::invalid_argument("redact: too many distinct pattern bytes");
+				}
+				classes_[c] = static_cast<uint8_t>(nclasses_++);
+			}
+		}
+	}
+	for (int c = 'A'; c <= 'Z'; c++) {
+		classes_[c] = classes_[ascii_lower(c)];
+	}
+
+	// Build the trie, 0 is the root and UINT32_MAX means no edge.
+	constexpr uint32_t none = UINT32_MAX;
+	next_.assign(nclasses_, none);
+	flags_.assign(1, 0);
+	for (const auto& rule : rules) {
+		uint32_t state = 0;
+		for (unsigned char c : rule.pattern) {
+			uint32_t& edge = next_[state * nclasses_ + classes_[c]];
+			if (edge == none) {
+				edge = static_cast<uint32_t>(flags_.size());
+				flags_.push_back(0);
+				next_.resize(next_.size() + nclasses_, none);
+			}
+			// NB: next_ may have been resized so re-index rather than using edge
+			state = next_[state * nclasses_ + classes_[c]];
+		}
+		flags_[state] |= static_cast<uint8_t>(rule.action);
+	}
+
+	// Convert the trie to a DFA by following the failure links (BFS order
+	// guarantees the failure state of a node has already been completed).
+	std::vector<uint32_t> fail(flags_.size(), 0);
+	std::vector<uint32_t> queue;
+	queue.reserve(flags_.size());
+	for (uint32_t c = 0; c < nclasses_; c++) {
+		uint32_t& edge = next_[c];
+		if (edge == none) {
+			edge = 0;
+		} else {
+			queue.push_back(edge);
+		}
+	}
+	for (size_t head = 0; head < queue.size(); head++) {
+		uint32_t state = queue[head];
+		flags_[state] |= flags_[fail[state]];
+		for (uint32_t c = 0; c < nclasses_; c++) {
+			uint32_t& edge = next_[state * nclasses_ + c];
+			uint32_t fallback = next_[fail[state] * nclasses_ + c];
+			if (edge == none) {
+				edge = fallback;
+			} else {
+				fail[edge] = fallback;
+				queue.push_back(edge);
+			}
+		}
+	}
+}
+
+static constexpr bool is_word_end(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == ';' || c == '|' || c == '&' ||
+		c == '"' || c == '\'';
+}
+
+// value_end returns the end of the value starting at raw[pos], quoted values
+// extend to the closing quote.
+static size_t value_end(const std::string& raw, size_t pos) {
+	if (pos < raw.size() && (raw[pos] == '"' || raw[pos] == '\'')) {
+		auto end = raw.find(raw[pos], pos + 1);
+		return end == std::string::npos ? raw.size() : end + 1;
+	}
+	size_t i = pos;
+	while (i < raw.size() && !is_word_end(raw[i])) {
+		i++;
+	}
+	return i;
+}
+
+RedactResult RedactMatcher::apply(std::string& raw) const {
+	RedactResult res;
+	std::vector<size_t> starts;
+	uint32_t state = 0;
+	const uint32_t *next = next_.data();
+	const uint32_t ncl = nclasses_;
+	for (size_t i = 0; i < raw.size(); i++) {
+		state = next[state * ncl + classes_[static_cast<unsigned char>(raw[i])]];
+		if (unsigned flags = flags_[state]; flags != 0) {
+			if (flags & static_cast<uint8_t>(RedactAction::Ignore)) {
+				res.ignore = true;
+				return res;
+			}
+			starts.push_back(i + 1);
+		}
+	}
+	if (starts.empty()) {
+		return res;
+	}
+
+	std::string out;
+	out.reserve(raw.size());
+	size_t pos = 0;
+	for (size_t start : starts) {
+		if (start < pos) {
+			continue; // overlaps the previous redaction
+		}
+		size_t end = value_end(raw, start);
+		if (end == start) {
+			continue; // nothing to redact ("PASSWORD= ...")
+		}
+		out.append(raw, pos, start - pos);
+		out.append(redacted_value);
+		pos = end;
+		res.redacted++;
+	}
+	if (res.redacted > 0) {
+		out.append(raw, pos, std::string::npos);
+		raw.swap(out);
+	}
+	return res;
+}
+
+// Serialization
+////////////////////////////////////////////////////////////////////////////////
+
+struct RedactCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t nclasses;
+	uint64_t fingerprint;
+	uint64_t nstates;
+};
+
+std::string RedactMatcher::serialize(uint64_t fingerprint) const {
+	RedactCacheHeader hdr;
+	std::memcpy(hdr.magic, redact_cache_magic, sizeof(hdr.magic));
+	hdr.version = redact_cache_version;
+	hdr.nclasses = nclasses_;
+	hdr.fingerprint = fingerprint;
+	hdr.nstates = flags_.size();
+
+	std::string out;
+	out.reserve(sizeof(hdr) + classes_.size() + next_.size() * sizeof(uint32_t) + flags_.size());
+	out.append(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+	out.append(reinterpret_cast<const char *>(classes_.data()), classes_.size());
+	out.append(reinterpret_cast<const char *>(next_.data()), next_.size() * sizeof(uint32_t));
+	out.append(reinterpret_cast<const char *>(flags_.data()), flags_.size());
+	return out;
+}
+
+std::optional<RedactMatcher> RedactMatcher::deserialize(std::string_view data,
+	uint64_t fingerprint) {
+
+	RedactCacheHeader hdr;
+	if (data.size() < sizeof(hdr)) {
+		return std::nullopt;
+	}
+	std::memcpy(&hdr, data.data(), sizeof(hdr));
+	if (std::memcmp(hdr.magic, redact_cache_magic, sizeof(hdr.magic)) != 0 ||
+		hdr.version != redact_cache_version || hdr.fingerprint != fingerprint ||
+		hdr.nclasses == 0 || hdr.nclasses > 256 || hdr.nstates == 0) {
+		return std::nullopt;
+	}
+	// Every state takes a row of the table and a flag, check the count
+	// before multiplying so that a corrupt one can't overflow.
+	const size_t row = hdr.nclasses * sizeof(uint32_t);
+	if (data.size() < sizeof(hdr) + 256 ||
+		hdr.nstates > (data.size() - sizeof(hdr) - 256) / (row + 1)) {
+		return std::nullopt;
+	}
+	const size_t table = hdr.nstates * row;
+	if (data.size() != sizeof(hdr) + 256 + table + hdr.nstates) {
+		return std::nullopt;
+	}
+	data.remove_prefix(sizeof(hdr));
+
+	RedactMatcher m;
+	m.nclasses_ = hdr.nclasses;
+	std::memcpy(m.classes_.data(), data.data(), 256);
+	data.remove_prefix(256);
+	m.next_.resize(hdr.nstates * hdr.nclasses);
+	std::memcpy(m.next_.data(), data.data(), table);
+	data.remove_prefix(table);
+	m.flags_.assign(data.begin(), data.end());
+
+	// Guard against a corrupt cache sending us out of bounds.
+	for (uint32_t c : m.classes_) {
+		if (c >= m.nclasses_) {
+			return std::nullopt;
+		}
+	}
+	for (uint32_t s : m.next_) {
+		if (s >= hdr.nstates) {
+			return std::nullopt;
+		}
+	}
+	return m;
+}
+
+// fnv1a is only used to fingerprint the redaction config.
+static uint64_t fnv1a(std::string_view s, uint64_t h = 14695981039346656037ULL) {
+	for (unsigned char c : s) {
+		h ^= c;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static bool read_file(const fs::path& path, std::string& out) {
+	std::ifstream f(path, std::ios::binary);
+	if (!f) {
+		return false;
+	}
+	out.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+	return !f.bad();
+}
+
+RedactMatcher RedactMatcher::load(const fs::path& config_path,
+	const fs::path& cache_path) {
+
+	// Fingerprint the config by its path, size and mtime so that a cache hit
+	// does not need to read (or parse) the config.
+	std::error_code ec;
+	uint64_t fingerprint;
+	auto mtime = fs::last_write_time(config_path, ec);
+	bool have_config = !ec;
+	if (have_config) {
+		fingerprint = fnv1a(absl::StrCat(
+			config_path.string(), ":", fs::file_size(config_path, ec), ":",
+			mtime.time_since_epoch().count()
+		));
+	} else {
+		fingerprint = fnv1a("<default>");
+	}
+
+	std::string data;
+	if (!cache_path.empty() && read_file(cache_path, data)) {
+		if (auto m = deserialize(data, fingerprint)) {
+			return std::move(*m);
+		}
+	}
+
+	std::vector<RedactRule> rules;
+	if (have_config) {
+		std::string config;
+		if (!read_file(config_path, config)) {
+			throw std::runtime_error(absl::StrCat(
+				"redact: failed to read config: ", config_path.string()
+			));
+		}
+		rules = parse_redact_rules(config);
+	} else {
+		rules = default_redact_rules();
+	}
+	RedactMatcher m(rules);
+
+	// Best effort: write the cache atomically.
+	if (!cache_path.empty()) {
+		fs::create_directories(cache_path.parent_path(), ec);
+		auto tmp = cache_path;
+		tmp += absl::StrCat(".", getpid(), ".tmp");
+		{
+			std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+			f << m.serialize(fingerprint);
+		}
+		fs::rename(tmp, cache_path, ec);
+		if (ec) {
+			fs::remove(tmp, ec);
+		}
+	}
+	return m;
+}
+
+} // namespace histdb
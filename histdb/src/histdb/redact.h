@@ -0,0 +1,79 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace histdb {
+
+// Redaction rules
+////////////////////////////////////////////////////////////////////////////////
+
+enum class RedactAction : uint8_t {
+	Redact = 1, // replace the rest of the word following the pattern
+	Ignore = 2, // do not record the command
+};
+
+struct RedactRule {
+	RedactAction action;
+	std::string pattern; // literal, matched ASCII case-insensitively
+};
+
+// default_redact_rules returns the rules used when there is no config file.
+std::vector<RedactRule> default_redact_rules();
+
+// parse_redact_rules parses a redaction config. Each non-empty line that is
+// not a comment ('#') is a rule of the form "redact PATTERN" or
+// "ignore PATTERN" where PATTERN is everything after the first space.
+// A config replaces the default rules. Throws std::invalid_argument if the
+// config is invalid.
+std::vector<RedactRule> parse_redact_rules(std::string_view config);
+
+// Matcher
+////////////////////////////////////////////////////////////////////////////////
+
+struct RedactResult {
+	bool ignore = false; // the command matched an "ignore" rule
+	int redacted = 0;    // number of redacted values
+};
+
+// RedactMatcher is an Aho-Corasick automaton compiled to a DFA over byte
+// equivalence classes, so matching any number of patterns is a single pass
+// with one table lookup per byte. It is cheap to serialize so that the
+// compiled automaton can be cached on disk and reused by every insert.
+class RedactMatcher {
+public:
+	explicit RedactMatcher(const std::vector<RedactRule>& rules);
+
+	// apply redacts raw in place and reports whether the command should be
+	// ignored. Matching stops at the first "ignore" match.
+	RedactResult apply(std::string& raw) const;
+
+	std::string serialize(uint64_t fingerprint) const;
+
+	// deserialize returns an empty optional if data is not a valid serialized
+	// matcher or was created with a different fingerprint.
+	static std::optional<RedactMatcher> deserialize(std::string_view data,
+		uint64_t fingerprint);
+
+	// load loads the rules from config_path (or the defaults if it does not
+	// exist) and compiles them, or returns the automaton cached at cache_path
+	// if it was compiled from the same config. The cache is updated on a miss,
+	// errors writing it are ignored.
+	static RedactMatcher load(const std::filesystem::path& config_path,
+		const std::filesystem::path& cache_path);
+
+private:
+	RedactMatcher() = default;
+
+	uint32_t nclasses_ = 1;
+	std::array<uint8_t, 256> classes_{};
+	std::vector<uint32_t> next_;  // [state * nclasses_ + class] => state
+	std::vector<uint8_t> flags_;  // [state] => RedactAction bits
+};
+
+} // namespace histdb
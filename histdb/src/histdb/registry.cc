@@ -0,0 +1,306 @@
+#include "registry.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "absl/strings/str_cat.h"
+#include <SQLiteCpp/Statement.h>
+
+#include "timefmt.h"
+
+namespace histdb {
+
+// Session id reservations
+////////////////////////////////////////////////////////////////////////////////
+
+// Ids are reserved past both the previous reservations and the session rows
+// (which "histdb session" wrote directly before the registry existed).
+constexpr char reserve_session_ids_stmt[] = R"""(
+UPDATE session_id_reservations
+SET next_id = max(next_id, (SELECT COALESCE(MAX(id), 0) + 1 FROM session_ids)) + ?;
+)""";
+
+int64_t reserve_session_ids(SQLite::Database& db, int64_t count) {
+	// A savepoint is a transaction of its own outside of one, and the
+	// UPDATE takes the write lock before anything is read.
+	db.exec("SAVEPOINT reserve_session_ids;");
+	try {
+		SQLite::Statement update(db, reserve_session_ids_stmt);
+		update.bind(1, count);
+		if (update.exec() != 1) {
+			throw std::runtime_error("session_id_reservations has no row");
+		}
+		const int64_t next_id = db.execAndGet(
+			"SELECT next_id FROM session_id_reservations;").getInt64();
+		db.exec("RELEASE reserve_session_ids;");
+		return next_id - count;
+	} catch (...) {
+		try {
+			db.exec("ROLLBACK TO reserve_session_ids; RELEASE reserve_session_ids;");
+		} catch (...) {
+			// ignore, report the original error
+		}
+		throw;
+	}
+}
+
+// Session registry
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+enum : uint32_t {
+	registry_new = 0,
+	registry_initializing = 1,
+	registry_ready = 2,
+};
+
+constexpr int range_count_bits = 16;
+constexpr uint64_t range_count_mask = (uint64_t(1) << range_count_bits) - 1;
+constexpr int64_t max_range_count = static_cast<int64_t>(range_count_mask);
+constexpr int64_t max_range_id = int64_t(1) << (64 - range_count_bits);
+
+// The process that creates the segment initializes it in microseconds, so
+// only a process killed while doing so makes the others wait this long.
+constexpr std::chrono::milliseconds init_timeout{100};
+
+} // namespace
+
+static uint64_t fnv1a(std::string_view s, uint64_t h = 14695981039346656037ULL) {
+	for (unsigned char c : s) {
+		h ^= c;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+std::string SessionRegistry::default_name(const std::string& database_path) {
+	// macOS limits names to 31 bytes.
+	return absl::StrCat("/histdb.", getuid(), ".",
+		absl::Hex(fnv1a(database_path) & 0xffffffff, absl::kZeroPad8));
+}
+
+void SessionRegistry::remove(const std::string& name) {
+	if (shm_unlink(name.c_str()) != 0 && errno != ENOENT) {
+		throw std::runtime_error(absl::StrCat(
+			"remove session registry: ", name, ": ", std::strerror(errno)));
+	}
+}
+
+SessionRegistry::SessionRegistry(const std::string& name,
+	const std::function<int64_t()>& boot_time_us) {
+
+	length_ = sizeof(RegistryHeader) + sizeof(RegistrySlot) * registry_slots;
+	const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+	if (fd == -1) {
+		throw std::runtime_error(absl::StrCat(
+			"open session registry: ", name, ": ", std::strerror(errno)));
+	}
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size == 0) {
+		// Racing creators truncate to the same size (or fail on macOS, which
+		// only allows it once), so check the size again either way.
+		(void)ftruncate(fd, static_cast<off_t>(length_));
+	}
+	if (fstat(fd, &st) != 0 || st.st_size != static_cast<off_t>(length_)) {
+		close(fd);
+		throw std::runtime_error(absl::StrCat("invalid session registry: ", name));
+	}
+	addr_ = mmap(nullptr, length_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr_ == MAP_FAILED) {
+		addr_ = nullptr;
+		throw std::runtime_error(absl::StrCat(
+			"mmap session registry: ", name, ": ", std::strerror(errno)));
+	}
+	header_ = static_cast<RegistryHeader *>(addr_);
+	slots_ = reinterpret_cast<RegistrySlot *>(static_cast<char *>(addr_) + sizeof(RegistryHeader));
+
+	// The segment is zero filled when created, the first process to flip
+	// init initializes the header.
+	uint32_t state = registry_new;
+	if (header_->init.compare_exchange_strong(state, registry_initializing)) {
+		try {
+			header_->boot_time_us = boot_time_us();
+		} catch (...) {
+			header_->init.store(registry_new, std::memory_order_release);
+			munmap(addr_, length_);
+			addr_ = nullptr;
+			throw;
+		}
+		std::memcpy(header_->magic, registry_magic, sizeof(registry_magic));
+		header_->slots = registry_slots;
+		header_->init.store(registry_ready, std::memory_order_release);
+	} else {
+		const auto deadline = std::chrono::steady_clock::now() + init_timeout;
+		while (header_->init.load(std::memory_order_acquire) != registry_ready) {
+			if (std::chrono::steady_clock::now() >= deadline) {
+				munmap(addr_, length_);
+				addr_ = nullptr;
+				throw std::runtime_error(absl::StrCat(
+					"session registry was not initialized: ", name));
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+	}
+	if (std::memcmp(header_->magic, registry_magic, sizeof(registry_magic)) != 0 ||
+		header_->slots != registry_slots) {
+
+		munmap(addr_, length_);
+		addr_ = nullptr;
+		throw std::runtime_error(absl::StrCat("invalid session registry: ", name));
+	}
+}
+
+SessionRegistry::~SessionRegistry() {
+	if (addr_) {
+		munmap(addr_, length_);
+	}
+}
+
+void SessionRegistry::register_session(int64_t session_id, int32_t ppid, SlotState state) {
+	RegistrySlot& s = slot(session_id);
+	// Unpublish the slot while it is rewritten so that readers that check
+	// the id before and after reading it never mix two sessions.
+	s.session_id.store(0, std::memory_order_release);
+	s.ppid.store(ppid, std::memory_order_relaxed);
+	s.last_command.store(0, std::memory_order_relaxed);
+	s.created_us.store(unix_micros(std::chrono::system_clock::now()),
+		std::memory_order_relaxed);
+	const auto old = static_cast<SlotState>(
+		s.state.exchange(static_cast<uint32_t>(state), std::memory_order_acq_rel));
+	if (old == SlotState::Pending) {
+		header_->pending.fetch_sub(1, std::memory_order_relaxed);
+	}
+	if (state == SlotState::Pending) {
+		header_->pending.fetch_add(1, std::memory_order_relaxed);
+	}
+	s.session_id.store(session_id, std::memory_order_release);
+}
+
+int64_t SessionRegistry::claim_session(int32_t ppid) {
+	uint64_t range = header_->range.load(std::memory_order_relaxed);
+	for (;;) {
+		const uint64_t left = range & range_count_mask;
+		if (left == 0) {
+			return 0;
+		}
+		const uint64_t next = range >> range_count_bits;
+		const uint64_t claimed = ((next + 1) << range_count_bits) | (left - 1);
+		if (header_->range.compare_exchange_weak(range, claimed,
+			std::memory_order_acq_rel, std::memory_order_relaxed)) {
+
+			const auto id = static_cast<int64_t>(next);
+			register_session(id, ppid, SlotState::Pending);
+			return id;
+		}
+	}
+}
+
+void SessionRegistry::add_block(int64_t first, int64_t count, int32_t ppid) {
+	register_session(first, ppid, SlotState::Pending);
+	if (count <= 1 || count > max_range_count + 1 || first > max_range_id - count) {
+		return;
+	}
+	const uint64_t block = (static_cast<uint64_t>(first + 1) << range_count_bits) |
+		static_cast<uint64_t>(count - 1);
+	uint64_t range = header_->range.load(std::memory_order_relaxed);
+	while ((range & range_count_mask) == 0) {
+		if (header_->range.compare_exchange_weak(range, block,
+			std::memory_order_acq_rel, std::memory_order_relaxed)) {
+			return;
+		}
+	}
+}
+
+bool SessionRegistry::record_command(int64_t session_id, std::string_view command) {
+	uint64_t h = fnv1a(command);
+	if (h == 0) {
+		h = 1; // 0 means no command
+	}
+	RegistrySlot& s = slot(session_id);
+	if (s.session_id.load(std::memory_order_acquire) != session_id) {
+		if (s.state.load(std::memory_order_acquire) ==
+			static_cast<uint32_t>(SlotState::Pending)) {
+			return true;
+		}
+		register_session(session_id, 0, SlotState::Flushed);
+	}
+	return s.last_command.exchange(h, std::memory_order_acq_rel) != h;
+}
+
+std::vector<int64_t> SessionRegistry::write_pending(SQLite::Database& db) const {
+	std::vector<int64_t> ids;
+	if (pending() == 0) {
+		return ids;
+	}
+	const TimePoint boot{std::chrono::microseconds(header_->boot_time_us)};
+	const std::string boot_time = format_time(boot);
+	SQLite::Statement insert(db,
+		"INSERT OR IGNORE INTO session_ids (id, ppid, boot_time) VALUES (?, ?, ?);");
+	for (uint32_t i = 0; i < registry_slots; i++) {
+		const RegistrySlot& s = slots_[i];
+		if (s.state.load(std::memory_order_acquire) !=
+			static_cast<uint32_t>(SlotState::Pending)) {
+			continue;
+		}
+		const int64_t id = s.session_id.load(std::memory_order_acquire);
+		const int32_t ppid = s.ppid.load(std::memory_order_relaxed);
+		if (id == 0 || s.session_id.load(std::memory_order_acquire) != id) {
+			continue; // being rewritten
+		}
+		insert.bind(1, id);
+		insert.bind(2, ppid);
+		insert.bind(3, boot_time);
+		insert.exec();
+		insert.reset();
+		ids.push_back(id);
+	}
+	return ids;
+}
+
+void SessionRegistry::mark_flushed(const std::vector<int64_t>& ids) {
+	for (int64_t id : ids) {
+		RegistrySlot& s = slot(id);
+		if (s.session_id.load(std::memory_order_acquire) != id) {
+			continue;
+		}
+		auto state = static_cast<uint32_t>(SlotState::Pending);
+		if (s.state.compare_exchange_strong(state, static_cast<uint32_t>(SlotState::Flushed),
+			std::memory_order_acq_rel)) {
+			header_->pending.fetch_sub(1, std::memory_order_relaxed);
+		}
+	}
+}
+
+RegistryStats SessionRegistry::stats() const {
+	RegistryStats stats;
+	const uint64_t range = header_->range.load(std::memory_order_acquire);
+	stats.next_id = static_cast<int64_t>(range >> range_count_bits);
+	stats.remaining = static_cast<int64_t>(range & range_count_mask);
+	for (uint32_t i = 0; i < registry_slots; i++) {
+		stats.sessions += slots_[i].session_id.load(std::memory_order_relaxed) != 0;
+	}
+	stats.pending = pending();
+	stats.boot_time_us = header_->boot_time_us;
+	return stats;
+}
+
+void print_registry_stats(const RegistryStats& stats, std::ostream& out) {
+	const TimePoint boot{std::chrono::microseconds(stats.boot_time_us)};
+	out << "registry: " << stats.sessions << " sessions, " << stats.pending
+		<< " pending\n"
+		<< "next session id: " << stats.next_id << " (" << stats.remaining
+		<< " left in block)\n"
+		<< "boot time: " << format_time(boot) << "\n";
+}
+
+} // namespace histdb
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <SQLiteCpp/Database.h>
+
+namespace histdb {
+
+// Session id reservations
+////////////////////////////////////////////////////////////////////////////////
+
+// reserve_session_ids reserves count consecutive session ids and returns the
+// first one. Reservations are recorded in the session_id_reservations table
+// so that ids are never handed out twice, even if the session rows using
+// them have not been written yet. It can be called in or out of a
+// transaction.
+int64_t reserve_session_ids(SQLite::Database& db, int64_t count);
+
+// Session registry
+////////////////////////////////////////////////////////////////////////////////
+
+// The session registry is a per-user shared memory segment that hands out
+// session ids from a block reserved in the database and remembers the last
+// command of each session, so that starting a shell does not touch SQLite
+// (only one in registry_block_size does) and repeated prompts are not
+// recorded twice. The rows of the sessions it hands out are written to the
+// session_ids table later, in bulk, by whoever next writes to the database.
+//
+// Layout (native byte order, shared by every process of the user):
+//
+//   RegistryHeader
+//   RegistrySlot[registry_slots]   slot of session id n is n % registry_slots
+//
+// Slots are direct-mapped: ids are handed out in order, so a slot is only
+// reused by a session registry_slots ids younger than its previous owner,
+// which was flushed by one of the many blocks reserved in between. Every
+// field is an atomic word and updates are single stores or compare-and-swaps,
+// so a process killed at any point leaves the registry usable.
+
+constexpr char registry_magic[8] = {'H', 'I', 'S', 'T', 'R', 'E', 'G', '1'};
+constexpr uint32_t registry_slots = 1024;
+constexpr int64_t registry_block_size = 64;
+
+enum class SlotState : uint32_t {
+	Free = 0,
+	Pending = 1, // the session row has not been written yet
+	Flushed = 2,
+};
+
+struct RegistryHeader {
+	std::atomic<uint32_t> init; // 0 new, 1 being initialized, 2 ready
+	uint32_t slots;
+	char magic[8];
+	int64_t boot_time_us;
+	// Unused ids of the current block: the next id in the high 48 bits and
+	// the number left in the low 16 bits, so that claiming one is a single
+	// compare-and-swap.
+	std::atomic<uint64_t> range;
+	std::atomic<int64_t> pending; // number of Pending slots
+	char padding[24];
+};
+
+struct alignas(64) RegistrySlot {
+	std::atomic<int64_t> session_id;
+	std::atomic<uint32_t> state; // SlotState
+	std::atomic<int32_t> ppid;
+	std::atomic<uint64_t> last_command; // hash of the last command, 0 if none
+	std::atomic<int64_t> created_us;
+};
+
+static_assert(sizeof(RegistryHeader) == 64, "RegistryHeader must fill a cache line");
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+	"the session registry needs address-free 64-bit atomics");
+
+struct RegistryStats {
+	int64_t next_id = 0;   // next id of the current block
+	int64_t remaining = 0; // ids left in the current block
+	int64_t sessions = 0;  // slots in use
+	int64_t pending = 0;   // sessions whose row has not been written
+	int64_t boot_time_us = 0;
+};
+
+// SessionRegistry is a mapping of the registry segment.
+class SessionRegistry {
+public:
+	// default_name returns the name of the registry of the database at path
+	// for the current user.
+	static std::string default_name(const std::string& database_path);
+
+	// remove unlinks the segment, processes that mapped it keep using it.
+	static void remove(const std::string& name);
+
+	// Opens (or creates) the segment name. boot_time_us is only called to
+	// initialize a new segment. Throws std::runtime_error if the segment
+	// cannot be mapped or was created by an incompatible version of histdb.
+	SessionRegistry(const std::string& name,
+		const std::function<int64_t()>& boot_time_us);
+	~SessionRegistry();
+
+	SessionRegistry(const SessionRegistry&) = delete;
+	SessionRegistry& operator=(const SessionRegistry&) = delete;
+
+	// claim_session hands out the next id of the current block to a new
+	// session of process ppid, or returns 0 if the block is used up.
+	int64_t claim_session(int32_t ppid);
+
+	// add_block registers a session for first, the first id of a newly
+	// reserved block, and offers the rest of the block to claim_session (it
+	// is dropped if another process installed a block meanwhile).
+	void add_block(int64_t first, int64_t count, int32_t ppid);
+
+	// record_command returns false if command is the last command recorded
+	// for the session and records it otherwise. Sessions that were not
+	// handed out by the registry are adopted, unless their slot holds a
+	// session that was not flushed.
+	bool record_command(int64_t session_id, std::string_view command);
+
+	int64_t pending() const { return header_->pending.load(std::memory_order_relaxed); }
+
+	// write_pending inserts the rows of the Pending sessions into the
+	// session_ids table and returns their ids. It must be called in a write
+	// transaction, pass the ids to mark_flushed once it committed.
+	std::vector<int64_t> write_pending(SQLite::Database& db) const;
+	void mark_flushed(const std::vector<int64_t>& ids);
+
+	RegistryStats stats() const;
+
+private:
+	RegistrySlot& slot(int64_t session_id) const {
+		return slots_[static_cast<uint64_t>(session_id) % registry_slots];
+	}
+	void register_session(int64_t session_id, int32_t ppid, SlotState state);
+
+	void *addr_ = nullptr;
+	size_t length_ = 0;
+	RegistryHeader *header_ = nullptr;
+	RegistrySlot *slots_ = nullptr;
+};
+
+void print_registry_stats(const RegistryStats& stats, std::ostream& out);
+
+} // namespace histdb
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+namespace histdb {
+
+// Ring buffer
+////////////////////////////////////////////////////////////////////////////////
+
+// RingBuffer is a bounded lock-free queue (Dmitry Vyukov's array queue).
+// Every cell carries a sequence number that tells producers and consumers
+// whether it is free or full for their lap around the ring, so a push or pop
+// is one compare-and-swap on the shared position followed by a release
+// store of the cell's sequence.
+//
+// The ingest pipeline uses it as an MPSC queue: many connection handlers
+// push and a single writer pops. Pops are nevertheless safe from any
+// thread, which the drop-oldest overflow policy relies on to evict the
+// oldest entry from a producer.
+//
+// capacity must be a power of two.
+template <typename T>
+class RingBuffer {
+public:
+	explicit RingBuffer(size_t capacity)
+		: mask_(capacity - 1), cells_(new Cell[capacity]) {
+
+		if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+			throw std::invalid_argument("ring buffer capacity must be a power of two");
+		}
+		for (size_t i = 0; i < capacity; i++) {
+			cells_[i].seq.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	RingBuffer(const RingBuffer&) = delete;
+	RingBuffer& operator=(const RingBuffer&) = delete;
+
+	size_t capacity() const { return mask_ + 1; }
+
+	// try_push moves value into the queue unless it is full.
+	bool try_push(T& value) {
+		size_t pos = tail_.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell& cell = cells_[pos & mask_];
+			const size_t seq = cell.seq.load(std::memory_order_acquire);
+			if (seq == pos) {
+				if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					cell.value = std::move(value);
+					cell.seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (seq < pos) {
+				return false; // full: the cell still holds last lap's value
+			} else {
+				pos = tail_.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// try_pop moves the oldest value into value unless the queue is empty.
+	bool try_pop(T& value) {
+		size_t pos = head_.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell& cell = cells_[pos & mask_];
+			const size_t seq = cell.seq.load(std::memory_order_acquire);
+			if (seq == pos + 1) {
+				if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					value = std::move(cell.value);
+					cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (seq < pos + 1) {
+				return false; // empty: the cell was not written this lap
+			} else {
+				pos = head_.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// size returns the number of queued values. It is only a snapshot when
+	// other threads are pushing or popping.
+	size_t size() const {
+		const size_t head = head_.load(std::memory_order_relaxed);
+		const size_t tail = tail_.load(std::memory_order_relaxed);
+		return tail > head ? tail - head : 0;
+	}
+
+private:
+	// Keep the positions and the cells on separate cache lines so producers
+	// and the consumer don't invalidate each other's lines.
+	static constexpr size_t cache_line = 64;
+
+	struct Cell {
+		std::atomic<size_t> seq;
+		T value;
+	};
+
+	const size_t mask_;
+	std::unique_ptr<Cell[]> cells_;
+	alignas(cache_line) std::atomic<size_t> tail_{0};
+	alignas(cache_line) std::atomic<size_t> head_{0};
+};
+
+} // namespace histdb
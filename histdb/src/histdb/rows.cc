@@ -0,0 +1,74 @@
+#include "rows.h"
+
+#include <SQLiteCpp/Column.h>
+
+namespace histdb {
+
+// Row cursor
+////////////////////////////////////////////////////////////////////////////////
+
+RowCursor::RowCursor(SQLite::Statement& query, size_t batch_rows)
+	: query_(query), batch_rows_(batch_rows > 0 ? batch_rows : 1),
+	  columns_(query.getColumnCount()) {
+
+	cells_.resize(batch_rows_ * static_cast<size_t>(columns_));
+	types_.resize(static_cast<size_t>(columns_), SQLITE_NULL);
+}
+
+bool RowCursor::next_batch() {
+	rows_ = 0;
+	arena_.clear();
+	if (done_) {
+		return false;
+	}
+	Cell *cell = cells_.data();
+	while (rows_ < batch_rows_) {
+		if (!query_.executeStep()) {
+			done_ = true;
+			break;
+		}
+		for (int i = 0; i < columns_; i++, cell++) {
+			const SQLite::Column col = query_.getColumn(i);
+			cell->size = 0;
+			cell->value = static_cast<int64_t>(arena_.size());
+
+			// Each call into SQLite costs about as much as copying the text,
+			// so a column that held text in the previous row is read as text
+			// right away and its type is only asked for if it is not (NULL).
+			// Text is read as a blob, which returns it as stored instead of
+			// checking its encoding, and must be read before its size (see
+			// sqlite3_column_bytes).
+			const char *data = nullptr;
+			if (types_[i] == SQLITE_TEXT) {
+				data = static_cast<const char *>(col.getBlob());
+			}
+			cell->type = data ? SQLITE_TEXT : col.getType();
+			types_[i] = cell->type;
+			if (cell->type == SQLITE_INTEGER) {
+				cell->value = col.getInt64();
+				continue;
+			}
+			if (cell->type == SQLITE_NULL) {
+				continue;
+			}
+			if (!data) {
+				data = static_cast<const char *>(col.getBlob());
+			}
+			const size_t n = static_cast<size_t>(col.getBytes());
+			cell->size = static_cast<uint32_t>(n);
+			arena_.append(data ? data : "", n);
+		}
+		rows_++;
+	}
+	rows_read_ += static_cast<int64_t>(rows_);
+	return rows_ > 0;
+}
+
+void RowCursor::reset() {
+	query_.reset();
+	rows_ = 0;
+	arena_.clear();
+	done_ = false;
+}
+
+} // namespace histdb
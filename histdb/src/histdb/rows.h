@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <SQLiteCpp/Statement.h>
+#include <sqlite3.h>
+
+namespace histdb {
+
+// Row cursor
+////////////////////////////////////////////////////////////////////////////////
+
+// RowCursor steps a statement and decodes its rows a batch at a time. Text
+// and blob columns are copied into an arena owned by the cursor, which is
+// cleared (but not freed) before every batch, so once the arena has grown to
+// the size of the largest batch a scan allocates nothing per row.
+//
+// The views returned by text are only valid until the next call to
+// next_batch or reset: callers that need to keep a value must copy it.
+//
+//	histdb::RowCursor rows(query);
+//	while (rows.next_batch()) {
+//		for (size_t i = 0; i < rows.size(); i++) {
+//			use(rows.integer(i, 0), rows.text(i, 1));
+//		}
+//	}
+class RowCursor {
+public:
+	static constexpr size_t default_batch_rows = 256;
+
+	// The cursor does not own query, which must outlive it and have its
+	// parameters bound before the first call to next_batch.
+	explicit RowCursor(SQLite::Statement& query,
+		size_t batch_rows = default_batch_rows);
+
+	RowCursor(const RowCursor&) = delete;
+	RowCursor& operator=(const RowCursor&) = delete;
+
+	// next_batch decodes up to batch_rows rows and returns false if there
+	// were none left.
+	bool next_batch();
+
+	// reset resets the statement so that it can be re-bound and scanned
+	// again, keeping the memory of the cursor.
+	void reset();
+
+	// size returns the number of rows in the current batch.
+	size_t size() const { return rows_; }
+	int columns() const { return columns_; }
+
+	// rows_read returns the number of rows decoded since the cursor was
+	// created.
+	int64_t rows_read() const { return rows_read_; }
+
+	bool is_null(size_t row, int col) const {
+		return cell(row, col).type == SQLITE_NULL;
+	}
+	// integer returns the column as an integer (zero if it is NULL or text).
+	// NB: columns are assumed to keep their type from one row to the next,
+	// an integer in a column that held text in the previous row is decoded
+	// as text.
+	int64_t integer(size_t row, int col) const {
+		const Cell& c = cell(row, col);
+		return c.type == SQLITE_INTEGER ? c.value : 0;
+	}
+	// text returns the column as text (empty if it is NULL or an integer,
+	// floats are formatted by SQLite).
+	std::string_view text(size_t row, int col) const {
+		const Cell& c = cell(row, col);
+		if (c.type == SQLITE_INTEGER) {
+			return std::string_view();
+		}
+		return std::string_view(arena_.data() + c.value, c.size);
+	}
+
+private:
+	// Cell is a decoded column: either an integer or the offset and size of
+	// its text in the arena.
+	struct Cell {
+		int64_t value;
+		uint32_t size;
+		int32_t type;
+	};
+
+	const Cell& cell(size_t row, int col) const {
+		return cells_[row * static_cast<size_t>(columns_) + static_cast<size_t>(col)];
+	}
+
+	SQLite::Statement& query_;
+	const size_t batch_rows_;
+	const int columns_;
+	std::vector<Cell> cells_;
+	std::vector<int> types_; // type of each column in the last row
+	std::string arena_;
+	size_t rows_ = 0;
+	int64_t rows_read_ = 0;
+	bool done_ = false;
+};
+
+} // namespace histdb
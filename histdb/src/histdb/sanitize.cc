@@ -0,0 +1,364 @@
+#include "sanitize.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <random>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define HISTDB_SANITIZE_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define HISTDB_SANITIZE_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace histdb {
+
+constexpr std::string_view utf8_replacement_char = "\xEF\xBF\xBD"; // U+FFFD
+
+// is_plain returns if c can be copied without further inspection: printable
+// ASCII (0x20 - 0x7E).
+static constexpr bool is_plain(unsigned char c) {
+	return 0x20 <= c && c < 0x7F;
+}
+
+// utf8_sequence_length returns the length of the valid UTF-8 sequence
+// starting at p[0] or, if the sequence is invalid, the negated length of its
+// maximal invalid subpart (see "U+FFFD Substitution of Maximal Subparts" in
+// chapter 3 of the Unicode standard). p[0] must be >= 0x80.
+static int utf8_sequence_length(const unsigned char *p, size_t n) {
+	const unsigned char c = p[0];
+	int len;
+	unsigned char lo = 0x80, hi = 0xBF; // valid range of the second byte
+	if (0xC2 <= c && c <= 0xDF) {
+		len = 2;
+	} else if (0xE0 <= c && c <= 0xEF) {
+		len = 3;
+		if (c == 0xE0) {
+			lo = 0xA0;
+		} else if (c == 0xED) {
+			hi = 0x9F; // surrogates
+		}
+	} else if (0xF0 <= c && c <= 0xF4) {
+		len = 4;
+		if (c == 0xF0) {
+			lo = 0x90;
+		} else if (c == 0xF4) {
+			hi = 0x8F; // > U+10FFFF
+		}
+	} else {
+		return -1; // continuation byte or invalid lead byte
+	}
+	if (n < 2 || p[1] < lo || p[1] > hi) {
+		return -1;
+	}
+	for (int i = 2; i < len; i++) {
+		if (static_cast<size_t>(i) >= n || p[i] < 0x80 || p[i] > 0xBF) {
+			return -i;
+		}
+	}
+	return len;
+}
+
+// sanitize_unit sanitizes the character (or invalid UTF-8 subsequence) at
+// p[i], appends the result to out and returns the index of the next
+// character.
+static size_t sanitize_unit(const unsigned char *p, size_t i, size_t n, std::string& out) {
+	const unsigned char c = p[i];
+	if (c < 0x80) {
+		if (c == '\r') {
+			out.push_back('\n');
+			return (i + 1 < n && p[i + 1] == '\n') ? i + 2 : i + 1;
+		}
+		if (is_plain(c) || c == '\t' || c == '\n') {
+			out.push_back(static_cast<char>(c));
+		}
+		return i + 1; // control char - drop it
+	}
+	int len = utf8_sequence_length(p + i, n - i);
+	if (len > 0) {
+		out.append(reinterpret_cast<const char *>(p + i), len);
+		return i + len;
+	}
+	out.append(utf8_replacement_char);
+	return i - len;
+}
+
+// plain_prefix functions return the length of the longest prefix of p that
+// only contains plain (printable ASCII) bytes.
+typedef size_t (*plain_prefix_func)(const unsigned char *p, size_t n);
+
+// PlainPrefixKernel is a vector implementation that the CPU supports, see
+// vector_kernels.
+struct PlainPrefixKernel {
+	const char *name;
+	plain_prefix_func prefix;
+};
+
+static size_t plain_prefix_scalar(const unsigned char *p, size_t n) {
+	size_t i = 0;
+	while (i < n && is_plain(p[i])) {
+		i++;
+	}
+	return i;
+}
+
+#if HISTDB_SANITIZE_X86
+
+static size_t plain_prefix_sse2(const unsigned char *p, size_t n) {
+	// Bytes >= 0x80 are negative when compared as signed so a single signed
+	// compare against 0x1F rejects both control chars and non-ASCII.
+	const __m128i lo = _mm_set1_epi8(0x1F);
+	const __m128i del = _mm_set1_epi8(0x7F);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+		__m128i ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, del), _mm_cmpgt_epi8(v, lo));
+		unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(ok));
+		if (mask != 0xFFFF) {
+			return i + __builtin_ctz(~mask);
+		}
+	}
+	return i + plain_prefix_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t plain_prefix_avx2(const unsigned char *p, size_t n) {
+	const __m256i lo = _mm256_set1_epi8(0x1F);
+	const __m256i del = _mm256_set1_epi8(0x7F);
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+		__m256i ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, del), _mm256_cmpgt_epi8(v, lo));
+		uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(ok));
+		if (mask != UINT32_MAX) {
+			return i + __builtin_ctz(~mask);
+		}
+	}
+	return i + plain_prefix_sse2(p + i, n - i);
+}
+
+static plain_prefix_func select_plain_prefix(const char **name) {
+	// NB: this runs during static initialization
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		*name = "avx2";
+		return plain_prefix_avx2;
+	}
+	*name = "sse2";
+	return plain_prefix_sse2;
+}
+
+static std::vector<PlainPrefixKernel> vector_kernels() {
+	std::vector<PlainPrefixKernel> kernels;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		kernels.push_back({"avx2", plain_prefix_avx2});
+	}
+	kernels.push_back({"sse2", plain_prefix_sse2});
+	return kernels;
+}
+
+#elif HISTDB_SANITIZE_NEON
+
+static size_t plain_prefix_neon(const unsigned char *p, size_t n) {
+	const uint8x16_t lo = vdupq_n_u8(0x20);
+	const uint8x16_t hi = vdupq_n_u8(0x7F);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t v = vld1q_u8(p + i);
+		uint8x16_t ok = vandq_u8(vcgeq_u8(v, lo), vcltq_u8(v, hi));
+		if (vminvq_u8(ok) != 0xFF) {
+			return i + plain_prefix_scalar(p + i, 16);
+		}
+	}
+	return i + plain_prefix_scalar(p + i, n - i);
+}
+
+static plain_prefix_func select_plain_prefix(const char **name) {
+	*name = "neon";
+	return plain_prefix_neon;
+}
+
+static std::vector<PlainPrefixKernel> vector_kernels() {
+	return {{"neon", plain_prefix_neon}};
+}
+
+#else
+
+static plain_prefix_func select_plain_prefix(const char **name) {
+	*name = "scalar";
+	return plain_prefix_scalar;
+}
+
+static std::vector<PlainPrefixKernel> vector_kernels() {
+	return {};
+}
+
+#endif
+
+static const char *kernel_name = nullptr;
+static const plain_prefix_func plain_prefix = select_plain_prefix(&kernel_name);
+
+static std::string sanitize(std::string_view raw, plain_prefix_func prefix) {
+	const auto *p = reinterpret_cast<const unsigned char *>(raw.data());
+	const size_t n = raw.size();
+
+	std::string out;
+	out.reserve(n);
+	size_t i = 0;
+	while (i < n) {
+		size_t k = prefix(p + i, n - i);
+		out.append(raw.data() + i, k);
+		i += k;
+		if (i < n) {
+			i = sanitize_unit(p, i, n, out);
+		}
+	}
+
+	// Control chars other than '\t' and '\n' have been removed.
+	constexpr std::string_view space = " \t\n";
+	auto end = out.find_last_not_of(space);
+	if (end == std::string::npos) {
+		return std::string();
+	}
+	out.erase(end + 1);
+	out.erase(0, out.find_first_not_of(space));
+	return out;
+}
+
+std::string sanitize_command(std::string_view raw) {
+	return sanitize(raw, plain_prefix);
+}
+
+std::string sanitize_command_scalar(std::string_view raw) {
+	return sanitize(raw, plain_prefix_scalar);
+}
+
+const char *sanitize_kernel() {
+	return kernel_name;
+}
+
+// Kernel checks
+////////////////////////////////////////////////////////////////////////////////
+
+// The bytes that end a plain run, and the bounds of the plain range.
+constexpr unsigned char special_bytes[] = {
+	0x00, '\t', '\n', '\r', 0x1B, 0x1F, 0x7F, 0x80, 0xBF, 0xC3, 0xE2, 0xF0, 0xFF,
+};
+
+// SanitizeChecker compares the kernels to the scalar path on one input at a
+// time.
+class SanitizeChecker {
+public:
+	explicit SanitizeChecker(std::ostream& out) : out_(out), kernels_(vector_kernels()) {}
+
+	void check(std::string_view raw) {
+		inputs_++;
+		const auto *p = reinterpret_cast<const unsigned char *>(raw.data());
+		const size_t want_prefix = plain_prefix_scalar(p, raw.size());
+		const std::string want = sanitize(raw, plain_prefix_scalar);
+		for (const auto& k : kernels_) {
+			const size_t prefix = k.prefix(p, raw.size());
+			if (prefix != want_prefix) {
+				mismatch(k, raw, absl::StrCat("plain prefix ", prefix, ", scalar ", want_prefix));
+			} else if (sanitize(raw, k.prefix) != want) {
+				mismatch(k, raw, "sanitized command differs");
+			}
+		}
+	}
+
+	void print_summary(std::ostream& out) const {
+		out << "histdb: sanitize check: kernels";
+		for (const auto& k : kernels_) {
+			out << " " << k.name;
+		}
+		if (kernels_.empty()) {
+			out << " (none)";
+		}
+		out << ": " << inputs_ << " inputs, " << mismatches_ << " mismatches" << std::endl;
+	}
+
+	int64_t mismatches() const { return mismatches_; }
+
+private:
+	void mismatch(const PlainPrefixKernel& k, std::string_view raw, const std::string& what) {
+		// The first ones are enough to reproduce a bug.
+		if (mismatches_++ >= 10) {
+			return;
+		}
+		out_ << "histdb: sanitize check: " << k.name << ": " << what << ": "
+			<< raw.size() << " bytes:" << std::hex << std::setfill('0');
+		for (const char c : raw) {
+			out_ << " " << std::setw(2) << static_cast<int>(static_cast<unsigned char>(c));
+		}
+		out_ << std::dec << std::setfill(' ') << std::endl;
+	}
+
+	std::ostream& out_;
+	const std::vector<PlainPrefixKernel> kernels_;
+	int64_t inputs_ = 0;
+	int64_t mismatches_ = 0;
+};
+
+int64_t run_sanitize_check(const SanitizeCheckOptions& opts, std::ostream& out) {
+	SanitizeChecker checker(out);
+
+	// Every length, with one special byte at every position (or none).
+	std::string raw;
+	for (size_t n = 0; n <= opts.max_length; n++) {
+		raw.assign(n, 'a');
+		for (size_t i = 0; i < n; i++) {
+			raw[i] = static_cast<char>('!' + i % 94);
+		}
+		checker.check(raw);
+		for (size_t i = 0; i < n; i++) {
+			const char plain = raw[i];
+			for (const unsigned char c : special_bytes) {
+				raw[i] = static_cast<char>(c);
+				checker.check(raw);
+			}
+			// The bounds of the plain range.
+			for (const char c : {' ', '~'}) {
+				raw[i] = c;
+				checker.check(raw);
+			}
+			raw[i] = plain;
+		}
+	}
+
+	// Random commands, mostly plain so that the vector paths run, at every
+	// alignment of the loads.
+	std::mt19937_64 rng(opts.seed);
+	std::uniform_int_distribution<size_t> length(0, 4 * opts.max_length);
+	std::uniform_int_distribution<int> byte(0, 255);
+	std::uniform_int_distribution<int> percent(0, 99);
+	std::string buf;
+	for (int64_t r = 0; r < opts.random; r++) {
+		const size_t offset = static_cast<size_t>(r % 64);
+		const size_t n = length(rng);
+		const int special = percent(rng) % 8;
+		buf.assign(offset, 'x');
+		for (size_t i = 0; i < n; i++) {
+			const int p = percent(rng);
+			if (p < special) {
+				buf.push_back(static_cast<char>(
+					special_bytes[static_cast<size_t>(byte(rng)) % sizeof(special_bytes)]));
+			} else if (p < 2 * special) {
+				buf.push_back(static_cast<char>(byte(rng)));
+			} else {
+				buf.push_back(static_cast<char>(' ' + byte(rng) % 95));
+			}
+		}
+		checker.check(std::string_view(buf).substr(offset));
+	}
+
+	checker.print_summary(out);
+	return checker.mismatches();
+}
+
+} // namespace histdb
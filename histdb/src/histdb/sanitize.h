@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+namespace histdb {
+
+// sanitize_command cleans a raw shell command before it is stored:
+//
+//   * invalid UTF-8 is replaced with U+FFFD (one per maximal invalid
+//     subsequence, which matches Python's "replace" error handler)
+//   * "\r\n" and lone '\r' are normalized to '\n'
+//   * ASCII control characters other than '\t' and '\n' are removed
+//   * leading and trailing ASCII whitespace is trimmed
+//
+// Runs of printable ASCII are validated 16 or 32 bytes at a time using
+// SSE2/AVX2 (or NEON) and copied as is; everything else goes through the
+// scalar path.
+std::string sanitize_command(std::string_view raw);
+
+// sanitize_command_scalar is the portable implementation of
+// sanitize_command. It is exposed for testing and benchmarks.
+std::string sanitize_command_scalar(std::string_view raw);
+
+// sanitize_kernel returns the name of the vector kernel used by
+// sanitize_command ("avx2", "sse2", "neon" or "scalar").
+const char *sanitize_kernel();
+
+// Kernel checks
+////////////////////////////////////////////////////////////////////////////////
+
+struct SanitizeCheckOptions {
+	size_t max_length = 100; // of the boundary inputs
+	int64_t random = 100000; // number of random inputs
+	uint64_t seed = 1;
+};
+
+// run_sanitize_check compares every vector kernel that the CPU supports to
+// the scalar path, both the length of the plain prefix and the sanitized
+// command. The inputs are every plain command of up to max_length bytes with
+// one special byte (a control char, a CR, a UTF-8 lead or continuation byte,
+// DEL) at every position, which covers every length around the 16 and 32 byte
+// blocks, and then random commands at random alignments. It prints the first
+// mismatches and a summary and returns the number of mismatches.
+int64_t run_sanitize_check(const SanitizeCheckOptions& opts, std::ostream& out);
+
+} // namespace histdb
@@ -0,0 +1,201 @@
+#include "session.h"
+
+#include <algorithm>
+#include <iomanip>
+
+#include "blobs.h"
+#include "paths.h"
+
+namespace histdb {
+
+// Session cursor
+////////////////////////////////////////////////////////////////////////////////
+
+// Served by the history_session_id_idx (session_id, id) index.
+constexpr char select_session_page_stmt[] = R"""(
+SELECT id, history_id, status_code, created_at, directory,
+	)""" HISTDB_COMMAND_SQL R"""(
+FROM history
+WHERE session_id = ? AND id > ?
+ORDER BY id
+LIMIT ?;
+)""";
+
+SessionCursor::SessionCursor(SQLite::Database& db, int64_t session_id,
+	int64_t after_id, int page_size)
+	: query_(db, select_session_page_stmt), rows_(query_, page_size),
+	  page_size_(page_size), position_(after_id) {
+
+	query_.bind(1, session_id);
+	query_.bind(3, page_size_);
+}
+
+bool SessionCursor::fetch() {
+	index_ = 0;
+	rows_.reset();
+	query_.bind(2, position_);
+	rows_.next_batch();
+	done_ = rows_.size() < static_cast<size_t>(page_size_);
+	return rows_.size() > 0;
+}
+
+bool SessionCursor::next(SessionEntry& e) {
+	if (index_ == rows_.size()) {
+		if (done_ || !fetch()) {
+			return false;
+		}
+	}
+	// Assign rather than construct the strings so that their buffers are
+	// reused from one entry to the next.
+	const size_t i = index_++;
+	e.id = rows_.integer(i, 0);
+	e.history_id = rows_.integer(i, 1);
+	e.status_code = static_cast<int>(rows_.integer(i, 2));
+	e.created_at.assign(rows_.text(i, 3));
+	e.directory.assign(rows_.text(i, 4));
+	e.raw.assign(rows_.text(i, 5));
+	position_ = e.id;
+	return true;
+}
+
+// Show and replay
+////////////////////////////////////////////////////////////////////////////////
+
+// for_each_entry calls fn with every entry of the session (and the previous
+// entry, or nullptr) up to opts.limit and returns the next cursor.
+template <typename Func>
+static int64_t for_each_entry(SQLite::Database& db, const SessionOptions& opts,
+	Func fn) {
+
+	SessionCursor cursor(db, opts.session_id, opts.after_id);
+	SessionEntry prev;
+	SessionEntry e;
+	int64_t n = 0;
+	while (cursor.next(e)) {
+		if (opts.limit > 0 && n == opts.limit) {
+			return prev.id; // there is at least one more entry
+		}
+		fn(e, n == 0 ? nullptr : &prev);
+		std::swap(prev, e);
+		n++;
+	}
+	return 0;
+}
+
+int64_t print_session(SQLite::Database& db, const SessionOptions& opts,
+	std::ostream& out) {
+
+	return for_each_entry(db, opts, [&out](const SessionEntry& e, const SessionEntry *prev) {
+		if (prev) {
+			if (e.history_id > prev->history_id + 1) {
+				const int64_t missing = e.history_id - prev->history_id - 1;
+				out << "        # " << missing << (missing == 1 ? " command" : " commands")
+					<< " not recorded\n";
+			} else if (e.history_id <= prev->history_id) {
+				out << "        # history numbering restarted\n";
+			}
+		}
+		if (!prev || e.directory != prev->directory) {
+			out << "# " << e.directory << "\n";
+		}
+		out << std::setw(6) << e.history_id << std::setw(5) << e.status_code << "  "
+			<< e.created_at << "  " << e.raw << "\n";
+	});
+}
+
+// shell_quote quotes s for bash using single quotes.
+static std::string shell_quote(const std::string& s) {
+	std::string out = "'";
+	for (char c : s) {
+		if (c == '\'') {
+			out.append("'\\''");
+		} else {
+			out.push_back(c);
+		}
+	}
+	out.push_back('\'');
+	return out;
+}
+
+int64_t print_session_replay(SQLite::Database& db, const SessionOptions& opts,
+	std::ostream& out) {
+
+	if (opts.after_id == 0) {
+		out << "#!/usr/bin/env bash\n"
+			<< "# histdb session " << opts.session_id << "\n";
+	}
+	return for_each_entry(db, opts, [&out](const SessionEntry& e, const SessionEntry *prev) {
+		if (!prev || e.directory != prev->directory) {
+			out << "cd " << shell_quote(e.directory) << "\n";
+		}
+		if (e.status_code != 0) {
+			out << "# exit status " << e.status_code << "\n";
+		}
+		out << e.raw << "\n";
+	});
+}
+
+// Seeding
+////////////////////////////////////////////////////////////////////////////////
+
+// Served by the history_directory_ref_idx (directory_id, id) index.
+constexpr char select_directory_seed_stmt[] = R"""(
+SELECT )""" HISTDB_COMMAND_SQL R"""( FROM history
+WHERE directory_id = (SELECT id FROM directories WHERE path = ?1)
+ORDER BY id DESC
+LIMIT ?2;
+)""";
+
+// The subdirectories are a range scan of the unique path index (see
+// subtree_range) and each of their rows is found with the
+// history_directory_ref_idx index.
+constexpr char select_subtree_seed_stmt[] = R"""(
+SELECT )""" HISTDB_COMMAND_SQL R"""( FROM history
+WHERE directory_id IN (
+	SELECT id FROM directories
+	WHERE path = ?1 OR (path >= ?3 AND path < ?4)
+)
+ORDER BY id DESC
+LIMIT ?2;
+)""";
+
+// The subquery walks the history table backwards from the most recent row
+// and stops at the first row of another session (so it only reads the
+// current session's rows), the outer query is served by the
+// history_session_id_idx (session_id, id) index.
+constexpr char select_previous_session_seed_stmt[] = R"""(
+SELECT )""" HISTDB_COMMAND_SQL R"""( FROM history
+WHERE session_id = (
+	SELECT session_id FROM history WHERE session_id != ? ORDER BY id DESC LIMIT 1
+)
+ORDER BY id DESC
+LIMIT ?;
+)""";
+
+std::vector<std::string> seed_history(SQLite::Database& db, const SeedOptions& opts) {
+	std::vector<std::string> cmds;
+	if (opts.limit <= 0) {
+		return cmds;
+	}
+	const char *stmt = opts.previous_session ? select_previous_session_seed_stmt :
+		opts.subdirectories ? select_subtree_seed_stmt : select_directory_seed_stmt;
+	SQLite::Statement query(db, stmt);
+	if (opts.previous_session) {
+		query.bind(1, opts.session_id);
+	} else {
+		query.bind(1, opts.directory);
+		if (opts.subdirectories) {
+			const PathRange range = subtree_range(opts.directory);
+			query.bind(3, range.lo);
+			query.bind(4, range.hi);
+		}
+	}
+	query.bind(2, opts.limit);
+	while (query.executeStep()) {
+		cmds.push_back(query.getColumn(0).getString());
+	}
+	std::reverse(cmds.begin(), cmds.end());
+	return cmds;
+}
+
+} // namespace histdb
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <SQLiteCpp/Database.h>
+#include <SQLiteCpp/Statement.h>
+
+#include "rows.h"
+
+namespace histdb {
+
+// Session cursor
+////////////////////////////////////////////////////////////////////////////////
+
+struct SessionEntry {
+	int64_t id = 0;
+	int64_t history_id = 0;
+	int32_t status_code = 0;
+	std::string created_at;
+	std::string directory;
+	std::string raw;
+};
+
+// SessionCursor iterates over the history of a session in insertion order.
+// Rows are fetched a page at a time using keyset pagination on the
+// (session_id, id) index so that memory use and the cost of each query are
+// independent of the size of the session. Pages are decoded by a RowCursor,
+// so next only copies an entry into the buffers of e.
+class SessionCursor {
+public:
+	// The cursor starts after the history row with id after_id.
+	SessionCursor(SQLite::Database& db, int64_t session_id, int64_t after_id = 0,
+		int page_size = 256);
+
+	// next stores the next entry in e and returns false if there are none.
+	bool next(SessionEntry& e);
+
+	// position returns the id of the last entry returned by next, which can
+	// be used to resume the cursor later.
+	int64_t position() const { return position_; }
+
+private:
+	bool fetch();
+
+	SQLite::Statement query_;
+	RowCursor rows_;
+	const int page_size_;
+	int64_t position_;
+	size_t index_ = 0;
+	bool done_ = false;
+};
+
+// Show and replay
+////////////////////////////////////////////////////////////////////////////////
+
+struct SessionOptions {
+	int64_t session_id = 0;
+	int64_t after_id = 0; // start after this history row (cursor)
+	int64_t limit = 0;    // max number of commands to print (0 means all)
+};
+
+// print_session prints the commands of a session in order along with their
+// exit codes, a line whenever the directory changes and a note whenever bash
+// history numbers were skipped (commands that were not recorded) or
+// restarted. If the output was truncated by opts.limit the cursor to pass as
+// opts.after_id to get the next page is returned, otherwise zero.
+int64_t print_session(SQLite::Database& db, const SessionOptions& opts,
+	std::ostream& out);
+
+// print_session_replay prints the session as a bash script that changes to
+// the directory of each command before running it. Failed commands are
+// annotated with their exit code. Returns the next cursor like
+// print_session.
+int64_t print_session_replay(SQLite::Database& db, const SessionOptions& opts,
+	std::ostream& out);
+
+// Seeding
+////////////////////////////////////////////////////////////////////////////////
+
+struct SeedOptions {
+	int64_t limit = 100;
+	// Seed from the most recent session other than session_id instead of
+	// from directory.
+	bool previous_session = false;
+	int64_t session_id = 0;
+	std::string directory; // canonical path (see paths.h)
+	bool subdirectories = false;
+};
+
+// seed_history returns the last opts.limit commands run in opts.directory
+// (and its subdirectories if opts.subdirectories is set) or in the previous
+// session, oldest first, for a new shell to load into its history. Each is a
+// single indexed query.
+std::vector<std::string> seed_history(SQLite::Database& db, const SeedOptions& opts);
+
+} // namespace histdb
@@ -0,0 +1,393 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "absl/strings/str_cat.h"
+#include <SQLiteCpp/Statement.h>
+
+#include "blobs.h"
+#include "rows.h"
+#include "timefmt.h"
+#include "trace.h"
+
+namespace histdb {
+
+static uint32_t trigram_key(const char *p) {
+	return uint32_t(uint8_t(p[0])) << 16 | uint32_t(uint8_t(p[1])) << 8 | uint32_t(uint8_t(p[2]));
+}
+
+// trigram_keys returns the distinct trigrams of s, sorted.
+static std::vector<uint32_t> trigram_keys(std::string_view s) {
+	std::vector<uint32_t> keys;
+	if (s.size() < 3) {
+		return keys;
+	}
+	keys.reserve(s.size() - 2);
+	for (size_t i = 0; i + 3 <= s.size(); i++) {
+		keys.push_back(trigram_key(s.data() + i));
+	}
+	std::sort(keys.begin(), keys.end());
+	keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+	return keys;
+}
+
+// Snapshot
+////////////////////////////////////////////////////////////////////////////////
+
+static bool section_fits(uint64_t offset, uint64_t count, uint64_t size, uint64_t length) {
+	return offset % 8 == 0 && offset <= length && count <= (length - offset) / size;
+}
+
+Snapshot::Snapshot(const std::string& path) {
+	const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		throw std::runtime_error(absl::StrCat(
+			"open snapshot: ", path, ": ", std::strerror(errno)));
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(SnapshotHeader))) {
+		close(fd);
+		throw std::runtime_error(absl::StrCat("invalid snapshot: ", path));
+	}
+	length_ = static_cast<size_t>(st.st_size);
+	addr_ = mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr_ == MAP_FAILED) {
+		addr_ = nullptr;
+		throw std::runtime_error(absl::StrCat(
+			"mmap snapshot: ", path, ": ", std::strerror(errno)));
+	}
+
+	const auto *base = static_cast<const char *>(addr_);
+	header_ = reinterpret_cast<const SnapshotHeader *>(base);
+	const SnapshotHeader& h = *header_;
+	const uint64_t n = length_;
+	if (std::memcmp(h.magic, snapshot_magic, sizeof(h.magic)) != 0 ||
+		h.version != snapshot_version || h.byte_order != snapshot_byte_order ||
+		h.file_size != n ||
+		!section_fits(h.entries_offset, h.entry_count, sizeof(SnapshotEntry), n) ||
+		!section_fits(h.trigrams_offset, h.trigram_count, sizeof(SnapshotTrigram), n) ||
+		!section_fits(h.postings_offset, h.postings_count, sizeof(uint32_t), n) ||
+		!section_fits(h.strings_offset, h.strings_size, 1, n)) {
+
+		munmap(addr_, length_);
+		addr_ = nullptr;
+		throw std::runtime_error(absl::StrCat("invalid snapshot: ", path));
+	}
+	entries_ = reinterpret_cast<const SnapshotEntry *>(base + h.entries_offset);
+	trigrams_ = reinterpret_cast<const SnapshotTrigram *>(base + h.trigrams_offset);
+	postings_ = reinterpret_cast<const uint32_t *>(base + h.postings_offset);
+	strings_ = base + h.strings_offset;
+}
+
+Snapshot::~Snapshot() {
+	if (addr_) {
+		munmap(addr_, length_);
+	}
+}
+
+std::string_view Snapshot::text(size_t i) const {
+	const SnapshotEntry& e = entries_[i];
+	// Bounds are checked here rather than when the file is opened.
+	if (e.text_offset > header_->strings_size ||
+		e.text_size > header_->strings_size - e.text_offset) {
+		return std::string_view();
+	}
+	return std::string_view(strings_ + e.text_offset, e.text_size);
+}
+
+const SnapshotTrigram *Snapshot::find_trigram(uint32_t key) const {
+	const SnapshotTrigram *end = trigrams_ + header_->trigram_count;
+	const SnapshotTrigram *t = std::lower_bound(trigrams_, end, key,
+		[](const SnapshotTrigram& a, uint32_t k) { return a.key < k; });
+	if (t == end || t->key != key || t->postings_index > header_->postings_count ||
+		t->postings_size > header_->postings_count - t->postings_index) {
+		return nullptr;
+	}
+	return t;
+}
+
+std::vector<size_t> Snapshot::search(std::string_view query, size_t limit) const {
+	std::vector<size_t> found;
+	if (limit == 0) {
+		return found;
+	}
+	if (query.size() < 3) {
+		for (size_t i = 0; i < size() && found.size() < limit; i++) {
+			if (text(i).find(query) != std::string_view::npos) {
+				found.push_back(i);
+			}
+		}
+		return found;
+	}
+
+	// Every match is in the posting list of each of the query's trigrams, so
+	// only the shortest list has to be checked.
+	const SnapshotTrigram *rarest = nullptr;
+	for (uint32_t key : trigram_keys(query)) {
+		const SnapshotTrigram *t = find_trigram(key);
+		if (t == nullptr) {
+			return found;
+		}
+		if (rarest == nullptr || t->postings_size < rarest->postings_size) {
+			rarest = t;
+		}
+	}
+	const uint32_t *p = postings_ + rarest->postings_index;
+	for (uint32_t j = 0; j < rarest->postings_size && found.size() < limit; j++) {
+		const size_t i = p[j];
+		if (i < size() && text(i).find(query) != std::string_view::npos) {
+			found.push_back(i);
+		}
+	}
+	return found;
+}
+
+// Refresh
+////////////////////////////////////////////////////////////////////////////////
+
+const char create_history_deletions_stmt[] = R"""(
+CREATE TABLE IF NOT EXISTS history_deletions (
+    `id`      INTEGER PRIMARY KEY CHECK (id = 1),
+    `deleted` INTEGER NOT NULL
+);
+
+INSERT OR IGNORE INTO history_deletions (id, deleted) VALUES (1, 0);
+
+CREATE TRIGGER IF NOT EXISTS history_count_deletions AFTER DELETE ON history
+BEGIN
+    UPDATE history_deletions SET deleted = deleted + 1 WHERE id = 1;
+END;
+)""";
+
+constexpr char select_history_deletions_stmt[] = R"""(
+SELECT deleted FROM history_deletions WHERE id = 1;
+)""";
+
+// Served by the history primary key.
+constexpr char select_snapshot_rows_stmt[] = R"""(
+SELECT
+	id,
+	)""" HISTDB_COMMAND_SQL R"""(,
+	COALESCE(created_at_us, histdb_unix_us(created_at))
+FROM history
+WHERE id > ?
+ORDER BY id;
+)""";
+
+namespace {
+
+struct Command {
+	uint32_t count = 0;
+	int64_t last_used_us = 0;
+	int64_t last_id = 0;
+	double score = 0;
+};
+
+} // namespace
+
+// decay returns the factor that a score at from_us is multiplied by at to_us.
+static double decay(int64_t from_us, int64_t to_us) {
+	const double half_life_us = std::chrono::duration<double, std::micro>(
+		frecency_half_life).count();
+	return std::exp2(-static_cast<double>(to_us - from_us) / half_life_us);
+}
+
+static uint64_t align8(uint64_t n) {
+	return (n + 7) & ~uint64_t(7);
+}
+
+template <typename T>
+static void put(std::string& buf, uint64_t offset, const T& value) {
+	std::memcpy(buf.data() + offset, &value, sizeof(T));
+}
+
+// write_file writes data to path atomically (via a temporary file and
+// rename).
+static void write_file(const std::string& path, const std::string& data) {
+	const std::string tmp = absl::StrCat(path, ".tmp.", getpid());
+	const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		throw std::system_error(errno, std::generic_category(), tmp);
+	}
+	const char *p = data.data();
+	size_t left = data.size();
+	while (left > 0) {
+		const ssize_t n = ::write(fd, p, left);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			const int err = errno;
+			close(fd);
+			unlink(tmp.c_str());
+			throw std::system_error(err, std::generic_category(), tmp);
+		}
+		p += n;
+		left -= static_cast<size_t>(n);
+	}
+	if (fsync(fd) != 0 || close(fd) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+		const int err = errno;
+		unlink(tmp.c_str());
+		throw std::system_error(err, std::generic_category(), path);
+	}
+}
+
+SnapshotStats refresh_snapshot(SQLite::Database& db, const std::string& path, bool full) {
+	TraceSpan span("snapshot");
+	SnapshotStats stats;
+	const int64_t now = unix_micros(std::chrono::system_clock::now());
+	std::unordered_map<std::string, Command> commands;
+	int64_t watermark = 0;
+	bool loaded = false;
+
+	const int64_t max_id = db.execAndGet("SELECT COALESCE(MAX(id), 0) FROM history;").getInt64();
+	// Read before the rows, so that rows deleted while they are read
+	// invalidate the snapshot written here.
+	const int64_t deletions = db.execAndGet(select_history_deletions_stmt).getInt64();
+	if (!full) {
+		try {
+			Snapshot old(path);
+			// A watermark past the end means that the database was replaced.
+			if (old.header().watermark <= max_id && old.header().deletions == deletions) {
+				const double f = decay(old.header().scored_at_us, now);
+				commands.reserve(old.size());
+				for (size_t i = 0; i < old.size(); i++) {
+					const SnapshotEntry& e = old.entry(i);
+					commands.emplace(std::string(old.text(i)),
+						Command{e.count, e.last_used_us, e.last_id, e.score * f});
+				}
+				watermark = old.header().watermark;
+				loaded = true;
+			}
+		} catch (const std::runtime_error&) {
+			// Missing or invalid, rebuild it.
+		}
+	}
+	stats.full = !loaded;
+
+	SQLite::Statement query(db, select_snapshot_rows_stmt);
+	query.bind(1, watermark);
+	RowCursor rows(query);
+	std::string raw; // only copied into the map for new commands
+	while (rows.next_batch()) {
+		for (size_t i = 0; i < rows.size(); i++) {
+			const int64_t id = rows.integer(i, 0);
+			const int64_t created_us = rows.is_null(i, 2) ? now : rows.integer(i, 2);
+			raw.assign(rows.text(i, 1));
+			Command& c = commands[raw];
+			c.count++;
+			c.last_used_us = std::max(c.last_used_us, created_us);
+			c.last_id = id;
+			c.score += decay(created_us, now);
+			watermark = id;
+		}
+	}
+	stats.new_rows = rows.rows_read();
+
+	// Sort by frecency, the most recently used first on ties.
+	std::vector<std::pair<const std::string *, const Command *>> sorted;
+	sorted.reserve(commands.size());
+	for (const auto& [text, c] : commands) {
+		sorted.emplace_back(&text, &c);
+	}
+	std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+		if (a.second->score != b.second->score) {
+			return a.second->score > b.second->score;
+		}
+		return a.second->last_id > b.second->last_id;
+	});
+
+	std::unordered_map<uint32_t, std::vector<uint32_t>> index;
+	uint64_t strings_size = 0;
+	for (size_t i = 0; i < sorted.size(); i++) {
+		for (uint32_t key : trigram_keys(*sorted[i].first)) {
+			index[key].push_back(static_cast<uint32_t>(i));
+		}
+		strings_size += sorted[i].first->size();
+	}
+	std::vector<uint32_t> keys;
+	keys.reserve(index.size());
+	uint64_t postings_count = 0;
+	for (const auto& [key, postings] : index) {
+		keys.push_back(key);
+		postings_count += postings.size();
+	}
+	std::sort(keys.begin(), keys.end());
+
+	SnapshotHeader h;
+	std::memset(&h, 0, sizeof(h));
+	std::memcpy(h.magic, snapshot_magic, sizeof(h.magic));
+	h.version = snapshot_version;
+	h.byte_order = snapshot_byte_order;
+	h.watermark = watermark;
+	h.scored_at_us = now;
+	h.deletions = deletions;
+	h.entry_count = sorted.size();
+	h.entries_offset = align8(sizeof(SnapshotHeader));
+	h.trigram_count = keys.size();
+	h.trigrams_offset = align8(h.entries_offset + h.entry_count * sizeof(SnapshotEntry));
+	h.postings_count = postings_count;
+	h.postings_offset = align8(h.trigrams_offset + h.trigram_count * sizeof(SnapshotTrigram));
+	h.strings_size = strings_size;
+	h.strings_offset = align8(h.postings_offset + h.postings_count * sizeof(uint32_t));
+	h.file_size = h.strings_offset + h.strings_size;
+
+	std::string buf(h.file_size, '\0');
+	put(buf, 0, h);
+	uint64_t text_offset = 0;
+	for (size_t i = 0; i < sorted.size(); i++) {
+		const auto& [text, c] = sorted[i];
+		SnapshotEntry e;
+		std::memset(&e, 0, sizeof(e));
+		e.text_offset = text_offset;
+		e.text_size = static_cast<uint32_t>(text->size());
+		e.count = c->count;
+		e.last_used_us = c->last_used_us;
+		e.last_id = c->last_id;
+		e.score = c->score;
+		put(buf, h.entries_offset + i * sizeof(SnapshotEntry), e);
+		std::memcpy(buf.data() + h.strings_offset + text_offset, text->data(), text->size());
+		text_offset += text->size();
+	}
+	uint64_t posting = 0;
+	for (size_t i = 0; i < keys.size(); i++) {
+		const auto& postings = index[keys[i]];
+		SnapshotTrigram t;
+		std::memset(&t, 0, sizeof(t));
+		t.key = keys[i];
+		t.postings_size = static_cast<uint32_t>(postings.size());
+		t.postings_index = posting;
+		put(buf, h.trigrams_offset + i * sizeof(SnapshotTrigram), t);
+		std::memcpy(buf.data() + h.postings_offset + posting * sizeof(uint32_t),
+			postings.data(), postings.size() * sizeof(uint32_t));
+		posting += postings.size();
+	}
+	write_file(path, buf);
+
+	stats.entries = static_cast<int64_t>(h.entry_count);
+	stats.trigrams = static_cast<int64_t>(h.trigram_count);
+	stats.watermark = watermark;
+	stats.bytes = static_cast<int64_t>(h.file_size);
+	return stats;
+}
+
+void print_snapshot_stats(const SnapshotStats& stats, std::ostream& out) {
+	out << "snapshot: " << stats.entries << " commands, " << stats.trigrams
+		<< " trigrams, " << (stats.bytes + 1023) / 1024 << " KiB\n"
+		<< "read " << stats.new_rows << " new rows up to history id " << stats.watermark
+		<< (stats.full ? " (full rebuild)" : "") << "\n";
+}
+
+} // namespace histdb
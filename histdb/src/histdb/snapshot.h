@@ -0,0 +1,134 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <SQLiteCpp/Database.h>
+
+namespace histdb {
+
+// Snapshot file
+////////////////////////////////////////////////////////////////////////////////
+
+// A snapshot is a read-only copy of the history optimized for interactive
+// lookups. It holds every distinct command once, sorted by frecency, along
+// with a trigram index, and is memory-mapped and used in place: opening it
+// only validates the header, so queries never parse it or touch SQLite.
+//
+// The file is written to a temporary file and renamed over the old one, so
+// readers always see a complete snapshot and keep their mapping of the old
+// file until they unmap it.
+//
+// Layout (native byte order, every section 8 byte aligned):
+//
+//   SnapshotHeader
+//   SnapshotEntry[entry_count]       sorted by score, highest first
+//   SnapshotTrigram[trigram_count]   sorted by key
+//   uint32_t postings[]              entry indexes of each trigram, ascending
+//   char strings[]                   command text
+
+constexpr char snapshot_magic[8] = {'H', 'I', 'S', 'T', 'S', 'N', 'A', 'P'};
+constexpr uint32_t snapshot_version = 2;
+constexpr uint32_t snapshot_byte_order = 0x01020304;
+
+struct SnapshotHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	int64_t watermark;    // largest history id included
+	int64_t scored_at_us; // time the scores were decayed to
+	int64_t deletions;    // history rows deleted before the refresh
+	uint64_t entry_count;
+	uint64_t entries_offset;
+	uint64_t trigram_count;
+	uint64_t trigrams_offset;
+	uint64_t postings_count;
+	uint64_t postings_offset;
+	uint64_t strings_size;
+	uint64_t strings_offset;
+	uint64_t file_size;
+};
+
+struct SnapshotEntry {
+	uint64_t text_offset;
+	uint32_t text_size;
+	uint32_t count;       // number of times the command was run
+	int64_t last_used_us;
+	int64_t last_id;      // history id of the last run
+	double score;         // frecency at scored_at_us
+};
+
+struct SnapshotTrigram {
+	uint32_t key; // three bytes, see trigram_key
+	uint32_t postings_size;
+	uint64_t postings_index;
+};
+
+// Frecency: every run of a command adds 1 to its score, and scores halve
+// every frecency_half_life.
+constexpr std::chrono::hours frecency_half_life{24 * 14};
+
+// Snapshot is a memory-mapped snapshot file.
+class Snapshot {
+public:
+	// open maps the snapshot at path. Throws std::runtime_error if it does
+	// not exist or is not a valid snapshot.
+	explicit Snapshot(const std::string& path);
+	~Snapshot();
+
+	Snapshot(const Snapshot&) = delete;
+	Snapshot& operator=(const Snapshot&) = delete;
+
+	const SnapshotHeader& header() const { return *header_; }
+	size_t size() const { return static_cast<size_t>(header_->entry_count); }
+	const SnapshotEntry& entry(size_t i) const { return entries_[i]; }
+	std::string_view text(size_t i) const;
+
+	// search returns the indexes of (at most limit) commands that contain
+	// query, in frecency order. Queries of at least three bytes only look at
+	// the commands in the posting list of their rarest trigram.
+	std::vector<size_t> search(std::string_view query, size_t limit) const;
+
+private:
+	const SnapshotTrigram *find_trigram(uint32_t key) const;
+
+	void *addr_ = nullptr;
+	size_t length_ = 0;
+	const SnapshotHeader *header_ = nullptr;
+	const SnapshotEntry *entries_ = nullptr;
+	const SnapshotTrigram *trigrams_ = nullptr;
+	const uint32_t *postings_ = nullptr;
+	const char *strings_ = nullptr;
+};
+
+// Refresh
+////////////////////////////////////////////////////////////////////////////////
+
+struct SnapshotStats {
+	int64_t new_rows = 0;   // history rows read from the database
+	int64_t entries = 0;    // distinct commands
+	int64_t trigrams = 0;
+	int64_t watermark = 0;
+	int64_t bytes = 0;
+	bool full = false;      // rebuilt from scratch
+};
+
+// The history_deletions table counts the deleted history rows (by compact,
+// for example) with a trigger. A snapshot taken before rows were deleted
+// still has their commands, so it is rebuilt. It is created by a migration.
+extern const char create_history_deletions_stmt[];
+
+// refresh_snapshot updates the snapshot at path with the history rows of db
+// past its watermark (or all rows if full is set, there is no valid snapshot
+// or history rows were deleted since) and atomically replaces it.
+SnapshotStats refresh_snapshot(SQLite::Database& db, const std::string& path,
+	bool full = false);
+
+void print_snapshot_stats(const SnapshotStats& stats, std::ostream& out);
+
+} // namespace histdb
@@ -0,0 +1,577 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <array>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+#include "absl/strings/str_cat.h"
+#include <SQLiteCpp/Statement.h>
+
+#include <sqlite3.h>
+
+namespace histdb {
+
+static constexpr bool is_space(unsigned char c) {
+	return c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r' || c == ' ';
+}
+
+std::vector<std::string_view> split_command(std::string_view raw) {
+	std::vector<std::string_view> words;
+	size_t i = 0;
+	const size_t n = raw.size();
+	while (i < n) {
+		while (i < n && is_space(raw[i])) {
+			i++;
+		}
+		if (i == n) {
+			break;
+		}
+		size_t start = i;
+		char quote = 0;
+		for (; i < n; i++) {
+			char c = raw[i];
+			if (quote) {
+				if (c == quote) {
+					quote = 0;
+				} else if (c == '\\' && quote == '"' && i + 1 < n) {
+					i++;
+				}
+			} else if (c == '\'' || c == '"') {
+				quote = c;
+			} else if (c == '\\' && i + 1 < n) {
+				i++;
+			} else if (is_space(c)) {
+				break;
+			}
+		}
+		words.push_back(raw.substr(start, i - start));
+	}
+	return words;
+}
+
+bool is_env_assignment(std::string_view word) {
+	auto eq = word.find('=');
+	if (eq == 0 || eq == std::string_view::npos) {
+		return false;
+	}
+	for (size_t i = 0; i < eq; i++) {
+		unsigned char c = word[i];
+		bool ok = c == '_' || ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') ||
+			(i > 0 && '0' <= c && c <= '9');
+		if (!ok) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Commands that run another command - the wrapped command is more
+// interesting than the wrapper.
+static constexpr std::array<std::string_view, 7> command_wrappers = {
+	"builtin", "command", "exec", "nohup", "sudo", "time", "env",
+};
+
+bool is_command_wrapper(std::string_view word) {
+	return std::find(command_wrappers.begin(), command_wrappers.end(), word) !=
+		command_wrappers.end();
+}
+
+std::string_view command_program(std::string_view raw) {
+	auto words = split_command(raw);
+	size_t i = 0;
+	bool wrapped = false;
+	while (i < words.size()) {
+		auto w = words[i];
+		if (is_env_assignment(w)) {
+			i++;
+		} else if (is_command_wrapper(w)) {
+			wrapped = true;
+			i++;
+		} else if (wrapped && w.size() > 1 && w[0] == '-') {
+			// Skip wrapper flags (e.g. "sudo -E")
+			i++;
+		} else {
+			break;
+		}
+	}
+	if (i == words.size()) {
+		// Only a wrapper ("sudo") or assignments ("FOO=bar")
+		if (words.empty()) {
+			return std::string_view();
+		}
+		i = words.size() - 1;
+	}
+	auto prog = words[i];
+	if (prog.size() >= 2 && (prog.front() == '\'' || prog.front() == '"') &&
+		prog.back() == prog.front()) {
+		prog = prog.substr(1, prog.size() - 2);
+	}
+	if (auto n = prog.find_last_of('/'); n != std::string_view::npos && n + 1 < prog.size()) {
+		prog = prog.substr(n + 1);
+	}
+	return prog;
+}
+
+// SQL functions
+////////////////////////////////////////////////////////////////////////////////
+
+static void sql_histdb_program(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+	(void)argc;
+	auto text = reinterpret_cast<const char *>(sqlite3_value_text(argv[0]));
+	if (!text) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	auto raw = std::string_view(text, sqlite3_value_bytes(argv[0]));
+	auto prog = command_program(raw);
+	// prog points into raw which SQLite owns until we return
+	sqlite3_result_text(ctx, prog.data(), static_cast<int>(prog.size()), SQLITE_TRANSIENT);
+}
+
+void register_stats_functions(SQLite::Database& db) {
+	int rc = sqlite3_create_function(db.getHandle(), "histdb_program", 1,
+		SQLITE_UTF8|SQLITE_DETERMINISTIC, nullptr, sql_histdb_program, nullptr, nullptr);
+	if (rc != SQLITE_OK) {
+		throw SQLite::Exception(db.getHandle(), rc);
+	}
+}
+
+// Rollups
+////////////////////////////////////////////////////////////////////////////////
+
+// NB: created_at is an RFC 3339 timestamp in local time so the first 10 bytes
+// are the (local) day and bytes 12-13 are the hour.
+
+constexpr char upsert_stats_daily_stmt[] = R"""(
+INSERT INTO stats_daily (day, directory, program, count, failures)
+VALUES (?, ?, ?, 1, ?)
+ON CONFLICT (day, directory, program) DO UPDATE SET
+	count = count + 1,
+	failures = failures + excluded.failures;
+)""";
+
+constexpr char upsert_stats_hourly_stmt[] = R"""(
+INSERT INTO stats_hourly (day, hour, count, failures)
+VALUES (?, ?, 1, ?)
+ON CONFLICT (day, hour) DO UPDATE SET
+	count = count + 1,
+	failures = failures + excluded.failures;
+)""";
+
+constexpr char upsert_stats_session_stmt[] = R"""(
+INSERT INTO stats_session (session_id, program, last_day, count, failures)
+VALUES (?, ?, ?, 1, ?)
+ON CONFLICT (session_id, program) DO UPDATE SET
+	last_day = excluded.last_day,
+	count = count + 1,
+	failures = failures + excluded.failures;
+)""";
+
+constexpr char rebuild_stats_stmt[] = R"""(
+DELETE FROM stats_daily;
+DELETE FROM stats_hourly;
+DELETE FROM stats_session;
+
+INSERT INTO stats_daily (day, directory, program, count, failures)
+SELECT substr(created_at, 1, 10), directory, histdb_program(raw),
+       COUNT(*), SUM(status_code != 0)
+FROM history GROUP BY 1, 2, 3;
+
+INSERT INTO stats_hourly (day, hour, count, failures)
+SELECT substr(created_at, 1, 10), CAST(substr(created_at, 12, 2) AS INTEGER),
+       COUNT(*), SUM(status_code != 0)
+FROM history GROUP BY 1, 2;
+
+INSERT INTO stats_session (session_id, program, last_day, count, failures)
+SELECT session_id, histdb_program(raw), MAX(substr(created_at, 1, 10)),
+       COUNT(*), SUM(status_code != 0)
+FROM history GROUP BY 1, 2;
+)""";
+
+StatsRollups::StatsRollups(SQLite::Database& db)
+	: daily_(db, upsert_stats_daily_stmt), hourly_(db, upsert_stats_hourly_stmt),
+	  session_(db, upsert_stats_session_stmt) {}
+
+void StatsRollups::add(int64_t session_id, int32_t status_code,
+	std::string_view created_at, const std::string& directory, std::string_view raw) {
+
+	if (created_at.size() < 13) {
+		throw std::invalid_argument(absl::StrCat("invalid timestamp: ", created_at));
+	}
+	const auto day = std::string(created_at.substr(0, 10));
+	const int hour = (created_at[11] - '0') * 10 + (created_at[12] - '0');
+	const auto program = std::string(command_program(raw));
+	const int failed = status_code != 0;
+
+	daily_.reset();
+	daily_.bind(1, day);
+	daily_.bind(2, directory);
+	daily_.bind(3, program);
+	daily_.bind(4, failed);
+	daily_.exec();
+
+	hourly_.reset();
+	hourly_.bind(1, day);
+	hourly_.bind(2, hour);
+	hourly_.bind(3, failed);
+	hourly_.exec();
+
+	session_.reset();
+	session_.bind(1, session_id);
+	session_.bind(2, program);
+	session_.bind(3, day);
+	session_.bind(4, failed);
+	session_.exec();
+}
+
+// The rollups of a range of history rows, added to the existing ones. The
+// WHERE clause also keeps the ON CONFLICT from being parsed as a join
+// constraint.
+constexpr char backfill_stats_daily_stmt[] = R"""(
+INSERT INTO stats_daily (day, directory, program, count, failures)
+SELECT substr(created_at, 1, 10), directory, histdb_program(raw),
+       COUNT(*), SUM(status_code != 0)
+FROM history WHERE rowid > ?1 AND rowid <= ?2 GROUP BY 1, 2, 3
+ON CONFLICT (day, directory, program) DO UPDATE SET
+	count = count + excluded.count,
+	failures = failures + excluded.failures;
+)""";
+
+constexpr char backfill_stats_hourly_stmt[] = R"""(
+INSERT INTO stats_hourly (day, hour, count, failures)
+SELECT substr(created_at, 1, 10), CAST(substr(created_at, 12, 2) AS INTEGER),
+       COUNT(*), SUM(status_code != 0)
+FROM history WHERE rowid > ?1 AND rowid <= ?2 GROUP BY 1, 2
+ON CONFLICT (day, hour) DO UPDATE SET
+	count = count + excluded.count,
+	failures = failures + excluded.failures;
+)""";
+
+constexpr char backfill_stats_session_stmt[] = R"""(
+INSERT INTO stats_session (session_id, program, last_day, count, failures)
+SELECT session_id, histdb_program(raw), MAX(substr(created_at, 1, 10)),
+       COUNT(*), SUM(status_code != 0)
+FROM history WHERE rowid > ?1 AND rowid <= ?2 GROUP BY 1, 2
+ON CONFLICT (session_id, program) DO UPDATE SET
+	last_day = max(last_day, excluded.last_day),
+	count = count + excluded.count,
+	failures = failures + excluded.failures;
+)""";
+
+void backfill_stats_rollups(SQLite::Database& db, int64_t lo, int64_t hi) {
+	for (const char *stmt : {backfill_stats_daily_stmt, backfill_stats_hourly_stmt,
+		backfill_stats_session_stmt}) {
+
+		SQLite::Statement query(db, stmt);
+		query.bind(1, lo);
+		query.bind(2, hi);
+		query.exec();
+	}
+}
+
+void rebuild_stats_rollups(SQLite::Database& db) {
+	db.exec(rebuild_stats_stmt);
+}
+
+// The rollups computed from history by rebuild_stats_stmt, as selects that
+// a filter is added to.
+static constexpr struct {
+	const char *table;
+	const char *columns;
+	const char *select;
+	const char *group_by;
+} filtered_rollups[] = {
+	{"stats_daily", "day, directory, program, count, failures",
+		"substr(created_at, 1, 10), directory, histdb_program(raw), "
+		"COUNT(*), SUM(status_code != 0)", "GROUP BY 1, 2, 3"},
+	{"stats_hourly", "day, hour, count, failures",
+		"substr(created_at, 1, 10), CAST(substr(created_at, 12, 2) AS INTEGER), "
+		"COUNT(*), SUM(status_code != 0)", "GROUP BY 1, 2"},
+	{"stats_session", "session_id, program, last_day, count, failures",
+		"session_id, histdb_program(raw), MAX(substr(created_at, 1, 10)), "
+		"COUNT(*), SUM(status_code != 0)", "GROUP BY 1, 2"},
+	// The temporary table shadows command_clusters, hence the schema.
+	{"command_clusters", "command, runs, failures, last_day",
+		"(SELECT command FROM main.command_clusters WHERE id = cluster_id), "
+		"COUNT(*), SUM(status_code != 0), MAX(substr(created_at, 1, 10))",
+		"GROUP BY cluster_id HAVING cluster_id IS NOT NULL"},
+};
+
+std::vector<std::string> filtered_stats_selects(const CompiledFilter& filter) {
+	std::vector<std::string> selects;
+	for (const auto& r : filtered_rollups) {
+		selects.push_back(filtered_select(filter, r.select, "", r.group_by));
+	}
+	return selects;
+}
+
+void filter_stats_rollups(SQLite::Database& db, const CompiledFilter& filter) {
+	const auto selects = filtered_stats_selects(filter);
+	for (size_t i = 0; i < selects.size(); i++) {
+		const auto& r = filtered_rollups[i];
+		db.exec(absl::StrCat("CREATE TEMP TABLE ", r.table, " (", r.columns, ");"));
+		SQLite::Statement insert(db, absl::StrCat("INSERT INTO temp.", r.table, " ", selects[i]));
+		bind_filter(insert, filter);
+		insert.exec();
+	}
+}
+
+constexpr char upsert_redaction_stats_stmt[] = R"""(
+INSERT INTO stats_redactions (day, redacted, ignored)
+VALUES (?, ?, ?)
+ON CONFLICT (day) DO UPDATE SET
+	redacted = redacted + excluded.redacted,
+	ignored = ignored + excluded.ignored;
+)""";
+
+void update_redaction_stats(SQLite::Database& db, std::string_view created_at,
+	int redacted, bool ignored) {
+
+	if (redacted == 0 && !ignored) {
+		return;
+	}
+	SQLite::Statement query(db, upsert_redaction_stats_stmt);
+	query.bind(1, std::string(created_at.substr(0, 10)));
+	query.bind(2, redacted);
+	query.bind(3, ignored ? 1 : 0);
+	query.exec();
+}
+
+// Reports
+////////////////////////////////////////////////////////////////////////////////
+
+StatsReport parse_stats_report(std::string_view name) {
+	if (name == "programs") {
+		return StatsReport::Programs;
+	}
+	if (name == "failing") {
+		return StatsReport::Failing;
+	}
+	if (name == "hourly") {
+		return StatsReport::Hourly;
+	}
+	if (name == "sessions") {
+		return StatsReport::Sessions;
+	}
+	if (name == "redactions") {
+		return StatsReport::Redactions;
+	}
+	if (name == "clusters") {
+		return StatsReport::Clusters;
+	}
+	throw std::invalid_argument(absl::StrCat("invalid stats report: '", name, "'"));
+}
+
+// All reports are answered from the rollup tables. These are tiny compared
+// to history (one row per day/directory/program) and are WITHOUT ROWID tables
+// clustered on their primary key so each report is a single ordered scan.
+
+constexpr char report_programs_stmt[] = R"""(
+SELECT program, SUM(count) AS total, SUM(failures)
+FROM stats_daily
+WHERE day >= ?1 AND (?2 = '' OR directory = ?2)
+GROUP BY program
+ORDER BY total DESC, program
+LIMIT ?3;
+)""";
+
+constexpr char report_failing_stmt[] = R"""(
+SELECT directory, program, SUM(failures) AS failed, SUM(count)
+FROM stats_daily
+WHERE day >= ?1 AND (?2 = '' OR directory = ?2) AND failures > 0
+GROUP BY directory, program
+ORDER BY failed DESC, directory, program
+LIMIT ?3;
+)""";
+
+constexpr char report_hourly_stmt[] = R"""(
+SELECT CAST(strftime('%w', day) AS INTEGER), hour, SUM(count)
+FROM stats_hourly
+WHERE day >= ?1
+GROUP BY 1, 2;
+)""";
+
+constexpr char report_sessions_stmt[] = R"""(
+SELECT session_id, program, count, failures FROM (
+	SELECT session_id, program, count, failures,
+	       ROW_NUMBER() OVER (PARTITION BY session_id ORDER BY count DESC, program) AS n
+	FROM stats_session
+	WHERE last_day >= ?1 AND session_id IN (
+		SELECT DISTINCT session_id FROM stats_session
+		WHERE last_day >= ?1
+		ORDER BY session_id DESC
+		LIMIT ?3
+	)
+)
+WHERE n <= 5
+ORDER BY session_id DESC, count DESC, program;
+)""";
+
+constexpr char report_redactions_stmt[] = R"""(
+SELECT day, SUM(redacted), SUM(ignored)
+FROM stats_redactions
+WHERE day >= ?1
+GROUP BY day
+ORDER BY day DESC
+LIMIT ?3;
+)""";
+
+// The clusters used in the period, with the runs of all time. Clusters
+// with the same normalized command (from federated databases) are merged.
+constexpr char report_clusters_stmt[] = R"""(
+SELECT command, SUM(runs) AS total, SUM(failures)
+FROM command_clusters
+WHERE last_day >= ?1
+GROUP BY command
+ORDER BY total DESC, command
+LIMIT ?3;
+)""";
+
+static std::string start_day(SQLite::Database& db, int days) {
+	if (days <= 0) {
+		return std::string();
+	}
+	SQLite::Statement query(db, "SELECT date('now', 'localtime', ?);");
+	query.bind(1, absl::StrCat("-", days - 1, " days"));
+	query.executeStep();
+	return query.getColumn(0).getString();
+}
+
+static std::string failure_rate(int64_t failures, int64_t count) {
+	if (count == 0) {
+		return "0.0%";
+	}
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(1) << (100.0 * failures / count) << "%";
+	return out.str();
+}
+
+static void print_hourly(SQLite::Statement& query, std::ostream& out) {
+	static constexpr std::array<std::string_view, 7> weekdays = {
+		"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat",
+	};
+	int64_t grid[7][24] = {};
+	while (query.executeStep()) {
+		int wday = query.getColumn(0).getInt();
+		int hour = query.getColumn(1).getInt();
+		if (0 <= wday && wday < 7 && 0 <= hour && hour < 24) {
+			grid[wday][hour] += query.getColumn(2).getInt64();
+		}
+	}
+	out << "    ";
+	for (int h = 0; h < 24; h++) {
+		out << std::setw(5) << h;
+	}
+	out << "\n";
+	for (int d = 0; d < 7; d++) {
+		out << weekdays[d] << " ";
+		for (int h = 0; h < 24; h++) {
+			out << std::setw(5) << grid[d][h];
+		}
+		out << "\n";
+	}
+}
+
+bool stats_report_by_directory(StatsReport report) {
+	return report == StatsReport::Programs || report == StatsReport::Failing;
+}
+
+void print_stats_report(SQLite::Database& db, const StatsOptions& opts,
+	std::ostream& out) {
+
+	const char *stmt = nullptr;
+	switch (opts.report) {
+	case StatsReport::Programs:
+		stmt = report_programs_stmt;
+		break;
+	case StatsReport::Failing:
+		stmt = report_failing_stmt;
+		break;
+	case StatsReport::Hourly:
+		stmt = report_hourly_stmt;
+		break;
+	case StatsReport::Sessions:
+		stmt = report_sessions_stmt;
+		break;
+	case StatsReport::Redactions:
+		stmt = report_redactions_stmt;
+		break;
+	case StatsReport::Clusters:
+		stmt = report_clusters_stmt;
+		break;
+	}
+
+	SQLite::Statement query(db, stmt);
+	query.bind(1, start_day(db, opts.days));
+	if (opts.report != StatsReport::Hourly) {
+		if (stats_report_by_directory(opts.report)) {
+			query.bind(2, opts.directory);
+		}
+		query.bind(3, opts.limit);
+	}
+
+	switch (opts.report) {
+	case StatsReport::Programs:
+		out << std::left << std::setw(24) << "PROGRAM" << std::right
+			<< std::setw(10) << "COUNT" << std::setw(10) << "RATE" << "\n";
+		while (query.executeStep()) {
+			auto count = query.getColumn(1).getInt64();
+			auto failures = query.getColumn(2).getInt64();
+			out << std::left << std::setw(24) << query.getColumn(0).getString()
+				<< std::right << std::setw(10) << count
+				<< std::setw(10) << failure_rate(failures, count) << "\n";
+		}
+		break;
+	case StatsReport::Failing:
+		out << std::left << std::setw(24) << "PROGRAM" << std::right
+			<< std::setw(10) << "FAILURES" << std::setw(10) << "RATE"
+			<< "  DIRECTORY\n";
+		while (query.executeStep()) {
+			auto failures = query.getColumn(2).getInt64();
+			auto count = query.getColumn(3).getInt64();
+			out << std::left << std::setw(24) << query.getColumn(1).getString()
+				<< std::right << std::setw(10) << failures
+				<< std::setw(10) << failure_rate(failures, count)
+				<< "  " << query.getColumn(0).getString() << "\n";
+		}
+		break;
+	case StatsReport::Hourly:
+		print_hourly(query, out);
+		break;
+	case StatsReport::Sessions:
+		out << std::left << std::setw(10) << "SESSION" << std::setw(24) << "PROGRAM"
+			<< std::right << std::setw(10) << "COUNT" << std::setw(10) << "RATE" << "\n";
+		while (query.executeStep()) {
+			auto count = query.getColumn(2).getInt64();
+			auto failures = query.getColumn(3).getInt64();
+			out << std::left << std::setw(10) << query.getColumn(0).getInt64()
+				<< std::setw(24) << query.getColumn(1).getString()
+				<< std::right << std::setw(10) << count
+				<< std::setw(10) << failure_rate(failures, count) << "\n";
+		}
+		break;
+	case StatsReport::Redactions:
+		out << std::left << std::setw(12) << "DAY" << std::right
+			<< std::setw(10) << "REDACTED" << std::setw(10) << "IGNORED" << "\n";
+		while (query.executeStep()) {
+			out << std::left << std::setw(12) << query.getColumn(0).getString()
+				<< std::right << std::setw(10) << query.getColumn(1).getInt64()
+				<< std::setw(10) << query.getColumn(2).getInt64() << "\n";
+		}
+		break;
+	case StatsReport::Clusters:
+		out << std::right << std::setw(10) << "COUNT" << std::setw(10) << "RATE"
+			<< "  COMMAND\n";
+		while (query.executeStep()) {
+			auto count = query.getColumn(1).getInt64();
+			auto failures = query.getColumn(2).getInt64();
+			out << std::setw(10) << count << std::setw(10) << failure_rate(failures, count)
+				<< "  " << query.getColumn(0).getString() << "\n";
+		}
+		break;
+	}
+}
+
+} // namespace histdb
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <SQLiteCpp/Database.h>
+#include <SQLiteCpp/Statement.h>
+
+#include "filter.h"
+
+namespace histdb {
+
+// Command tokenizing
+////////////////////////////////////////////////////////////////////////////////
+
+// split_command splits raw into whitespace separated words. Quoted strings
+// are kept intact (quotes included). The returned views point into raw.
+std::vector<std::string_view> split_command(std::string_view raw);
+
+// is_env_assignment returns if word is a shell variable assignment
+// ("NAME=value").
+bool is_env_assignment(std::string_view word);
+
+// is_command_wrapper returns if word is a command that runs another one
+// ("sudo", "nohup", etc.).
+bool is_command_wrapper(std::string_view word);
+
+// command_program returns the name of the program invoked by raw with any
+// leading environment assignments ("FOO=1 make") and common wrappers ("sudo",
+// "nohup", etc.) removed and any leading path components stripped. An empty
+// string is returned if no program could be found.
+std::string_view command_program(std::string_view raw);
+
+// Rollups
+////////////////////////////////////////////////////////////////////////////////
+
+// register_stats_functions registers the SQL functions used by the rollup
+// migrations and queries (currently: "histdb_program(raw)").
+void register_stats_functions(SQLite::Database& db);
+
+// StatsRollups increments the per-day, per-hour and per-session rollups for
+// newly inserted history rows. It keeps its statements, so one should be
+// used for all the rows of a transaction.
+class StatsRollups {
+public:
+	explicit StatsRollups(SQLite::Database& db);
+
+	// add counts a history row, it should be called in the same transaction
+	// as the insert.
+	void add(int64_t session_id, int32_t status_code, std::string_view created_at,
+		const std::string& directory, std::string_view raw);
+
+private:
+	SQLite::Statement daily_;
+	SQLite::Statement hourly_;
+	SQLite::Statement session_;
+};
+
+// backfill_stats_rollups adds the history rows in the rowid range (lo, hi]
+// to the rollups (see migrate.h).
+void backfill_stats_rollups(SQLite::Database& db, int64_t lo, int64_t hi);
+
+// rebuild_stats_rollups recomputes all rollups from the history table.
+// Redaction counts are not derived from history and are left as is.
+void rebuild_stats_rollups(SQLite::Database& db);
+
+// filtered_stats_selects returns the selects that compute the per-day,
+// per-hour and per-session rollups of the history rows that match filter.
+std::vector<std::string> filtered_stats_selects(const CompiledFilter& filter);
+
+// filter_stats_rollups creates temporary tables named after the per-day,
+// per-hour and per-session rollups that hold the rollups of the rows that
+// match filter. They shadow the rollup tables, so that print_stats_report
+// reports on those rows only (the redactions are not rows and can't be
+// filtered).
+void filter_stats_rollups(SQLite::Database& db, const CompiledFilter& filter);
+
+// update_redaction_stats records that a command inserted (or dropped) on
+// created_at had redacted values redacted or was ignored.
+void update_redaction_stats(SQLite::Database& db, std::string_view created_at,
+	int redacted, bool ignored);
+
+// Reports
+////////////////////////////////////////////////////////////////////////////////
+
+enum class StatsReport {
+	Programs,   // most used programs
+	Failing,    // most failing programs by directory
+	Hourly,     // commands per weekday/hour
+	Sessions,   // most used programs per session
+	Redactions, // redacted and ignored commands per day
+	Clusters,   // most used clusters of near-duplicate commands (see clusters.h)
+};
+
+// parse_stats_report parses the name of a report ("programs", "failing",
+// "hourly", "sessions", "redactions" or "clusters") and throws
+// std::invalid_argument if it is invalid.
+StatsReport parse_stats_report(std::string_view name);
+
+struct StatsOptions {
+	StatsReport report = StatsReport::Programs;
+	int days = 7;           // only include the last N days (0 means all)
+	int limit = 20;         // max number of rows to print
+	std::string directory;  // only include this directory (if not empty)
+};
+
+// stats_report_by_directory returns if report can be limited to a directory,
+// the other rollups don't have one.
+bool stats_report_by_directory(StatsReport report);
+
+void print_stats_report(SQLite::Database& db, const StatsOptions& opts,
+	std::ostream& out);
+
+} // namespace histdb
@@ -0,0 +1,406 @@
+#include "tail.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#define HISTDB_INOTIFY 1
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <sys/event.h>
+#include <sys/time.h>
+#define HISTDB_KQUEUE 1
+#endif
+
+#include "absl/strings/str_cat.h"
+#include <SQLiteCpp/Database.h>
+#include <SQLiteCpp/Statement.h>
+
+#include "arrow_ipc.h"
+#include "blobs.h"
+#include "export.h"
+#include "rows.h"
+#include "trace.h"
+
+namespace histdb {
+
+// File watcher
+////////////////////////////////////////////////////////////////////////////////
+
+FileWatcher::FileWatcher(const std::string& path) : path_(path) {
+#if defined(HISTDB_INOTIFY)
+	fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#elif defined(HISTDB_KQUEUE)
+	fd_ = kqueue();
+#endif
+	if (supported() && fd_ == -1) {
+		throw std::runtime_error(absl::StrCat(
+			"watch: ", path, ": ", std::strerror(errno)));
+	}
+	watch();
+}
+
+FileWatcher::~FileWatcher() {
+#if defined(HISTDB_KQUEUE)
+	if (watch_ != -1) {
+		close(watch_);
+	}
+	if (wal_watch_ != -1) {
+		close(wal_watch_);
+	}
+#endif
+	if (fd_ != -1) {
+		close(fd_);
+	}
+}
+
+bool FileWatcher::supported() {
+#if defined(HISTDB_INOTIFY) || defined(HISTDB_KQUEUE)
+	return true;
+#else
+	return false;
+#endif
+}
+
+// add_watch adds path to fd (an inotify instance or kqueue) and returns the
+// watch, or -1 if path does not exist.
+static int add_watch(int fd, const std::string& path) {
+#if defined(HISTDB_INOTIFY)
+	return inotify_add_watch(fd, path.c_str(),
+		IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+#elif defined(HISTDB_KQUEUE)
+#ifdef O_EVTONLY
+	int wd = open(path.c_str(), O_EVTONLY | O_CLOEXEC);
+#else
+	int wd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+	if (wd == -1) {
+		return -1;
+	}
+	struct kevent change;
+	EV_SET(&change, wd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+		NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME, 0, nullptr);
+	if (kevent(fd, &change, 1, nullptr, 0, nullptr) == -1) {
+		close(wd);
+		return -1;
+	}
+	return wd;
+#else
+	(void)fd;
+	(void)path;
+	return -1;
+#endif
+}
+
+// watch starts watching the file, watch_ is left at -1 if it does not exist.
+void FileWatcher::watch() {
+	watch_ = add_watch(fd_, path_);
+}
+
+void FileWatcher::unwatch_wal() {
+	if (wal_watch_ == -1) {
+		return;
+	}
+#if defined(HISTDB_INOTIFY)
+	inotify_rm_watch(fd_, wal_watch_);
+#elif defined(HISTDB_KQUEUE)
+	close(wal_watch_);
+#endif
+	wal_watch_ = -1;
+}
+
+void FileWatcher::watch_wal(const std::string& path) {
+	unwatch_wal();
+	wal_path_ = path;
+	if (supported()) {
+		wal_watch_ = add_watch(fd_, wal_path_);
+	}
+}
+
+FileWatcher::Event FileWatcher::wait(std::chrono::milliseconds timeout) {
+	if (!supported() || watch_ == -1) {
+		// Look for the file again every second.
+		std::this_thread::sleep_for(std::min<std::chrono::milliseconds>(
+			timeout, std::chrono::seconds(1)));
+		if (!supported()) {
+			return Event::Timeout;
+		}
+		watch();
+		return watch_ == -1 ? Event::Timeout : Event::Replaced;
+	}
+	bool replaced = false;
+	if (!wal_path_.empty() && wal_watch_ == -1) {
+		// Until the log is back its writes are only found by looking.
+		wal_watch_ = add_watch(fd_, wal_path_);
+		if (wal_watch_ == -1) {
+			timeout = std::min<std::chrono::milliseconds>(timeout, std::chrono::seconds(1));
+		}
+	}
+
+#if defined(HISTDB_INOTIFY)
+	struct pollfd pfd = {fd_, POLLIN, 0};
+	const int n = poll(&pfd, 1, static_cast<int>(timeout.count()));
+	if (n == 0) {
+		return Event::Timeout;
+	}
+	if (n == -1 && errno != EINTR) {
+		throw std::runtime_error(absl::StrCat("watch: ", path_, ": ", std::strerror(errno)));
+	}
+	// Drain the queue: a commit writes many pages.
+	alignas(struct inotify_event) char buf[4096];
+	for (;;) {
+		const ssize_t len = read(fd_, buf, sizeof(buf));
+		if (len <= 0) {
+			break;
+		}
+		for (ssize_t off = 0; off < len; ) {
+			const auto *ev = reinterpret_cast<const struct inotify_event *>(buf + off);
+			if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+				if (ev->wd == watch_) {
+					replaced = true;
+				} else if (ev->wd == wal_watch_) {
+					unwatch_wal(); // checkpointed and deleted
+				}
+			}
+			off += static_cast<ssize_t>(sizeof(struct inotify_event) + ev->len);
+		}
+	}
+	if (replaced) {
+		inotify_rm_watch(fd_, watch_);
+		watch();
+	}
+
+#elif defined(HISTDB_KQUEUE)
+	struct timespec ts;
+	ts.tv_sec = static_cast<time_t>(timeout.count() / 1000);
+	ts.tv_nsec = static_cast<long>(timeout.count() % 1000) * 1000000;
+	// EV_CLEAR coalesces the writes since the last call into one event per
+	// file.
+	struct kevent evs[2];
+	const int n = kevent(fd_, nullptr, 0, evs, 2, &ts);
+	if (n == 0) {
+		return Event::Timeout;
+	}
+	if (n == -1 && errno != EINTR) {
+		throw std::runtime_error(absl::StrCat("watch: ", path_, ": ", std::strerror(errno)));
+	}
+	for (int i = 0; i < n; i++) {
+		if (!(evs[i].fflags & (NOTE_DELETE | NOTE_RENAME))) {
+			continue;
+		}
+		if (static_cast<int>(evs[i].ident) == watch_) {
+			replaced = true;
+		} else if (static_cast<int>(evs[i].ident) == wal_watch_) {
+			unwatch_wal();
+		}
+	}
+	if (replaced) {
+		close(watch_);
+		watch();
+	}
+#endif
+
+	if (replaced) {
+		// Until it is back, the file is looked for by the next wait.
+		return watch_ == -1 ? Event::Timeout : Event::Replaced;
+	}
+	return Event::Changed;
+}
+
+// Tail
+////////////////////////////////////////////////////////////////////////////////
+
+TailFormat parse_tail_format(std::string_view name) {
+	if (name == "text") {
+		return TailFormat::Text;
+	}
+	if (name == "csv") {
+		return TailFormat::Csv;
+	}
+	if (name == "arrow-ipc") {
+		return TailFormat::ArrowIpc;
+	}
+	throw std::invalid_argument(absl::StrCat("invalid tail format: '", name, "'"));
+}
+
+constexpr char select_history_after_stmt[] = R"""(
+SELECT
+	id,
+	session_id,
+	history_id,
+	ppid,
+	status_code,
+	created_at,
+	username,
+	directory,
+	)""" HISTDB_COMMAND_SQL R"""(
+FROM history WHERE id > ? ORDER BY id;
+)""";
+
+// The id before the last N rows, served by the primary key.
+constexpr char select_tail_watermark_stmt[] = R"""(
+SELECT id FROM history ORDER BY id DESC LIMIT 1 OFFSET ?;
+)""";
+
+static SQLite::Database open_tail_database(const std::string& path, int busy_timeout_ms) {
+	SQLite::Database db(path, SQLite::OPEN_READONLY);
+	trace_connection(db, busy_timeout_ms);
+	return db;
+}
+
+// TailReader is a read-only connection to the database with the range
+// query prepared.
+struct TailReader {
+	SQLite::Database db;
+	SQLite::Statement query;
+	RowCursor rows;
+
+	TailReader(const std::string& path, int busy_timeout_ms)
+		: db(open_tail_database(path, busy_timeout_ms)),
+		  query(db, select_history_after_stmt),
+		  rows(query) {}
+};
+
+// TailWriter encodes the rows read by the tail in the output format.
+class TailWriter {
+public:
+	TailWriter(const TailOptions& opts, std::ostream& out) : opts_(opts), out_(out) {}
+
+	void begin() {
+		switch (opts_.format) {
+		case TailFormat::Text:
+			break;
+		case TailFormat::Csv:
+			out_ << csv_header();
+			break;
+		case TailFormat::ArrowIpc:
+			out_ << arrow_ipc_schema();
+			break;
+		}
+	}
+
+	void write(const RowCursor& rows) {
+		if (opts_.format == TailFormat::Text) {
+			buf_.clear();
+			for (size_t i = 0; i < rows.size(); i++) {
+				buf_.append(rows.text(i, 8));
+				buf_.push_back(opts_.separator);
+			}
+			out_.write(buf_.data(), static_cast<std::streamsize>(buf_.size()));
+			return;
+		}
+		HistoryBatch batch;
+		for (size_t i = 0; i < rows.size(); i++) {
+			append_history_row(rows, i, batch);
+		}
+		out_ << (opts_.format == TailFormat::Csv ? encode_csv(batch) : encode_arrow_ipc_batch(batch));
+	}
+
+	void end() {
+		if (opts_.format == TailFormat::ArrowIpc) {
+			out_ << arrow_ipc_eos();
+		}
+	}
+
+	void flush() {
+		out_.flush();
+		if (!out_) {
+			throw std::runtime_error("tail: error writing output");
+		}
+	}
+
+private:
+	const TailOptions& opts_;
+	std::ostream& out_;
+	std::string buf_;
+};
+
+// read_new_rows writes the rows after watermark and returns the new
+// watermark. The statement is reset when done so that the read lock is not
+// held while waiting.
+static int64_t read_new_rows(TailReader& reader, int64_t watermark, TailWriter& writer) {
+	reader.query.bind(1, watermark);
+	while (reader.rows.next_batch()) {
+		writer.write(reader.rows);
+		watermark = reader.rows.integer(reader.rows.size() - 1, 0);
+	}
+	reader.rows.reset();
+	return watermark;
+}
+
+// watch_journal watches the write-ahead log of the database of reader if it
+// is in WAL mode (the grouped and relaxed durability tiers), where commits
+// don't write the database file. Returns if it is.
+static bool watch_journal(FileWatcher& watcher, TailReader& reader, const std::string& path) {
+	SQLite::Statement query(reader.db, "PRAGMA journal_mode;");
+	if (query.executeStep() && query.getColumn(0).getString() == "wal") {
+		watcher.watch_wal(path + "-wal");
+		return true;
+	}
+	return false;
+}
+
+void tail_history(const std::string& path, const TailOptions& opts, std::ostream& out) {
+	if (opts.lines < 0) {
+		throw std::invalid_argument("tail: the number of lines must not be negative");
+	}
+	// Watch before reading so that no commit falls in between.
+	std::unique_ptr<FileWatcher> watcher;
+	if (opts.follow) {
+		watcher = std::make_unique<FileWatcher>(path);
+	}
+	auto reader = std::make_unique<TailReader>(path, opts.busy_timeout_ms);
+	bool wal = watcher && watch_journal(*watcher, *reader, path);
+	int64_t watermark = 0;
+	{
+		SQLite::Statement query(reader->db, select_tail_watermark_stmt);
+		query.bind(1, opts.lines);
+		if (query.executeStep()) {
+			watermark = query.getColumn(0).getInt64();
+		}
+	}
+
+	TailWriter writer(opts, out);
+	writer.begin();
+	watermark = read_new_rows(*reader, watermark, writer);
+	if (!opts.follow) {
+		writer.end();
+		writer.flush();
+		return;
+	}
+	writer.flush();
+
+	const auto interval = FileWatcher::supported() ? opts.poll_interval :
+		std::min<std::chrono::milliseconds>(opts.poll_interval, std::chrono::seconds(1));
+	// A WAL commit is published by updating the index in the -shm file after
+	// the last write to the log, which is mapped and not watched: read again
+	// shortly after the log was written.
+	constexpr std::chrono::milliseconds wal_settle{10};
+	auto timeout = interval;
+	for (;;) {
+		const auto event = watcher->wait(timeout);
+		timeout = wal && event == FileWatcher::Event::Changed ? wal_settle : interval;
+		if (event == FileWatcher::Event::Replaced) {
+			// Read the new file, its rows are expected to continue the ids
+			// of the old one (as after a VACUUM INTO and rename).
+			reader.reset();
+			reader = std::make_unique<TailReader>(path, opts.busy_timeout_ms);
+			wal = watch_journal(*watcher, *reader, path);
+		} else if (!wal) {
+			// Switching to WAL writes the database file.
+			wal = watch_journal(*watcher, *reader, path);
+		}
+		watermark = read_new_rows(*reader, watermark, writer);
+		writer.flush();
+	}
+}
+
+} // namespace histdb
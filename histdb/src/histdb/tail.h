@@ -0,0 +1,96 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+namespace histdb {
+
+// File watcher
+////////////////////////////////////////////////////////////////////////////////
+
+// FileWatcher waits for writes to a file: with inotify on Linux and kqueue
+// on macOS and the BSDs, so waiting costs nothing until the file changes.
+// Elsewhere wait simply sleeps for its timeout.
+//
+// A database in WAL mode is only written on checkpoints, its commits append
+// to the write-ahead log, which is watched as well (see watch_wal).
+class FileWatcher {
+public:
+	enum class Event {
+		Changed,  // the file was written (or may have been)
+		Replaced, // the file was deleted or renamed, it is watched again if
+		          // it exists
+		Timeout,
+	};
+
+	// Throws std::runtime_error if path cannot be watched.
+	explicit FileWatcher(const std::string& path);
+	~FileWatcher();
+
+	FileWatcher(const FileWatcher&) = delete;
+	FileWatcher& operator=(const FileWatcher&) = delete;
+
+	// supported returns false if wait only sleeps.
+	static bool supported();
+
+	// watch_wal watches writes to path (the write-ahead log of the database)
+	// too. The log is deleted when the last connection closes, until it is
+	// back wait looks for it every second.
+	void watch_wal(const std::string& path);
+
+	// wait waits for the file to change or for timeout to expire. Changes
+	// that happened since the previous call are returned at once, and all
+	// of them are consumed by a single call.
+	Event wait(std::chrono::milliseconds timeout);
+
+private:
+	void watch();
+	void unwatch_wal();
+
+	const std::string path_;
+	int fd_ = -1;    // inotify instance or kqueue
+	int watch_ = -1; // inotify watch or the file descriptor watched by kqueue
+	std::string wal_path_;
+	int wal_watch_ = -1;
+};
+
+// Tail
+////////////////////////////////////////////////////////////////////////////////
+
+enum class TailFormat {
+	Text,     // the commands, terminated by TailOptions::separator
+	Csv,      // see export.h
+	ArrowIpc, // an Arrow IPC stream, a record batch per read
+};
+
+// parse_tail_format parses "text", "csv" or "arrow-ipc" and throws
+// std::invalid_argument if name is invalid.
+TailFormat parse_tail_format(std::string_view name);
+
+struct TailOptions {
+	TailFormat format = TailFormat::Text;
+	char separator = '\n';
+	int64_t lines = 10;  // last rows to print before following
+	bool follow = false;
+	// Time after which new rows are looked for even if the database was not
+	// written to, in case a write was missed.
+	std::chrono::milliseconds poll_interval{30000};
+	int busy_timeout_ms = 0;
+};
+
+// tail_history prints the last opts.lines rows of the history table of the
+// database at path and, if opts.follow is set, then the rows inserted after
+// them as they are committed by any shell (or the daemon), until the process
+// is killed or out fails.
+//
+// Following keeps the largest id printed as a watermark and reads the rows
+// after it with a prepared range query on the primary key each time the
+// database file is written: the database uses a rollback journal, so every
+// commit writes it. The database is opened read-only and only locked while
+// new rows are read.
+void tail_history(const std::string& path, const TailOptions& opts, std::ostream& out);
+
+} // namespace histdb
@@ -0,0 +1,336 @@
+#include "timefmt.h"
+
+#include <array>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+#include <sqlite3.h>
+
+namespace histdb {
+
+// code_us_fraction encodes microsecond fraction us into char p. The behavior
+// is undefined if us is greater than one second or if p is not large enough
+// to store the fraction and leading '.'.
+static char *code_us_fraction(int64_t us, char *p) {
+	if (us == 0) {
+		*p = '\0';
+		return p;
+	}
+	int32_t i = 6;
+	*p++ = '.';
+	while (us % 10 == 0) {
+		us /= 10;
+		i--;
+	}
+	p[i] = '\0';
+	char *end = &p[i];
+	for (;;) {
+		p[--i] = '0' + us % 10;
+		if (i == 0) {
+			break;
+		}
+		us /= 10;
+	}
+	return end;
+}
+
+std::string format_time_libc(TimePoint t) {
+	const auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+		t - std::chrono::floor<std::chrono::seconds>(t)
+	);
+
+	const std::time_t tt = std::chrono::system_clock::to_time_t(t);
+	std::tm tm;
+	if (localtime_r(&tt, &tm) == nullptr) {
+		throw std::runtime_error("error: failed to convert time");
+	}
+
+	char format[32] = "%Y-%m-%dT%H:%M:%S";
+	char *frac = &format[std::strlen("%Y-%m-%dT%H:%M:%S")];
+
+	// append microseconds to the format string => "%Y-%m-%dT%H:%M:%S.01234"
+	// zone is the new end of the format string
+	char *zone = code_us_fraction(us.count(), frac);
+
+	// bytes remaining in the format string after appending microseconds
+	auto bufsz = sizeof(format) - ptrdiff_t(zone - format);
+
+	// convert zone (-0400 => -04:00) and append it to the format string
+	if (std::strftime(zone, bufsz, "%z", &tm) == 5) {
+		std::memmove(&zone[4], &zone[3], 3);
+		zone[3] = ':';
+	}
+
+	auto dest = std::string(34, '\0');
+	std::size_t n = std::strftime(&dest.at(0), dest.capacity(), format, &tm);
+	if (n == 0) {
+		throw std::runtime_error("error: failed to format time");
+	}
+	dest.resize(n);
+
+	return dest;
+}
+
+// Formatting
+////////////////////////////////////////////////////////////////////////////////
+
+// digit_pairs is "00" "01" ... "99"
+static constexpr std::array<char, 200> digit_pairs = []() {
+	std::array<char, 200> a{};
+	for (int i = 0; i < 100; i++) {
+		a[i * 2] = static_cast<char>('0' + i / 10);
+		a[i * 2 + 1] = static_cast<char>('0' + i % 10);
+	}
+	return a;
+}();
+
+static inline char *put2(char *p, uint32_t v) {
+	std::memcpy(p, &digit_pairs[v * 2], 2);
+	return p + 2;
+}
+
+// The zone cache probes for DST transitions this far (in steps of one week)
+// on either side of a miss. This assumes that a zone never has more than one
+// transition per week, which holds for every zone in the tz database since
+// at least the 1970s.
+constexpr int64_t zone_probe_step = 7 * 24 * 60 * 60;
+constexpr int zone_probe_count = 13;
+
+static int32_t utc_offset(int64_t sec) {
+	const std::time_t tt = static_cast<std::time_t>(sec);
+	std::tm tm;
+	if (localtime_r(&tt, &tm) == nullptr) {
+		throw std::runtime_error("error: failed to convert time");
+	}
+	return static_cast<int32_t>(tm.tm_gmtoff);
+}
+
+// zone_edge returns the last second, moving from sec in direction dir (1 or
+// -1), that has UTC offset off.
+static int64_t zone_edge(int64_t sec, int32_t off, int64_t dir) {
+	int64_t last = sec;
+	for (int i = 0; i < zone_probe_count; i++) {
+		if (utc_offset(last + dir * zone_probe_step) != off) {
+			// The transition is within the step: binary search for it.
+			uint32_t lo = 0;
+			uint32_t hi = zone_probe_step;
+			while (hi - lo > 1) {
+				uint32_t mid = lo + (hi - lo) / 2;
+				if (utc_offset(last + dir * mid) == off) {
+					lo = mid;
+				} else {
+					hi = mid;
+				}
+			}
+			return last + dir * lo;
+		}
+		last += dir * zone_probe_step;
+	}
+	return last;
+}
+
+void TimeFormatter::load_zone(int64_t sec) {
+	zone_offset_ = utc_offset(sec);
+	zone_start_ = zone_edge(sec, zone_offset_, -1);
+	zone_end_ = zone_edge(sec, zone_offset_, 1);
+	misses_++;
+}
+
+size_t TimeFormatter::format_to(TimePoint t, char *buf) {
+	const auto secs = std::chrono::floor<std::chrono::seconds>(t);
+	const auto us = std::chrono::duration_cast<std::chrono::microseconds>(t - secs).count();
+	const int64_t sec = secs.time_since_epoch().count();
+	if (sec < zone_start_ || sec > zone_end_) {
+		load_zone(sec);
+	}
+
+	// Convert to a civil date (see Howard Hinnant's "days_from_civil").
+	const int64_t local = sec + zone_offset_;
+	int64_t days = local / 86400;
+	int64_t secs_of_day = local % 86400;
+	if (secs_of_day < 0) {
+		secs_of_day += 86400;
+		days--;
+	}
+	const int64_t z = days + 719468;
+	const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+	const uint32_t doe = static_cast<uint32_t>(z - era * 146097);
+	const uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	const uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	const uint32_t mp = (5 * doy + 2) / 153;
+	const uint32_t day = doy - (153 * mp + 2) / 5 + 1;
+	const uint32_t month = mp < 10 ? mp + 3 : mp - 9;
+	const int64_t year = yoe + era * 400 + (month <= 2);
+
+	// strftime does not zero pad years before 1000 so leave those (and
+	// anything past 9999) to libc.
+	if (year < 1000 || year > 9999) {
+		auto s = format_time_libc(t);
+		std::memcpy(buf, s.data(), s.size());
+		return s.size();
+	}
+
+	const uint32_t yyyy = static_cast<uint32_t>(year);
+	const uint32_t rem = static_cast<uint32_t>(secs_of_day);
+	const uint32_t frac = static_cast<uint32_t>(us);
+
+	char *p = buf;
+	p = put2(p, yyyy / 100);
+	p = put2(p, yyyy % 100);
+	*p++ = '-';
+	p = put2(p, month);
+	*p++ = '-';
+	p = put2(p, day);
+	*p++ = 'T';
+	p = put2(p, rem / 3600);
+	*p++ = ':';
+	p = put2(p, rem / 60 % 60);
+	*p++ = ':';
+	p = put2(p, rem % 60);
+
+	if (frac != 0) {
+		*p++ = '.';
+		p = put2(p, frac / 10000);
+		p = put2(p, frac / 100 % 100);
+		p = put2(p, frac % 100);
+		while (p[-1] == '0') {
+			p--;
+		}
+	}
+
+	// Like strftime's "%z" any seconds in the offset are truncated.
+	*p++ = zone_offset_ < 0 ? '-' : '+';
+	const uint32_t off = static_cast<uint32_t>(
+		zone_offset_ < 0 ? -int64_t(zone_offset_) : zone_offset_) / 60;
+	p = put2(p, off / 60);
+	*p++ = ':';
+	p = put2(p, off % 60);
+
+	return static_cast<size_t>(p - buf);
+}
+
+std::string TimeFormatter::format(TimePoint t) {
+	char buf[max_size];
+	return std::string(buf, format_to(t, buf));
+}
+
+std::string format_time(TimePoint t) {
+	thread_local TimeFormatter formatter;
+	return formatter.format(t);
+}
+
+// Parsing
+////////////////////////////////////////////////////////////////////////////////
+
+// parse_digits parses the n digit number at s[i:] and advances i.
+static bool parse_digits(std::string_view s, size_t& i, size_t n, uint32_t& v) {
+	if (s.size() - i < n) {
+		return false;
+	}
+	v = 0;
+	for (size_t end = i + n; i < end; i++) {
+		const uint32_t d = static_cast<uint32_t>(s[i]) - '0';
+		if (d > 9) {
+			return false;
+		}
+		v = v * 10 + d;
+	}
+	return true;
+}
+
+static bool expect(std::string_view s, size_t& i, char c) {
+	if (i < s.size() && s[i] == c) {
+		i++;
+		return true;
+	}
+	return false;
+}
+
+// days_from_civil returns the number of days since 1970-01-01 of a proleptic
+// Gregorian date (see Howard Hinnant's "days_from_civil").
+static int64_t days_from_civil(uint32_t year, uint32_t month, uint32_t day) {
+	const uint32_t y = year - (month <= 2);
+	const uint32_t era = y / 400;
+	const uint32_t yoe = y - era * 400;
+	const uint32_t doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+	const uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return int64_t(era) * 146097 + int64_t(doe) - 719468;
+}
+
+bool parse_time(std::string_view s, int64_t& unix_us) {
+	size_t i = 0;
+	uint32_t year, month, day, hour, minute, second;
+	if (!(parse_digits(s, i, 4, year) && expect(s, i, '-') &&
+		parse_digits(s, i, 2, month) && expect(s, i, '-') &&
+		parse_digits(s, i, 2, day) && expect(s, i, 'T') &&
+		parse_digits(s, i, 2, hour) && expect(s, i, ':') &&
+		parse_digits(s, i, 2, minute) && expect(s, i, ':') &&
+		parse_digits(s, i, 2, second))) {
+		return false;
+	}
+	if (year < 1 || month < 1 || month > 12 || day < 1 || day > 31 ||
+		hour > 23 || minute > 59 || second > 60) {
+		return false;
+	}
+
+	uint32_t us = 0;
+	if (expect(s, i, '.')) {
+		uint32_t scale = 100000;
+		size_t start = i;
+		for (; i < s.size() && s[i] >= '0' && s[i] <= '9'; i++) {
+			us += static_cast<uint32_t>(s[i] - '0') * scale;
+			scale /= 10;
+		}
+		if (i == start) {
+			return false;
+		}
+	}
+
+	int64_t offset = 0;
+	if (!expect(s, i, 'Z')) {
+		if (i == s.size() || (s[i] != '+' && s[i] != '-')) {
+			return false;
+		}
+		const bool negative = s[i++] == '-';
+		uint32_t off_hour, off_minute;
+		if (!(parse_digits(s, i, 2, off_hour) && expect(s, i, ':') &&
+			parse_digits(s, i, 2, off_minute))) {
+			return false;
+		}
+		offset = int64_t(off_hour) * 3600 + int64_t(off_minute) * 60;
+		if (negative) {
+			offset = -offset;
+		}
+	}
+	if (i != s.size()) {
+		return false;
+	}
+
+	const int64_t secs = days_from_civil(year, month, day) * 86400 +
+		int64_t(hour) * 3600 + int64_t(minute) * 60 + int64_t(second) - offset;
+	unix_us = secs * 1000000 + us;
+	return true;
+}
+
+static void sql_unix_us(sqlite3_context *ctx, int, sqlite3_value **argv) {
+	const auto *text = sqlite3_value_text(argv[0]);
+	int64_t us;
+	if (text != nullptr && parse_time(std::string_view(
+			reinterpret_cast<const char *>(text),
+			static_cast<size_t>(sqlite3_value_bytes(argv[0]))), us)) {
+		sqlite3_result_int64(ctx, us);
+	} else {
+		sqlite3_result_null(ctx);
+	}
+}
+
+void register_time_functions(SQLite::Database& db) {
+	int rc = sqlite3_create_function(db.getHandle(), "histdb_unix_us", 1,
+		SQLITE_UTF8|SQLITE_DETERMINISTIC, nullptr, sql_unix_us, nullptr, nullptr);
+	if (rc != SQLITE_OK) {
+		throw SQLite::Exception(db.getHandle(), rc);
+	}
+}
+
+} // namespace histdb
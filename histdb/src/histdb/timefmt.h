@@ -0,0 +1,74 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include <SQLiteCpp/Database.h>
+
+namespace histdb {
+
+using TimePoint = std::chrono::time_point<std::chrono::system_clock>;
+
+// TimeFormatter formats timestamps as RFC 3339 in the local time zone with a
+// microsecond fraction ("2022-03-04T05:06:07.123-05:00"). Trailing zeros are
+// trimmed from the fraction and it is omitted entirely if it is zero.
+//
+// The UTC offset is cached along with the range of time for which it is
+// valid, which is found by probing the zone database for the neighbouring
+// DST transitions. Timestamps within the cached range are formatted with
+// integer math and no calls to localtime/strftime.
+//
+// A TimeFormatter is not thread-safe, use one per thread.
+class TimeFormatter {
+public:
+	// Maximum number of bytes written by format_to.
+	static constexpr size_t max_size = 40;
+
+	std::string format(TimePoint t);
+
+	// format_to writes the formatted time to buf, which must be at least
+	// max_size bytes long, and returns the number of bytes written.
+	size_t format_to(TimePoint t, char *buf);
+
+	// misses returns the number of times the zone cache was refreshed.
+	int64_t misses() const { return misses_; }
+
+private:
+	void load_zone(int64_t sec);
+
+	// UTC offset (in seconds) of [zone_start_, zone_end_]
+	int64_t zone_start_ = 1;
+	int64_t zone_end_ = 0;
+	int32_t zone_offset_ = 0;
+	int64_t misses_ = 0;
+};
+
+// format_time formats t using a thread local TimeFormatter.
+std::string format_time(TimePoint t);
+
+// format_time_libc is the localtime/strftime implementation of format_time.
+// It is slow but serves as the reference for tests and benchmarks.
+std::string format_time_libc(TimePoint t);
+
+// unix_micros returns t in microseconds since the Unix epoch.
+inline int64_t unix_micros(TimePoint t) {
+	// NB: We rely on the epoch of the system_clock being the Unix epoch,
+	// which is unspecified until C++20.
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		t.time_since_epoch()).count();
+}
+
+// parse_time parses an RFC 3339 timestamp as written by format_time
+// ("2022-03-04T05:06:07.123-05:00", a "Z" offset is also accepted) and
+// stores it in unix_us as microseconds since the Unix epoch. Returns false
+// if s is not valid. Years must be between 1 and 9999.
+bool parse_time(std::string_view s, int64_t& unix_us);
+
+// register_time_functions registers "histdb_unix_us(created_at)" which
+// returns parse_time(created_at) or NULL if it is invalid.
+void register_time_functions(SQLite::Database& db);
+
+} // namespace histdb
@@ -0,0 +1,402 @@
+#include "tokens.h"
+
+#include <algorithm>
+#include <array>
+#include <utility>
+
+#include "absl/strings/str_cat.h"
+
+#include "blobs.h"
+#include "rows.h"
+#include "stats.h"
+
+namespace histdb {
+
+// Lexer
+////////////////////////////////////////////////////////////////////////////////
+
+const char *token_kind_name(TokenKind kind) {
+	switch (kind) {
+	case TokenKind::Program:
+		return "prog";
+	case TokenKind::Flag:
+		return "flag";
+	case TokenKind::Pipe:
+		return "pipe";
+	case TokenKind::Env:
+		return "env";
+	}
+	return "unknown";
+}
+
+namespace {
+
+enum class LexemeType {
+	Word,
+	Separator, // ; & && || ;; ( ) and newlines
+	Pipe,      // | and |&
+	Redirect,  // < > >> etc. (the next word is their target)
+	Heredoc,   // << and <<- (the next word is the delimiter)
+};
+
+struct Lexeme {
+	LexemeType type;
+	std::string text;    // of words, without quotes and escapes
+	bool quoted = false; // the word starts with a quote
+	bool strip_tabs = false; // <<-
+};
+
+constexpr bool is_blank(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+constexpr bool is_operator(char c) {
+	return c == '|' || c == '&' || c == ';' || c == '(' || c == ')' || c == '<' || c == '>';
+}
+
+// Operators by decreasing length, so that the longest one matches.
+constexpr std::array<std::pair<std::string_view, LexemeType>, 19> operators = {{
+	{"<<<", LexemeType::Redirect},
+	{"&>>", LexemeType::Redirect},
+	{"<<-", LexemeType::Heredoc},
+	{"<<", LexemeType::Heredoc},
+	{"&&", LexemeType::Separator},
+	{"||", LexemeType::Separator},
+	{";;", LexemeType::Separator},
+	{"|&", LexemeType::Pipe},
+	{"&>", LexemeType::Redirect},
+	{">>", LexemeType::Redirect},
+	{">&", LexemeType::Redirect},
+	{">|", LexemeType::Redirect},
+	{"<&", LexemeType::Redirect},
+	{"<>", LexemeType::Redirect},
+	{"<", LexemeType::Redirect},
+	{">", LexemeType::Redirect},
+	{"|", LexemeType::Pipe},
+	{";", LexemeType::Separator},
+	{"&", LexemeType::Separator},
+}};
+
+class Lexer {
+public:
+	explicit Lexer(std::string_view raw) : raw_(raw) {}
+
+	std::vector<Lexeme> lex();
+
+private:
+	void word();
+	size_t skip_balanced(size_t i, char open, char close) const;
+	void skip_heredocs();
+
+	std::string_view raw_;
+	size_t i_ = 0;
+	std::vector<Lexeme> out_;
+	// Delimiters of the here documents whose bodies start at the next
+	// newline.
+	std::vector<std::pair<std::string, bool>> heredocs_;
+	bool want_delimiter_ = false;
+};
+
+std::vector<Lexeme> Lexer::lex() {
+	const size_t n = raw_.size();
+	while (i_ < n) {
+		const char c = raw_[i_];
+		if (is_blank(c)) {
+			i_++;
+		} else if (c == '\\' && i_ + 1 < n && raw_[i_ + 1] == '\n') {
+			i_ += 2; // line continuation
+		} else if (c == '\n') {
+			i_++;
+			skip_heredocs();
+			out_.push_back({LexemeType::Separator, "\n"});
+		} else if (c == '#') {
+			// A comment runs to the end of the line.
+			while (i_ < n && raw_[i_] != '\n') {
+				i_++;
+			}
+		} else if (c == '(' || c == ')') {
+			i_++;
+			out_.push_back({LexemeType::Separator, std::string(1, c)});
+		} else if (is_operator(c)) {
+			for (const auto& [op, type] : operators) {
+				if (raw_.substr(i_, op.size()) == op) {
+					i_ += op.size();
+					Lexeme l{type, std::string(op)};
+					l.strip_tabs = op == "<<-";
+					want_delimiter_ = type == LexemeType::Heredoc;
+					out_.push_back(std::move(l));
+					break;
+				}
+			}
+		} else {
+			word();
+		}
+	}
+	return std::move(out_);
+}
+
+// skip_balanced returns the index after the close that matches the open at
+// raw_[i], skipping quoted strings.
+size_t Lexer::skip_balanced(size_t i, char open, char close) const {
+	int depth = 0;
+	char quote = 0;
+	for (; i < raw_.size(); i++) {
+		const char c = raw_[i];
+		if (quote) {
+			if (c == quote) {
+				quote = 0;
+			} else if (c == '\\' && quote == '"') {
+				i++;
+			}
+		} else if (c == '\'' || c == '"') {
+			quote = c;
+		} else if (c == '\\') {
+			i++;
+		} else if (c == open) {
+			depth++;
+		} else if (c == close && --depth == 0) {
+			return i + 1;
+		}
+	}
+	return raw_.size();
+}
+
+void Lexer::word() {
+	const size_t n = raw_.size();
+	const size_t start = i_;
+	Lexeme l{LexemeType::Word, ""};
+	l.quoted = raw_[i_] == '\'' || raw_[i_] == '"';
+	while (i_ < n) {
+		const char c = raw_[i_];
+		if (c == '\\') {
+			if (i_ + 1 < n && raw_[i_ + 1] != '\n') {
+				l.text.push_back(raw_[i_ + 1]);
+			}
+			i_ += 2;
+		} else if (c == '\'') {
+			size_t end = raw_.find('\'', i_ + 1);
+			if (end == std::string_view::npos) {
+				end = n;
+			}
+			l.text.append(raw_.substr(i_ + 1, end - i_ - 1));
+			i_ = end + 1;
+		} else if (c == '"') {
+			for (i_++; i_ < n && raw_[i_] != '"'; i_++) {
+				if (raw_[i_] == '\\' && i_ + 1 < n &&
+					std::string_view("\"\\$`\n").find(raw_[i_ + 1]) != std::string_view::npos) {
+					i_++;
+				}
+				l.text.push_back(raw_[i_]);
+			}
+			i_++;
+		} else if (c == '$' && i_ + 1 < n && (raw_[i_ + 1] == '(' || raw_[i_ + 1] == '{')) {
+			const size_t end = skip_balanced(i_ + 1, raw_[i_ + 1], raw_[i_ + 1] == '(' ? ')' : '}');
+			l.text.append(raw_.substr(i_, end - i_));
+			i_ = end;
+		} else if (c == '`') {
+			size_t end = raw_.find('`', i_ + 1);
+			end = end == std::string_view::npos ? n : end + 1;
+			l.text.append(raw_.substr(i_, end - i_));
+			i_ = end;
+		} else if (is_blank(c) || c == '\n' || is_operator(c)) {
+			break;
+		} else {
+			l.text.push_back(c);
+			i_++;
+		}
+	}
+	i_ = std::min(i_, n);
+	if (want_delimiter_) {
+		want_delimiter_ = false;
+		heredocs_.emplace_back(l.text, !out_.empty() && out_.back().strip_tabs);
+	}
+	// The file descriptor of a redirection ("2>/dev/null").
+	const std::string_view text = raw_.substr(start, i_ - start);
+	if (i_ < n && (raw_[i_] == '<' || raw_[i_] == '>') &&
+		std::all_of(text.begin(), text.end(), [](char d) { return '0' <= d && d <= '9'; })) {
+		return;
+	}
+	out_.push_back(std::move(l));
+}
+
+// skip_heredocs skips the bodies of the pending here documents, which start
+// at i_ (after a newline).
+void Lexer::skip_heredocs() {
+	for (const auto& [delimiter, strip_tabs] : heredocs_) {
+		while (i_ < raw_.size()) {
+			size_t end = raw_.find('\n', i_);
+			if (end == std::string_view::npos) {
+				end = raw_.size();
+			}
+			std::string_view line = raw_.substr(i_, end - i_);
+			while (strip_tabs && !line.empty() && line.front() == '\t') {
+				line.remove_prefix(1);
+			}
+			i_ = std::min(end + 1, raw_.size());
+			if (line == delimiter) {
+				break;
+			}
+		}
+	}
+	heredocs_.clear();
+}
+
+constexpr std::array<std::string_view, 12> reserved_words = {
+	"!", "{", "}", "do", "done", "elif", "else", "esac", "fi", "if", "then", "until",
+};
+
+// Reserved words followed by words that are not commands up to the next
+// separator ("for f in *; do").
+constexpr std::array<std::string_view, 4> header_words = {
+	"case", "for", "function", "select",
+};
+
+template <typename T>
+bool contains(const T& words, std::string_view w) {
+	return std::find(words.begin(), words.end(), w) != words.end();
+}
+
+} // namespace
+
+std::vector<CommandToken> command_tokens(std::string_view raw) {
+	std::vector<CommandToken> tokens;
+	auto add = [&tokens](TokenKind kind, std::string_view text) {
+		if (!text.empty() && text.size() <= max_token_bytes &&
+			text.find('\n') == std::string_view::npos) {
+			tokens.push_back({kind, std::string(text)});
+		}
+	};
+	bool at_start = true;     // the next word is the program
+	bool piped = false;       // the simple command reads a pipe
+	bool wrapped = false;     // after a wrapper ("sudo -E")
+	bool header = false;      // "for ... in ..."
+	bool skip = false;        // the next word is a redirection target
+	bool end_of_flags = false;
+	for (const Lexeme& l : Lexer(raw).lex()) {
+		switch (l.type) {
+		case LexemeType::Separator:
+		case LexemeType::Pipe:
+			at_start = true;
+			piped = l.type == LexemeType::Pipe;
+			wrapped = header = skip = end_of_flags = false;
+			continue;
+		case LexemeType::Redirect:
+		case LexemeType::Heredoc:
+			skip = true;
+			continue;
+		case LexemeType::Word:
+			break;
+		}
+		const std::string_view w = l.text;
+		if (skip) {
+			skip = false;
+		} else if (header) {
+			// not a command
+		} else if (at_start && !l.quoted && is_env_assignment(w)) {
+			add(TokenKind::Env, w.substr(0, w.find('=')));
+		} else if (at_start && !l.quoted && contains(header_words, w)) {
+			header = true;
+		} else if (at_start && !l.quoted && contains(reserved_words, w)) {
+			// the command follows
+		} else if (at_start && wrapped && w.size() > 1 && w[0] == '-') {
+			// a flag of the wrapper
+		} else if (at_start) {
+			std::string_view prog = w;
+			if (auto slash = prog.find_last_of('/');
+				slash != std::string_view::npos && slash + 1 < prog.size()) {
+				prog.remove_prefix(slash + 1);
+			}
+			add(TokenKind::Program, prog);
+			if (piped) {
+				add(TokenKind::Pipe, prog);
+			}
+			wrapped = is_command_wrapper(prog);
+			at_start = wrapped;
+		} else if (w == "--") {
+			end_of_flags = true;
+		} else if (!end_of_flags && !l.quoted && w.size() > 1 && w[0] == '-') {
+			add(TokenKind::Flag, w);
+			if (auto eq = w.find('='); eq != std::string_view::npos && eq > 1) {
+				add(TokenKind::Flag, w.substr(0, eq));
+			}
+		}
+	}
+	std::sort(tokens.begin(), tokens.end());
+	tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+	return tokens;
+}
+
+// Token index
+////////////////////////////////////////////////////////////////////////////////
+
+// Served by the UNIQUE (kind, text) index.
+constexpr char select_token_stmt[] = R"""(
+SELECT id FROM command_tokens WHERE kind = ? AND text = ?;
+)""";
+
+constexpr char insert_token_stmt[] = R"""(
+INSERT INTO command_tokens (kind, text) VALUES (?, ?);
+)""";
+
+constexpr char insert_posting_stmt[] = R"""(
+INSERT OR IGNORE INTO command_postings (token_id, row_id) VALUES (?, ?);
+)""";
+
+TokenIndexer::TokenIndexer(SQLite::Database& db)
+	: db_(db), select_token_(db, select_token_stmt), insert_token_(db, insert_token_stmt),
+	  insert_posting_(db, insert_posting_stmt) {}
+
+int64_t TokenIndexer::token_id(const CommandToken& token) {
+	const int kind = static_cast<int>(token.kind);
+	const std::string key = absl::StrCat(kind, ":", token.text);
+	if (auto it = ids_.find(key); it != ids_.end()) {
+		return it->second;
+	}
+	int64_t id;
+	select_token_.reset();
+	select_token_.bind(1, kind);
+	select_token_.bind(2, token.text);
+	if (select_token_.executeStep()) {
+		id = select_token_.getColumn(0).getInt64();
+	} else {
+		insert_token_.reset();
+		insert_token_.bind(1, kind);
+		insert_token_.bind(2, token.text);
+		insert_token_.exec();
+		id = db_.getLastInsertRowid();
+	}
+	select_token_.reset();
+	ids_.emplace(key, id);
+	return id;
+}
+
+void TokenIndexer::add(int64_t id, std::string_view raw) {
+	for (const auto& token : command_tokens(raw)) {
+		insert_posting_.reset();
+		insert_posting_.bind(1, token_id(token));
+		insert_posting_.bind(2, id);
+		insert_posting_.exec();
+	}
+}
+
+constexpr char select_backfill_commands_stmt[] = R"""(
+SELECT id, )""" HISTDB_COMMAND_SQL R"""(
+FROM history
+WHERE rowid > ? AND rowid <= ?
+ORDER BY rowid;
+)""";
+
+void backfill_command_tokens(SQLite::Database& db, int64_t lo, int64_t hi) {
+	TokenIndexer indexer(db);
+	SQLite::Statement select(db, select_backfill_commands_stmt);
+	select.bind(1, lo);
+	select.bind(2, hi);
+	RowCursor rows(select);
+	while (rows.next_batch()) {
+		for (size_t i = 0; i < rows.size(); i++) {
+			indexer.add(rows.integer(i, 0), rows.text(i, 1));
+		}
+	}
+}
+
+} // namespace histdb
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <SQLiteCpp/Database.h>
+#include <SQLiteCpp/Statement.h>
+
+namespace histdb {
+
+// Command tokens
+////////////////////////////////////////////////////////////////////////////////
+
+// TokenKind is what a token of a command is. The values are stored in the
+// command_tokens table.
+enum class TokenKind {
+	Program = 1, // a program that the command runs ("kubectl")
+	Flag = 2,    // a flag of one of its programs ("--context=prod", "--context")
+	Pipe = 3,    // a program that reads a pipe ("xargs" in "find . | xargs rm")
+	Env = 4,     // a variable assigned for a program ("AWS_PROFILE" in "AWS_PROFILE=x aws")
+};
+
+// token_kind_name returns the name of kind ("prog", "flag", "pipe" or
+// "env"), which is also the key of its filter terms (see filter.h).
+const char *token_kind_name(TokenKind kind);
+
+struct CommandToken {
+	TokenKind kind;
+	std::string text;
+
+	bool operator==(const CommandToken& t) const { return kind == t.kind && text == t.text; }
+	bool operator<(const CommandToken& t) const {
+		return kind != t.kind ? kind < t.kind : text < t.text;
+	}
+};
+
+// Tokens longer than this are not indexed.
+constexpr size_t max_token_bytes = 128;
+
+// command_tokens lexes raw like a shell would and returns its distinct
+// tokens, sorted. The lexer splits raw into simple commands at pipes, "&&",
+// "||", ";", "&", newlines and parentheses, and removes quotes and
+// backslash escapes from words. In each simple command it skips the
+// variable assignments that prefix it (which are Env tokens), reserved words
+// ("if", "do"...), redirections and their targets, and the bodies of here
+// documents. The first remaining word is the program (without its
+// directory), a wrapper ("sudo", "env"...) makes the word after it (and
+// after the wrapper's own flags) a program too, and the words that start
+// with "-" before "--" are flags ("--name=value" is also indexed as
+// "--name").
+//
+// Command substitutions ("$(...)" and backquotes) are kept in the word that
+// contains them: the commands in them are not indexed.
+std::vector<CommandToken> command_tokens(std::string_view raw);
+
+// Token index
+////////////////////////////////////////////////////////////////////////////////
+
+// The tokens of every command are interned in the command_tokens table and
+// each has a posting list of the history rows that contain it: the rows of
+// the command_postings (token_id, row_id) primary key. Finding the commands
+// with given tokens is an intersection of their posting lists, which costs
+// the number of rows in the lists rather than a scan of the history. A
+// trigger deletes the postings of deleted history rows.
+
+// TokenIndexer adds the tokens of history rows to the index. It keeps its
+// statements and the ids of the tokens that it has seen, so one indexer
+// should be used for many rows.
+class TokenIndexer {
+public:
+	explicit TokenIndexer(SQLite::Database& db);
+
+	// add indexes raw, the command of history row id. It must be called in
+	// the transaction that inserts the row.
+	void add(int64_t id, std::string_view raw);
+
+private:
+	int64_t token_id(const CommandToken& token);
+
+	SQLite::Database& db_;
+	SQLite::Statement select_token_;
+	SQLite::Statement insert_token_;
+	SQLite::Statement insert_posting_;
+	std::unordered_map<std::string, int64_t> ids_; // by kind and text
+};
+
+// backfill_command_tokens indexes the history rows in the rowid range
+// (lo, hi] (see migrate.h).
+void backfill_command_tokens(SQLite::Database& db, int64_t lo, int64_t hi);
+
+} // namespace histdb
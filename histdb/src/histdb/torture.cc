@@ -0,0 +1,500 @@
+#include "torture.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iterator>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include <SQLiteCpp/Exception.h>
+#include <SQLiteCpp/Statement.h>
+#include <sqlite3.h>
+
+#include "timefmt.h"
+#include "trace.h"
+
+namespace histdb {
+
+// Configurations
+////////////////////////////////////////////////////////////////////////////////
+
+std::string TortureConfig::name() const {
+	if (durability) {
+		return durability->name();
+	}
+	return absl::StrCat(journal_mode, ":", locking_mode);
+}
+
+TortureConfig parse_torture_config(std::string_view spec) {
+	const size_t colon = spec.find(':');
+	const std::string name = absl::AsciiStrToLower(spec.substr(0, colon));
+	if (name == "strict" || name == "grouped" || name == "relaxed") {
+		TortureConfig config;
+		config.durability = parse_durability(spec);
+		config.journal_mode = config.durability->journal_mode();
+		config.locking_mode =
+			config.durability->tier == DurabilityTier::Strict ? "exclusive" : "normal";
+		return config;
+	}
+	if (colon == std::string_view::npos) {
+		throw std::invalid_argument(absl::StrCat(
+			"invalid torture configuration: '", spec, "' (expected JOURNAL:LOCKING)"));
+	}
+	TortureConfig config;
+	config.journal_mode = absl::AsciiStrToLower(spec.substr(0, colon));
+	config.locking_mode = absl::AsciiStrToLower(spec.substr(colon + 1));
+	const auto& j = config.journal_mode;
+	if (j != "delete" && j != "truncate" && j != "persist" && j != "wal") {
+		throw std::invalid_argument(absl::StrCat("invalid journal mode: '", j, "'"));
+	}
+	const auto& l = config.locking_mode;
+	if (l != "normal" && l != "exclusive") {
+		throw std::invalid_argument(absl::StrCat("invalid locking mode: '", l, "'"));
+	}
+	return config;
+}
+
+// Processes
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+using TortureClock = std::chrono::steady_clock;
+
+enum class TortureEvent : int32_t {
+	Commit,
+	Read,
+	Busy,
+	Error,
+};
+
+// TortureMessage is what the processes send to the parent after each
+// attempt. It is smaller than PIPE_BUF so that concurrent writes to the pipe
+// are never interleaved.
+struct TortureMessage {
+	TortureEvent event;
+	int32_t error_code; // extended SQLite result code of an Error
+	int32_t synced;     // the Commit was synced to disk
+	int64_t session_id;
+	int64_t history_id;
+	int64_t wait_us;
+	int64_t latency_us;
+};
+
+// TortureProcess is the context of a forked process.
+struct TortureProcess {
+	const TortureOptions& opts;
+	const TortureConfig& config;
+	const std::string& path;
+	const TortureHooks& hooks;
+	TortureClock::time_point deadline;
+	int fd; // write end of the pipe
+};
+
+} // namespace
+
+static int64_t elapsed_us(TortureClock::time_point start) {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		TortureClock::now() - start).count();
+}
+
+static SQLite::Database open_torture_database(const TortureProcess& p, bool readonly) {
+	SQLite::Database db(p.path, readonly ? SQLite::OPEN_READONLY : SQLite::OPEN_READWRITE);
+	sqlite3_extended_result_codes(db.getHandle(), 1);
+	trace_connection(db, p.opts.busy_timeout_ms);
+	// The rollback journal modes only last as long as the connection, so
+	// every connection sets them (as open_database does).
+	if (p.config.durability) {
+		configure_durability(db, *p.config.durability);
+	} else {
+		db.exec(absl::StrCat(
+			"PRAGMA journal_mode = '", p.config.journal_mode, "';\n"
+			"PRAGMA locking_mode = '", p.config.locking_mode, "';"));
+	}
+	if (p.hooks.prepare) {
+		p.hooks.prepare(db);
+	}
+	return db;
+}
+
+static bool is_busy(const SQLite::Exception& e) {
+	const int code = e.getErrorCode() & 0xff;
+	return code == SQLITE_BUSY || code == SQLITE_LOCKED;
+}
+
+static void send_message(int fd, const TortureMessage& msg) {
+	while (write(fd, &msg, sizeof(msg)) == -1 && errno == EINTR) {
+	}
+}
+
+static void run_torture_writer(const TortureProcess& p, int64_t session_id) {
+	IngestRecord rec;
+	rec.session_id = session_id;
+	rec.ppid = static_cast<int32_t>(getpid());
+	rec.user = "torture";
+	rec.directory = "/tmp/torture";
+	while (TortureClock::now() < p.deadline) {
+		rec.history_id++;
+		rec.created_us = unix_micros(std::chrono::system_clock::now());
+		rec.raw = absl::StrCat("torture ", session_id, " ", rec.history_id);
+
+		TortureMessage msg{};
+		msg.session_id = session_id;
+		msg.history_id = rec.history_id;
+		const auto start = TortureClock::now();
+		try {
+			SQLite::Database db = open_torture_database(p, false);
+			const auto begin = TortureClock::now();
+			// Without a tier the connection keeps its synchronous setting,
+			// which a strict transaction does not change.
+			DurableTransaction transaction(db, p.config.durability.value_or(Durability{}));
+			msg.wait_us = elapsed_us(begin);
+			p.hooks.write(db, rec);
+			if (p.opts.hold.count() > 0) {
+				std::this_thread::sleep_for(p.opts.hold);
+			}
+			transaction.commit();
+			msg.event = TortureEvent::Commit;
+			msg.synced = transaction.synced();
+			msg.latency_us = elapsed_us(start);
+		} catch (const SQLite::Exception& e) {
+			msg.event = is_busy(e) ? TortureEvent::Busy : TortureEvent::Error;
+			msg.error_code = e.getExtendedErrorCode();
+		} catch (const std::exception&) {
+			msg.event = TortureEvent::Error;
+			msg.error_code = 0;
+		}
+		send_message(p.fd, msg);
+	}
+}
+
+// The recent rows, read through the primary key like "histdb tail".
+constexpr char select_torture_recent_stmt[] = R"""(
+SELECT COUNT(*) FROM history
+WHERE id > (SELECT COALESCE(MAX(id), 0) - 100 FROM history);
+)""";
+
+static void run_torture_reader(const TortureProcess& p) {
+	while (TortureClock::now() < p.deadline) {
+		TortureMessage msg{};
+		const auto start = TortureClock::now();
+		try {
+			SQLite::Database db = open_torture_database(p, true);
+			db.execAndGet(select_torture_recent_stmt);
+			msg.event = TortureEvent::Read;
+			msg.latency_us = elapsed_us(start);
+		} catch (const SQLite::Exception& e) {
+			msg.event = is_busy(e) ? TortureEvent::Busy : TortureEvent::Error;
+			msg.error_code = e.getExtendedErrorCode();
+		} catch (const std::exception&) {
+			msg.event = TortureEvent::Error;
+			msg.error_code = 0;
+		}
+		send_message(p.fd, msg);
+	}
+}
+
+// Torture test
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+// TortureRun is the parent side of run_torture.
+class TortureRun {
+public:
+	TortureRun(const TortureProcess& p, TortureResult& r, int read_fd)
+		: p_(p), r_(r), read_fd_(read_fd), rng_(p.opts.seed) {}
+
+	// spawn forks a writer (if session_id is not 0) or a reader.
+	void spawn(int64_t session_id) {
+		// Do not let the children flush what the parent buffered.
+		std::fflush(nullptr);
+		const pid_t pid = fork();
+		if (pid == -1) {
+			throw std::runtime_error(absl::StrCat("fork: ", std::strerror(errno)));
+		}
+		if (pid == 0) {
+			close(read_fd_);
+			int code = EXIT_SUCCESS;
+			try {
+				if (session_id != 0) {
+					run_torture_writer(p_, session_id);
+				} else {
+					run_torture_reader(p_);
+				}
+			} catch (...) {
+				code = EXIT_FAILURE;
+			}
+			_exit(code);
+		}
+		children_.emplace(pid, session_id);
+		r_.processes++;
+	}
+
+	void spawn_writer() { spawn(next_session_id_++); }
+	void spawn_reader() { spawn(0); }
+
+	void kill_random() {
+		if (children_.empty()) {
+			return;
+		}
+		auto it = children_.begin();
+		std::advance(it, static_cast<long>(rng_() % children_.size()));
+		if (killed_.count(it->first) == 0 && kill(it->first, SIGKILL) == 0) {
+			killed_.insert(it->first);
+			r_.killed++;
+		}
+	}
+
+	// reap waits for the processes that exited and replaces them if respawn
+	// is set.
+	void reap(bool block, bool respawn) {
+		for (;;) {
+			int status = 0;
+			const pid_t pid = waitpid(-1, &status, block ? 0 : WNOHANG);
+			if (pid <= 0) {
+				return;
+			}
+			auto it = children_.find(pid);
+			if (it == children_.end()) {
+				continue;
+			}
+			const bool writer = it->second != 0;
+			children_.erase(it);
+			const bool was_killed = killed_.erase(pid) > 0;
+			if (!was_killed && !(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)) {
+				r_.errors++;
+				r_.error_codes[0]++;
+			}
+			if (respawn) {
+				writer ? spawn_writer() : spawn_reader();
+			}
+			if (block && children_.empty()) {
+				return;
+			}
+		}
+	}
+
+	bool running() const { return !children_.empty(); }
+
+	// drain handles the messages in the pipe and returns false at the end
+	// of the file (once every process exited and the parent closed its end).
+	bool drain() {
+		char buf[sizeof(TortureMessage) * 256];
+		for (;;) {
+			const ssize_t n = read(read_fd_, buf, sizeof(buf));
+			if (n == 0) {
+				return false;
+			}
+			if (n == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					return true;
+				}
+				throw std::runtime_error(absl::StrCat("read: ", std::strerror(errno)));
+			}
+			pending_.append(buf, static_cast<size_t>(n));
+			size_t off = 0;
+			for (; pending_.size() - off >= sizeof(TortureMessage); off += sizeof(TortureMessage)) {
+				TortureMessage msg;
+				std::memcpy(&msg, pending_.data() + off, sizeof(msg));
+				handle(msg);
+			}
+			pending_.erase(0, off);
+		}
+	}
+
+	const std::set<std::pair<int64_t, int64_t>>& acked() const { return acked_; }
+
+private:
+	void handle(const TortureMessage& msg) {
+		switch (msg.event) {
+		case TortureEvent::Commit:
+			r_.commits++;
+			r_.synced += msg.synced != 0;
+			r_.lock_wait_us.record(msg.wait_us);
+			r_.commit_us.record(msg.latency_us);
+			acked_.emplace(msg.session_id, msg.history_id);
+			break;
+		case TortureEvent::Read:
+			r_.reads++;
+			r_.read_us.record(msg.latency_us);
+			break;
+		case TortureEvent::Busy:
+			r_.busy++;
+			break;
+		case TortureEvent::Error:
+			r_.errors++;
+			r_.error_codes[msg.error_code]++;
+			break;
+		}
+	}
+
+	const TortureProcess& p_;
+	TortureResult& r_;
+	const int read_fd_;
+	std::mt19937_64 rng_;
+	std::map<pid_t, int64_t> children_; // pid to session id (0 for readers)
+	std::set<pid_t> killed_;
+	int64_t next_session_id_ = 1;
+	std::string pending_; // partial message
+	std::set<std::pair<int64_t, int64_t>> acked_; // session and history ids
+};
+
+} // namespace
+
+// check_torture_database fills the checks of r. The database is opened
+// read-write so that a hot journal left by a killed writer is rolled back.
+static void check_torture_database(const TortureProcess& p,
+	const std::set<std::pair<int64_t, int64_t>>& acked, TortureResult& r) {
+
+	SQLite::Database db = open_torture_database(p, false);
+	r.integrity = db.execAndGet("PRAGMA integrity_check;").getString();
+	SQLite::Statement fk(db, "PRAGMA foreign_key_check;");
+	while (fk.executeStep()) {
+		r.foreign_key_violations++;
+	}
+	std::set<std::pair<int64_t, int64_t>> present;
+	SQLite::Statement rows(db, "SELECT session_id, history_id FROM history;");
+	while (rows.executeStep()) {
+		present.emplace(rows.getColumn(0).getInt64(), rows.getColumn(1).getInt64());
+	}
+	for (const auto& key : acked) {
+		r.lost += present.count(key) == 0;
+	}
+	for (const auto& key : present) {
+		r.unacked += acked.count(key) == 0;
+	}
+	if (p.config.durability && p.config.durability->tier == DurabilityTier::Grouped) {
+		r.unsynced = db.execAndGet("SELECT pending FROM durability_groups;").getInt64();
+	}
+}
+
+TortureResult run_torture(const TortureOptions& opts, const TortureConfig& config,
+	const std::string& path, const TortureHooks& hooks) {
+
+	TortureResult r;
+	r.config = config;
+	hooks.setup(path);
+
+	int fds[2];
+	if (pipe(fds) != 0) {
+		throw std::runtime_error(absl::StrCat("pipe: ", std::strerror(errno)));
+	}
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+	const auto start = TortureClock::now();
+	TortureProcess p{opts, config, path, hooks, start + opts.duration, fds[1]};
+	{
+		// Switch to WAL (which is persistent) before the processes race to.
+		SQLite::Database db = open_torture_database(p, false);
+	}
+	TortureRun run(p, r, fds[0]);
+	try {
+		for (int i = 0; i < opts.writers; i++) {
+			run.spawn_writer();
+		}
+		for (int i = 0; i < opts.readers; i++) {
+			run.spawn_reader();
+		}
+		auto next_kill = start + opts.kill_interval;
+		for (;;) {
+			const auto now = TortureClock::now();
+			if (now >= p.deadline) {
+				break;
+			}
+			if (opts.kill_interval.count() > 0 && now >= next_kill) {
+				run.kill_random();
+				next_kill += opts.kill_interval;
+			}
+			struct pollfd pfd = {fds[0], POLLIN, 0};
+			poll(&pfd, 1, 1);
+			run.drain();
+			run.reap(false, true);
+		}
+		// The processes stop by themselves at the deadline, the pipe is at
+		// its end once they all exited.
+		close(fds[1]);
+		fds[1] = -1;
+		for (;;) {
+			struct pollfd pfd = {fds[0], POLLIN, 0};
+			poll(&pfd, 1, 100);
+			if (!run.drain()) {
+				break;
+			}
+			run.reap(false, false);
+		}
+		if (run.running()) {
+			run.reap(true, false);
+		}
+	} catch (...) {
+		if (fds[1] != -1) {
+			close(fds[1]);
+		}
+		close(fds[0]);
+		throw;
+	}
+	close(fds[0]);
+	r.seconds = static_cast<double>(elapsed_us(start)) / 1e6;
+
+	check_torture_database(p, run.acked(), r);
+	return r;
+}
+
+static double per_second(int64_t n, double seconds) {
+	return seconds > 0 ? static_cast<double>(n) / seconds : 0.0;
+}
+
+void print_torture_result(const TortureOptions& opts, const TortureResult& r,
+	std::ostream& out) {
+
+	std::ostringstream os;
+	os << std::fixed << std::setprecision(1);
+	os << r.config.name() << ": " << opts.writers << " writers, " << opts.readers
+		<< " readers, " << r.seconds << " s\n";
+	os << "  processes: " << r.processes << " started, " << r.killed << " killed\n";
+	os << "  commits:   " << r.commits << " (" << per_second(r.commits, r.seconds)
+		<< "/s), p50 " << r.commit_us.percentile(50) << " us, p99 "
+		<< r.commit_us.percentile(99) << " us, max " << r.commit_us.max() << " us\n";
+	os << "  lock wait: p50 " << r.lock_wait_us.percentile(50) << " us, p90 "
+		<< r.lock_wait_us.percentile(90) << " us, p99 " << r.lock_wait_us.percentile(99)
+		<< " us, max " << r.lock_wait_us.max() << " us\n";
+	os << "  reads:     " << r.reads << " (" << per_second(r.reads, r.seconds)
+		<< "/s), p50 " << r.read_us.percentile(50) << " us, p99 "
+		<< r.read_us.percentile(99) << " us, max " << r.read_us.max() << " us\n";
+	os << "  errors:    " << r.busy << " busy, " << r.errors << " other\n";
+	for (const auto& [code, count] : r.error_codes) {
+		os << "    " << count << " x " << (code == 0 ? "not from SQLite" :
+			absl::StrCat(sqlite3_errstr(code), " (", code, ")")) << "\n";
+	}
+	os << "  check:     integrity " << r.integrity << ", " << r.foreign_key_violations
+		<< " foreign key violations, " << r.lost << " lost, " << r.unacked << " unacked\n";
+	if (r.config.durability) {
+		os << "  synced:    " << r.synced << " of " << r.commits << " commits";
+		if (r.config.durability->tier == DurabilityTier::Grouped) {
+			os << ", " << r.unsynced << " unsynced at the end (a power loss would lose them)";
+		}
+		os << "\n";
+	}
+	out << os.str();
+}
+
+} // namespace histdb
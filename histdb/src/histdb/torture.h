@@ -0,0 +1,116 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <SQLiteCpp/Database.h>
+
+#include "durability.h"
+#include "ingest.h"
+
+namespace histdb {
+
+// Configurations
+////////////////////////////////////////////////////////////////////////////////
+
+// TortureConfig is the journal and locking mode used by every connection of
+// a torture run, or the durability tier that they use (and whose
+// transactions the writers commit).
+struct TortureConfig {
+	std::string journal_mode; // delete, truncate, persist or wal
+	std::string locking_mode; // normal or exclusive
+	std::optional<Durability> durability;
+
+	// name returns "JOURNAL:LOCKING" or the name of the durability tier.
+	std::string name() const;
+};
+
+// parse_torture_config parses "JOURNAL:LOCKING" (e.g. "persist:exclusive")
+// or a durability tier (see parse_durability) and throws
+// std::invalid_argument if spec is invalid. The journal modes that are not
+// crash safe (memory and off) are rejected.
+TortureConfig parse_torture_config(std::string_view spec);
+
+// Torture test
+////////////////////////////////////////////////////////////////////////////////
+
+struct TortureOptions {
+	int writers = 200;
+	int readers = 50;
+	std::chrono::milliseconds duration{5000}; // per configuration
+	// Time between two processes being killed, 0 disables the kills.
+	std::chrono::milliseconds kill_interval{10};
+	// Time that writers sleep before committing, which widens the window in
+	// which a kill lands mid-transaction.
+	std::chrono::microseconds hold{200};
+	int busy_timeout_ms = 0;
+	uint64_t seed = 1;
+};
+
+// TortureHooks connect a torture run to the schema of the real database.
+struct TortureHooks {
+	// setup creates the database at path.
+	std::function<void(const std::string& path)> setup;
+	// prepare is called on every connection once the configuration pragmas
+	// were set.
+	std::function<void(SQLite::Database& db)> prepare;
+	// write writes rec, and its session if it is new, in the transaction
+	// that db has open.
+	std::function<void(SQLite::Database& db, const IngestRecord& rec)> write;
+};
+
+struct TortureResult {
+	TortureConfig config;
+	double seconds = 0;
+	int64_t processes = 0; // started, including the replacements
+	int64_t killed = 0;
+
+	int64_t commits = 0;   // acknowledged
+	int64_t reads = 0;
+	int64_t busy = 0;      // gave up after the busy timeout
+	int64_t errors = 0;    // other failures, and processes that died on their own
+	std::map<int, int64_t> error_codes; // of the failures, 0 if not from SQLite
+	LatencyHistogram lock_wait_us; // time to take the write lock
+	LatencyHistogram commit_us;    // open to COMMIT
+	LatencyHistogram read_us;      // open to the end of the query
+
+	std::string integrity; // first row of "PRAGMA integrity_check"
+	int64_t foreign_key_violations = 0;
+	int64_t lost = 0;      // acknowledged but not in the database
+	int64_t unacked = 0;   // committed by processes killed before acknowledging
+	int64_t synced = 0;    // acknowledged commits that were synced to disk
+	int64_t unsynced = 0;  // grouped: records written since the last synced commit
+
+	bool ok() const {
+		return integrity == "ok" && foreign_key_violations == 0 && lost == 0;
+	}
+};
+
+// run_torture creates the database at path and hammers it for opts.duration
+// with opts.writers processes that insert one command per connection and
+// transaction (like "histdb insert") and opts.readers processes that run
+// short queries (like "histdb search"), all forked from the calling process.
+// Every opts.kill_interval a random process gets SIGKILL, wherever it is
+// (including in the middle of a transaction or of a commit), and is replaced
+// by a new one.
+//
+// Writers acknowledge each command to the parent over a pipe only once its
+// COMMIT returned. When all of them are gone the database is checked: its
+// integrity, its foreign keys and that every acknowledged command is there.
+//
+// Kills only simulate crashes of the processes: the writes they made are in
+// the page cache, so losing power (or the OS crashing) is not covered.
+TortureResult run_torture(const TortureOptions& opts, const TortureConfig& config,
+	const std::string& path, const TortureHooks& hooks);
+
+void print_torture_result(const TortureOptions& opts, const TortureResult& r,
+	std::ostream& out);
+
+} // namespace histdb
@@ -0,0 +1,726 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>        // open
+#include <sys/resource.h> // getrusage
+#include <unistd.h>       // write
+
+#include "absl/strings/str_cat.h"
+
+#include <sqlite3.h>
+
+namespace histdb {
+
+// Trace state
+////////////////////////////////////////////////////////////////////////////////
+
+struct SpanRecord {
+	const char *name;
+	int depth;
+	TraceClock::duration start; // since the first span
+	TraceClock::duration duration;
+};
+
+struct StatementStats {
+	int64_t calls = 0;
+	int64_t ns = 0;
+	int64_t vm_steps = 0;
+	int64_t fullscan_steps = 0;
+	int64_t sorts = 0;
+	int64_t autoindexes = 0;
+};
+
+struct TraceState {
+	std::mutex mu;
+	std::atomic<bool> enabled{false};
+	bool started = false;
+	TraceClock::time_point start;
+	std::vector<SpanRecord> spans;
+	std::map<std::string, StatementStats> statements; // by normalized SQL
+	std::map<sqlite3_stmt *, TraceClock::time_point> running;
+
+	std::atomic<int64_t> busy_retries{0};
+	std::atomic<int64_t> busy_timeouts{0};
+	std::atomic<int64_t> busy_wait_ns{0};
+	std::atomic<int64_t> syncs{0};
+	std::atomic<int64_t> sync_ns{0};
+};
+
+static TraceState& trace_state() {
+	static TraceState state;
+	return state;
+}
+
+static int64_t elapsed_ns(TraceClock::time_point start) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		TraceClock::now() - start).count();
+}
+
+// Nesting depth of the spans of the current thread (the spans of the daemon's
+// threads are interleaved).
+static thread_local int span_depth = 0;
+
+TraceSpan::TraceSpan(const char *name) : enabled_(trace_enabled()) {
+	if (!enabled_) {
+		return;
+	}
+	auto& st = trace_state();
+	std::lock_guard<std::mutex> lock(st.mu);
+	start_ = TraceClock::now();
+	if (!st.started) {
+		st.start = start_;
+		st.started = true;
+	}
+	index_ = st.spans.size();
+	st.spans.push_back({name, span_depth++, start_ - st.start, {}});
+}
+
+TraceSpan::~TraceSpan() {
+	if (!enabled_) {
+		return;
+	}
+	auto& st = trace_state();
+	std::lock_guard<std::mutex> lock(st.mu);
+	st.spans[index_].duration = TraceClock::now() - start_;
+	span_depth--;
+}
+
+void trace_span(const char *name, TraceClock::time_point start,
+	TraceClock::time_point end) {
+
+	if (!trace_enabled()) {
+		return;
+	}
+	auto& st = trace_state();
+	std::lock_guard<std::mutex> lock(st.mu);
+	if (!st.started) {
+		st.start = start;
+		st.started = true;
+	}
+	st.spans.push_back({name, span_depth, start - st.start, end - start});
+}
+
+bool trace_enabled() {
+	return trace_state().enabled.load(std::memory_order_acquire);
+}
+
+// Fsync timing VFS
+////////////////////////////////////////////////////////////////////////////////
+
+// The trace VFS wraps the default VFS: files are opened by the default VFS
+// and every method is forwarded to it, only xSync is timed.
+
+struct TraceFile {
+	sqlite3_file base;
+	sqlite3_file *real; // stored directly after the TraceFile
+};
+
+static sqlite3_vfs *real_vfs = nullptr;
+static sqlite3_vfs trace_vfs;
+static sqlite3_io_methods trace_io_methods[3]; // by iVersion - 1
+
+static sqlite3_file *real_file(sqlite3_file *f) {
+	return reinterpret_cast<TraceFile *>(f)->real;
+}
+
+static int trace_close(sqlite3_file *f) {
+	auto *r = real_file(f);
+	int rc = r->pMethods->xClose(r);
+	f->pMethods = nullptr;
+	return rc;
+}
+
+static int trace_read(sqlite3_file *f, void *buf, int n, sqlite3_int64 off) {
+	auto *r = real_file(f);
+	return r->pMethods->xRead(r, buf, n, off);
+}
+
+static int trace_write(sqlite3_file *f, const void *buf, int n, sqlite3_int64 off) {
+	auto *r = real_file(f);
+	return r->pMethods->xWrite(r, buf, n, off);
+}
+
+static int trace_truncate(sqlite3_file *f, sqlite3_int64 size) {
+	auto *r = real_file(f);
+	return r->pMethods->xTruncate(r, size);
+}
+
+static int trace_sync(sqlite3_file *f, int flags) {
+	auto *r = real_file(f);
+	auto start = TraceClock::now();
+	int rc = r->pMethods->xSync(r, flags);
+	auto& st = trace_state();
+	st.syncs++;
+	st.sync_ns += elapsed_ns(start);
+	return rc;
+}
+
+static int trace_file_size(sqlite3_file *f, sqlite3_int64 *size) {
+	auto *r = real_file(f);
+	return r->pMethods->xFileSize(r, size);
+}
+
+static int trace_lock(sqlite3_file *f, int lock) {
+	auto *r = real_file(f);
+	return r->pMethods->xLock(r, lock);
+}
+
+static int trace_unlock(sqlite3_file *f, int lock) {
+	auto *r = real_file(f);
+	return r->pMethods->xUnlock(r, lock);
+}
+
+static int trace_check_reserved_lock(sqlite3_file *f, int *out) {
+	auto *r = real_file(f);
+	return r->pMethods->xCheckReservedLock(r, out);
+}
+
+static int trace_file_control(sqlite3_file *f, int op, void *arg) {
+	auto *r = real_file(f);
+	return r->pMethods->xFileControl(r, op, arg);
+}
+
+static int trace_sector_size(sqlite3_file *f) {
+	auto *r = real_file(f);
+	return r->pMethods->xSectorSize(r);
+}
+
+static int trace_device_characteristics(sqlite3_file *f) {
+	auto *r = real_file(f);
+	return r->pMethods->xDeviceCharacteristics(r);
+}
+
+static int trace_shm_map(sqlite3_file *f, int region, int size, int extend,
+	void volatile **out) {
+	auto *r = real_file(f);
+	return r->pMethods->xShmMap(r, region, size, extend, out);
+}
+
+static int trace_shm_lock(sqlite3_file *f, int offset, int n, int flags) {
+	auto *r = real_file(f);
+	return r->pMethods->xShmLock(r, offset, n, flags);
+}
+
+static void trace_shm_barrier(sqlite3_file *f) {
+	auto *r = real_file(f);
+	r->pMethods->xShmBarrier(r);
+}
+
+static int trace_shm_unmap(sqlite3_file *f, int delete_flag) {
+	auto *r = real_file(f);
+	return r->pMethods->xShmUnmap(r, delete_flag);
+}
+
+static int trace_fetch(sqlite3_file *f, sqlite3_int64 off, int n, void **out) {
+	auto *r = real_file(f);
+	return r->pMethods->xFetch(r, off, n, out);
+}
+
+static int trace_unfetch(sqlite3_file *f, sqlite3_int64 off, void *p) {
+	auto *r = real_file(f);
+	return r->pMethods->xUnfetch(r, off, p);
+}
+
+static int trace_open(sqlite3_vfs *, const char *name, sqlite3_file *f, int flags,
+	int *out_flags) {
+
+	auto *tf = reinterpret_cast<TraceFile *>(f);
+	tf->base.pMethods = nullptr;
+	tf->real = reinterpret_cast<sqlite3_file *>(tf + 1);
+	int rc = real_vfs->xOpen(real_vfs, name, tf->real, flags, out_flags);
+	if (tf->real->pMethods) {
+		const int version = std::clamp(tf->real->pMethods->iVersion, 1, 3);
+		tf->base.pMethods = &trace_io_methods[version - 1];
+	}
+	return rc;
+}
+
+static int trace_delete(sqlite3_vfs *, const char *name, int sync_dir) {
+	return real_vfs->xDelete(real_vfs, name, sync_dir);
+}
+
+static int trace_access(sqlite3_vfs *, const char *name, int flags, int *out) {
+	return real_vfs->xAccess(real_vfs, name, flags, out);
+}
+
+static int trace_full_pathname(sqlite3_vfs *, const char *name, int n, char *out) {
+	return real_vfs->xFullPathname(real_vfs, name, n, out);
+}
+
+static void *trace_dl_open(sqlite3_vfs *, const char *name) {
+	return real_vfs->xDlOpen(real_vfs, name);
+}
+
+static void trace_dl_error(sqlite3_vfs *, int n, char *msg) {
+	real_vfs->xDlError(real_vfs, n, msg);
+}
+
+static void (*trace_dl_sym(sqlite3_vfs *, void *handle, const char *sym))(void) {
+	return real_vfs->xDlSym(real_vfs, handle, sym);
+}
+
+static void trace_dl_close(sqlite3_vfs *, void *handle) {
+	real_vfs->xDlClose(real_vfs, handle);
+}
+
+static int trace_randomness(sqlite3_vfs *, int n, char *out) {
+	return real_vfs->xRandomness(real_vfs, n, out);
+}
+
+static int trace_sleep(sqlite3_vfs *, int us) {
+	return real_vfs->xSleep(real_vfs, us);
+}
+
+static int trace_current_time(sqlite3_vfs *, double *out) {
+	return real_vfs->xCurrentTime(real_vfs, out);
+}
+
+static int trace_get_last_error(sqlite3_vfs *, int n, char *out) {
+	return real_vfs->xGetLastError ? real_vfs->xGetLastError(real_vfs, n, out) : 0;
+}
+
+static int trace_current_time_int64(sqlite3_vfs *, sqlite3_int64 *out) {
+	return real_vfs->xCurrentTimeInt64(real_vfs, out);
+}
+
+static void register_trace_vfs() {
+	real_vfs = sqlite3_vfs_find(nullptr);
+	if (real_vfs == nullptr) {
+		throw std::runtime_error("trace: no default SQLite VFS");
+	}
+
+	for (int i = 0; i < 3; i++) {
+		auto& m = trace_io_methods[i];
+		m.iVersion = i + 1;
+		m.xClose = trace_close;
+		m.xRead = trace_read;
+		m.xWrite = trace_write;
+		m.xTruncate = trace_truncate;
+		m.xSync = trace_sync;
+		m.xFileSize = trace_file_size;
+		m.xLock = trace_lock;
+		m.xUnlock = trace_unlock;
+		m.xCheckReservedLock = trace_check_reserved_lock;
+		m.xFileControl = trace_file_control;
+		m.xSectorSize = trace_sector_size;
+		m.xDeviceCharacteristics = trace_device_characteristics;
+		if (m.iVersion >= 2) {
+			m.xShmMap = trace_shm_map;
+			m.xShmLock = trace_shm_lock;
+			m.xShmBarrier = trace_shm_barrier;
+			m.xShmUnmap = trace_shm_unmap;
+		}
+		if (m.iVersion >= 3) {
+			m.xFetch = trace_fetch;
+			m.xUnfetch = trace_unfetch;
+		}
+	}
+
+	trace_vfs = sqlite3_vfs{};
+	trace_vfs.iVersion = std::min(real_vfs->iVersion, 2);
+	trace_vfs.szOsFile = static_cast<int>(sizeof(TraceFile)) + real_vfs->szOsFile;
+	trace_vfs.mxPathname = real_vfs->mxPathname;
+	trace_vfs.zName = "histdb-trace";
+	trace_vfs.xOpen = trace_open;
+	trace_vfs.xDelete = trace_delete;
+	trace_vfs.xAccess = trace_access;
+	trace_vfs.xFullPathname = trace_full_pathname;
+	trace_vfs.xDlOpen = trace_dl_open;
+	trace_vfs.xDlError = trace_dl_error;
+	trace_vfs.xDlSym = trace_dl_sym;
+	trace_vfs.xDlClose = trace_dl_close;
+	trace_vfs.xRandomness = trace_randomness;
+	trace_vfs.xSleep = trace_sleep;
+	trace_vfs.xCurrentTime = trace_current_time;
+	trace_vfs.xGetLastError = trace_get_last_error;
+	if (trace_vfs.iVersion >= 2) {
+		trace_vfs.xCurrentTimeInt64 = trace_current_time_int64;
+	}
+	int rc = sqlite3_vfs_register(&trace_vfs, 1);
+	if (rc != SQLITE_OK) {
+		throw std::runtime_error(absl::StrCat(
+			"trace: registering VFS: ", sqlite3_errstr(rc)));
+	}
+}
+
+void trace_enable() {
+	auto& st = trace_state();
+	std::lock_guard<std::mutex> lock(st.mu);
+	if (!st.enabled) {
+		register_trace_vfs();
+		st.enabled.store(true, std::memory_order_release);
+	}
+}
+
+// Connections
+////////////////////////////////////////////////////////////////////////////////
+
+// busy_handler waits for a lock with the same backoff as sqlite3_busy_timeout
+// (when usleep is available) and counts the retries.
+static int busy_handler(void *arg, int count) {
+	static constexpr int delays[] = {1, 2, 5, 10, 15, 20, 25, 25, 25, 50, 50, 100};
+	static constexpr int totals[] = {0, 1, 3, 8, 18, 33, 53, 78, 103, 128, 178, 228};
+	constexpr int n = static_cast<int>(sizeof(delays) / sizeof(delays[0]));
+
+	const auto timeout = static_cast<int>(reinterpret_cast<intptr_t>(arg));
+	int delay;
+	int prior;
+	if (count < n) {
+		delay = delays[count];
+		prior = totals[count];
+	} else {
+		delay = delays[n - 1];
+		prior = totals[n - 1] + delay * (count - (n - 1));
+	}
+	auto& st = trace_state();
+	if (prior + delay > timeout) {
+		delay = timeout - prior;
+		if (delay <= 0) {
+			st.busy_timeouts++;
+			return 0;
+		}
+	}
+	auto start = TraceClock::now();
+	std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+	st.busy_retries++;
+	st.busy_wait_ns += elapsed_ns(start);
+	return 1;
+}
+
+// normalize_sql collapses whitespace so that statements can be grouped.
+static std::string normalize_sql(const char *sql) {
+	std::string out;
+	bool space = false;
+	for (const char *p = sql; *p; p++) {
+		if (std::isspace(static_cast<unsigned char>(*p))) {
+			space = !out.empty();
+			continue;
+		}
+		if (space) {
+			out.push_back(' ');
+			space = false;
+		}
+		out.push_back(*p);
+	}
+	return out;
+}
+
+// profile_callback times every run of a statement from its first step
+// (SQLITE_TRACE_STMT) until it is done or reset (SQLITE_TRACE_PROFILE) with
+// the monotonic clock, since the time reported by SQLite is only accurate to
+// the millisecond on some systems.
+static int profile_callback(unsigned type, void *, void *p, void *) {
+	auto *stmt = static_cast<sqlite3_stmt *>(p);
+	auto& st = trace_state();
+	if (type == SQLITE_TRACE_STMT) {
+		std::lock_guard<std::mutex> lock(st.mu);
+		st.running[stmt] = TraceClock::now();
+		return 0;
+	}
+	if (type != SQLITE_TRACE_PROFILE) {
+		return 0;
+	}
+	const auto end = TraceClock::now();
+	const char *sql = sqlite3_sql(stmt);
+	auto key = normalize_sql(sql ? sql : "");
+	std::lock_guard<std::mutex> lock(st.mu);
+	auto it = st.running.find(stmt);
+	if (it == st.running.end()) {
+		return 0;
+	}
+	auto& s = st.statements[key];
+	s.calls++;
+	s.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - it->second).count();
+	st.running.erase(it);
+	s.vm_steps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+	s.fullscan_steps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+	s.sorts += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+	s.autoindexes += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+	return 0;
+}
+
+void trace_connection(SQLite::Database& db, int busy_timeout_ms) {
+	if (!trace_enabled()) {
+		db.setBusyTimeout(busy_timeout_ms);
+		return;
+	}
+	sqlite3 *h = db.getHandle();
+	sqlite3_busy_handler(h, busy_handler,
+		reinterpret_cast<void *>(static_cast<intptr_t>(busy_timeout_ms)));
+	sqlite3_trace_v2(h, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE, profile_callback, nullptr);
+}
+
+// Report
+////////////////////////////////////////////////////////////////////////////////
+
+static double to_ms(int64_t ns) {
+	return static_cast<double>(ns) / 1e6;
+}
+
+static int64_t to_us(TraceClock::duration d) {
+	return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+static int64_t timeval_us(const struct timeval& tv) {
+	return static_cast<int64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+struct Metrics {
+	TraceClock::duration total{};
+	std::vector<SpanRecord> spans;
+	std::map<std::string, StatementStats> statements;
+	int64_t busy_retries = 0;
+	int64_t busy_timeouts = 0;
+	int64_t busy_wait_ns = 0;
+	int64_t syncs = 0;
+	int64_t sync_ns = 0;
+	struct rusage usage{};
+};
+
+static Metrics collect_metrics() {
+	Metrics m;
+	auto& st = trace_state();
+	{
+		std::lock_guard<std::mutex> lock(st.mu);
+		m.spans = st.spans;
+		m.statements = st.statements;
+		if (st.started) {
+			m.total = TraceClock::now() - st.start;
+		}
+	}
+	m.busy_retries = st.busy_retries;
+	m.busy_timeouts = st.busy_timeouts;
+	m.busy_wait_ns = st.busy_wait_ns;
+	m.syncs = st.syncs;
+	m.sync_ns = st.sync_ns;
+	getrusage(RUSAGE_SELF, &m.usage);
+	return m;
+}
+
+static int64_t max_rss_bytes(const struct rusage& usage) {
+#ifdef __APPLE__
+	return static_cast<int64_t>(usage.ru_maxrss);
+#else
+	return static_cast<int64_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+static void print_trace(const std::string& command, const Metrics& m,
+	std::ostream& out) {
+
+	std::ostringstream os;
+	os << std::fixed << std::setprecision(3);
+	os << "histdb: trace: " << command << "\n";
+	os << "  span" << std::setw(36) << "start ms" << std::setw(12) << "ms" << "\n";
+	for (const auto& s : m.spans) {
+		std::string name = std::string(static_cast<size_t>(2 * s.depth), ' ') + s.name;
+		os << "  " << std::left << std::setw(28) << name << std::right
+			<< std::setw(12) << to_ms(std::chrono::nanoseconds(s.start).count())
+			<< std::setw(12) << to_ms(std::chrono::nanoseconds(s.duration).count()) << "\n";
+	}
+	os << "  " << std::left << std::setw(40) << "total" << std::right
+		<< std::setw(12) << to_ms(std::chrono::nanoseconds(m.total).count()) << "\n";
+
+	int64_t sql_ns = 0;
+	for (const auto& [_, s] : m.statements) {
+		sql_ns += s.ns;
+	}
+	os << "  sql:   " << to_ms(sql_ns) << " ms\n";
+	os << "  busy:  " << m.busy_retries << " retries, " << m.busy_timeouts
+		<< " timeouts, " << to_ms(m.busy_wait_ns) << " ms waited\n";
+	os << "  fsync: " << m.syncs << " calls, " << to_ms(m.sync_ns) << " ms\n";
+	os << "  cpu:   user " << to_ms(timeval_us(m.usage.ru_utime) * 1000)
+		<< " ms, sys " << to_ms(timeval_us(m.usage.ru_stime) * 1000)
+		<< " ms, max rss " << max_rss_bytes(m.usage) / 1024 << " KiB\n";
+
+	if (!m.statements.empty()) {
+		os << "  " << std::setw(6) << "calls" << std::setw(10) << "ms"
+			<< std::setw(10) << "vm steps" << std::setw(8) << "scans"
+			<< std::setw(6) << "sorts" << std::setw(9) << "autoidx" << "  sql\n";
+		for (const auto& [sql, s] : m.statements) {
+			constexpr size_t max_sql = 72;
+			os << "  " << std::setw(6) << s.calls << std::setw(10) << to_ms(s.ns)
+				<< std::setw(10) << s.vm_steps << std::setw(8) << s.fullscan_steps
+				<< std::setw(6) << s.sorts << std::setw(9) << s.autoindexes << "  "
+				<< (sql.size() > max_sql ? sql.substr(0, max_sql - 3) + "..." : sql)
+				<< "\n";
+		}
+	}
+	out << os.str();
+	out.flush();
+}
+
+// format_metrics formats m as a single line of tab separated "key=value"
+// pairs. Durations are in microseconds (with a "_us" suffix), spans with the
+// same name are summed.
+static std::string format_metrics(const std::string& command, const Metrics& m) {
+	const auto now = std::chrono::system_clock::now().time_since_epoch();
+	std::map<std::string, int64_t> spans;
+	for (const auto& s : m.spans) {
+		spans[absl::StrCat(s.name, "_us")] += to_us(s.duration);
+	}
+	int64_t sql_ns = 0;
+	int64_t vm_steps = 0;
+	for (const auto& [_, s] : m.statements) {
+		sql_ns += s.ns;
+		vm_steps += s.vm_steps;
+	}
+	std::string line = absl::StrCat(
+		"time=", std::chrono::duration_cast<std::chrono::seconds>(now).count(),
+		"\tcommand=", command,
+		"\ttotal_us=", to_us(m.total));
+	for (const auto& [key, us] : spans) {
+		absl::StrAppend(&line, "\t", key, "=", us);
+	}
+	absl::StrAppend(&line,
+		"\tsql_us=", sql_ns / 1000,
+		"\tvm_steps=", vm_steps,
+		"\tbusy_retries=", m.busy_retries,
+		"\tbusy_timeouts=", m.busy_timeouts,
+		"\tbusy_wait_us=", m.busy_wait_ns / 1000,
+		"\tfsyncs=", m.syncs,
+		"\tfsync_us=", m.sync_ns / 1000,
+		"\tuser_us=", timeval_us(m.usage.ru_utime),
+		"\tsys_us=", timeval_us(m.usage.ru_stime),
+		"\tmax_rss_kib=", max_rss_bytes(m.usage) / 1024,
+		"\n");
+	return line;
+}
+
+// append_metrics appends line to path with a single write so that lines
+// appended concurrently by other shells are not interleaved.
+static void append_metrics(const std::string& path, const std::string& line) {
+	int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		throw std::runtime_error(absl::StrCat(
+			"opening metrics file: ", path, ": ", std::strerror(errno)));
+	}
+	ssize_t n = write(fd, line.data(), line.size());
+	int err = errno;
+	close(fd);
+	if (n != static_cast<ssize_t>(line.size())) {
+		throw std::runtime_error(absl::StrCat(
+			"writing metrics file: ", path, ": ", std::strerror(err)));
+	}
+}
+
+void trace_finish(const std::string& command, std::ostream *out,
+	const std::string& metrics_file) {
+
+	const Metrics m = collect_metrics();
+	if (out) {
+		print_trace(command, m, *out);
+	}
+	if (!metrics_file.empty()) {
+		append_metrics(metrics_file, format_metrics(command, m));
+	}
+}
+
+// Profile
+////////////////////////////////////////////////////////////////////////////////
+
+// percentile returns the nearest-rank percentile p (0-100) of sorted values.
+static int64_t percentile(const std::vector<int64_t>& sorted, double p) {
+	const double rank = std::ceil(p / 100.0 * static_cast<double>(sorted.size()));
+	const size_t i = std::max<size_t>(1, static_cast<size_t>(rank)) - 1;
+	return sorted[std::min(i, sorted.size() - 1)];
+}
+
+static bool ends_with(const std::string& s, std::string_view suffix) {
+	return s.size() >= suffix.size() &&
+		s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+void print_profile(const std::string& metrics_file, std::ostream& out) {
+	std::ifstream in(metrics_file);
+	if (!in) {
+		throw std::runtime_error(absl::StrCat(
+			"opening metrics file: ", metrics_file, ": ", std::strerror(errno)));
+	}
+
+	// command => metric => values
+	std::map<std::string, std::map<std::string, std::vector<int64_t>>> commands;
+	std::map<std::string, int64_t> runs;
+	std::string line;
+	while (std::getline(in, line)) {
+		std::string command;
+		std::vector<std::pair<std::string, int64_t>> values;
+		std::istringstream fields(line);
+		for (std::string field; std::getline(fields, field, '\t'); ) {
+			auto eq = field.find('=');
+			if (eq == std::string::npos) {
+				continue;
+			}
+			auto key = field.substr(0, eq);
+			auto value = field.substr(eq + 1);
+			if (key == "command") {
+				command = value;
+			} else if (key != "time") {
+				try {
+					values.emplace_back(key, std::stoll(value));
+				} catch (const std::exception&) {
+					// ignore malformed values (the file is append only and
+					// may contain partially written lines)
+				}
+			}
+		}
+		if (command.empty()) {
+			continue;
+		}
+		runs[command]++;
+		auto& metrics = commands[command];
+		for (auto& [key, value] : values) {
+			metrics[key].push_back(value);
+		}
+	}
+
+	std::ostringstream os;
+	os << std::fixed;
+	for (auto& [command, metrics] : commands) {
+		os << command << ": " << runs[command] << " runs\n";
+		os << "  " << std::left << std::setw(24) << "metric" << std::right
+			<< std::setw(6) << "n" << std::setw(12) << "p50" << std::setw(12) << "p90"
+			<< std::setw(12) << "p99" << std::setw(12) << "max" << "\n";
+
+		// Print total first, then the other durations and then the counters.
+		std::vector<std::string> keys;
+		for (const auto& [key, _] : metrics) {
+			keys.push_back(key);
+		}
+		std::stable_sort(keys.begin(), keys.end(), [](const std::string& a, const std::string& b) {
+			auto rank = [](const std::string& k) {
+				return k == "total_us" ? 0 : ends_with(k, "_us") ? 1 : 2;
+			};
+			return rank(a) < rank(b);
+		});
+		for (const auto& key : keys) {
+			auto& values = metrics[key];
+			std::sort(values.begin(), values.end());
+			const bool us = ends_with(key, "_us");
+			const std::string name = us ? key.substr(0, key.size() - 3) + "_ms" : key;
+			os << "  " << std::left << std::setw(24) << name << std::right
+				<< std::setw(6) << values.size() << std::setprecision(us ? 3 : 0);
+			for (double p : {50.0, 90.0, 99.0, 100.0}) {
+				const auto v = static_cast<double>(percentile(values, p));
+				os << std::setw(12) << (us ? v / 1000 : v);
+			}
+			os << "\n";
+		}
+	}
+	out << os.str();
+}
+
+} // namespace histdb
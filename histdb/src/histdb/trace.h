@@ -0,0 +1,67 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include <SQLiteCpp/Database.h>
+
+namespace histdb {
+
+// Tracing
+////////////////////////////////////////////////////////////////////////////////
+
+// Tracing records how long each phase of a command took (spans) along with
+// SQLite lock waits, fsyncs and per statement counters. Nothing is collected
+// until trace_enable has been called, so that the spans of long running
+// commands (the daemon) don't accumulate.
+
+using TraceClock = std::chrono::steady_clock;
+
+// TraceSpan records the time from its construction to its destruction as a
+// span named name (which must be a string literal). Spans may be nested.
+class TraceSpan {
+public:
+	explicit TraceSpan(const char *name);
+	~TraceSpan();
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+	bool enabled_;
+	size_t index_ = 0;
+	TraceClock::time_point start_;
+};
+
+// trace_span records a span that ended before tracing was enabled, such as
+// parsing the command line. It does nothing if tracing is not enabled.
+void trace_span(const char *name, TraceClock::time_point start,
+	TraceClock::time_point end);
+
+// trace_enable enables collecting SQLite statistics. It must be called before
+// any database is opened since it installs a VFS (as the default) that times
+// the fsyncs of every connection.
+void trace_enable();
+
+bool trace_enabled();
+
+// trace_connection sets the busy timeout of db. If tracing is enabled the
+// lock waits and retries are counted (with the same backoff that SQLite uses)
+// and the statements that db runs are profiled.
+void trace_connection(SQLite::Database& db, int busy_timeout_ms);
+
+// trace_finish prints a report of command to out (if not null) and appends
+// its metrics to metrics_file (if not empty).
+void trace_finish(const std::string& command, std::ostream *out,
+	const std::string& metrics_file);
+
+// Profile
+////////////////////////////////////////////////////////////////////////////////
+
+// print_profile prints the percentiles of the metrics appended to
+// metrics_file by trace_finish grouped by command.
+void print_profile(const std::string& metrics_file, std::ostream& out);
+
+} // namespace histdb
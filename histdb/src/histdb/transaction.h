@@ -0,0 +1,39 @@
+#pragma once
+
+#include <SQLiteCpp/Database.h>
+
+namespace histdb {
+
+// WriteTransaction is a SQLite::Transaction that takes the write lock when it
+// starts ("BEGIN IMMEDIATE") so that waiting for a busy database is handled
+// by the busy timeout instead of failing when the lock is upgraded.
+class WriteTransaction {
+public:
+	explicit WriteTransaction(SQLite::Database& db) : db_(db) {
+		db_.exec("BEGIN IMMEDIATE;");
+	}
+
+	~WriteTransaction() {
+		if (!committed_) {
+			try {
+				db_.exec("ROLLBACK;");
+			} catch (...) {
+				// ignore, the transaction is already being unwound
+			}
+		}
+	}
+
+	void commit() {
+		db_.exec("COMMIT;");
+		committed_ = true;
+	}
+
+	WriteTransaction(const WriteTransaction&) = delete;
+	WriteTransaction& operator=(const WriteTransaction&) = delete;
+
+private:
+	SQLite::Database& db_;
+	bool committed_ = false;
+};
+
+} // namespace histdb